@@ -24,6 +24,9 @@
 #include <stddef.h>
 #include <math.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #ifdef CRUSTY_TEST
 #include <stdarg.h>
@@ -38,7 +41,34 @@
 #define MAX_INCLUDE_DEPTH (16)
 #define DEFAULT_CALLSTACK_SIZE (256)
 
+/* use GCC's labels as values extension for the interpreter loop */
+#ifdef __GNUC__
+#define CRUSTY_THREADED
+#endif
+
+/* The threaded interpreter can call in to native code, either translated to C
+   ahead of time and loaded from a shared object or generated on x86-64. */
+#if defined(CRUSTY_THREADED) && defined(__unix__)
+#define CRUSTY_NATIVE
+#include <dlfcn.h>
+#ifdef __x86_64__
+#define CRUSTY_JIT
+#endif
+#endif
+
+/* arithmetic over array ranges has SSE2 and AVX2 kernels on x86-64, picked by
+   what the CPU supports */
+#ifdef __GNUC__
+#ifdef __x86_64__
+#define CRUSTY_SIMD
+#include <immintrin.h>
+#endif
+#endif
+
 #define ALIGNMENT (sizeof(int))
+/* alignment of the stack, the globals and each procedure's frame, enough for
+   any variable type */
+#define STACK_ALIGNMENT (sizeof(double))
 #define FIND_ALIGNMENT_VALUE(VALUE) \
     if((VALUE) % ALIGNMENT != 0) \
         (VALUE) += (ALIGNMENT - ((VALUE) % ALIGNMENT));
@@ -81,6 +111,12 @@ typedef struct {
 
 typedef struct CrustyProcedure_s CrustyProcedure;
 
+/* a range of bytes in memory which needs something done to it */
+typedef struct {
+    unsigned int offset;
+    unsigned int length;
+} CrustyRange;
+
 typedef struct {
     long nameOffset;
     const char *name;
@@ -103,6 +139,22 @@ typedef struct {
     void *writepriv;
 } CrustyVariable;
 
+/* What the interpreter needs to know about a variable, packed in to a small
+   table built once the program is ready to run so the lookups made for every
+   operand stay in cache.  The CrustyVariable is still used for callbacks and
+   anything else which isn't run often. */
+#define VARINFO_GLOBAL   (1 << 0)
+#define VARINFO_ARGUMENT (1 << 1)
+#define VARINFO_READ     (1 << 2) /* has a read callback */
+#define VARINFO_WRITE    (1 << 3) /* has a write callback */
+
+typedef struct {
+    unsigned int offset;
+    unsigned int length;
+    unsigned char type;
+    unsigned char flags;
+} CrustyVarInfo;
+
 typedef struct {
     long nameOffset;
     const char *name;
@@ -123,11 +175,200 @@ typedef struct CrustyProcedure_s {
 
     unsigned int stackneeded;
     unsigned char *initializer;
+    /* parts of a new frame which need copying from the initializer or
+       clearing, leaving out arguments and anything which is always set before
+       being read */
+    CrustyRange *copy;
+    unsigned int copies;
+    CrustyRange *zero;
+    unsigned int zeros;
 
     CrustyLabel *label;
     unsigned int labels;
 } CrustyProcedure;
 
+/* Kinds of operands for move, math and cmp instructions, which are known after
+   code generation so codegen can emit instructions specialized for each
+   combination of destination and source kind rather than have the interpreter
+   figure it out each time.
+   GLOBAL and LOCAL are plain variables or arrays with immediate indexes, which
+   have the index folded in to the address.  ARRAY is an array with a variable
+   index and INDEXED is one whose index was proven to always be in range, so it
+   isn't checked.  ARGUMENT is a procedure argument used on its own, which is
+   already resolved to what it refers to when the procedure is called.
+   REFERENCE is anything else involving a procedure argument (including the
+   index), which still needs to be resolved at runtime and CALLBACK is a
+   callback variable. */
+typedef enum {
+    CRUSTY_OPERAND_GLOBAL,
+    CRUSTY_OPERAND_LOCAL,
+    CRUSTY_OPERAND_IMMEDIATE,
+    CRUSTY_OPERAND_ARRAY,
+    CRUSTY_OPERAND_INDEXED,
+    CRUSTY_OPERAND_ARGUMENT,
+    CRUSTY_OPERAND_REFERENCE,
+    CRUSTY_OPERAND_CALLBACK,
+    CRUSTY_OPERAND_KINDS
+} CrustyOperandKind;
+
+#define CRUSTY_SRC_KINDS(X, OP, DEST) \
+    X(OP, DEST, GLOBAL) \
+    X(OP, DEST, LOCAL) \
+    X(OP, DEST, IMMEDIATE) \
+    X(OP, DEST, ARRAY) \
+    X(OP, DEST, INDEXED) \
+    X(OP, DEST, ARGUMENT) \
+    X(OP, DEST, REFERENCE) \
+    X(OP, DEST, CALLBACK)
+
+/* math results can't be written to callbacks, so those are left to the generic
+   instructions to fail at runtime. */
+#define CRUSTY_DEST_KINDS(X, OP) \
+    CRUSTY_SRC_KINDS(X, OP, GLOBAL) \
+    CRUSTY_SRC_KINDS(X, OP, LOCAL) \
+    CRUSTY_SRC_KINDS(X, OP, ARRAY) \
+    CRUSTY_SRC_KINDS(X, OP, INDEXED) \
+    CRUSTY_SRC_KINDS(X, OP, ARGUMENT) \
+    CRUSTY_SRC_KINDS(X, OP, REFERENCE)
+
+#define CRUSTY_MOVE_DEST_KINDS(X, OP) \
+    CRUSTY_DEST_KINDS(X, OP) \
+    CRUSTY_SRC_KINDS(X, OP, CALLBACK)
+
+/* cmp never writes its destination, so it can be anything a source can be */
+#define CRUSTY_CMP_DEST_KINDS(X, OP) \
+    CRUSTY_MOVE_DEST_KINDS(X, OP) \
+    CRUSTY_SRC_KINDS(X, OP, IMMEDIATE)
+
+#define CRUSTY_SPECIALIZED_INSTRUCTIONS(X) \
+    CRUSTY_MOVE_DEST_KINDS(X, MOVE) \
+    CRUSTY_DEST_KINDS(X, ADD) \
+    CRUSTY_DEST_KINDS(X, SUB) \
+    CRUSTY_DEST_KINDS(X, MUL) \
+    CRUSTY_DEST_KINDS(X, DIV) \
+    CRUSTY_DEST_KINDS(X, MOD) \
+    CRUSTY_DEST_KINDS(X, AND) \
+    CRUSTY_DEST_KINDS(X, OR) \
+    CRUSTY_DEST_KINDS(X, XOR) \
+    CRUSTY_DEST_KINDS(X, SHR) \
+    CRUSTY_DEST_KINDS(X, SHL) \
+    CRUSTY_CMP_DEST_KINDS(X, CMP)
+
+/* Direct operands also have a known type, so the type checks can be dropped
+   too when neither is a char.  Immediates are always ints.  Logic and shift
+   operations only work on ints.  Arguments only have a known type in the
+   copies of a procedure made for what its callers pass it. */
+#define CRUSTY_TYPED_SRC_KINDS(X, OP, DEST, DT) \
+    X(OP, DEST, GLOBAL, DT, I) \
+    X(OP, DEST, GLOBAL, DT, F) \
+    X(OP, DEST, LOCAL, DT, I) \
+    X(OP, DEST, LOCAL, DT, F) \
+    X(OP, DEST, IMMEDIATE, DT, I) \
+    X(OP, DEST, ARGUMENT, DT, I) \
+    X(OP, DEST, ARGUMENT, DT, F)
+
+#define CRUSTY_TYPED_KINDS(X, OP) \
+    CRUSTY_TYPED_SRC_KINDS(X, OP, GLOBAL, I) \
+    CRUSTY_TYPED_SRC_KINDS(X, OP, GLOBAL, F) \
+    CRUSTY_TYPED_SRC_KINDS(X, OP, LOCAL, I) \
+    CRUSTY_TYPED_SRC_KINDS(X, OP, LOCAL, F) \
+    CRUSTY_TYPED_SRC_KINDS(X, OP, ARGUMENT, I) \
+    CRUSTY_TYPED_SRC_KINDS(X, OP, ARGUMENT, F)
+
+#define CRUSTY_TYPED_INT_SRC_KINDS(X, OP, DEST) \
+    X(OP, DEST, GLOBAL, I, I) \
+    X(OP, DEST, LOCAL, I, I) \
+    X(OP, DEST, IMMEDIATE, I, I) \
+    X(OP, DEST, ARGUMENT, I, I)
+
+#define CRUSTY_TYPED_INT_KINDS(X, OP) \
+    CRUSTY_TYPED_INT_SRC_KINDS(X, OP, GLOBAL) \
+    CRUSTY_TYPED_INT_SRC_KINDS(X, OP, LOCAL) \
+    CRUSTY_TYPED_INT_SRC_KINDS(X, OP, ARGUMENT)
+
+#define CRUSTY_TYPED_INSTRUCTIONS(X) \
+    CRUSTY_TYPED_KINDS(X, MOVE) \
+    CRUSTY_TYPED_KINDS(X, ADD) \
+    CRUSTY_TYPED_KINDS(X, SUB) \
+    CRUSTY_TYPED_KINDS(X, MUL) \
+    CRUSTY_TYPED_KINDS(X, DIV) \
+    CRUSTY_TYPED_INT_KINDS(X, AND) \
+    CRUSTY_TYPED_INT_KINDS(X, OR) \
+    CRUSTY_TYPED_INT_KINDS(X, XOR) \
+    CRUSTY_TYPED_INT_KINDS(X, SHR) \
+    CRUSTY_TYPED_INT_KINDS(X, SHL) \
+    CRUSTY_TYPED_KINDS(X, CMP)
+
+/* Pairs of instructions which are very common are fused in to a single
+   instruction which does both.  The second instruction is left in place after
+   the fused one so verification and line lookups work as usual, and it's only
+   ever executed on its own if nothing jumps to it. */
+#define CRUSTY_BRANCH_JUMPS(X, DEST, SRC, DT, ST) \
+    X(DEST, SRC, DT, ST, JUMPN) \
+    X(DEST, SRC, DT, ST, JUMPZ) \
+    X(DEST, SRC, DT, ST, JUMPL) \
+    X(DEST, SRC, DT, ST, JUMPG)
+
+#define CRUSTY_BRANCH_SRC_KINDS(X, DEST, DT) \
+    CRUSTY_BRANCH_JUMPS(X, DEST, GLOBAL, DT, I) \
+    CRUSTY_BRANCH_JUMPS(X, DEST, GLOBAL, DT, F) \
+    CRUSTY_BRANCH_JUMPS(X, DEST, LOCAL, DT, I) \
+    CRUSTY_BRANCH_JUMPS(X, DEST, LOCAL, DT, F) \
+    CRUSTY_BRANCH_JUMPS(X, DEST, IMMEDIATE, DT, I)
+
+/* typed cmp followed by a conditional jump */
+#define CRUSTY_FUSED_BRANCHES(X) \
+    CRUSTY_BRANCH_SRC_KINDS(X, GLOBAL, I) \
+    CRUSTY_BRANCH_SRC_KINDS(X, GLOBAL, F) \
+    CRUSTY_BRANCH_SRC_KINDS(X, LOCAL, I) \
+    CRUSTY_BRANCH_SRC_KINDS(X, LOCAL, F)
+
+#define CRUSTY_FUSED_OP_SRCS_I(X, DEST, MSRC, OP) \
+    X(DEST, I, MSRC, I, OP, GLOBAL, I) \
+    X(DEST, I, MSRC, I, OP, LOCAL, I) \
+    X(DEST, I, MSRC, I, OP, IMMEDIATE, I)
+
+#define CRUSTY_FUSED_OP_SRCS_F(X, DEST, MSRC, OP) \
+    X(DEST, F, MSRC, F, OP, GLOBAL, F) \
+    X(DEST, F, MSRC, F, OP, LOCAL, F) \
+    X(DEST, F, MSRC, F, OP, IMMEDIATE, I)
+
+#define CRUSTY_FUSED_MATH_OP(X, OP) \
+    CRUSTY_FUSED_OP_SRCS_I(X, GLOBAL, GLOBAL, OP) \
+    CRUSTY_FUSED_OP_SRCS_I(X, GLOBAL, LOCAL, OP) \
+    CRUSTY_FUSED_OP_SRCS_I(X, GLOBAL, IMMEDIATE, OP) \
+    CRUSTY_FUSED_OP_SRCS_I(X, LOCAL, GLOBAL, OP) \
+    CRUSTY_FUSED_OP_SRCS_I(X, LOCAL, LOCAL, OP) \
+    CRUSTY_FUSED_OP_SRCS_I(X, LOCAL, IMMEDIATE, OP) \
+    CRUSTY_FUSED_OP_SRCS_F(X, GLOBAL, GLOBAL, OP) \
+    CRUSTY_FUSED_OP_SRCS_F(X, GLOBAL, LOCAL, OP) \
+    CRUSTY_FUSED_OP_SRCS_F(X, LOCAL, GLOBAL, OP) \
+    CRUSTY_FUSED_OP_SRCS_F(X, LOCAL, LOCAL, OP)
+
+/* typed move of a value in to a variable followed by a typed add or sub to that
+   same kind and type of variable, like "move a b" "add a c".  The same variable
+   isn't required, it's just the only way this is likely to come up. */
+#define CRUSTY_FUSED_MATH(X) \
+    CRUSTY_FUSED_MATH_OP(X, ADD) \
+    CRUSTY_FUSED_MATH_OP(X, SUB)
+
+/* loops specialized for an int counter in memory stepped by a constant and
+   compared with an int bound, which is nearly every counted loop.  The counter
+   can be a global or local and the bound can also be an immediate. */
+#define CRUSTY_TYPED_LOOPS(X) \
+    X(GLOBAL, GLOBAL) \
+    X(GLOBAL, LOCAL) \
+    X(GLOBAL, IMMEDIATE) \
+    X(LOCAL, GLOBAL) \
+    X(LOCAL, LOCAL) \
+    X(LOCAL, IMMEDIATE)
+
+#define CRUSTY_TYPED_I (0)
+#define CRUSTY_TYPED_F (1)
+#define CRUSTY_TYPED_TYPES (2)
+#define CRUSTY_TYPED_TYPE_I CRUSTY_TYPE_INT
+#define CRUSTY_TYPED_TYPE_F CRUSTY_TYPE_FLOAT
+
 typedef enum {
     CRUSTY_INSTRUCTION_TYPE_MOVE,
     CRUSTY_INSTRUCTION_TYPE_ADD,
@@ -146,10 +387,190 @@ typedef enum {
     CRUSTY_INSTRUCTION_TYPE_JUMPZ,
     CRUSTY_INSTRUCTION_TYPE_JUMPL,
     CRUSTY_INSTRUCTION_TYPE_JUMPG,
+    /* jump to one of a table of labels picked by a value */
+    CRUSTY_INSTRUCTION_TYPE_SWITCH,
+    /* step a counter and jump back until it reaches a bound, followed by the
+       typed versions, which stay out of the specialized instructions since
+       they don't specialize a move, math or cmp */
+    CRUSTY_INSTRUCTION_TYPE_LOOP,
+#define TYPED_LOOP(COUNTER, BOUND) \
+    CRUSTY_INSTRUCTION_TYPE_LOOP_##COUNTER##_##BOUND,
+    CRUSTY_TYPED_LOOPS(TYPED_LOOP)
+#undef TYPED_LOOP
+    /* math which picks one of its operands instead of branching */
+    CRUSTY_INSTRUCTION_TYPE_MIN,
+    CRUSTY_INSTRUCTION_TYPE_MAX,
+    CRUSTY_INSTRUCTION_TYPE_ABS,
+    CRUSTY_INSTRUCTION_TYPE_CLAMP,
+    CRUSTY_INSTRUCTION_TYPE_SELECT,
     CRUSTY_INSTRUCTION_TYPE_CALL,
-    CRUSTY_INSTRUCTION_TYPE_RET
+    CRUSTY_INSTRUCTION_TYPE_RET,
+    /* a call which replaces the frame of the procedure it's made from, only
+       made by the optimizer */
+    CRUSTY_INSTRUCTION_TYPE_TAILCALL,
+    /* copy, shift or fill a range of an array all at once */
+    CRUSTY_INSTRUCTION_TYPE_COPY,
+    CRUSTY_INSTRUCTION_TYPE_SHIFT,
+    CRUSTY_INSTRUCTION_TYPE_FILL,
+    /* arithmetic over a range of an array, in the order of their kernels */
+    CRUSTY_INSTRUCTION_TYPE_VADD,
+    CRUSTY_INSTRUCTION_TYPE_VSUB,
+    CRUSTY_INSTRUCTION_TYPE_VMUL,
+    CRUSTY_INSTRUCTION_TYPE_VMIN,
+    CRUSTY_INSTRUCTION_TYPE_VMAX,
+    CRUSTY_INSTRUCTION_TYPE_VSCALE,
+#define SPECIALIZED_INSTRUCTION(OP, DEST, SRC) \
+    CRUSTY_INSTRUCTION_TYPE_##OP##_##DEST##_##SRC,
+    CRUSTY_SPECIALIZED_INSTRUCTIONS(SPECIALIZED_INSTRUCTION)
+#undef SPECIALIZED_INSTRUCTION
+#define TYPED_INSTRUCTION(OP, DEST, SRC, DT, ST) \
+    CRUSTY_INSTRUCTION_TYPE_##OP##_##DEST##_##SRC##_##DT##_##ST,
+    CRUSTY_TYPED_INSTRUCTIONS(TYPED_INSTRUCTION)
+#undef TYPED_INSTRUCTION
+#define FUSED_BRANCH(DEST, SRC, DT, ST, JUMP) \
+    CRUSTY_INSTRUCTION_TYPE_CMP_##DEST##_##SRC##_##DT##_##ST##_##JUMP,
+    CRUSTY_FUSED_BRANCHES(FUSED_BRANCH)
+#undef FUSED_BRANCH
+#define FUSED_MATH(DEST, DT, MSRC, MST, OP, SRC, ST) \
+    CRUSTY_INSTRUCTION_TYPE_MOVE_##DEST##_##MSRC##_##DT##_##MST##_##\
+        OP##_##DEST##_##SRC##_##DT##_##ST,
+    CRUSTY_FUSED_MATH(FUSED_MATH)
+#undef FUSED_MATH
+    CRUSTY_INSTRUCTION_TYPE_INVALID
 } CrustyInstructionType;
 
+#define CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED \
+    (CRUSTY_INSTRUCTION_TYPE_VSCALE + 1)
+
+typedef struct {
+    const char *name;
+    CrustyInstructionType generic;
+    CrustyOperandKind dest;
+    CrustyOperandKind src;
+    /* NONE if the instruction still checks the types at runtime */
+    CrustyType desttype;
+    CrustyType srctype;
+} CrustySpecialization;
+
+#define SPECIALIZED_INSTRUCTION(OP, DEST, SRC) \
+    [CRUSTY_INSTRUCTION_TYPE_##OP##_##DEST##_##SRC - \
+     CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED] = { \
+        #OP "." #DEST "." #SRC, \
+        CRUSTY_INSTRUCTION_TYPE_##OP, \
+        CRUSTY_OPERAND_##DEST, \
+        CRUSTY_OPERAND_##SRC \
+    },
+#define TYPED_INSTRUCTION(OP, DEST, SRC, DT, ST) \
+    [CRUSTY_INSTRUCTION_TYPE_##OP##_##DEST##_##SRC##_##DT##_##ST - \
+     CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED] = { \
+        #OP "." #DT "." #ST "." #DEST "." #SRC, \
+        CRUSTY_INSTRUCTION_TYPE_##OP, \
+        CRUSTY_OPERAND_##DEST, \
+        CRUSTY_OPERAND_##SRC, \
+        CRUSTY_TYPED_TYPE_##DT, \
+        CRUSTY_TYPED_TYPE_##ST \
+    },
+static const CrustySpecialization CRUSTY_SPECIALIZATIONS[] = {
+    CRUSTY_SPECIALIZED_INSTRUCTIONS(SPECIALIZED_INSTRUCTION)
+    CRUSTY_TYPED_INSTRUCTIONS(TYPED_INSTRUCTION)
+};
+#undef TYPED_INSTRUCTION
+#undef SPECIALIZED_INSTRUCTION
+
+/* zero (generic move) where there is no specialized instruction */
+#define SPECIALIZED_INSTRUCTION(OP, DEST, SRC) \
+    [CRUSTY_INSTRUCTION_TYPE_##OP] \
+    [CRUSTY_OPERAND_##DEST] \
+    [CRUSTY_OPERAND_##SRC] = CRUSTY_INSTRUCTION_TYPE_##OP##_##DEST##_##SRC,
+static const unsigned short CRUSTY_SPECIALIZE[CRUSTY_INSTRUCTION_TYPE_CMP + 1]
+                                             [CRUSTY_OPERAND_KINDS]
+                                             [CRUSTY_OPERAND_KINDS] = {
+    CRUSTY_SPECIALIZED_INSTRUCTIONS(SPECIALIZED_INSTRUCTION)
+};
+#undef SPECIALIZED_INSTRUCTION
+
+/* fused instructions come right after all the specialized ones */
+#define CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED \
+    (CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED + \
+     (sizeof(CRUSTY_SPECIALIZATIONS) / sizeof(CrustySpecialization)))
+
+typedef struct {
+    const char *name;
+    unsigned short first;
+    unsigned short second;
+} CrustyFusion;
+
+#define FUSED_BRANCH(DEST, SRC, DT, ST, JUMP) \
+    [CRUSTY_INSTRUCTION_TYPE_CMP_##DEST##_##SRC##_##DT##_##ST##_##JUMP - \
+     CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED] = { \
+        "CMP." #DT "." #ST "." #DEST "." #SRC "+" #JUMP, \
+        CRUSTY_INSTRUCTION_TYPE_CMP_##DEST##_##SRC##_##DT##_##ST, \
+        CRUSTY_INSTRUCTION_TYPE_##JUMP \
+    },
+#define FUSED_MATH(DEST, DT, MSRC, MST, OP, SRC, ST) \
+    [CRUSTY_INSTRUCTION_TYPE_MOVE_##DEST##_##MSRC##_##DT##_##MST##_##\
+         OP##_##DEST##_##SRC##_##DT##_##ST - \
+     CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED] = { \
+        "MOVE." #DT "." #MST "." #DEST "." #MSRC "+" \
+            #OP "." #DT "." #ST "." #DEST "." #SRC, \
+        CRUSTY_INSTRUCTION_TYPE_MOVE_##DEST##_##MSRC##_##DT##_##MST, \
+        CRUSTY_INSTRUCTION_TYPE_##OP##_##DEST##_##SRC##_##DT##_##ST \
+    },
+static const CrustyFusion CRUSTY_FUSIONS[] = {
+    CRUSTY_FUSED_BRANCHES(FUSED_BRANCH)
+    CRUSTY_FUSED_MATH(FUSED_MATH)
+};
+#undef FUSED_MATH
+#undef FUSED_BRANCH
+
+/* zero where there is no typed instruction */
+#define TYPED_INSTRUCTION(OP, DEST, SRC, DT, ST) \
+    [CRUSTY_INSTRUCTION_TYPE_##OP] \
+    [CRUSTY_OPERAND_##DEST] \
+    [CRUSTY_OPERAND_##SRC] \
+    [CRUSTY_TYPED_##DT] \
+    [CRUSTY_TYPED_##ST] = \
+        CRUSTY_INSTRUCTION_TYPE_##OP##_##DEST##_##SRC##_##DT##_##ST,
+static const unsigned short CRUSTY_TYPED[CRUSTY_INSTRUCTION_TYPE_CMP + 1]
+                                        [CRUSTY_OPERAND_KINDS]
+                                        [CRUSTY_OPERAND_KINDS]
+                                        [CRUSTY_TYPED_TYPES]
+                                        [CRUSTY_TYPED_TYPES] = {
+    CRUSTY_TYPED_INSTRUCTIONS(TYPED_INSTRUCTION)
+};
+#undef TYPED_INSTRUCTION
+
+typedef struct {
+    const char *name;
+    CrustyOperandKind counter;
+    CrustyOperandKind bound;
+} CrustyLoop;
+
+#define CRUSTY_INSTRUCTION_TYPE_FIRST_TYPED_LOOP \
+    (CRUSTY_INSTRUCTION_TYPE_LOOP + 1)
+
+#define TYPED_LOOP(COUNTER, BOUND) \
+    [CRUSTY_INSTRUCTION_TYPE_LOOP_##COUNTER##_##BOUND - \
+     CRUSTY_INSTRUCTION_TYPE_FIRST_TYPED_LOOP] = { \
+        "LOOP.I." #COUNTER "." #BOUND, \
+        CRUSTY_OPERAND_##COUNTER, \
+        CRUSTY_OPERAND_##BOUND \
+    },
+static const CrustyLoop CRUSTY_LOOPS[] = {
+    CRUSTY_TYPED_LOOPS(TYPED_LOOP)
+};
+#undef TYPED_LOOP
+
+/* zero where there is no typed loop */
+#define TYPED_LOOP(COUNTER, BOUND) \
+    [CRUSTY_OPERAND_##COUNTER] \
+    [CRUSTY_OPERAND_##BOUND] = CRUSTY_INSTRUCTION_TYPE_LOOP_##COUNTER##_##BOUND,
+static const unsigned short CRUSTY_TYPED_LOOP[CRUSTY_OPERAND_KINDS]
+                                             [CRUSTY_OPERAND_KINDS] = {
+    CRUSTY_TYPED_LOOPS(TYPED_LOOP)
+};
+#undef TYPED_LOOP
+
 #define MOVE_DEST_FLAGS (1)
 #define MOVE_DEST_VAL   (2)
 #define MOVE_DEST_INDEX (3)
@@ -171,6 +592,41 @@ typedef enum {
 #define JUMP_LOCATION (1)
 #define JUMP_ARGS JUMP_LOCATION
 
+/* the value is laid out as the destination of move is, then how many values
+   have their own label, the default label for anything else and a label for
+   each value from 0 */
+#define SWITCH_VALUE_FLAGS   (1)
+#define SWITCH_VALUE_VAL     (2)
+#define SWITCH_VALUE_INDEX   (3)
+#define SWITCH_COUNT         (4)
+#define SWITCH_DEFAULT       (5)
+#define SWITCH_START_TARGETS (6)
+
+/* the counter and step are laid out as the destination and source of add are,
+   then the bound and where to jump.  A typed loop's step is an immediate and
+   its counter and bound are resolved like a typed instruction's operands. */
+#define LOOP_COUNTER_FLAGS MOVE_DEST_FLAGS
+#define LOOP_COUNTER_VAL   MOVE_DEST_VAL
+#define LOOP_COUNTER_INDEX MOVE_DEST_INDEX
+#define LOOP_STEP_FLAGS    MOVE_SRC_FLAGS
+#define LOOP_STEP_VAL      MOVE_SRC_VAL
+#define LOOP_STEP_INDEX    MOVE_SRC_INDEX
+#define LOOP_BOUND_FLAGS   (7)
+#define LOOP_BOUND_VAL     (8)
+#define LOOP_BOUND_INDEX   (9)
+#define LOOP_LOCATION      (10)
+#define LOOP_ARGS LOOP_LOCATION
+/* where a typed operand's address is */
+#define LOOP_COUNTER_PTR LOOP_COUNTER_INDEX
+#define LOOP_BOUND_PTR   LOOP_BOUND_INDEX
+
+/* min, max and abs are laid out as math is, clamp and select have another
+   source after, which is the upper bound or what's picked for a zero result */
+#define PICK_OTHER_FLAGS (7)
+#define PICK_OTHER_VAL   (8)
+#define PICK_OTHER_INDEX (9)
+#define PICK_ARGS PICK_OTHER_INDEX
+
 #define CALL_PROCEDURE (1)
 #define CALL_START_ARGS (2)
 #define CALL_ARG_FLAGS (0)
@@ -180,6 +636,81 @@ typedef enum {
 
 #define RET_ARGS (0)
 
+/* the destination and source (or value, for fill) are laid out as they are
+   for move, followed by the count */
+#define BULK_DEST_FLAGS  MOVE_DEST_FLAGS
+#define BULK_DEST_VAL    MOVE_DEST_VAL
+#define BULK_DEST_INDEX  MOVE_DEST_INDEX
+#define BULK_SRC_FLAGS   MOVE_SRC_FLAGS
+#define BULK_SRC_VAL     MOVE_SRC_VAL
+#define BULK_SRC_INDEX   MOVE_SRC_INDEX
+#define BULK_COUNT_FLAGS (7)
+#define BULK_COUNT_VAL   (8)
+#define BULK_COUNT_INDEX (9)
+#define BULK_ARGS BULK_COUNT_INDEX
+
+#ifdef CRUSTY_NATIVE
+/* Result registers passed in and out of native code.  This and everything else
+   shared with native code has to match what crustyvm_translate() writes. */
+typedef struct {
+    int intresult;
+    CrustyType resulttype;
+    double floatresult;
+} CrustyNativeRegs;
+
+/* called with the stack, stack pointer, result registers and the instruction
+   being entered at, returns the instruction the interpreter should continue
+   from */
+typedef unsigned int (*CrustyNativeFunc)(unsigned char *stack,
+                                         unsigned int sp,
+                                         CrustyNativeRegs *regs,
+                                         unsigned int ip);
+
+/* entry points exported by a translated program */
+typedef struct {
+    unsigned int ip;
+    CrustyNativeFunc func;
+} CrustyNativeEntry;
+#endif
+
+/* Kernels for arithmetic over a range of ints or floats, in place in dest.
+   src is a range the same length, or a single value for scale. */
+typedef void (*CrustyVectorKernel)(void *dest, const void *src, int count);
+
+#define VECTOR_OP_ADD   (0)
+#define VECTOR_OP_SUB   (1)
+#define VECTOR_OP_MUL   (2)
+#define VECTOR_OP_MIN   (3)
+#define VECTOR_OP_MAX   (4)
+#define VECTOR_OP_SCALE (5)
+#define VECTOR_OPS      (6)
+
+typedef struct {
+    CrustyVectorKernel kernel[VECTOR_OPS][CRUSTY_TYPED_TYPES];
+} CrustyVectorKernels;
+
+/* written ranges closer together than this are restored by one copy */
+#define RESET_GAP (64)
+
+/* how much of the globals the next reset has to restore */
+#define RESET_NONE    (0) /* nothing has run since the last reset */
+#define RESET_WRITTEN (1) /* the parts the program can write to */
+#define RESET_ALL     (2) /* everything, for a stack never initialized */
+
+/* a file read in while compiling, so a saved image can tell if it changed */
+typedef struct {
+    long nameOffset;
+    unsigned long long hash;
+} CrustyDependency;
+
+/* The compiled program isn't changed once it's ready to run, so it's shared
+   between a VM and any clones of it, which only get their own stacks.  The
+   compile-time data in each of them points to the same memory and it's freed
+   along with the last of them. */
+typedef struct {
+    unsigned int refs;
+} CrustyProgram;
+
 typedef struct CrustyVM_s {
     void (*log_cb)(void *priv, const char *fmt, ...);
     void *log_priv;
@@ -187,6 +718,7 @@ typedef struct CrustyVM_s {
     unsigned int flags;
 
 /* compile-time data */
+    CrustyProgram *program;
 
 /* logging things */
     unsigned int logline;
@@ -200,6 +732,7 @@ typedef struct CrustyVM_s {
 
     CrustyVariable *var;
     unsigned int vars;
+    CrustyVarInfo *vinfo;
 
     CrustyProcedure *proc;
     unsigned int procs;
@@ -210,12 +743,56 @@ typedef struct CrustyVM_s {
     unsigned int stacksize;
     unsigned int initialstack;
     unsigned char *initializer;
+    /* parts of the globals the program can change, which are all a reset
+       needs to restore */
+    CrustyRange *resetrange;
+    unsigned int resetranges;
 
     unsigned int callstacksize;
+    /* the program can't recurse, so the stacks were sized for the deepest
+       possible call and calls don't need to check for overflow */
+    int bounded;
+
+    /* files the program was built from and a hash of everything else it was
+       built from, for saving images */
+    CrustyDependency *dep;
+    unsigned int deps;
+    unsigned long long key;
+    /* mapped image the VM was loaded from, which the token memory,
+       instructions and initializers point in to */
+    void *image;
+    size_t imagesize;
+
+    /* threaded code for the interpreter: the instructions with each opcode
+       replaced by the offset of its handler and typed instructions packed
+       down to the one word each operand uses, with maps from instruction
+       indexes to threaded code indexes and back */
+    int *thread;
+    unsigned int threadlen;
+    unsigned int *threadip;
+    unsigned int *instip;
+
+    /* the best kernels for arithmetic over array ranges the CPU supports */
+    const CrustyVectorKernels *vector;
+
+#ifdef CRUSTY_NATIVE
+    /* native code entry point for each instruction, if there is one */
+    CrustyNativeFunc *nativeentry;
+    /* loaded translated program */
+    void *nativelib;
+#endif
+#ifdef CRUSTY_JIT
+    /* generated native code */
+    unsigned char *native;
+    size_t nativesize;
+#endif
 
     /* runtime data */
     unsigned char *stack; /* runtime stack */
     CrustyCallStackArg *cstack; /* call stack */
+    /* arguments of a tail call, resolved before the frame they're read from is
+       replaced */
+    CrustyStackArg *tailarg;
     unsigned int sp; /* stack pointer */
     unsigned int csp; /* callstack pointer */
     unsigned int ip; /* instruction pointer */
@@ -224,6 +801,7 @@ typedef struct CrustyVM_s {
     double floatresult;
     int intresult;
     CrustyStatus status;
+    unsigned int dirty; /* RESET_* */
 } CrustyVM;
 
 /* compile-time stuff */
@@ -333,6 +911,48 @@ FILE *crustyvm_open_file(const char *filename,
     return(in);
 }
 
+#define IMAGE_MAGIC "CRUSTYVM"
+#define IMAGE_VERSION (11)
+/* flags which change the generated code, the rest are applied on loading */
+#define IMAGE_KEY_FLAGS (CRUSTY_FLAG_OPTIMIZE)
+/* sections are aligned so the mapped image can be used in place */
+#define IMAGE_ALIGNMENT (sizeof(double))
+
+/* FNV-1a, used to tell whether a saved image is still current */
+#define IMAGE_HASH_START (14695981039346656037ULL)
+
+static unsigned long long image_hash(unsigned long long hash,
+                                     const void *data,
+                                     unsigned long len) {
+    const unsigned char *bytes = data;
+    unsigned long i;
+
+    for(i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return(hash);
+}
+
+/* hash the full contents of a file, leaving it rewound */
+static int image_hash_file(FILE *in, unsigned long long *hash) {
+    unsigned char buf[4096];
+    size_t got;
+
+    *hash = IMAGE_HASH_START;
+    rewind(in);
+    while((got = fread(buf, 1, sizeof(buf), in)) > 0) {
+        *hash = image_hash(*hash, buf, got);
+    }
+    if(ferror(in)) {
+        return(-1);
+    }
+    rewind(in);
+
+    return(0);
+}
+
 static CrustyVM *init() {
     CrustyVM *cvm;
 
@@ -341,6 +961,13 @@ static CrustyVM *init() {
         return(NULL);
     }
 
+    cvm->program = malloc(sizeof(CrustyProgram));
+    if(cvm->program == NULL) {
+        free(cvm);
+        return(NULL);
+    }
+    cvm->program->refs = 1;
+
     cvm->log_cb = NULL;
     cvm->log_priv = NULL;
     cvm->stage = NULL;
@@ -350,14 +977,38 @@ static CrustyVM *init() {
     cvm->tokenmemlen = 0;
     cvm->var = NULL;
     cvm->vars = 0;
+    cvm->vinfo = NULL;
     cvm->proc = NULL;
     cvm->procs = 0;
     cvm->inst = NULL;
     cvm->insts = 0;
+    cvm->dep = NULL;
+    cvm->deps = 0;
+    cvm->key = 0;
+    cvm->image = NULL;
+    cvm->imagesize = 0;
+    cvm->thread = NULL;
+    cvm->threadlen = 0;
+    cvm->threadip = NULL;
+    cvm->instip = NULL;
+    cvm->vector = NULL;
+#ifdef CRUSTY_NATIVE
+    cvm->nativeentry = NULL;
+    cvm->nativelib = NULL;
+#endif
+#ifdef CRUSTY_JIT
+    cvm->native = NULL;
+    cvm->nativesize = 0;
+#endif
     cvm->stack = NULL;
     cvm->cstack = NULL;
+    cvm->tailarg = NULL;
     cvm->initialstack = 0;
     cvm->initializer = NULL;
+    cvm->resetrange = NULL;
+    cvm->resetranges = 0;
+    cvm->bounded = 0;
+    cvm->dirty = RESET_ALL;
 
     return(cvm);
 }
@@ -365,6 +1016,38 @@ static CrustyVM *init() {
 void crustyvm_free(CrustyVM *cvm) {
     unsigned int i;
 
+    if(cvm->stack != NULL) {
+        free(cvm->stack);
+    }
+
+    if(cvm->cstack != NULL) {
+        free(cvm->cstack);
+    }
+
+    if(cvm->tailarg != NULL) {
+        free(cvm->tailarg);
+    }
+
+    /* leave the program for any clones still using it */
+    cvm->program->refs--;
+    if(cvm->program->refs > 0) {
+        free(cvm);
+        return;
+    }
+    free(cvm->program);
+
+    if(cvm->image != NULL) {
+        /* don't free anything which points in to the image */
+        cvm->tokenmem = NULL;
+        cvm->inst = NULL;
+        cvm->initializer = NULL;
+        if(cvm->proc != NULL) {
+            for(i = 0; i < cvm->procs; i++) {
+                cvm->proc[i].initializer = NULL;
+            }
+        }
+    }
+
     if(cvm->line != NULL) {
         for(i = 0; i < cvm->lines; i++) {
             if(cvm->line[i].offset != NULL) {
@@ -392,6 +1075,12 @@ void crustyvm_free(CrustyVM *cvm) {
             if(cvm->proc[i].initializer != NULL) {
                 free(cvm->proc[i].initializer);
             }
+            if(cvm->proc[i].copy != NULL) {
+                free(cvm->proc[i].copy);
+            }
+            if(cvm->proc[i].zero != NULL) {
+                free(cvm->proc[i].zero);
+            }
         }
         free(cvm->proc);
     }
@@ -400,22 +1089,58 @@ void crustyvm_free(CrustyVM *cvm) {
         free(cvm->var);
     }
 
+    if(cvm->vinfo != NULL) {
+        free(cvm->vinfo);
+    }
+
+    if(cvm->resetrange != NULL) {
+        free(cvm->resetrange);
+    }
+
     if(cvm->inst != NULL) {
         free(cvm->inst);
     }
 
-    if(cvm->stack != NULL) {
-        free(cvm->stack);
+    if(cvm->thread != NULL) {
+        free(cvm->thread);
     }
 
-    if(cvm->cstack != NULL) {
-        free(cvm->cstack);
+    if(cvm->threadip != NULL) {
+        free(cvm->threadip);
+    }
+
+    if(cvm->instip != NULL) {
+        free(cvm->instip);
+    }
+
+#ifdef CRUSTY_NATIVE
+    if(cvm->nativeentry != NULL) {
+        free(cvm->nativeentry);
+    }
+
+    if(cvm->nativelib != NULL) {
+        dlclose(cvm->nativelib);
+    }
+#endif
+
+#ifdef CRUSTY_JIT
+    if(cvm->native != NULL) {
+        munmap(cvm->native, cvm->nativesize);
     }
+#endif
 
     if(cvm->initializer != NULL) {
         free(cvm->initializer);
     }
 
+    if(cvm->dep != NULL) {
+        free(cvm->dep);
+    }
+
+    if(cvm->image != NULL) {
+        munmap(cvm->image, cvm->imagesize);
+    }
+
     free(cvm);
 }
 
@@ -548,6 +1273,27 @@ static long add_token(CrustyVM *cvm,
     return((long)oldlen);
 }
 
+/* remember a file which was read in while compiling */
+static int add_dependency(CrustyVM *cvm, long nameOffset, FILE *in) {
+    CrustyDependency *temp;
+
+    temp = realloc(cvm->dep, sizeof(CrustyDependency) * (cvm->deps + 1));
+    if(temp == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for dependency list.\n");
+        return(-1);
+    }
+    cvm->dep = temp;
+
+    if(image_hash_file(in, &(cvm->dep[cvm->deps].hash)) < 0) {
+        LOG_PRINTF(cvm, "Failed to read %s.\n", TOKENVAL(nameOffset));
+        return(-1);
+    }
+    cvm->dep[cvm->deps].nameOffset = nameOffset;
+    cvm->deps++;
+
+    return(0);
+}
+
 static int compare_token_and_string(CrustyVM *cvm,
                                     long offset,
                                     const char *str) {
@@ -856,6 +1602,13 @@ static int tokenize(CrustyVM *cvm,
                     return(-1);
                 }
 
+                if(add_dependency(cvm,
+                                  GET_TOKEN_OFFSET(cvm->lines, 1),
+                                  in) < 0) {
+                    fclose(in);
+                    return(-1);
+                }
+
                 if(fseek(in, 0, SEEK_END) < 0) {
                     LOG_PRINTF_TOK(cvm, "Failed to seek include file.\n");
                     return(-1);
@@ -1779,7 +2532,7 @@ error:
 
 #undef ISJUNK
 
-#define INSTRUCTION_COUNT (26)
+#define INSTRUCTION_COUNT (42)
 
 static int valid_instruction(const char *name) {
     int i;
@@ -1804,12 +2557,28 @@ static int valid_instruction(const char *name) {
         "shl",
         "shr",
         "cmp",
+        "min",
+        "max",
+        "abs",
+        "clamp",
+        "select",
         "call",
         "jump",
         "jumpn",
         "jumpz",
         "jumpl",
         "jumpg",
+        "switch",
+        "loop",
+        "copy",
+        "shift",
+        "fill",
+        "vadd",
+        "vsub",
+        "vmul",
+        "vmin",
+        "vmax",
+        "vscale",
         "binclude"
     };  
 
@@ -2314,6 +3083,14 @@ static int variable_is_callback(CrustyVariable *var) {
     return(var->read != NULL || var->write != NULL);
 }
 
+/* a single int which can be read straight from memory */
+static int variable_is_plain_int(CrustyVariable *var) {
+    return(var->type == CRUSTY_TYPE_INT &&
+           var->length == 1 &&
+           !variable_is_argument(var) &&
+           !variable_is_callback(var));
+}
+
 /* this function is used while proc->var and var->proc are invalid and the only
    associations between variables and their procedures is a list of indexes in
    to the variable list within each procedure */
@@ -2802,1772 +3579,8317 @@ static int variable_declaration(CrustyVM *cvm,
     return(0);
 }
 
-static int symbols_scan(CrustyVM *cvm,
-                        char *safepath) {
-    unsigned int i, j;
-    CrustyProcedure *curProc = NULL;
-    int curProcIndex = -1;
+/* Small procedures which don't call anything are inlined in to the procedures
+   which call them when optimizing, so little helpers don't cost a call and a
+   new frame each time.  It's done to the lines before symbols are scanned, so
+   the inlined lines keep the module and line they came from for errors and
+   traces, and everything after works as if the program was written that way.
+   The callee's locals and labels become the caller's, with names containing a
+   ';' so they can't clash with anything read from a source file, and its
+   arguments are replaced by what's passed.  Arguments are passed by reference,
+   so that's the same as long as what's passed is used the same way, so calls
+   passing anything which would be read differently are left alone, as are
+   calls passing anything with a variable index, since that's read when the
+   call is made. */
+#define INLINE_MAX_LINES (8)
+/* inlining in to a procedure can make it small enough to be inlined too */
+#define INLINE_ROUNDS (4)
+
+/* how a procedure uses each of its arguments */
+#define INLINE_USE_WRITTEN (1 << 0)
+#define INLINE_USE_ARRAY   (1 << 1) /* indexed or its length read */
+#define INLINE_USE_INDEX   (1 << 2) /* used as an index */
+
+/* part of a token, a name or an index */
+typedef struct {
+    long offset;
+    unsigned int start;
+    unsigned int len;
+} CrustyTokenPart;
 
-    CrustyLine *new = NULL;
-    char *temp;
-    unsigned int lines;
+/* where a procedure is in the lines */
+typedef struct {
+    unsigned int first; /* the proc line */
+    unsigned int end; /* the ret line */
+} CrustyInlineProc;
+
+/* split an operand in to the name and the index after the last colon, if
+   any.  Returns whether there's a colon. */
+static int split_operand(CrustyVM *cvm,
+                         long offset,
+                         CrustyTokenPart *name,
+                         CrustyTokenPart *index) {
+    int i;
 
-    new = malloc(sizeof(CrustyLine) * cvm->lines);
-    if(new == NULL) {
-        LOG_PRINTF(cvm, "Failed to allocate memory for lines\n");
-        return(-1);
+    name->offset = offset;
+    name->start = 0;
+    name->len = TOKENLEN(offset);
+    index->offset = offset;
+    index->start = TOKENLEN(offset);
+    index->len = 0;
+
+    for(i = TOKENLEN(offset) - 1; i >= 0; i--) {
+        if(TOKENVAL(offset)[i] == ':') {
+            name->len = i;
+            index->start = i + 1;
+            index->len = TOKENLEN(offset) - (i + 1);
+            return(1);
+        }
     }
 
-    cvm->stacksize = 0;
+    return(0);
+}
 
-    lines = 0;
-    for(cvm->logline = 0; cvm->logline < cvm->lines; cvm->logline++) {
-        if(curProc != NULL) {
-            curProc->length++;
-        }
-        /* no need to check if tokencount > 0 because those lines were filtered
-           out previously */
-        if(compare_token_and_string(cvm,
-                                    GET_TOKEN_OFFSET(cvm->logline, 0),
-                                    "proc") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 2) {
-                LOG_PRINTF_LINE(cvm, "proc takes a name as argument.\n");
-                goto failure;
-            }
+static int compare_part_and_token(CrustyVM *cvm,
+                                  const CrustyTokenPart *part,
+                                  long offset) {
+    if((int)(part->len) != TOKENLEN(offset)) {
+        return(-1);
+    }
 
-            if(curProc != NULL) {
-                LOG_PRINTF_LINE(cvm, "proc within proc.\n");
-                goto failure;
-            }
+    return(memcmp(&(TOKENVAL(part->offset)[part->start]),
+                  TOKENVAL(offset),
+                  part->len));
+}
 
-            if(find_procedure(cvm, GET_TOKEN(cvm->logline, 1)) >= 0) {
-                LOG_PRINTF_LINE(cvm, "Redeclaration of procedure.\n");
-                goto failure;
-            }
+/* whether a part is a whole number, the same as populate_var checks.  Parts
+   always run to the end of the token, or are followed by a colon, which can't
+   be part of a number anyway. */
+static int part_is_number(CrustyVM *cvm, const CrustyTokenPart *part) {
+    char *end;
 
-            curProc = realloc(cvm->proc, sizeof(CrustyProcedure) * (cvm->procs + 1));
-            if(curProc == NULL) {
-                LOG_PRINTF_LINE(cvm, "Couldn't allocate memory for procedure.\n");
-                goto failure;
-            }
-            cvm->proc = curProc;
-            curProcIndex = cvm->procs;
-            curProc = &(cvm->proc[curProcIndex]);
-            cvm->procs++;
+    if(part->len == 0) {
+        return(0);
+    }
 
-            curProc->nameOffset = cvm->line[cvm->logline].offset[1];
-            curProc->start = lines;
-            curProc->length = 0;
-            curProc->stackneeded = 0;
-            curProc->initializer = NULL;
-            curProc->args = 0; 
-            curProc->var = NULL;
-            curProc->varIndex = NULL;
-            curProc->vars = 0;
-            curProc->label = NULL;
-            curProc->labels = 0;
+    strtol(&(TOKENVAL(part->offset)[part->start]), &end, 0);
+    return(end == &(TOKENVAL(part->offset)[part->start + part->len]));
+}
 
-            unsigned int args = cvm->line[cvm->logline].tokencount - 2;
-            /* add arguments as local variables */
-            for(i = 0; i < args; i++) {
-                /* argument variables have 0 length and no initializers and no
-                   read or write functions but obviously is a local variable */
-                if(new_variable(cvm,
-                                cvm->line[cvm->logline].offset[i + 2],
-                                CRUSTY_TYPE_NONE,
-                                0,
-                                NULL,
-                                NULL,
-                                curProcIndex) < 0) {
-                                    /* print an error so the user can get a line
-                                     * number. */
-                                    LOG_PRINTF_LINE(cvm, "Error from "
-                                                        "new_variable().\n");
-                                    goto failure;
-                }
-            }                    
+/* find which of the names of a procedure's arguments, locals or labels a part
+   is */
+static int find_part(CrustyVM *cvm,
+                     const CrustyTokenPart *part,
+                     const long *name,
+                     unsigned int names) {
+    unsigned int i;
 
-            continue; /* don't copy in to new list */
-        } else if(compare_token_and_string(cvm,
-                                           GET_TOKEN_OFFSET(cvm->logline, 0),
-                                           "ret") == 0) {
-            if(curProc == NULL) {
-                LOG_PRINTF_LINE(cvm, "ret without proc.\n");
-                goto failure;
-            }
+    for(i = 0; i < names; i++) {
+        if(compare_part_and_token(cvm, part, name[i]) == 0) {
+            return(i);
+        }
+    }
 
-            cvm->stacksize += curProc->stackneeded;
-            curProc = NULL;
-            curProcIndex = -1;
+    return(-1);
+}
 
-            /* this is a real instruction, so it should be copied over */
-        } else if(compare_token_and_string(cvm,
-                                           GET_TOKEN_OFFSET(cvm->logline, 0),
-                                           "static") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 2) {
-                LOG_PRINTF_LINE(cvm, "static takes a name as argument.\n");
-                goto failure;
-            }
+static int is_math_instruction(CrustyVM *cvm, long offset) {
+    const char *MATH_INSTRUCTIONS[] = {
+        "move", "add", "sub", "mul", "div", "mod",
+        "and", "or", "xor", "shl", "shr", "cmp"
+    };
+    unsigned int i;
 
-            if(variable_declaration(cvm, &(cvm->line[cvm->logline]), -1) < 0) {
-                goto failure;
-            }
+    for(i = 0; i < sizeof(MATH_INSTRUCTIONS) / sizeof(MATH_INSTRUCTIONS[0]); i++) {
+        if(compare_token_and_string(cvm, offset, MATH_INSTRUCTIONS[i]) == 0) {
+            return(1);
+        }
+    }
 
-            continue; /* don't copy in to new list */
-        } else if(compare_token_and_string(cvm,
-                                           GET_TOKEN_OFFSET(cvm->logline, 0),
-                                           "local") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 2) {
-                LOG_PRINTF_LINE(cvm, "local takes a name as argument.\n");
-                goto failure;
-            }
+    return(0);
+}
 
-            if(curProc == NULL) {
-                LOG_PRINTF_LINE(cvm, "local declared outside of procedure.\n");
-                goto failure;
-            }
+static int is_jump_instruction(CrustyVM *cvm, long offset) {
+    return(compare_token_and_string(cvm, offset, "jump") == 0 ||
+           compare_token_and_string(cvm, offset, "jumpn") == 0 ||
+           compare_token_and_string(cvm, offset, "jumpz") == 0 ||
+           compare_token_and_string(cvm, offset, "jumpl") == 0 ||
+           compare_token_and_string(cvm, offset, "jumpg") == 0);
+}
 
-            if(variable_declaration(cvm, &(cvm->line[cvm->logline]), curProcIndex) < 0) {
-                goto failure;
-            }
+/* Whether a name is a callback, which are the only variables which exist
+   before the symbols scan.  A callback named directly is handled as one when
+   the code is generated, but through an argument it's only reached at runtime,
+   so one can't be put in place of the other.  One of the caller's own
+   arguments passed on doesn't need refusing even if it's bound to a callback:
+   resolve_arg() gives the procedure called the same reference the caller's
+   argument holds, so a read through either one reaches the same callback at
+   the same index the same way.  Writes through it are refused for another
+   reason by can_pass_inline(). */
+static int part_is_callback(CrustyVM *cvm, const CrustyTokenPart *part) {
+    unsigned int i;
 
-            continue; /* don't copy in to new list */
-        } else if(compare_token_and_string(cvm,
-                                           GET_TOKEN_OFFSET(cvm->logline, 0),
-                                           "stack") == 0) {
-            if(cvm->line[cvm->logline].tokencount != 2) {
-                LOG_PRINTF_LINE(cvm, "stack takes a number as argument.\n");
-                goto failure;
-            }
+    for(i = 0; i < cvm->vars; i++) {
+        if(variable_is_global(&(cvm->var[i])) &&
+           compare_part_and_token(cvm, part, cvm->var[i].nameOffset) == 0) {
+            return(1);
+        }
+    }
 
-            long stack = strtol(GET_TOKEN(cvm->logline, 1), &temp, 0);
-            if(temp - GET_TOKEN(cvm->logline, 1) == TOKENLEN(GET_TOKEN_OFFSET(cvm->logline, 1))) {
-                cvm->stacksize += stack;
-            } else {
-                LOG_PRINTF_LINE(cvm, "stack takes a number as argument.\n");
-                goto failure;
-            }
+    return(0);
+}
 
-            continue; /* don't copy in to new list */
-        } else if(compare_token_and_string(cvm,
-                                           GET_TOKEN_OFFSET(cvm->logline, 0),
-                                           "label") == 0) {
-            if(cvm->line[cvm->logline].tokencount != 2) {
-                LOG_PRINTF_LINE(cvm, "label takes a name as argument.\n");
-                goto failure;
-            }
+/* Whether a math or cmp line sets the result.  A move to a callback only
+   sets it from a variable, and an argument could be an immediate when it's
+   put in place.  Writes to an argument are left to can_pass_inline(). */
+static int sets_result(CrustyVM *cvm,
+                       const CrustyLine *line,
+                       const long *arg,
+                       unsigned int args) {
+    CrustyTokenPart name, index;
 
-            if(curProc == NULL) {
-                LOG_PRINTF_LINE(cvm, "label not in a procedure.\n");
-                goto failure;
-            }
+    if(compare_token_and_string(cvm, line->offset[0], "move") != 0) {
+        return(1);
+    }
 
-            for(i = 0; i < curProc->labels; i++) {
-                if(compare_token_and_token(cvm,
-                                           GET_TOKEN_OFFSET(cvm->logline, 1),
-                                           curProc->label[i].nameOffset) == 0) {
-                    LOG_PRINTF_LINE(cvm, "Duplicate label: %s\n",
-                                        GET_TOKEN(cvm->logline, 1));
-                    goto failure;
-                }
-            }
+    split_operand(cvm, line->offset[1], &name, &index);
+    if(!part_is_callback(cvm, &name)) {
+        return(1);
+    }
 
-            temp = realloc(curProc->label, sizeof(CrustyLabel) * (curProc->labels + 1));
-            if(temp == NULL) {
-                LOG_PRINTF_LINE(cvm, "Failed to allocate memory for labels list.\n");
-                goto failure;
-            }
-            curProc->label = (CrustyLabel *)temp;
-            curProc->label[curProc->labels].nameOffset =
-                cvm->line[cvm->logline].offset[1];
-            curProc->label[curProc->labels].line = lines;
-            curProc->labels++;
+    if(split_operand(cvm, line->offset[2], &name, &index)) {
+        /* just the name is its length */
+        if(index.len == 0) {
+            return(0);
+        }
+    } else if(part_is_number(cvm, &name)) {
+        return(0);
+    }
 
-            continue; /* don't copy in to new list */
-        } else if(compare_token_and_string(cvm,
-                                           GET_TOKEN_OFFSET(cvm->logline, 0),
-                                           "binclude") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 4 ||
-               cvm->line[cvm->logline].tokencount > 6) {
-                LOG_PRINTF_LINE(cvm, "binclude takes at least a symbol name, "
-                                    "type and filename and optionally a "
-                                    "start and length.\n");
-                goto failure;
-            }
+    return(find_part(cvm, &name, arg, args) < 0);
+}
 
-            unsigned long fileStart = 0;
-            long fileLength = 0;
+/* A procedure can be inlined if it's only instructions which aren't calls,
+   labels and plain int locals, which can be set back to their initial values
+   with a move, and it isn't too long.  Those moves set the result, so with
+   locals the first instruction has to set it again before anything could
+   look at the one the procedure was called with.  Fills in how each argument
+   is used. */
+static int can_inline(CrustyVM *cvm,
+                      const CrustyInlineProc *proc,
+                      unsigned char *use) {
+    CrustyLine *line;
+    CrustyTokenPart name, index;
+    const long *arg;
+    unsigned int args;
+    unsigned int i, j;
+    unsigned int insts = 0;
+    unsigned int locals = 0;
+    int firstmath = 0;
+    char *end;
+    int a;
 
-            if(cvm->line[cvm->logline].tokencount >= 5) {
-                fileStart = strtoul(GET_TOKEN(cvm->logline, 4), &temp, 0);
-                if(temp - GET_TOKEN(cvm->logline, 4) != TOKENLEN(GET_TOKEN_OFFSET(cvm->logline, 4))) {
-                    LOG_PRINTF_LINE(cvm, "binclude start field must be a "
-                                        "number\n");
-                    goto failure;
-                }
-            }
-            if(cvm->line[cvm->logline].tokencount == 6) {
-                fileLength = strtoul(GET_TOKEN(cvm->logline, 5), &temp, 0);
-                if(temp - GET_TOKEN(cvm->logline, 5) != TOKENLEN(GET_TOKEN_OFFSET(cvm->logline, 5))) {
-                    LOG_PRINTF_LINE(cvm, "binclude start field must be a "
-                                        "number\n");
-                    goto failure;
-                }
-            }
+    arg = (const long *)&(cvm->line[proc->first].offset[2]);
+    args = cvm->line[proc->first].tokencount - 2;
+    memset(use, 0, args);
 
-            CrustyType type;
-            if(compare_token_and_string(cvm,
-                                        GET_TOKEN_OFFSET(cvm->logline, 2),
-                                        "chars") == 0) {
-                type = CRUSTY_TYPE_CHAR;
-            } else if(compare_token_and_string(cvm,
-                                        GET_TOKEN_OFFSET(cvm->logline, 2),
-                                        "ints") == 0) {
-                type = CRUSTY_TYPE_INT;
-            } else if(compare_token_and_string(cvm,
-                                        GET_TOKEN_OFFSET(cvm->logline, 2),
-                                        "floats") == 0) {
-                type = CRUSTY_TYPE_FLOAT;
-            } else {
-                LOG_PRINTF_LINE(cvm, "Type must be chars, ints or floats.\n");
-                goto failure;
-            }
-            
-            FILE *in;
-            in = crustyvm_open_file(GET_TOKEN(cvm->logline, 3),
-                                    &safepath,
-                                    cvm->log_cb,
-                                    cvm->log_priv);
-            if(in == NULL) {
-                LOG_PRINTF_LINE(cvm, "Failed to open %s for reading.\n",
-                                    GET_TOKEN(cvm->logline, 3));
-                goto failure;
-            }
-            if(fileLength == 0) {
-                if(fseek(in, 0, SEEK_END) < 0) {
-                    LOG_PRINTF_LINE(cvm, "Failed to seek to end.\n");
-                    goto failure;
-                }
-                fileLength = ftell(in);
-                if(fileLength < 0) {
-                    LOG_PRINTF_LINE(cvm, "Failed to get length.\n");
-                    goto failure;
-                }
-                if(fseek(in, 0, SEEK_SET) < 0) {
-                    LOG_PRINTF_LINE(cvm, "Failed to seek to start.\n");
-                    goto failure;
-                }
-                fileLength -= fileStart;
-            }
+    if(cvm->line[proc->end].tokencount != 1) {
+        return(0);
+    }
 
-            if(type == CRUSTY_TYPE_INT) {
-                fileLength = fileLength / sizeof(int) * sizeof(int);
-           } else if(type == CRUSTY_TYPE_FLOAT) {
-                fileLength = fileLength / sizeof(double) * sizeof(double);
+    for(i = proc->first + 1; i < proc->end; i++) {
+        line = &(cvm->line[i]);
+        if(compare_token_and_string(cvm, line->offset[0], "local") == 0) {
+            if(line->tokencount == 3) {
+                strtol(TOKENVAL(line->offset[2]), &end, 0);
+                if(end == TOKENVAL(line->offset[2]) || *end != '\0') {
+                    return(0);
+                }
+            } else if(line->tokencount != 2) {
+                return(0);
             }
-            if(fileLength == 0) {
-                LOG_PRINTF_LINE(cvm, "Selected size not large enough for "
-                                    "type.\n");
-                goto failure;
+            locals++;
+        } else if(compare_token_and_string(cvm, line->offset[0], "label") == 0) {
+            if(line->tokencount != 2) {
+                return(0);
             }
- 
-            if(fseek(in, fileStart, SEEK_SET) < 0) {
-                LOG_PRINTF_LINE(cvm, "Failed to seek to position.\n");
-                goto failure;
+        } else if(is_jump_instruction(cvm, line->offset[0])) {
+            if(line->tokencount != 2) {
+                return(0);
             }
-
-            unsigned char *buf;
-            buf = malloc(fileLength);
-            if(buf == NULL) {
-                LOG_PRINTF_LINE(cvm, "Couldn't allocate memory.\n");
-                goto failure;
+            insts++;
+        } else if(is_math_instruction(cvm, line->offset[0])) {
+            if(line->tokencount != 3) {
+                return(0);
             }
-
-            if(fread(buf, 1, fileLength, in) != fileLength) {
-                LOG_PRINTF_LINE(cvm, "Couldn't read full length.\n");
-                free(buf);
-                goto failure;
+            if(insts == 0) {
+                firstmath = sets_result(cvm, line, arg, args);
             }
+            insts++;
 
-            fclose(in);
-
-            if(type == CRUSTY_TYPE_CHAR) {
-                if(new_variable(cvm,
-                                cvm->line[cvm->logline].offset[1],
-                                CRUSTY_TYPE_CHAR,
-                                fileLength,
-                                buf,
-                                NULL,
-                                curProcIndex) < 0) {
-                    free(buf);
-                    goto failure;
+            for(j = 1; j < 3; j++) {
+                if(!split_operand(cvm, line->offset[j], &name, &index)) {
+                    a = find_part(cvm, &name, arg, args);
+                    if(a >= 0 &&
+                       j == 1 &&
+                       compare_token_and_string(cvm,
+                                                line->offset[0],
+                                                "cmp") != 0) {
+                        use[a] |= INLINE_USE_WRITTEN;
+                    }
+                    continue;
                 }
-            } else if(type == CRUSTY_TYPE_INT) {
-                if(new_variable(cvm,
-                                cvm->line[cvm->logline].offset[1],
-                                CRUSTY_TYPE_INT,
-                                fileLength / sizeof(int),
-                                buf,
-                                NULL,
-                                curProcIndex) < 0) {
-                    free(buf);
-                    goto failure;
+
+                a = find_part(cvm, &name, arg, args);
+                if(a >= 0) {
+                    /* an immediate index in to an argument is checked at
+                       runtime, but would be checked when the code is
+                       generated if it was in to what was passed */
+                    if(part_is_number(cvm, &index)) {
+                        return(0);
+                    }
+                    use[a] |= INLINE_USE_ARRAY;
                 }
-            } else if(type == CRUSTY_TYPE_FLOAT) {
-                if(new_variable(cvm,
-                                cvm->line[cvm->logline].offset[1],
-                                CRUSTY_TYPE_FLOAT,
-                                fileLength / sizeof(double),
-                                buf,
-                                NULL,
-                                curProcIndex) < 0) {
-                    free(buf);
-                    goto failure;
+
+                a = find_part(cvm, &index, arg, args);
+                if(a >= 0) {
+                    use[a] |= INLINE_USE_INDEX;
                 }
             }
-            free(buf);
-
-            continue;
+        } else {
+            return(0);
         }
+    }
 
-        new[lines].tokencount = cvm->line[cvm->logline].tokencount;
-        new[lines].moduleOffset = cvm->line[cvm->logline].moduleOffset;
-        new[lines].line = cvm->line[cvm->logline].line;
-        new[lines].offset = malloc(sizeof(long) * new[lines].tokencount);
-        if(new[lines].offset == NULL) {
-            LOG_PRINTF_LINE(cvm, "Failed to allocate memory for line copy.\n");
-            goto failure;
-        }
-        for(i = 0; i < new[lines].tokencount; i++) {
-            new[lines].offset[i] = cvm->line[cvm->logline].offset[i];
-        }
-        lines++;
+    if(locals > 0 && !firstmath) {
+        return(0);
     }
 
-    if(curProc != NULL) {
-        LOG_PRINTF(cvm, "Procedure without return.\n");
-        goto failure;
+    return(insts <= INLINE_MAX_LINES);
+}
+
+/* Whether what's passed to an argument reads the same when it's put in place
+   of the argument in the procedure's lines.  An argument passed on is a copy
+   of what the caller was passed, so if that was an immediate, anything written
+   to it would only be seen by the procedure called. */
+static int can_pass_inline(CrustyVM *cvm,
+                           long actual,
+                           unsigned char use,
+                           const long *arg,
+                           unsigned int args) {
+    CrustyTokenPart name, index;
+    CrustyTokenPart whole;
+
+    whole.offset = actual;
+    whole.start = 0;
+    whole.len = TOKENLEN(actual);
+    if(part_is_number(cvm, &whole)) {
+        return(!(use & (INLINE_USE_WRITTEN |
+                        INLINE_USE_ARRAY |
+                        INLINE_USE_INDEX)));
+    }
+
+    split_operand(cvm, actual, &name, &index);
+    if(part_is_callback(cvm, &name) ||
+       ((use & INLINE_USE_WRITTEN) && find_part(cvm, &name, arg, args) >= 0)) {
+        return(0);
     }
 
-    /* point CrustyVariables in CrustyProcedures and vise versa */
-    for(i = 0; i < cvm->vars; i++) {
-        cvm->var[i].proc = NULL;
+    if((int)(name.len) == TOKENLEN(actual)) {
+        return(1);
     }
 
-    for(i = 0; i < cvm->procs; i++) {
-        cvm->proc[i].var = malloc(sizeof(CrustyVariable *) * cvm->proc[i].vars);
-        if(cvm->proc[i].var == NULL) {
-            LOG_PRINTF(cvm, "Failed to allocate memory for procedure variable pointer list.\n");
-            goto failure;
+    if(index.len == 0) {
+        /* array length */
+        return(!(use & (INLINE_USE_WRITTEN |
+                        INLINE_USE_ARRAY |
+                        INLINE_USE_INDEX)));
+    }
+
+    if(part_is_number(cvm, &index)) {
+        return(!(use & (INLINE_USE_ARRAY | INLINE_USE_INDEX)));
+    }
+
+    /* variable index */
+    return(0);
+}
+
+/* the names of the arguments and locals of a procedure */
+static int procedure_names(CrustyVM *cvm,
+                           const CrustyInlineProc *proc,
+                           long **name,
+                           unsigned int *names) {
+    unsigned int i;
+
+    *names = 0;
+    *name = malloc(sizeof(long) * (proc->end - proc->first +
+                                   cvm->line[proc->first].tokencount));
+    if(*name == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for names.\n");
+        return(-1);
+    }
+
+    for(i = 2; i < cvm->line[proc->first].tokencount; i++) {
+        (*name)[*names] = cvm->line[proc->first].offset[i];
+        (*names)++;
+    }
+    for(i = proc->first + 1; i < proc->end; i++) {
+        if(compare_token_and_string(cvm, cvm->line[i].offset[0], "local") == 0 &&
+           cvm->line[i].tokencount >= 2) {
+            (*name)[*names] = cvm->line[i].offset[1];
+            (*names)++;
         }
+    }
 
-        for(j = 0; j < cvm->proc[i].vars; j++) {
-            cvm->proc[i].var[j] = &(cvm->var[cvm->proc[i].varIndex[j]]);
-            cvm->proc[i].var[j]->proc = &(cvm->proc[i]);
+    return(0);
+}
+
+/* whether anything the callee refers to which isn't its own would refer to
+   something else in the caller */
+static int inline_shadowed(CrustyVM *cvm,
+                           const CrustyInlineProc *callee,
+                           const long *own,
+                           unsigned int owns,
+                           const long *caller,
+                           unsigned int callers) {
+    CrustyTokenPart part[2];
+    unsigned int i, j, k;
+
+    for(i = callee->first + 1; i < callee->end; i++) {
+        if(!is_math_instruction(cvm, cvm->line[i].offset[0])) {
+            continue;
+        }
+
+        for(j = 1; j < 3; j++) {
+            split_operand(cvm, cvm->line[i].offset[j], &(part[0]), &(part[1]));
+            for(k = 0; k < 2; k++) {
+                if(part[k].len > 0 &&
+                   !part_is_number(cvm, &(part[k])) &&
+                   find_part(cvm, &(part[k]), own, owns) < 0 &&
+                   find_part(cvm, &(part[k]), caller, callers) >= 0) {
+                    return(1);
+                }
+            }
         }
     }
 
-    temp = realloc(new, sizeof(CrustyLine) * lines);
-    if(temp == NULL) {
-        LOG_PRINTF(cvm, "Failed to shrink line array.\n");
-        goto failure;
+    return(0);
+}
+
+/* make a name for a local or label of a procedure inlined in to another */
+static long inline_name(CrustyVM *cvm,
+                        long procname,
+                        unsigned int count,
+                        long name) {
+    long tokenstart;
+    char *buf;
+    int valsize;
+
+    valsize = snprintf(NULL, 0, "%s;%u;%s",
+                       TOKENVAL(procname), count, TOKENVAL(name));
+    buf = malloc(valsize + 1);
+    if(buf == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for inlined name.\n");
+        return(-1);
     }
+    snprintf(buf, valsize + 1, "%s;%u;%s",
+             TOKENVAL(procname), count, TOKENVAL(name));
 
-    for(i = 0; i < cvm->lines; i++) {
-        free(cvm->line[i].offset);
+    tokenstart = add_token(cvm, buf, valsize, 0, NULL);
+    free(buf);
+    if(tokenstart < 0) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for inlined name.\n");
+        return(-1);
     }
-    free(cvm->line);
-    cvm->line = (CrustyLine *)temp;
-    cvm->lines = lines;
 
-    cvm->stacksize += cvm->initialstack;
+    return(tokenstart);
+}
 
-    return(0);
+/* rewrite an operand of an inlined line, replacing arguments with what was
+   passed and locals with the caller's copies */
+static long inline_operand(CrustyVM *cvm,
+                           long offset,
+                           const long *from,
+                           const long *to,
+                           unsigned int names) {
+    CrustyTokenPart part[2];
+    int colon;
+    int i, k;
+    long tokenstart;
+    char *buf;
+    unsigned int len;
+
+    colon = split_operand(cvm, offset, &(part[0]), &(part[1]));
+    k = 0;
+    for(i = 0; i < 2; i++) {
+        int n = find_part(cvm, &(part[i]), from, names);
+        if(n >= 0) {
+            part[i].offset = to[n];
+            part[i].start = 0;
+            part[i].len = TOKENLEN(to[n]);
+            k = 1;
+        }
+    }
 
-failure:
-    if(new != NULL) {
-        for(i = 0; i < lines; i++) {
-            if(new[i].offset != NULL) {
-                free(new[i].offset);
-            }
+    if(!k) {
+        return(offset);
+    }
+
+    len = part[0].len;
+    if(colon) {
+        len += 1 + part[1].len;
+    }
+    buf = malloc(len);
+    if(buf == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for inlined operand.\n");
+        return(-1);
+    }
+    memcpy(buf, &(TOKENVAL(part[0].offset)[part[0].start]), part[0].len);
+    if(colon) {
+        buf[part[0].len] = ':';
+        memcpy(&(buf[part[0].len + 1]),
+               &(TOKENVAL(part[1].offset)[part[1].start]),
+               part[1].len);
+    }
+
+    tokenstart = add_token(cvm, buf, len, 0, NULL);
+    free(buf);
+    if(tokenstart < 0) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for inlined operand.\n");
+        return(-1);
+    }
+
+    return(tokenstart);
+}
+
+/* add a line to the end of a list of lines being built up */
+static CrustyLine *append_line(CrustyVM *cvm,
+                               CrustyLine **new,
+                               unsigned int *lines,
+                               unsigned int *mem,
+                               unsigned int tokencount,
+                               const CrustyLine *from) {
+    CrustyLine *temp;
+
+    if(*lines == *mem) {
+        temp = realloc(*new, sizeof(CrustyLine) * (*mem * 2));
+        if(temp == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for lines.\n");
+            return(NULL);
         }
-        free(new);
+        *new = temp;
+        *mem *= 2;
     }
 
-    return(-1);
+    temp = &((*new)[*lines]);
+    temp->offset = malloc(sizeof(long) * tokencount);
+    if(temp->offset == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for line.\n");
+        return(NULL);
+    }
+    temp->tokencount = tokencount;
+    temp->moduleOffset = from->moduleOffset;
+    temp->line = from->line;
+    temp->instruction = 0;
+    (*lines)++;
+
+    return(temp);
 }
 
-/* get a bunch of messy checks out of the way.  Many of these are wacky and
-   should be impossible but may as well get as much out of the way as possible. */
-static int symbols_verify(CrustyVM *cvm) {
-    unsigned int i, j, k;
-    unsigned int leni, lenj, offi, offj;
-    int ret = 0;
+/* replace the call on line call with the lines of callee */
+static int inline_call(CrustyVM *cvm,
+                       unsigned int call,
+                       const CrustyInlineProc *callee,
+                       unsigned int count,
+                       CrustyLine **new,
+                       unsigned int *lines,
+                       unsigned int *mem) {
+    CrustyLine *line, *out;
+    long *from = NULL;
+    long *to = NULL;
+    unsigned int names = 0;
+    long *label = NULL;
+    long *labelto = NULL;
+    unsigned int labels = 0;
+    long procname;
+    long movetoken = -1;
+    long zerotoken = -1;
+    unsigned int i, j;
+    long n;
+    int ret = -1;
+
+    procname = cvm->line[callee->first].offset[1];
+
+    from = malloc(sizeof(long) * (callee->end - callee->first +
+                                  cvm->line[callee->first].tokencount));
+    to = malloc(sizeof(long) * (callee->end - callee->first +
+                                cvm->line[callee->first].tokencount));
+    label = malloc(sizeof(long) * (callee->end - callee->first));
+    labelto = malloc(sizeof(long) * (callee->end - callee->first));
+    if(from == NULL || to == NULL || label == NULL || labelto == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for names.\n");
+        goto done;
+    }
+
+    /* arguments are replaced by what's passed */
+    for(i = 2; i < cvm->line[callee->first].tokencount; i++) {
+        from[names] = cvm->line[callee->first].offset[i];
+        to[names] = cvm->line[call].offset[i];
+        names++;
+    }
+
+    /* locals get fresh copies in the caller, which are set to their initial
+       values where the call was, the same as a new frame would be */
+    for(i = callee->first + 1; i < callee->end; i++) {
+        line = &(cvm->line[i]);
+        if(compare_token_and_string(cvm, line->offset[0], "label") == 0) {
+            label[labels] = line->offset[1];
+            labelto[labels] = inline_name(cvm, procname, count, line->offset[1]);
+            if(labelto[labels] < 0) {
+                goto done;
+            }
+            labels++;
+            continue;
+        }
 
-    for(i = 0; i < cvm->vars; i++) {
-        if(variable_is_global(&(cvm->var[i]))) {
-            if(cvm->var[i].length == 0) {
-                LOG_PRINTF(cvm, "Global variable %s has 0 length.\n", cvm->var[i].name);
-                ret = -1;
-            }
+        if(compare_token_and_string(cvm, line->offset[0], "local") != 0) {
+            continue;
+        }
 
-            if(cvm->var[i].read == NULL && cvm->var[i].write == NULL) {
-                if(cvm->var[i].type != CRUSTY_TYPE_INT &&
-                   cvm->var[i].type != CRUSTY_TYPE_FLOAT &&
-                   cvm->var[i].type != CRUSTY_TYPE_CHAR) {
-                    LOG_PRINTF(cvm, "Non-callback variable with invalid type.\n");
-                    continue;
-                }
+        from[names] = line->offset[1];
+        to[names] = inline_name(cvm, procname, count, line->offset[1]);
+        if(to[names] < 0) {
+            goto done;
+        }
 
-                if(cvm->var[i].type == CRUSTY_TYPE_INT) {
-                    leni = cvm->var[i].length * sizeof(int);
-                } else if(cvm->var[i].type == CRUSTY_TYPE_FLOAT) {
-                    leni = cvm->var[i].length * sizeof(double);
-                } else {
-                    leni = cvm->var[i].length;
-                }
-                if(cvm->var[i].offset + leni > cvm->initialstack) {
-                    LOG_PRINTF(cvm, "Global variable %s exceeds initial stack: "
-                                    "%u + %u = %u > %u\n",
-                                    cvm->var[i].name,
-                                    cvm->var[i].offset,
-                                    leni,
-                                    cvm->var[i].offset + leni,
-                                    cvm->initialstack);
-                    ret = -1;
-                }
-                for(j = i + 1; j < cvm->vars; j++) {
-                    if(variable_is_global(&(cvm->var[j]))) {
-                        if(cvm->var[i].type == CRUSTY_TYPE_INT) {
-                            lenj = cvm->var[j].length * sizeof(int);
-                        } else if(cvm->var[i].type == CRUSTY_TYPE_FLOAT) {
-                            lenj = cvm->var[j].length * sizeof(double);
-                        } else {
-                            lenj = cvm->var[j].length;
-                        }
-                        if((cvm->var[j].offset > cvm->var[i].offset &&
-                            cvm->var[j].offset < cvm->var[i].offset + leni - 1) ||
-                           (cvm->var[j].offset + lenj - 1 > cvm->var[i].offset &&
-                            cvm->var[j].offset + lenj - 1 < cvm->var[i].offset + leni - 1)) {
-                            LOG_PRINTF(cvm, "Global variables %s and %s overlap: "
-                                            "(%u -> %u) (%u -> %u)\n",
-                                       cvm->var[i].name, cvm->var[j].name,
-                                       cvm->var[i].offset,
-                                       cvm->var[i].offset + leni - 1,
-                                       cvm->var[j].offset,
-                                       cvm->var[j].offset + lenj - 1);
-                            ret = -1;
-                        }
-                    }
-                }
-            }
-        } else { /* locals */
-            if(variable_is_callback(&(cvm->var[i]))) {
-                LOG_PRINTF(cvm, "Local variable %s with callback.\n", cvm->var[i].name);
-                ret = -1;
+        out = append_line(cvm, new, lines, mem, line->tokencount, line);
+        if(out == NULL) {
+            goto done;
+        }
+        for(j = 0; j < line->tokencount; j++) {
+            out->offset[j] = line->offset[j];
+        }
+        out->offset[1] = to[names];
+
+        if(movetoken < 0) {
+            movetoken = add_token(cvm, "move", 4, 0, NULL);
+            zerotoken = add_token(cvm, "0", 1, 0, NULL);
+            if(movetoken < 0 || zerotoken < 0) {
+                LOG_PRINTF(cvm, "Failed to allocate memory for token.\n");
+                goto done;
             }
+        }
+        out = append_line(cvm, new, lines, mem, 3, &(cvm->line[call]));
+        if(out == NULL) {
+            goto done;
+        }
+        out->offset[0] = movetoken;
+        out->offset[1] = to[names];
+        out->offset[2] = line->tokencount == 3 ?
+                         line->offset[2] :
+                         (unsigned long)zerotoken;
 
-            for(j = 0; j < cvm->var[i].proc->vars; j++) {
-                if(cvm->var[i].proc == cvm->var[i].proc->var[j]->proc) {
+        names++;
+    }
+
+    for(i = callee->first + 1; i < callee->end; i++) {
+        line = &(cvm->line[i]);
+        if(compare_token_and_string(cvm, line->offset[0], "local") == 0) {
+            continue;
+        }
+
+        out = append_line(cvm, new, lines, mem, line->tokencount, line);
+        if(out == NULL) {
+            goto done;
+        }
+        out->offset[0] = line->offset[0];
+
+        if(line->tokencount == 2) {
+            /* label or jump */
+            out->offset[1] = line->offset[1];
+            for(j = 0; j < labels; j++) {
+                if(compare_token_and_token(cvm, line->offset[1], label[j]) == 0) {
+                    out->offset[1] = labelto[j];
                     break;
                 }
             }
-            if(j == cvm->var[i].proc->vars) {
-                LOG_PRINTF(cvm, "Couldn't find variable in procedure %s "
-                                "referenced by variable %s.\n",
-                           cvm->var[i].proc->name, cvm->var[i].name);
-                ret = -1;
+            continue;
+        }
+
+        for(j = 1; j < line->tokencount; j++) {
+            n = inline_operand(cvm, line->offset[j], from, to, names);
+            if(n < 0) {
+                goto done;
             }
+            out->offset[j] = n;
         }
     }
 
-    for(i = 0; i < cvm->procs; i++) {
-        for(j = 0; j < cvm->proc[i].vars; j++) {
-            if(cvm->proc[i].var[j]->proc != &(cvm->proc[i])) {
-                LOG_PRINTF(cvm, "Mispointed variable %s points to procedure %s "
-                                "but pointed to by procedure %s.\n",
-                           cvm->proc[i].var[j]->name,
-                           cvm->proc[i].var[j]->proc->name,
-                           cvm->proc[i].name);
-                ret = -1;
+    ret = 0;
+done:
+    if(from != NULL) {
+        free(from);
+    }
+    if(to != NULL) {
+        free(to);
+    }
+    if(label != NULL) {
+        free(label);
+    }
+    if(labelto != NULL) {
+        free(labelto);
+    }
+
+    return(ret);
+}
+
+/* inline what calls can be once, counting how many were */
+static int inline_calls(CrustyVM *cvm, unsigned int *count) {
+    CrustyInlineProc *proc = NULL;
+    unsigned int procs = 0;
+    unsigned char **use = NULL;
+    unsigned char *inlinable = NULL;
+    CrustyLine *new = NULL;
+    unsigned int lines = 0;
+    unsigned int mem;
+    long *callee_name = NULL;
+    unsigned int callee_names;
+    long *caller_name = NULL;
+    unsigned int caller_names;
+    CrustyInlineProc *caller;
+    CrustyLine *out;
+    unsigned int i, j, c, p;
+    int inlined = 0;
+    int inproc = 0;
+    int ret = -1;
+
+    /* find where the procedures are, leaving anything malformed for the
+       symbols scan to complain about */
+    proc = malloc(sizeof(CrustyInlineProc) * cvm->lines);
+    if(proc == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for procedure list.\n");
+        goto done;
+    }
+    for(i = 0; i < cvm->lines; i++) {
+        if(compare_token_and_string(cvm, cvm->line[i].offset[0], "proc") == 0) {
+            if(inproc || cvm->line[i].tokencount < 2) {
+                ret = 0;
+                goto done;
+            }
+            proc[procs].first = i;
+            inproc = 1;
+        } else if(compare_token_and_string(cvm, cvm->line[i].offset[0], "ret") == 0 &&
+                  inproc) {
+            proc[procs].end = i;
+            procs++;
+            inproc = 0;
+        }
+    }
+    if(inproc || procs == 0) {
+        ret = 0;
+        goto done;
+    }
+
+    use = calloc(procs, sizeof(unsigned char *));
+    inlinable = malloc(procs);
+    if(use == NULL || inlinable == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for procedure list.\n");
+        goto done;
+    }
+    for(i = 0; i < procs; i++) {
+        use[i] = malloc(cvm->line[proc[i].first].tokencount);
+        if(use[i] == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for procedure list.\n");
+            goto done;
+        }
+        inlinable[i] = can_inline(cvm, &(proc[i]), use[i]);
+    }
+
+    mem = cvm->lines;
+    new = malloc(sizeof(CrustyLine) * mem);
+    if(new == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for lines.\n");
+        goto done;
+    }
+
+    p = 0;
+    for(i = 0; i < cvm->lines; i++) {
+        while(p < procs && proc[p].end < i) {
+            p++;
+        }
+        caller = (p < procs && proc[p].first < i) ? &(proc[p]) : NULL;
+
+        if(caller != NULL &&
+           compare_token_and_string(cvm, cvm->line[i].offset[0], "call") == 0 &&
+           cvm->line[i].tokencount >= 2) {
+            for(c = 0; c < procs; c++) {
+                if(compare_token_and_token(cvm,
+                                           cvm->line[i].offset[1],
+                                           cvm->line[proc[c].first].offset[1]) == 0) {
+                    break;
+                }
             }
 
-            if(cvm->proc[i].var[j]->length == 0) {
-                if(j > cvm->proc[i].args) {
-                    LOG_PRINTF(cvm, "Variable %s in proc %s has 0 length but "
-                                    "index greater than args. (%u > %u)\n",
-                               cvm->proc[i].var[j]->name,
-                               cvm->proc[i].name,
-                               j, cvm->proc[i].args);
-                    ret = -1;
+            if(c < procs &&
+               inlinable[c] &&
+               cvm->line[i].tokencount == cvm->line[proc[c].first].tokencount) {
+                for(j = 2; j < cvm->line[i].tokencount; j++) {
+                    if(!can_pass_inline(cvm,
+                                        cvm->line[i].offset[j],
+                                        use[c][j - 2],
+                                        (const long *)&(cvm->line[caller->first].offset[2]),
+                                        cvm->line[caller->first].tokencount - 2)) {
+                        break;
+                    }
                 }
-                if(cvm->proc[i].var[j]->offset > cvm->proc[i].args) {
-                    LOG_PRINTF(cvm, "Variable %s in proc %s is argument but "
-                                    "stack offset greater than args. (%u > %u)\n",
-                               cvm->proc[i].var[j]->name,
-                               cvm->proc[i].name,
-                               cvm->proc[i].var[j]->offset,
-                               cvm->proc[i].args);
-                    ret = -1;
+
+                if(j == cvm->line[i].tokencount) {
+                    if(procedure_names(cvm, &(proc[c]),
+                                       &callee_name, &callee_names) < 0 ||
+                       procedure_names(cvm, caller,
+                                       &caller_name, &caller_names) < 0) {
+                        goto done;
+                    }
+
+                    if(!inline_shadowed(cvm, &(proc[c]),
+                                        callee_name, callee_names,
+                                        caller_name, caller_names)) {
+                        if(inline_call(cvm, i, &(proc[c]), *count,
+                                       &new, &lines, &mem) < 0) {
+                            goto done;
+                        }
+                        (*count)++;
+                        inlined++;
+
+                        free(callee_name);
+                        callee_name = NULL;
+                        free(caller_name);
+                        caller_name = NULL;
+                        continue;
+                    }
+
+                    free(callee_name);
+                    callee_name = NULL;
+                    free(caller_name);
+                    caller_name = NULL;
                 }
             }
+        }
 
-            if(!variable_is_argument(cvm->proc[i].var[j])) {
-                if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_INT) {
-                    lenj = cvm->proc[i].var[j]->length * sizeof(int);
-                    offj = cvm->proc[i].var[j]->offset;
-                    offj -= lenj; /* stack is indexed from top */
-                } else if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_FLOAT) {
-                    lenj = cvm->proc[i].var[j]->length * sizeof(double);
-                    offj = cvm->proc[i].var[j]->offset;
-                    offj -= lenj; /* stack is indexed from top */
-                } else { /* CHAR */
-                    lenj = cvm->proc[i].var[j]->length;
-                    offj = cvm->proc[i].var[j]->offset;
-                    offj -= lenj;
+        out = append_line(cvm, &new, &lines, &mem,
+                          cvm->line[i].tokencount, &(cvm->line[i]));
+        if(out == NULL) {
+            goto done;
+        }
+        for(j = 0; j < cvm->line[i].tokencount; j++) {
+            out->offset[j] = cvm->line[i].offset[j];
+        }
+    }
+
+    if(inlined > 0) {
+        for(i = 0; i < cvm->lines; i++) {
+            free(cvm->line[i].offset);
+        }
+        free(cvm->line);
+        cvm->line = new;
+        cvm->lines = lines;
+        new = NULL;
+    }
+
+    ret = inlined;
+done:
+    if(new != NULL) {
+        for(i = 0; i < lines; i++) {
+            free(new[i].offset);
+        }
+        free(new);
+    }
+    if(callee_name != NULL) {
+        free(callee_name);
+    }
+    if(caller_name != NULL) {
+        free(caller_name);
+    }
+    if(use != NULL) {
+        for(i = 0; i < procs; i++) {
+            if(use[i] != NULL) {
+                free(use[i]);
+            }
+        }
+        free(use);
+    }
+    if(inlinable != NULL) {
+        free(inlinable);
+    }
+    if(proc != NULL) {
+        free(proc);
+    }
+
+    return(ret);
+}
+
+static int inline_procedures(CrustyVM *cvm) {
+    unsigned int count = 0;
+    unsigned int i;
+    int ret;
+
+    for(i = 0; i < INLINE_ROUNDS; i++) {
+        ret = inline_calls(cvm, &count);
+        if(ret < 0) {
+            return(-1);
+        }
+        if(ret == 0) {
+            break;
+        }
+    }
+
+    return(0);
+}
+
+static int symbols_scan(CrustyVM *cvm,
+                        char *safepath) {
+    unsigned int i, j;
+    CrustyProcedure *curProc = NULL;
+    int curProcIndex = -1;
+
+    CrustyLine *new = NULL;
+    char *temp;
+    unsigned int lines;
+
+    new = malloc(sizeof(CrustyLine) * cvm->lines);
+    if(new == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for lines\n");
+        return(-1);
+    }
+
+    cvm->stacksize = 0;
+
+    lines = 0;
+    for(cvm->logline = 0; cvm->logline < cvm->lines; cvm->logline++) {
+        if(curProc != NULL) {
+            curProc->length++;
+        }
+        /* no need to check if tokencount > 0 because those lines were filtered
+           out previously */
+        if(compare_token_and_string(cvm,
+                                    GET_TOKEN_OFFSET(cvm->logline, 0),
+                                    "proc") == 0) {
+            if(cvm->line[cvm->logline].tokencount < 2) {
+                LOG_PRINTF_LINE(cvm, "proc takes a name as argument.\n");
+                goto failure;
+            }
+
+            if(curProc != NULL) {
+                LOG_PRINTF_LINE(cvm, "proc within proc.\n");
+                goto failure;
+            }
+
+            if(find_procedure(cvm, GET_TOKEN(cvm->logline, 1)) >= 0) {
+                LOG_PRINTF_LINE(cvm, "Redeclaration of procedure.\n");
+                goto failure;
+            }
+
+            curProc = realloc(cvm->proc, sizeof(CrustyProcedure) * (cvm->procs + 1));
+            if(curProc == NULL) {
+                LOG_PRINTF_LINE(cvm, "Couldn't allocate memory for procedure.\n");
+                goto failure;
+            }
+            cvm->proc = curProc;
+            curProcIndex = cvm->procs;
+            curProc = &(cvm->proc[curProcIndex]);
+            cvm->procs++;
+
+            curProc->nameOffset = cvm->line[cvm->logline].offset[1];
+            curProc->start = lines;
+            curProc->length = 0;
+            curProc->stackneeded = 0;
+            curProc->initializer = NULL;
+            curProc->copy = NULL;
+            curProc->copies = 0;
+            curProc->zero = NULL;
+            curProc->zeros = 0;
+            curProc->args = 0; 
+            curProc->var = NULL;
+            curProc->varIndex = NULL;
+            curProc->vars = 0;
+            curProc->label = NULL;
+            curProc->labels = 0;
+
+            unsigned int args = cvm->line[cvm->logline].tokencount - 2;
+            /* add arguments as local variables */
+            for(i = 0; i < args; i++) {
+                /* argument variables have 0 length and no initializers and no
+                   read or write functions but obviously is a local variable */
+                if(new_variable(cvm,
+                                cvm->line[cvm->logline].offset[i + 2],
+                                CRUSTY_TYPE_NONE,
+                                0,
+                                NULL,
+                                NULL,
+                                curProcIndex) < 0) {
+                                    /* print an error so the user can get a line
+                                     * number. */
+                                    LOG_PRINTF_LINE(cvm, "Error from "
+                                                        "new_variable().\n");
+                                    goto failure;
+                }
+            }                    
+
+            continue; /* don't copy in to new list */
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "ret") == 0) {
+            if(curProc == NULL) {
+                LOG_PRINTF_LINE(cvm, "ret without proc.\n");
+                goto failure;
+            }
+
+            cvm->stacksize += curProc->stackneeded;
+            curProc = NULL;
+            curProcIndex = -1;
+
+            /* this is a real instruction, so it should be copied over */
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "static") == 0) {
+            if(cvm->line[cvm->logline].tokencount < 2) {
+                LOG_PRINTF_LINE(cvm, "static takes a name as argument.\n");
+                goto failure;
+            }
+
+            if(variable_declaration(cvm, &(cvm->line[cvm->logline]), -1) < 0) {
+                goto failure;
+            }
+
+            continue; /* don't copy in to new list */
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "local") == 0) {
+            if(cvm->line[cvm->logline].tokencount < 2) {
+                LOG_PRINTF_LINE(cvm, "local takes a name as argument.\n");
+                goto failure;
+            }
+
+            if(curProc == NULL) {
+                LOG_PRINTF_LINE(cvm, "local declared outside of procedure.\n");
+                goto failure;
+            }
+
+            if(variable_declaration(cvm, &(cvm->line[cvm->logline]), curProcIndex) < 0) {
+                goto failure;
+            }
+
+            continue; /* don't copy in to new list */
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "stack") == 0) {
+            if(cvm->line[cvm->logline].tokencount != 2) {
+                LOG_PRINTF_LINE(cvm, "stack takes a number as argument.\n");
+                goto failure;
+            }
+
+            long stack = strtol(GET_TOKEN(cvm->logline, 1), &temp, 0);
+            if(temp - GET_TOKEN(cvm->logline, 1) == TOKENLEN(GET_TOKEN_OFFSET(cvm->logline, 1))) {
+                cvm->stacksize += stack;
+            } else {
+                LOG_PRINTF_LINE(cvm, "stack takes a number as argument.\n");
+                goto failure;
+            }
+
+            continue; /* don't copy in to new list */
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "label") == 0) {
+            if(cvm->line[cvm->logline].tokencount != 2) {
+                LOG_PRINTF_LINE(cvm, "label takes a name as argument.\n");
+                goto failure;
+            }
+
+            if(curProc == NULL) {
+                LOG_PRINTF_LINE(cvm, "label not in a procedure.\n");
+                goto failure;
+            }
+
+            for(i = 0; i < curProc->labels; i++) {
+                if(compare_token_and_token(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 1),
+                                           curProc->label[i].nameOffset) == 0) {
+                    LOG_PRINTF_LINE(cvm, "Duplicate label: %s\n",
+                                        GET_TOKEN(cvm->logline, 1));
+                    goto failure;
+                }
+            }
+
+            temp = realloc(curProc->label, sizeof(CrustyLabel) * (curProc->labels + 1));
+            if(temp == NULL) {
+                LOG_PRINTF_LINE(cvm, "Failed to allocate memory for labels list.\n");
+                goto failure;
+            }
+            curProc->label = (CrustyLabel *)temp;
+            curProc->label[curProc->labels].nameOffset =
+                cvm->line[cvm->logline].offset[1];
+            curProc->label[curProc->labels].line = lines;
+            curProc->labels++;
+
+            continue; /* don't copy in to new list */
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "binclude") == 0) {
+            if(cvm->line[cvm->logline].tokencount < 4 ||
+               cvm->line[cvm->logline].tokencount > 6) {
+                LOG_PRINTF_LINE(cvm, "binclude takes at least a symbol name, "
+                                    "type and filename and optionally a "
+                                    "start and length.\n");
+                goto failure;
+            }
+
+            unsigned long fileStart = 0;
+            long fileLength = 0;
+
+            if(cvm->line[cvm->logline].tokencount >= 5) {
+                fileStart = strtoul(GET_TOKEN(cvm->logline, 4), &temp, 0);
+                if(temp - GET_TOKEN(cvm->logline, 4) != TOKENLEN(GET_TOKEN_OFFSET(cvm->logline, 4))) {
+                    LOG_PRINTF_LINE(cvm, "binclude start field must be a "
+                                        "number\n");
+                    goto failure;
+                }
+            }
+            if(cvm->line[cvm->logline].tokencount == 6) {
+                fileLength = strtoul(GET_TOKEN(cvm->logline, 5), &temp, 0);
+                if(temp - GET_TOKEN(cvm->logline, 5) != TOKENLEN(GET_TOKEN_OFFSET(cvm->logline, 5))) {
+                    LOG_PRINTF_LINE(cvm, "binclude start field must be a "
+                                        "number\n");
+                    goto failure;
+                }
+            }
+
+            CrustyType type;
+            if(compare_token_and_string(cvm,
+                                        GET_TOKEN_OFFSET(cvm->logline, 2),
+                                        "chars") == 0) {
+                type = CRUSTY_TYPE_CHAR;
+            } else if(compare_token_and_string(cvm,
+                                        GET_TOKEN_OFFSET(cvm->logline, 2),
+                                        "ints") == 0) {
+                type = CRUSTY_TYPE_INT;
+            } else if(compare_token_and_string(cvm,
+                                        GET_TOKEN_OFFSET(cvm->logline, 2),
+                                        "floats") == 0) {
+                type = CRUSTY_TYPE_FLOAT;
+            } else {
+                LOG_PRINTF_LINE(cvm, "Type must be chars, ints or floats.\n");
+                goto failure;
+            }
+            
+            FILE *in;
+            in = crustyvm_open_file(GET_TOKEN(cvm->logline, 3),
+                                    &safepath,
+                                    cvm->log_cb,
+                                    cvm->log_priv);
+            if(in == NULL) {
+                LOG_PRINTF_LINE(cvm, "Failed to open %s for reading.\n",
+                                    GET_TOKEN(cvm->logline, 3));
+                goto failure;
+            }
+            if(add_dependency(cvm,
+                              GET_TOKEN_OFFSET(cvm->logline, 3),
+                              in) < 0) {
+                fclose(in);
+                goto failure;
+            }
+            if(fileLength == 0) {
+                if(fseek(in, 0, SEEK_END) < 0) {
+                    LOG_PRINTF_LINE(cvm, "Failed to seek to end.\n");
+                    goto failure;
+                }
+                fileLength = ftell(in);
+                if(fileLength < 0) {
+                    LOG_PRINTF_LINE(cvm, "Failed to get length.\n");
+                    goto failure;
+                }
+                if(fseek(in, 0, SEEK_SET) < 0) {
+                    LOG_PRINTF_LINE(cvm, "Failed to seek to start.\n");
+                    goto failure;
+                }
+                fileLength -= fileStart;
+            }
+
+            if(type == CRUSTY_TYPE_INT) {
+                fileLength = fileLength / sizeof(int) * sizeof(int);
+           } else if(type == CRUSTY_TYPE_FLOAT) {
+                fileLength = fileLength / sizeof(double) * sizeof(double);
+            }
+            if(fileLength == 0) {
+                LOG_PRINTF_LINE(cvm, "Selected size not large enough for "
+                                    "type.\n");
+                goto failure;
+            }
+ 
+            if(fseek(in, fileStart, SEEK_SET) < 0) {
+                LOG_PRINTF_LINE(cvm, "Failed to seek to position.\n");
+                goto failure;
+            }
+
+            unsigned char *buf;
+            buf = malloc(fileLength);
+            if(buf == NULL) {
+                LOG_PRINTF_LINE(cvm, "Couldn't allocate memory.\n");
+                goto failure;
+            }
+
+            if(fread(buf, 1, fileLength, in) != fileLength) {
+                LOG_PRINTF_LINE(cvm, "Couldn't read full length.\n");
+                free(buf);
+                goto failure;
+            }
+
+            fclose(in);
+
+            if(type == CRUSTY_TYPE_CHAR) {
+                if(new_variable(cvm,
+                                cvm->line[cvm->logline].offset[1],
+                                CRUSTY_TYPE_CHAR,
+                                fileLength,
+                                buf,
+                                NULL,
+                                curProcIndex) < 0) {
+                    free(buf);
+                    goto failure;
+                }
+            } else if(type == CRUSTY_TYPE_INT) {
+                if(new_variable(cvm,
+                                cvm->line[cvm->logline].offset[1],
+                                CRUSTY_TYPE_INT,
+                                fileLength / sizeof(int),
+                                buf,
+                                NULL,
+                                curProcIndex) < 0) {
+                    free(buf);
+                    goto failure;
+                }
+            } else if(type == CRUSTY_TYPE_FLOAT) {
+                if(new_variable(cvm,
+                                cvm->line[cvm->logline].offset[1],
+                                CRUSTY_TYPE_FLOAT,
+                                fileLength / sizeof(double),
+                                buf,
+                                NULL,
+                                curProcIndex) < 0) {
+                    free(buf);
+                    goto failure;
+                }
+            }
+            free(buf);
+
+            continue;
+        }
+
+        new[lines].tokencount = cvm->line[cvm->logline].tokencount;
+        new[lines].moduleOffset = cvm->line[cvm->logline].moduleOffset;
+        new[lines].line = cvm->line[cvm->logline].line;
+        new[lines].offset = malloc(sizeof(long) * new[lines].tokencount);
+        if(new[lines].offset == NULL) {
+            LOG_PRINTF_LINE(cvm, "Failed to allocate memory for line copy.\n");
+            goto failure;
+        }
+        for(i = 0; i < new[lines].tokencount; i++) {
+            new[lines].offset[i] = cvm->line[cvm->logline].offset[i];
+        }
+        lines++;
+    }
+
+    if(curProc != NULL) {
+        LOG_PRINTF(cvm, "Procedure without return.\n");
+        goto failure;
+    }
+
+    /* point CrustyVariables in CrustyProcedures and vise versa */
+    for(i = 0; i < cvm->vars; i++) {
+        cvm->var[i].proc = NULL;
+    }
+
+    for(i = 0; i < cvm->procs; i++) {
+        cvm->proc[i].var = malloc(sizeof(CrustyVariable *) * cvm->proc[i].vars);
+        if(cvm->proc[i].var == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for procedure variable pointer list.\n");
+            goto failure;
+        }
+
+        for(j = 0; j < cvm->proc[i].vars; j++) {
+            cvm->proc[i].var[j] = &(cvm->var[cvm->proc[i].varIndex[j]]);
+            cvm->proc[i].var[j]->proc = &(cvm->proc[i]);
+        }
+    }
+
+    temp = realloc(new, sizeof(CrustyLine) * lines);
+    if(temp == NULL) {
+        LOG_PRINTF(cvm, "Failed to shrink line array.\n");
+        goto failure;
+    }
+
+    for(i = 0; i < cvm->lines; i++) {
+        free(cvm->line[i].offset);
+    }
+    free(cvm->line);
+    cvm->line = (CrustyLine *)temp;
+    cvm->lines = lines;
+
+    cvm->stacksize += cvm->initialstack;
+
+    return(0);
+
+failure:
+    if(new != NULL) {
+        for(i = 0; i < lines; i++) {
+            if(new[i].offset != NULL) {
+                free(new[i].offset);
+            }
+        }
+        free(new);
+    }
+
+    return(-1);
+}
+
+/* get a bunch of messy checks out of the way.  Many of these are wacky and
+   should be impossible but may as well get as much out of the way as possible. */
+static unsigned int type_size(CrustyType type) {
+    if(type == CRUSTY_TYPE_INT) {
+        return(sizeof(int));
+    } else if(type == CRUSTY_TYPE_FLOAT) {
+        return(sizeof(double));
+    }
+
+    return(1);
+}
+
+/* variables are laid out in groups, scalars ahead of arrays so the values
+   used most often share cache lines, and the widest type first within each so
+   everything can be naturally aligned with little padding */
+#define LAYOUT_GROUPS (6)
+static const CrustyType layout_type[] = {
+    CRUSTY_TYPE_FLOAT,
+    CRUSTY_TYPE_INT,
+    CRUSTY_TYPE_CHAR
+};
+
+static int layout_group(CrustyVariable *var, unsigned int group) {
+    return(var->type == layout_type[group % 3] &&
+           (var->length > 1) == (group >= 3));
+}
+
+/* size rounded up to the alignment a type needs */
+static unsigned int layout_align(unsigned int size, unsigned int align) {
+    if(size % align != 0) {
+        size += align - (size % align);
+    }
+
+    return(size);
+}
+
+/* Move variables from the order they were declared in to their final layout.
+   Globals count up from the start of the stack and locals count down from the
+   top of their frame past the arguments, and since the stack, the globals and
+   every frame are a multiple of STACK_ALIGNMENT, each variable ends up aligned
+   to its own size in memory. */
+static int layout_variables(CrustyVM *cvm) {
+    unsigned int i, j, k;
+    unsigned int size, len;
+    unsigned int *offset;
+    unsigned char *init = NULL;
+    CrustyProcedure *proc;
+    CrustyVariable *var;
+
+    offset = malloc(sizeof(unsigned int) * (cvm->vars + 1));
+    if(offset == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for variable layout.\n");
+        return(-1);
+    }
+
+    size = 0;
+    for(i = 0; i < LAYOUT_GROUPS; i++) {
+        for(j = 0; j < cvm->vars; j++) {
+            var = &(cvm->var[j]);
+            if(!variable_is_global(var) ||
+               variable_is_callback(var) ||
+               !layout_group(var, i)) {
+                continue;
+            }
+
+            size = layout_align(size, type_size(var->type));
+            offset[j] = size;
+            size += var->length * type_size(var->type);
+        }
+    }
+    size = layout_align(size, STACK_ALIGNMENT);
+
+    if(size > 0) {
+        init = malloc(size);
+        if(init == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for initializer.\n");
+            goto error;
+        }
+        memset(init, 0, size);
+    }
+    for(j = 0; j < cvm->vars; j++) {
+        var = &(cvm->var[j]);
+        if(!variable_is_global(var) || variable_is_callback(var)) {
+            continue;
+        }
+
+        memcpy(&(init[offset[j]]),
+               &(cvm->initializer[var->offset]),
+               var->length * type_size(var->type));
+        var->offset = offset[j];
+    }
+    if(cvm->initializer != NULL) {
+        free(cvm->initializer);
+    }
+    cvm->initializer = init;
+    cvm->stacksize = cvm->stacksize - cvm->initialstack + size;
+    cvm->initialstack = size;
+
+    for(i = 0; i < cvm->procs; i++) {
+        proc = &(cvm->proc[i]);
+
+        /* arguments stay where they are at the top of the frame */
+        size = proc->args * sizeof(CrustyStackArg);
+        for(j = 0; j < LAYOUT_GROUPS; j++) {
+            for(k = 0; k < proc->vars; k++) {
+                var = proc->var[k];
+                if(variable_is_argument(var) || !layout_group(var, j)) {
+                    continue;
+                }
+
+                /* offsets are counted down from the top of the frame */
+                len = var->length * type_size(var->type);
+                size = layout_align(size, type_size(var->type)) + len;
+                offset[proc->varIndex[k]] = size;
+            }
+        }
+        size = layout_align(size, STACK_ALIGNMENT);
+
+        init = malloc(size);
+        if(init == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for initializer.\n");
+            goto error;
+        }
+        memset(init, 0, size);
+        for(k = 0; k < proc->vars; k++) {
+            var = proc->var[k];
+            if(variable_is_argument(var)) {
+                continue;
+            }
+
+            memcpy(&(init[size - offset[proc->varIndex[k]]]),
+                   &(proc->initializer[proc->stackneeded - var->offset]),
+                   var->length * type_size(var->type));
+            var->offset = offset[proc->varIndex[k]];
+        }
+        if(proc->initializer != NULL) {
+            free(proc->initializer);
+        }
+        proc->initializer = init;
+        cvm->stacksize = cvm->stacksize - proc->stackneeded + size;
+        proc->stackneeded = size;
+    }
+
+    free(offset);
+    return(0);
+
+error:
+    free(offset);
+    return(-1);
+}
+
+static int symbols_verify(CrustyVM *cvm) {
+    unsigned int i, j, k;
+    unsigned int leni, lenj, offi, offj;
+    int ret = 0;
+
+    for(i = 0; i < cvm->vars; i++) {
+        if(variable_is_global(&(cvm->var[i]))) {
+            if(cvm->var[i].length == 0) {
+                LOG_PRINTF(cvm, "Global variable %s has 0 length.\n", cvm->var[i].name);
+                ret = -1;
+            }
+
+            if(cvm->var[i].read == NULL && cvm->var[i].write == NULL) {
+                if(cvm->var[i].type != CRUSTY_TYPE_INT &&
+                   cvm->var[i].type != CRUSTY_TYPE_FLOAT &&
+                   cvm->var[i].type != CRUSTY_TYPE_CHAR) {
+                    LOG_PRINTF(cvm, "Non-callback variable with invalid type.\n");
+                    continue;
+                }
+
+                if(cvm->var[i].type == CRUSTY_TYPE_INT) {
+                    leni = cvm->var[i].length * sizeof(int);
+                } else if(cvm->var[i].type == CRUSTY_TYPE_FLOAT) {
+                    leni = cvm->var[i].length * sizeof(double);
+                } else {
+                    leni = cvm->var[i].length;
+                }
+                if(cvm->var[i].offset + leni > cvm->initialstack) {
+                    LOG_PRINTF(cvm, "Global variable %s exceeds initial stack: "
+                                    "%u + %u = %u > %u\n",
+                                    cvm->var[i].name,
+                                    cvm->var[i].offset,
+                                    leni,
+                                    cvm->var[i].offset + leni,
+                                    cvm->initialstack);
+                    ret = -1;
+                }
+                for(j = i + 1; j < cvm->vars; j++) {
+                    if(variable_is_global(&(cvm->var[j]))) {
+                        if(cvm->var[j].type == CRUSTY_TYPE_INT) {
+                            lenj = cvm->var[j].length * sizeof(int);
+                        } else if(cvm->var[j].type == CRUSTY_TYPE_FLOAT) {
+                            lenj = cvm->var[j].length * sizeof(double);
+                        } else {
+                            lenj = cvm->var[j].length;
+                        }
+                        if((cvm->var[j].offset > cvm->var[i].offset &&
+                            cvm->var[j].offset < cvm->var[i].offset + leni - 1) ||
+                           (cvm->var[j].offset + lenj - 1 > cvm->var[i].offset &&
+                            cvm->var[j].offset + lenj - 1 < cvm->var[i].offset + leni - 1)) {
+                            LOG_PRINTF(cvm, "Global variables %s and %s overlap: "
+                                            "(%u -> %u) (%u -> %u)\n",
+                                       cvm->var[i].name, cvm->var[j].name,
+                                       cvm->var[i].offset,
+                                       cvm->var[i].offset + leni - 1,
+                                       cvm->var[j].offset,
+                                       cvm->var[j].offset + lenj - 1);
+                            ret = -1;
+                        }
+                    }
+                }
+            }
+        } else { /* locals */
+            if(variable_is_callback(&(cvm->var[i]))) {
+                LOG_PRINTF(cvm, "Local variable %s with callback.\n", cvm->var[i].name);
+                ret = -1;
+            }
+
+            for(j = 0; j < cvm->var[i].proc->vars; j++) {
+                if(cvm->var[i].proc == cvm->var[i].proc->var[j]->proc) {
+                    break;
+                }
+            }
+            if(j == cvm->var[i].proc->vars) {
+                LOG_PRINTF(cvm, "Couldn't find variable in procedure %s "
+                                "referenced by variable %s.\n",
+                           cvm->var[i].proc->name, cvm->var[i].name);
+                ret = -1;
+            }
+        }
+    }
+
+    for(i = 0; i < cvm->procs; i++) {
+        for(j = 0; j < cvm->proc[i].vars; j++) {
+            if(cvm->proc[i].var[j]->proc != &(cvm->proc[i])) {
+                LOG_PRINTF(cvm, "Mispointed variable %s points to procedure %s "
+                                "but pointed to by procedure %s.\n",
+                           cvm->proc[i].var[j]->name,
+                           cvm->proc[i].var[j]->proc->name,
+                           cvm->proc[i].name);
+                ret = -1;
+            }
+
+            if(cvm->proc[i].var[j]->length == 0) {
+                if(j > cvm->proc[i].args) {
+                    LOG_PRINTF(cvm, "Variable %s in proc %s has 0 length but "
+                                    "index greater than args. (%u > %u)\n",
+                               cvm->proc[i].var[j]->name,
+                               cvm->proc[i].name,
+                               j, cvm->proc[i].args);
+                    ret = -1;
+                }
+                if(cvm->proc[i].var[j]->offset > cvm->proc[i].args) {
+                    LOG_PRINTF(cvm, "Variable %s in proc %s is argument but "
+                                    "stack offset greater than args. (%u > %u)\n",
+                               cvm->proc[i].var[j]->name,
+                               cvm->proc[i].name,
+                               cvm->proc[i].var[j]->offset,
+                               cvm->proc[i].args);
+                    ret = -1;
+                }
+            }
+
+            if(!variable_is_argument(cvm->proc[i].var[j])) {
+                if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_INT) {
+                    lenj = cvm->proc[i].var[j]->length * sizeof(int);
+                    offj = cvm->proc[i].var[j]->offset;
+                    offj -= lenj; /* stack is indexed from top */
+                } else if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_FLOAT) {
+                    lenj = cvm->proc[i].var[j]->length * sizeof(double);
+                    offj = cvm->proc[i].var[j]->offset;
+                    offj -= lenj; /* stack is indexed from top */
+                } else { /* CHAR */
+                    lenj = cvm->proc[i].var[j]->length;
+                    offj = cvm->proc[i].var[j]->offset;
+                    offj -= lenj;
+                }
+            } else {
+                lenj = sizeof(CrustyStackArg);
+                offj = cvm->proc[i].var[j]->offset * sizeof(CrustyStackArg);
+                offj -= lenj;
+            }
+            if(offj > cvm->proc[i].stackneeded) {
+                LOG_PRINTF(cvm, "Variable %s from procedure %s exceeds "
+                                "needed stack: %u > %u\n",
+                                cvm->proc[i].var[j]->name,
+                                cvm->proc[i].name,
+                                offj,
+                                cvm->proc[i].stackneeded);
+                ret = -1;
+            }
+            for(k = j + 1; k < cvm->proc[i].vars; k++) {
+                if(!variable_is_argument(cvm->proc[i].var[k])) {
+                    if(cvm->proc[i].var[k]->type == CRUSTY_TYPE_INT) {
+                        leni = cvm->proc[i].var[k]->length * sizeof(int);
+                        offi = cvm->proc[i].var[k]->offset;
+                        offi -= leni; /* stack is indexed from top */
+                    } else if(cvm->proc[i].var[k]->type == CRUSTY_TYPE_FLOAT) {
+                        leni = cvm->proc[i].var[k]->length * sizeof(double);
+                        offi = cvm->proc[i].var[k]->offset;
+                        offi -= leni; /* stack is indexed from top */
+                    } else { /* CHAR */
+                        leni = cvm->proc[i].var[k]->length;
+                        offi = cvm->proc[i].var[k]->offset;
+                        offi -= leni;
+                    }
+                } else {
+                    leni = sizeof(CrustyStackArg);
+                    offi = cvm->proc[i].var[k]->offset * sizeof(CrustyStackArg);
+                    offi -= leni;
+                }
+                if((offi > offj &&
+                    offi < offj + lenj - 1) ||
+                   (offi + leni - 1 > offj &&
+                    offi + leni - 1 < offj + lenj - 1)) {
+                    LOG_PRINTF(cvm, "Variables %s and %s from procedure %s "
+                                    "overlap: (%u -> %u) (%u -> %u)\n",
+                               cvm->proc[i].var[j]->name,
+                               cvm->proc[i].var[k]->name,
+                               cvm->proc[i].name,
+                               offj, offj + lenj - 1,
+                               offi, offi + leni - 1);
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    return(ret);
+}
+
+static int populate_var(CrustyVM *cvm,
+                        char *name,
+                        CrustyProcedure *proc,
+                        int readable,
+                        int writable,
+                        int *flags,
+                        int *var,
+                        int *index,
+                        CrustyOperandKind *kind) {
+    CrustyVariable *varObj, *indexObj = NULL;
+    char *colon;
+    char *vararray = NULL;
+    char *end;
+
+    *flags = 0;
+    *index = 0;
+
+    /* test to see if we have an immediate value */
+    *var = strtol(name, &end, 0);
+    if(name != end && *end == '\0') {
+        /* immediate value */
+        if(writable) {
+            LOG_PRINTF_LINE(cvm, "Immediate values aren't writable.\n");
+            return(-1);
+        }
+
+        *flags |= MOVE_FLAG_IMMEDIATE;
+        if(kind != NULL) {
+            *kind = CRUSTY_OPERAND_IMMEDIATE;
+        }
+        return(0);
+    }
+
+    /* find colon */
+    colon = strrchr(name, ':');
+
+    if(colon != NULL) {
+        /* replace : with 0 and start at beginning of offset, if any */
+        *colon = '\0';
+        vararray = &(colon[1]);
+    }
+
+    *var = find_variable(cvm, proc, name);
+    if(*var == -1) {
+        LOG_PRINTF_LINE(cvm, "Variable %s not found.\n", name);
+        goto failure;
+    }
+    varObj = &(cvm->var[*var]);
+
+    if(writable) {
+        if(varObj->read != NULL && varObj->write == NULL) {
+            LOG_PRINTF_LINE(cvm, "%s isn't a writable callback.\n", name);
+            goto failure;
+        }
+    }
+    if(readable) {
+        if(varObj->write != NULL && varObj->read == NULL) {
+            LOG_PRINTF_LINE(cvm, "%s isn't a readable callback.\n", name);
+            goto failure;
+        }
+    }
+
+    if(vararray != NULL) {
+        if(*vararray == '\0') {
+            /* array length */
+            if(writable) {
+                LOG_PRINTF_LINE(cvm, "Array length isn't writable.\n");
+                goto failure;
+            }
+
+            *flags |= MOVE_FLAG_LENGTH;
+        } else {
+            *flags |= MOVE_FLAG_VAR;
+            *index = strtol(vararray, &end, 0);
+            if(end != vararray && *end == '\0') {
+                /* array with immediate index, if length is 0, it's a local
+                 * variable and we can't know until runtime. */
+                if(*index < 0 ||
+                   ((int)(varObj->length) > 0 &&
+                    *index > (int)(varObj->length) - 1)) {
+                    LOG_PRINTF_LINE(cvm, "Immediate index out of array size.\n");
+                    goto failure;
+                }
+                *flags |= MOVE_FLAG_INDEX_IMMEDIATE;
+            } else {
+                /* array with variable index */
+                *index = find_variable(cvm, proc, vararray);
+                if(*index == -1) {
+                    LOG_PRINTF_LINE(cvm, "Array index variable %s not found.\n", vararray);
+                    goto failure;
+                }
+                indexObj = &(cvm->var[*index]);
+
+                if(indexObj->write != NULL &&
+                   indexObj->read == NULL) {
+                    LOG_PRINTF_LINE(cvm, "%s isn't a readable callback.\n", vararray);
+                    goto failure;
+                }
+
+                *flags |= MOVE_FLAG_INDEX_VAR;
+            }
+        }
+    } else {
+        /* variable */
+        *flags |= MOVE_FLAG_VAR | MOVE_FLAG_INDEX_IMMEDIATE;
+        *index = 0;
+    }
+
+    if(kind != NULL) {
+        if(variable_is_argument(varObj) && vararray == NULL) {
+            *kind = CRUSTY_OPERAND_ARGUMENT;
+        } else if(variable_is_argument(varObj) ||
+           (indexObj != NULL && variable_is_argument(indexObj))) {
+            *kind = CRUSTY_OPERAND_REFERENCE;
+        } else if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+            /* length of anything but an argument is a constant */
+            *kind = CRUSTY_OPERAND_IMMEDIATE;
+        } else if(variable_is_callback(varObj)) {
+            *kind = CRUSTY_OPERAND_CALLBACK;
+        } else if(indexObj != NULL) {
+            *kind = CRUSTY_OPERAND_ARRAY;
+        } else if(variable_is_global(varObj)) {
+            *kind = CRUSTY_OPERAND_GLOBAL;
+        } else {
+            *kind = CRUSTY_OPERAND_LOCAL;
+        }
+    }
+
+    if(colon != NULL) {
+        *colon = ':';
+    }
+    return(0);
+
+failure:
+    if(colon != NULL) {
+        *colon = ':';
+    }
+    return(-1);
+}
+
+static int *new_instruction(CrustyVM *cvm, unsigned int args) {
+    int *temp;
+
+    temp = realloc(cvm->inst, sizeof(int) * (cvm->insts + args + 1));
+    if(temp == NULL) {
+        LOG_PRINTF_LINE(cvm, "Failed to allocate memory for instructions.\n");
+        return(NULL);
+    }
+    cvm->inst = temp;
+    temp = &(cvm->inst[cvm->insts]);
+    cvm->insts += (args + 1);
+
+    return(temp);
+}
+
+static int find_label(CrustyProcedure *proc, const char *name) {
+    unsigned int i;
+
+    for(i = 0; i < proc->labels; i++) {
+        if(strcmp(proc->label[i].name, name) == 0) {
+            return(proc->label[i].line);
+        }
+    }
+
+    return(-1);
+}
+
+/* fold in to an operand everything which can be known about it now */
+static void resolve_operand(CrustyVM *cvm,
+                            CrustyOperandKind kind,
+                            int *flags,
+                            int *val,
+                            int *index) {
+    CrustyVariable *var;
+
+    switch(kind) {
+        case CRUSTY_OPERAND_GLOBAL:
+            /* index becomes the address of the value */
+            var = &(cvm->var[*val]);
+            *index = var->offset + (*index * type_size(var->type));
+            break;
+        case CRUSTY_OPERAND_LOCAL:
+            /* index becomes the address of the value from the stack pointer */
+            var = &(cvm->var[*val]);
+            *index = var->offset - (*index * type_size(var->type));
+            break;
+        case CRUSTY_OPERAND_IMMEDIATE:
+            if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+                *flags = MOVE_FLAG_IMMEDIATE;
+                *val = cvm->var[*val].length;
+                *index = 0;
+            }
+            break;
+        case CRUSTY_OPERAND_ARGUMENT:
+            /* index becomes where the argument is from the stack pointer */
+            *index = cvm->var[*val].offset * sizeof(CrustyStackArg);
+            break;
+        default:
+            /* resolved at runtime */
+            break;
+    }
+}
+
+/* get the type index of a direct operand for looking up a typed instruction,
+   or -1 if it can't have one */
+static int typed_type(CrustyVM *cvm, CrustyOperandKind kind, int val) {
+    switch(kind) {
+        case CRUSTY_OPERAND_IMMEDIATE:
+            return(CRUSTY_TYPED_I);
+        case CRUSTY_OPERAND_GLOBAL:
+        case CRUSTY_OPERAND_LOCAL:
+            if(cvm->var[val].type == CRUSTY_TYPE_INT) {
+                return(CRUSTY_TYPED_I);
+            } else if(cvm->var[val].type == CRUSTY_TYPE_FLOAT) {
+                return(CRUSTY_TYPED_F);
+            }
+            break;
+        default:
+            break;
+    }
+
+    return(-1);
+}
+
+/* replace a move, math or cmp instruction with the version specialized for the
+   kinds of its operands, and their types if they're known, if there is one. */
+static void specialize_instruction(CrustyVM *cvm,
+                                   int *inst,
+                                   CrustyOperandKind destkind,
+                                   CrustyOperandKind srckind) {
+    unsigned short specialized;
+    int desttype, srctype;
+
+    /* A callback written to from an array is given everything from the index
+       to the end, which can't be worked out once the index is folded in to
+       the address, so leave it to the generic move.  An argument could be bound
+       to a callback too. */
+    if(inst[0] == CRUSTY_INSTRUCTION_TYPE_MOVE &&
+       (destkind == CRUSTY_OPERAND_CALLBACK ||
+        destkind == CRUSTY_OPERAND_ARGUMENT ||
+        destkind == CRUSTY_OPERAND_REFERENCE) &&
+       (srckind == CRUSTY_OPERAND_GLOBAL ||
+        srckind == CRUSTY_OPERAND_LOCAL) &&
+       inst[MOVE_SRC_INDEX] != 0) {
+        return;
+    }
+
+    specialized = CRUSTY_SPECIALIZE[inst[0]][destkind][srckind];
+    if(specialized == 0) {
+        return;
+    }
+
+    desttype = typed_type(cvm, destkind, inst[MOVE_DEST_VAL]);
+    srctype = typed_type(cvm, srckind, inst[MOVE_SRC_VAL]);
+    if(desttype >= 0 && srctype >= 0 &&
+       CRUSTY_TYPED[inst[0]][destkind][srckind][desttype][srctype] != 0) {
+        specialized =
+            CRUSTY_TYPED[inst[0]][destkind][srckind][desttype][srctype];
+    }
+
+    inst[0] = specialized;
+    resolve_operand(cvm,
+                    destkind,
+                    &(inst[MOVE_DEST_FLAGS]),
+                    &(inst[MOVE_DEST_VAL]),
+                    &(inst[MOVE_DEST_INDEX]));
+    resolve_operand(cvm,
+                    srckind,
+                    &(inst[MOVE_SRC_FLAGS]),
+                    &(inst[MOVE_SRC_VAL]),
+                    &(inst[MOVE_SRC_INDEX]));
+}
+
+/* whether an instruction is a loop, generic or typed */
+static int is_loop(int type) {
+    return(type >= CRUSTY_INSTRUCTION_TYPE_LOOP &&
+           type < (int)(CRUSTY_INSTRUCTION_TYPE_FIRST_TYPED_LOOP +
+                        (sizeof(CRUSTY_LOOPS) / sizeof(CrustyLoop))));
+}
+
+/* the operand kinds of a typed loop, or NULL */
+static const CrustyLoop *typed_loop(int type) {
+    if(type < CRUSTY_INSTRUCTION_TYPE_FIRST_TYPED_LOOP || !is_loop(type)) {
+        return(NULL);
+    }
+
+    return(&(CRUSTY_LOOPS[type - CRUSTY_INSTRUCTION_TYPE_FIRST_TYPED_LOOP]));
+}
+
+/* Find where the labels a jump, switch or loop can go to are in its
+   instruction.  They're always together, so this returns how many there are
+   and sets first to the first, or returns 0 for anything else. */
+static unsigned int jump_targets(const int *inst, unsigned int *first) {
+    switch(inst[0]) {
+        case CRUSTY_INSTRUCTION_TYPE_JUMP:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPG:
+            *first = JUMP_LOCATION;
+            return(1);
+        case CRUSTY_INSTRUCTION_TYPE_SWITCH:
+            *first = SWITCH_DEFAULT;
+            return(inst[SWITCH_COUNT] + 1);
+        default:
+            if(is_loop(inst[0])) {
+                *first = LOOP_LOCATION;
+                return(1);
+            }
+            return(0);
+    }
+}
+
+/* replace pairs of instructions with a fused instruction where there is one,
+   as long as nothing can land on the second instruction. */
+static int fuse_instructions(CrustyVM *cvm) {
+    unsigned char *target;
+    const int *inst;
+    unsigned int i, j, k;
+    unsigned int first, second;
+    unsigned int targets, loc;
+
+    target = calloc(cvm->insts, 1);
+    if(target == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for jump targets.\n");
+        return(-1);
+    }
+
+    for(j = 0; j < cvm->lines; j++) {
+        inst = &(cvm->inst[cvm->line[j].instruction]);
+        targets = jump_targets(inst, &loc);
+        for(k = 0; k < targets; k++) {
+            target[inst[loc + k]] = 1;
+        }
+    }
+
+    for(j = 1; j < cvm->lines; j++) {
+        first = cvm->line[j - 1].instruction;
+        second = cvm->line[j].instruction;
+        if(target[second]) {
+            continue;
+        }
+
+        for(i = 0; i < sizeof(CRUSTY_FUSIONS) / sizeof(CrustyFusion); i++) {
+            if(CRUSTY_FUSIONS[i].first == cvm->inst[first] &&
+               CRUSTY_FUSIONS[i].second == cvm->inst[second]) {
+                cvm->inst[first] = CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED + i;
+                /* the second can't start another fused instruction */
+                j++;
+                break;
+            }
+        }
+    }
+
+    free(target);
+    return(0);
+}
+
+#define MATH_INSTRUCTION(NAME, ENUM) \
+    else if(compare_token_and_string(cvm, \
+                                     GET_TOKEN_OFFSET(cvm->logline, 0), \
+                                     NAME) == 0) { \
+        if(cvm->line[cvm->logline].tokencount != 3) { \
+            LOG_PRINTF_LINE(cvm, NAME " takes two operands.\n"); \
+            return(-1); \
+        } \
+    \
+        inst = new_instruction(cvm, MOVE_ARGS); \
+        if(inst == NULL) { \
+            return(-1); \
+        } \
+    \
+        inst[0] = ENUM; \
+    \
+        if(populate_var(cvm, \
+                        GET_TOKEN(cvm->logline, 1), \
+                        curproc, \
+                        1, 1, \
+                        &(inst[MOVE_DEST_FLAGS]), \
+                        &(inst[MOVE_DEST_VAL]), \
+                        &(inst[MOVE_DEST_INDEX]), \
+                        &destkind) < 0) { \
+            return(-1); \
+        } \
+    \
+        if(populate_var(cvm, \
+                        GET_TOKEN(cvm->logline, 2), \
+                        curproc, \
+                        1, 0, \
+                        &(inst[MOVE_SRC_FLAGS]), \
+                        &(inst[MOVE_SRC_VAL]), \
+                        &(inst[MOVE_SRC_INDEX]), \
+                        &srckind) < 0) { \
+            return(-1); \
+        } \
+    \
+        specialize_instruction(cvm, inst, destkind, srckind);
+
+#define JUMP_INSTRUCTION(NAME, ENUM) \
+    else if(compare_token_and_string(cvm, \
+                                     GET_TOKEN_OFFSET(cvm->logline, 0), \
+                                     NAME) == 0) { \
+        if(cvm->line[cvm->logline].tokencount != 2) { \
+            LOG_PRINTF_LINE(cvm, NAME " takes a label.\n"); \
+            return(-1); \
+        } \
+    \
+        inst = new_instruction(cvm, JUMP_ARGS); \
+        if(inst == NULL) { \
+            return(-1); \
+        } \
+    \
+        inst[0] = ENUM; \
+    \
+        inst[JUMP_LOCATION] = find_label(curproc, GET_TOKEN(cvm->logline, 1)); \
+        if(inst[JUMP_LOCATION] == -1) { \
+            LOG_PRINTF_LINE(cvm, "Couldn't find label %s.\n", \
+                                 GET_TOKEN(cvm->logline, 1)); \
+            return(-1); \
+        }
+
+/* whether an instruction working on a range takes a single value instead of a
+   source range */
+static int bulk_takes_value(int type) {
+    return(type == CRUSTY_INSTRUCTION_TYPE_FILL ||
+           type == CRUSTY_INSTRUCTION_TYPE_VSCALE);
+}
+
+/* Generate an instruction working on a range of an array.  The destination, and
+   the source of anything but fill and vscale, are ranges of arrays in memory,
+   so they can't be immediates, lengths or callbacks. */
+static int bulk_instruction(CrustyVM *cvm,
+                            CrustyProcedure *proc,
+                            CrustyInstructionType type,
+                            const char *name) {
+    int *inst;
+    CrustyOperandKind destkind, srckind;
+
+    if(cvm->line[cvm->logline].tokencount != 4) {
+        LOG_PRINTF_LINE(cvm, "%s takes a destination, %s and count.\n",
+                             name,
+                             bulk_takes_value(type) ? "value" : "source");
+        return(-1);
+    }
+
+    inst = new_instruction(cvm, BULK_ARGS);
+    if(inst == NULL) {
+        return(-1);
+    }
+
+    inst[0] = type;
+
+    if(populate_var(cvm,
+                    GET_TOKEN(cvm->logline, 1),
+                    proc,
+                    0, 1,
+                    &(inst[BULK_DEST_FLAGS]),
+                    &(inst[BULK_DEST_VAL]),
+                    &(inst[BULK_DEST_INDEX]),
+                    &destkind) < 0) {
+        return(-1);
+    }
+
+    if(populate_var(cvm,
+                    GET_TOKEN(cvm->logline, 2),
+                    proc,
+                    1, 0,
+                    &(inst[BULK_SRC_FLAGS]),
+                    &(inst[BULK_SRC_VAL]),
+                    &(inst[BULK_SRC_INDEX]),
+                    &srckind) < 0) {
+        return(-1);
+    }
+
+    if(populate_var(cvm,
+                    GET_TOKEN(cvm->logline, 3),
+                    proc,
+                    1, 0,
+                    &(inst[BULK_COUNT_FLAGS]),
+                    &(inst[BULK_COUNT_VAL]),
+                    &(inst[BULK_COUNT_INDEX]),
+                    NULL) < 0) {
+        return(-1);
+    }
+
+    if(destkind == CRUSTY_OPERAND_CALLBACK ||
+       (!bulk_takes_value(type) &&
+        ((inst[BULK_SRC_FLAGS] & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR ||
+         srckind == CRUSTY_OPERAND_CALLBACK))) {
+        LOG_PRINTF_LINE(cvm, "%s only works on arrays in memory.\n", name);
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* Generate a switch.  The value can be anything readable and the labels are
+   found the same as for a jump, then converted to instructions with them. */
+static int switch_instruction(CrustyVM *cvm, CrustyProcedure *proc) {
+    int *inst;
+    unsigned int count, i;
+
+    if(cvm->line[cvm->logline].tokencount < 3) {
+        LOG_PRINTF_LINE(cvm, "switch takes a value, a default label and a "
+                             "label for each value.\n");
+        return(-1);
+    }
+    count = cvm->line[cvm->logline].tokencount - 3;
+
+    inst = new_instruction(cvm, SWITCH_START_TARGETS + count - 1);
+    if(inst == NULL) {
+        return(-1);
+    }
+
+    inst[0] = CRUSTY_INSTRUCTION_TYPE_SWITCH;
+
+    if(populate_var(cvm,
+                    GET_TOKEN(cvm->logline, 1),
+                    proc,
+                    1, 0,
+                    &(inst[SWITCH_VALUE_FLAGS]),
+                    &(inst[SWITCH_VALUE_VAL]),
+                    &(inst[SWITCH_VALUE_INDEX]),
+                    NULL) < 0) {
+        return(-1);
+    }
+
+    inst[SWITCH_COUNT] = count;
+    for(i = 0; i <= count; i++) {
+        inst[SWITCH_DEFAULT + i] = find_label(proc,
+                                              GET_TOKEN(cvm->logline, i + 2));
+        if(inst[SWITCH_DEFAULT + i] == -1) {
+            LOG_PRINTF_LINE(cvm, "Couldn't find label %s.\n",
+                                 GET_TOKEN(cvm->logline, i + 2));
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+/* Generate a loop, which is the typed version when the counter is an int in
+   memory, the step is a constant and the bound is an int in memory or a
+   constant. */
+static int loop_instruction(CrustyVM *cvm, CrustyProcedure *proc) {
+    int *inst;
+    CrustyOperandKind counterkind, stepkind, boundkind;
+
+    if(cvm->line[cvm->logline].tokencount != 5) {
+        LOG_PRINTF_LINE(cvm, "loop takes a counter, a step, a bound and a "
+                             "label.\n");
+        return(-1);
+    }
+
+    inst = new_instruction(cvm, LOOP_ARGS);
+    if(inst == NULL) {
+        return(-1);
+    }
+
+    inst[0] = CRUSTY_INSTRUCTION_TYPE_LOOP;
+
+    if(populate_var(cvm,
+                    GET_TOKEN(cvm->logline, 1),
+                    proc,
+                    1, 1,
+                    &(inst[LOOP_COUNTER_FLAGS]),
+                    &(inst[LOOP_COUNTER_VAL]),
+                    &(inst[LOOP_COUNTER_INDEX]),
+                    &counterkind) < 0) {
+        return(-1);
+    }
+
+    if(populate_var(cvm,
+                    GET_TOKEN(cvm->logline, 2),
+                    proc,
+                    1, 0,
+                    &(inst[LOOP_STEP_FLAGS]),
+                    &(inst[LOOP_STEP_VAL]),
+                    &(inst[LOOP_STEP_INDEX]),
+                    &stepkind) < 0) {
+        return(-1);
+    }
+
+    if(populate_var(cvm,
+                    GET_TOKEN(cvm->logline, 3),
+                    proc,
+                    1, 0,
+                    &(inst[LOOP_BOUND_FLAGS]),
+                    &(inst[LOOP_BOUND_VAL]),
+                    &(inst[LOOP_BOUND_INDEX]),
+                    &boundkind) < 0) {
+        return(-1);
+    }
+
+    inst[LOOP_LOCATION] = find_label(proc, GET_TOKEN(cvm->logline, 4));
+    if(inst[LOOP_LOCATION] == -1) {
+        LOG_PRINTF_LINE(cvm, "Couldn't find label %s.\n",
+                             GET_TOKEN(cvm->logline, 4));
+        return(-1);
+    }
+
+    if(CRUSTY_TYPED_LOOP[counterkind][boundkind] == 0 ||
+       stepkind != CRUSTY_OPERAND_IMMEDIATE ||
+       typed_type(cvm, counterkind, inst[LOOP_COUNTER_VAL]) !=
+       CRUSTY_TYPED_I ||
+       typed_type(cvm, boundkind, inst[LOOP_BOUND_VAL]) != CRUSTY_TYPED_I) {
+        return(0);
+    }
+
+    inst[0] = CRUSTY_TYPED_LOOP[counterkind][boundkind];
+    resolve_operand(cvm,
+                    counterkind,
+                    &(inst[LOOP_COUNTER_FLAGS]),
+                    &(inst[LOOP_COUNTER_VAL]),
+                    &(inst[LOOP_COUNTER_INDEX]));
+    resolve_operand(cvm,
+                    stepkind,
+                    &(inst[LOOP_STEP_FLAGS]),
+                    &(inst[LOOP_STEP_VAL]),
+                    &(inst[LOOP_STEP_INDEX]));
+    resolve_operand(cvm,
+                    boundkind,
+                    &(inst[LOOP_BOUND_FLAGS]),
+                    &(inst[LOOP_BOUND_VAL]),
+                    &(inst[LOOP_BOUND_INDEX]));
+
+    return(0);
+}
+
+/* whether an instruction picking a value takes a second source, which is
+   clamp's upper bound or what select picks for a zero result */
+static int pick_takes_other(int type) {
+    return(type == CRUSTY_INSTRUCTION_TYPE_CLAMP ||
+           type == CRUSTY_INSTRUCTION_TYPE_SELECT);
+}
+
+/* Generate min, max, abs, clamp or select.  The operands are the same as
+   math's with clamp and select taking one more source, and abs given only a
+   destination works on that in place. */
+static int pick_instruction(CrustyVM *cvm,
+                            CrustyProcedure *proc,
+                            CrustyInstructionType type,
+                            const char *name) {
+    int *inst;
+    unsigned int src;
+
+    if(type == CRUSTY_INSTRUCTION_TYPE_CLAMP) {
+        if(cvm->line[cvm->logline].tokencount != 4) {
+            LOG_PRINTF_LINE(cvm, "clamp takes a destination, a low bound and "
+                                 "a high bound.\n");
+            return(-1);
+        }
+    } else if(type == CRUSTY_INSTRUCTION_TYPE_SELECT) {
+        if(cvm->line[cvm->logline].tokencount != 4) {
+            LOG_PRINTF_LINE(cvm, "select takes a destination and a value each "
+                                 "for a nonzero and a zero result.\n");
+            return(-1);
+        }
+    } else if(type == CRUSTY_INSTRUCTION_TYPE_ABS) {
+        if(cvm->line[cvm->logline].tokencount < 2 ||
+           cvm->line[cvm->logline].tokencount > 3) {
+            LOG_PRINTF_LINE(cvm, "abs takes one or two operands.\n");
+            return(-1);
+        }
+    } else if(cvm->line[cvm->logline].tokencount != 3) {
+        LOG_PRINTF_LINE(cvm, "%s takes two operands.\n", name);
+        return(-1);
+    }
+
+    inst = new_instruction(cvm, pick_takes_other(type) ? PICK_ARGS : MOVE_ARGS);
+    if(inst == NULL) {
+        return(-1);
+    }
+
+    inst[0] = type;
+
+    if(populate_var(cvm,
+                    GET_TOKEN(cvm->logline, 1),
+                    proc,
+                    1, 1,
+                    &(inst[MOVE_DEST_FLAGS]),
+                    &(inst[MOVE_DEST_VAL]),
+                    &(inst[MOVE_DEST_INDEX]),
+                    NULL) < 0) {
+        return(-1);
+    }
+
+    src = cvm->line[cvm->logline].tokencount == 2 ? 1 : 2;
+    if(populate_var(cvm,
+                    GET_TOKEN(cvm->logline, src),
+                    proc,
+                    1, 0,
+                    &(inst[MOVE_SRC_FLAGS]),
+                    &(inst[MOVE_SRC_VAL]),
+                    &(inst[MOVE_SRC_INDEX]),
+                    NULL) < 0) {
+        return(-1);
+    }
+
+    if(pick_takes_other(type) &&
+       populate_var(cvm,
+                    GET_TOKEN(cvm->logline, 3),
+                    proc,
+                    1, 0,
+                    &(inst[PICK_OTHER_FLAGS]),
+                    &(inst[PICK_OTHER_VAL]),
+                    &(inst[PICK_OTHER_INDEX]),
+                    NULL) < 0) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+#define PICK_INSTRUCTION(NAME, ENUM) \
+    else if(compare_token_and_string(cvm, \
+                                     GET_TOKEN_OFFSET(cvm->logline, 0), \
+                                     NAME) == 0) { \
+        if(pick_instruction(cvm, curproc, ENUM, NAME) < 0) { \
+            return(-1); \
+        }
+
+#define BULK_INSTRUCTION(NAME, ENUM) \
+    else if(compare_token_and_string(cvm, \
+                                     GET_TOKEN_OFFSET(cvm->logline, 0), \
+                                     NAME) == 0) { \
+        if(bulk_instruction(cvm, curproc, ENUM, NAME) < 0) { \
+            return(-1); \
+        }
+
+static int codegen(CrustyVM *cvm) {
+    CrustyProcedure *curproc = NULL;
+    int procnum = 0;
+    int *inst;
+    unsigned int j, k;
+    unsigned int targets, loc;
+    CrustyOperandKind destkind, srckind;
+
+    for(cvm->logline = 0; cvm->logline < cvm->lines; cvm->logline++) {
+        if(curproc == NULL) {
+            if(cvm->logline == cvm->proc[procnum].start) {
+                curproc = &(cvm->proc[procnum]);
+                curproc->instruction = cvm->insts;
+            }
+        }
+
+        if(curproc == NULL) {
+            LOG_PRINTF_LINE(cvm, "BUG: code line not in a procedure.\n");
+            return(-1);
+        }
+
+        cvm->line[cvm->logline].instruction = cvm->insts;
+
+        if(compare_token_and_string(cvm,
+                                    GET_TOKEN_OFFSET(cvm->logline, 0),
+                                    "move") == 0) {
+            if(cvm->line[cvm->logline].tokencount != 3) {
+                LOG_PRINTF_LINE(cvm, "move takes a destination and source.\n");
+                return(-1);
+            }
+
+            inst = new_instruction(cvm, MOVE_ARGS);
+            if(inst == NULL) {
+                return(-1);
+            }
+
+            inst[0] = CRUSTY_INSTRUCTION_TYPE_MOVE;
+
+            if(populate_var(cvm,
+                            GET_TOKEN(cvm->logline, 1),
+                            curproc,
+                            0, 1,
+                            &(inst[MOVE_DEST_FLAGS]),
+                            &(inst[MOVE_DEST_VAL]),
+                            &(inst[MOVE_DEST_INDEX]),
+                            &destkind) < 0) {
+                return(-1);
+            }
+
+            if(populate_var(cvm,
+                            GET_TOKEN(cvm->logline, 2),
+                            curproc,
+                            1, 0,
+                            &(inst[MOVE_SRC_FLAGS]),
+                            &(inst[MOVE_SRC_VAL]),
+                            &(inst[MOVE_SRC_INDEX]),
+                            &srckind) < 0) {
+                return(-1);
+            }
+
+            specialize_instruction(cvm, inst, destkind, srckind);
+        } MATH_INSTRUCTION("add", CRUSTY_INSTRUCTION_TYPE_ADD)
+        } MATH_INSTRUCTION("sub", CRUSTY_INSTRUCTION_TYPE_SUB)
+        } MATH_INSTRUCTION("mul", CRUSTY_INSTRUCTION_TYPE_MUL)
+        } MATH_INSTRUCTION("div", CRUSTY_INSTRUCTION_TYPE_DIV)
+        } MATH_INSTRUCTION("mod", CRUSTY_INSTRUCTION_TYPE_MOD)
+        } MATH_INSTRUCTION("and", CRUSTY_INSTRUCTION_TYPE_AND)
+        } MATH_INSTRUCTION("or",  CRUSTY_INSTRUCTION_TYPE_OR )
+        } MATH_INSTRUCTION("xor", CRUSTY_INSTRUCTION_TYPE_XOR)
+        } MATH_INSTRUCTION("shr", CRUSTY_INSTRUCTION_TYPE_SHR)
+        } MATH_INSTRUCTION("shl", CRUSTY_INSTRUCTION_TYPE_SHL)
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "cmp") == 0) {
+            if(cvm->line[cvm->logline].tokencount < 2 ||
+               cvm->line[cvm->logline].tokencount > 3) {
+                LOG_PRINTF_LINE(cvm, "cmp takes one or two operands.\n");
+                return(-1);
+            }
+
+            inst = new_instruction(cvm, MOVE_ARGS);
+            if(inst == NULL) {
+                return(-1);
+            }
+
+            inst[0] = CRUSTY_INSTRUCTION_TYPE_CMP;
+
+            if(populate_var(cvm,
+                            GET_TOKEN(cvm->logline, 1),
+                            curproc,
+                            1, 0,
+                            &(inst[MOVE_DEST_FLAGS]),
+                            &(inst[MOVE_DEST_VAL]),
+                            &(inst[MOVE_DEST_INDEX]),
+                            &destkind) < 0) {
+                return(-1);
+            }
+
+            if(cvm->line[cvm->logline].tokencount == 3) {
+                if(populate_var(cvm,
+                                GET_TOKEN(cvm->logline, 2),
+                                curproc,
+                                1, 0,
+                                &(inst[MOVE_SRC_FLAGS]),
+                                &(inst[MOVE_SRC_VAL]),
+                                &(inst[MOVE_SRC_INDEX]),
+                                &srckind) < 0) {
+                    return(-1);
+                }
+            } else {
+                inst[MOVE_SRC_FLAGS] = MOVE_FLAG_IMMEDIATE;
+                inst[MOVE_SRC_VAL] = 0;
+                inst[MOVE_SRC_INDEX] = 0; /* ignored but may as well */
+                srckind = CRUSTY_OPERAND_IMMEDIATE;
+            }
+
+            specialize_instruction(cvm, inst, destkind, srckind);
+        } PICK_INSTRUCTION("min",    CRUSTY_INSTRUCTION_TYPE_MIN   )
+        } PICK_INSTRUCTION("max",    CRUSTY_INSTRUCTION_TYPE_MAX   )
+        } PICK_INSTRUCTION("abs",    CRUSTY_INSTRUCTION_TYPE_ABS   )
+        } PICK_INSTRUCTION("clamp",  CRUSTY_INSTRUCTION_TYPE_CLAMP )
+        } PICK_INSTRUCTION("select", CRUSTY_INSTRUCTION_TYPE_SELECT)
+        } JUMP_INSTRUCTION("jump",  CRUSTY_INSTRUCTION_TYPE_JUMP )
+        } JUMP_INSTRUCTION("jumpn", CRUSTY_INSTRUCTION_TYPE_JUMPN)
+        } JUMP_INSTRUCTION("jumpz", CRUSTY_INSTRUCTION_TYPE_JUMPZ)
+        } JUMP_INSTRUCTION("jumpl", CRUSTY_INSTRUCTION_TYPE_JUMPL)
+        } JUMP_INSTRUCTION("jumpg", CRUSTY_INSTRUCTION_TYPE_JUMPG)
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "switch") == 0) {
+            if(switch_instruction(cvm, curproc) < 0) {
+                return(-1);
+            }
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "loop") == 0) {
+            if(loop_instruction(cvm, curproc) < 0) {
+                return(-1);
+            }
+        } BULK_INSTRUCTION("copy",  CRUSTY_INSTRUCTION_TYPE_COPY )
+        } BULK_INSTRUCTION("shift", CRUSTY_INSTRUCTION_TYPE_SHIFT)
+        } BULK_INSTRUCTION("fill",  CRUSTY_INSTRUCTION_TYPE_FILL )
+        } BULK_INSTRUCTION("vadd",  CRUSTY_INSTRUCTION_TYPE_VADD )
+        } BULK_INSTRUCTION("vsub",  CRUSTY_INSTRUCTION_TYPE_VSUB )
+        } BULK_INSTRUCTION("vmul",  CRUSTY_INSTRUCTION_TYPE_VMUL )
+        } BULK_INSTRUCTION("vmin",  CRUSTY_INSTRUCTION_TYPE_VMIN )
+        } BULK_INSTRUCTION("vmax",  CRUSTY_INSTRUCTION_TYPE_VMAX )
+        } BULK_INSTRUCTION("vscale", CRUSTY_INSTRUCTION_TYPE_VSCALE)
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "call") == 0) {
+            if(cvm->line[cvm->logline].tokencount < 2) {
+                LOG_PRINTF_LINE(cvm, "call takes a procedure and possible arguments.\n");
+                return(-1);
+            }
+
+            unsigned int args = cvm->line[cvm->logline].tokencount - 2;
+            unsigned int i;
+
+            inst = new_instruction(cvm, (args * 3) + 1);
+            if(inst == NULL) {
+                return(-1);
+            }
+
+            inst[0] = CRUSTY_INSTRUCTION_TYPE_CALL;
+
+            inst[1] = find_procedure(cvm,
+                                     GET_TOKEN(cvm->logline, 1));
+            if(inst[1] == -1) {
+                LOG_PRINTF_LINE(cvm, "Couldn't find procedure %s.\n",
+                                     GET_TOKEN(cvm->logline, 1));
+                return(-1);
+            }
+
+            if(args != cvm->proc[inst[1]].args) {
+                LOG_PRINTF_LINE(cvm, "Procedure %s takes %u args, %u given.\n",
+                                cvm->proc[inst[1]].name,
+                                cvm->proc[inst[1]].args,
+                                args);
+                return(-1);
+            }
+
+            for(i = 0; i < args; i++) {
+                if(populate_var(cvm,
+                            GET_TOKEN(cvm->logline, i + 2),
+                            curproc,
+                            0, 0,
+                            &(inst[CALL_START_ARGS + (i * CALL_ARG_SIZE) + CALL_ARG_FLAGS]),
+                            &(inst[CALL_START_ARGS + (i * CALL_ARG_SIZE) + CALL_ARG_VAL]),
+                            &(inst[CALL_START_ARGS + (i * CALL_ARG_SIZE) + CALL_ARG_INDEX]),
+                            NULL) < 0) {
+                    return(-1);
+                }
+            }
+        } else if(compare_token_and_string(cvm,
+                                           GET_TOKEN_OFFSET(cvm->logline, 0),
+                                           "ret") == 0) {
+            if(cvm->line[cvm->logline].tokencount != 1) {
+                LOG_PRINTF_LINE(cvm, "ret takes no arguments.\n");
+                return(-1);
+            }
+
+            inst = new_instruction(cvm, 0);
+            if(inst == NULL) {
+                return(-1);
+            }
+
+            inst[0] = CRUSTY_INSTRUCTION_TYPE_RET;
+
+            procnum++;
+            curproc = NULL;
+        } else {
+            LOG_PRINTF_LINE(cvm, "Invalid instruction mnemonic: %s\n",
+                                 GET_TOKEN(cvm->logline, 0));
+            return(-1);
+        }
+    }
+
+    /* convert jump arguments from line to ip */
+    for(j = 0; j < cvm->lines; j++) {
+        inst = &(cvm->inst[cvm->line[j].instruction]);
+        targets = jump_targets(inst, &loc);
+        for(k = 0; k < targets; k++) {
+            inst[loc + k] = cvm->line[inst[loc + k]].instruction;
+        }
+    }
+
+    return(0);
+}
+
+#undef PICK_INSTRUCTION
+#undef BULK_INSTRUCTION
+#undef JUMP_INSTRUCTION
+#undef MATH_INSTRUCTION
+
+static int is_jump(int type) {
+    return(type == CRUSTY_INSTRUCTION_TYPE_JUMP ||
+           type == CRUSTY_INSTRUCTION_TYPE_JUMPN ||
+           type == CRUSTY_INSTRUCTION_TYPE_JUMPZ ||
+           type == CRUSTY_INSTRUCTION_TYPE_JUMPL ||
+           type == CRUSTY_INSTRUCTION_TYPE_JUMPG);
+}
+
+/* whether an instruction works on a range of an array */
+static int is_bulk(int type) {
+    return(type >= CRUSTY_INSTRUCTION_TYPE_COPY &&
+           type <= CRUSTY_INSTRUCTION_TYPE_VSCALE);
+}
+
+/* whether an instruction picks one of its operands */
+static int is_pick(int type) {
+    return(type >= CRUSTY_INSTRUCTION_TYPE_MIN &&
+           type <= CRUSTY_INSTRUCTION_TYPE_SELECT);
+}
+
+/* get what's known about a typed instruction, or NULL if it isn't one */
+static const CrustySpecialization *typed_instruction(int type) {
+    const CrustySpecialization *spec;
+
+    if(type < CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED ||
+       type >= (int)CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED) {
+        return(NULL);
+    }
+
+    spec = &(CRUSTY_SPECIALIZATIONS[type -
+                                    CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED]);
+    if(spec->desttype == CRUSTY_TYPE_NONE) {
+        return(NULL);
+    }
+
+    return(spec);
+}
+
+static int same_dest(const int *a, const int *b) {
+    return(a[MOVE_DEST_FLAGS] == b[MOVE_DEST_FLAGS] &&
+           a[MOVE_DEST_VAL] == b[MOVE_DEST_VAL] &&
+           a[MOVE_DEST_INDEX] == b[MOVE_DEST_INDEX]);
+}
+
+/* Thread jumps and switches through unconditional jumps so they go straight to
+   where they'd end up.  Loops made only of jumps are left alone, and so is a
+   jump to self, which ends the program. */
+static int thread_jumps(CrustyVM *cvm) {
+    unsigned int i, j, k;
+    unsigned int targets, loc;
+    int *jump;
+    int target, next;
+    int changed = 0;
+
+    for(j = 0; j < cvm->lines; j++) {
+        jump = &(cvm->inst[cvm->line[j].instruction]);
+        targets = jump_targets(jump, &loc);
+        for(k = 0; k < targets; k++) {
+            target = jump[loc + k];
+            for(i = 0; i < cvm->lines; i++) {
+                if(cvm->inst[target] != CRUSTY_INSTRUCTION_TYPE_JUMP) {
+                    break;
+                }
+                next = cvm->inst[target + JUMP_LOCATION];
+                if(next == target) {
+                    break;
+                }
+                target = next;
+            }
+
+            if(i == cvm->lines) { /* went around in a loop */
+                continue;
+            }
+
+            if(target != jump[loc + k] &&
+               target != (int)(cvm->line[j].instruction)) {
+                jump[loc + k] = target;
+                changed = 1;
+            }
+        }
+    }
+
+    return(changed);
+}
+
+/* mark lines in a procedure which can't be reached from its start */
+static void mark_unreachable(CrustyVM *cvm,
+                             CrustyProcedure *proc,
+                             unsigned int end,
+                             const int *instline,
+                             unsigned char *remove,
+                             unsigned int *work) {
+    unsigned int works;
+    unsigned int j, k, target;
+    unsigned int targets, loc;
+    const int *inst;
+    int type;
+
+    for(j = proc->start; j < end; j++) {
+        remove[j] = 1;
+    }
+
+    work[0] = proc->start;
+    works = 1;
+    remove[proc->start] = 0;
+    while(works > 0) {
+        works--;
+        j = work[works];
+        inst = &(cvm->inst[cvm->line[j].instruction]);
+        type = inst[0];
+
+        targets = jump_targets(inst, &loc);
+        for(k = 0; k < targets; k++) {
+            target = instline[inst[loc + k]];
+            if(remove[target]) {
+                remove[target] = 0;
+                work[works] = target;
+                works++;
+            }
+        }
+
+        if(type != CRUSTY_INSTRUCTION_TYPE_JUMP &&
+           type != CRUSTY_INSTRUCTION_TYPE_SWITCH &&
+           type != CRUSTY_INSTRUCTION_TYPE_RET &&
+           type != CRUSTY_INSTRUCTION_TYPE_TAILCALL &&
+           j + 1 < end &&
+           remove[j + 1]) {
+            remove[j + 1] = 0;
+            work[works] = j + 1;
+            works++;
+        }
+    }
+
+    /* always keep the ret which ends the procedure */
+    remove[end - 1] = 0;
+}
+
+/* remove the marked lines and their instructions, pointing anything which
+   referred to them at the next line which is kept */
+static int remove_lines(CrustyVM *cvm,
+                        const int *instline,
+                        const unsigned char *remove) {
+    unsigned int *newline;
+    unsigned int *newinst;
+    int *inst;
+    unsigned int insts, lines;
+    unsigned int size;
+    unsigned int i, j, k;
+    unsigned int targets, loc;
+    int next;
+
+    newline = malloc(sizeof(unsigned int) * (cvm->lines + 1));
+    if(newline == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for line map.\n");
+        return(-1);
+    }
+    newinst = malloc(sizeof(unsigned int) * (cvm->lines + 1));
+    if(newinst == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for instruction map.\n");
+        free(newline);
+        return(-1);
+    }
+    inst = malloc(sizeof(int) * cvm->insts);
+    if(inst == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for instructions.\n");
+        free(newinst);
+        free(newline);
+        return(-1);
+    }
+
+    insts = 0;
+    lines = 0;
+    for(j = 0; j < cvm->lines; j++) {
+        newline[j] = lines;
+        newinst[j] = insts;
+        if(remove[j]) {
+            continue;
+        }
+
+        if(j + 1 < cvm->lines) {
+            size = cvm->line[j + 1].instruction - cvm->line[j].instruction;
+        } else {
+            size = cvm->insts - cvm->line[j].instruction;
+        }
+        memcpy(&(inst[insts]),
+               &(cvm->inst[cvm->line[j].instruction]),
+               sizeof(int) * size);
+        insts += size;
+        lines++;
+    }
+    newline[cvm->lines] = lines;
+    newinst[cvm->lines] = insts;
+
+    /* jumps to removed lines go to whatever comes after */
+    for(j = 0; j < cvm->lines; j++) {
+        if(remove[j]) {
+            continue;
+        }
+
+        targets = jump_targets(&(cvm->inst[cvm->line[j].instruction]), &loc);
+        for(k = 0; k < targets; k++) {
+            next = instline[cvm->inst[cvm->line[j].instruction + loc + k]];
+            inst[newinst[j] + loc + k] = newinst[next];
+        }
+    }
+
+    for(i = 0; i < cvm->procs; i++) {
+        cvm->proc[i].instruction = newinst[cvm->proc[i].start];
+        for(j = 0; j < cvm->proc[i].labels; j++) {
+            cvm->proc[i].label[j].line = newline[cvm->proc[i].label[j].line];
+        }
+    }
+    for(i = 0; i < cvm->procs; i++) {
+        cvm->proc[i].start = newline[cvm->proc[i].start];
+    }
+    for(i = 0; i < cvm->procs; i++) {
+        if(i + 1 < cvm->procs) {
+            cvm->proc[i].length = cvm->proc[i + 1].start - cvm->proc[i].start;
+        } else {
+            cvm->proc[i].length = lines - cvm->proc[i].start;
+        }
+    }
+
+    lines = 0;
+    for(j = 0; j < cvm->lines; j++) {
+        if(remove[j]) {
+            free(cvm->line[j].offset);
+            continue;
+        }
+
+        cvm->line[lines] = cvm->line[j];
+        cvm->line[lines].instruction = newinst[j];
+        lines++;
+    }
+    cvm->lines = lines;
+
+    free(cvm->inst);
+    cvm->inst = inst;
+    cvm->insts = insts;
+
+    free(newinst);
+    free(newline);
+    return(0);
+}
+
+/* Optional cleanup of generated code.  Lines are removed along with their
+   instructions so every remaining instruction still has its own line for error
+   messages and debug traces.  Only typed instructions are considered for
+   removal because they're the only ones which are known to have no side effects
+   other than the value written and the result registers. */
+static int optimize(CrustyVM *cvm) {
+    int *instline = NULL;
+    unsigned char *remove = NULL;
+    unsigned char *target = NULL;
+    unsigned int *work = NULL;
+    const CrustySpecialization *first, *second;
+    const int *a, *b;
+    unsigned int i, j, end;
+    unsigned int targets, loc;
+    int changed;
+    int ret = -1;
+
+    remove = malloc(cvm->lines);
+    work = malloc(sizeof(unsigned int) * cvm->lines);
+    if(remove == NULL || work == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for optimization.\n");
+        goto done;
+    }
+
+    do {
+        free(instline);
+        instline = malloc(sizeof(int) * cvm->insts);
+        free(target);
+        target = calloc(cvm->insts, 1);
+        if(instline == NULL || target == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for optimization.\n");
+            goto done;
+        }
+        for(j = 0; j < cvm->lines; j++) {
+            instline[cvm->line[j].instruction] = j;
+        }
+
+        changed = thread_jumps(cvm);
+
+        for(j = 0; j < cvm->lines; j++) {
+            a = &(cvm->inst[cvm->line[j].instruction]);
+            targets = jump_targets(a, &loc);
+            for(i = 0; i < targets; i++) {
+                target[a[loc + i]] = 1;
+            }
+        }
+
+        for(i = 0; i < cvm->procs; i++) {
+            if(i + 1 < cvm->procs) {
+                end = cvm->proc[i + 1].start;
+            } else {
+                end = cvm->lines;
+            }
+            mark_unreachable(cvm, &(cvm->proc[i]), end, instline, remove, work);
+        }
+
+        for(j = 0; j + 1 < cvm->lines; j++) {
+            if(remove[j] || remove[j + 1]) {
+                continue;
+            }
+            a = &(cvm->inst[cvm->line[j].instruction]);
+            b = &(cvm->inst[cvm->line[j + 1].instruction]);
+
+            /* jump to the next instruction does nothing */
+            if(is_jump(a[0]) &&
+               a[JUMP_LOCATION] == (int)(cvm->line[j + 1].instruction)) {
+                remove[j] = 1;
+                continue;
+            }
+
+            first = typed_instruction(a[0]);
+            second = typed_instruction(b[0]);
+            if(first == NULL || second == NULL) {
+                continue;
+            }
+
+            /* A move which is immediately overwritten by the same kind of move
+               is dead, as long as the second doesn't read it.  Both set the
+               same result registers. */
+            if(first->generic == CRUSTY_INSTRUCTION_TYPE_MOVE &&
+               a[0] == b[0] &&
+               same_dest(a, b) &&
+               (second->src == CRUSTY_OPERAND_IMMEDIATE ||
+                b[MOVE_SRC_VAL] != a[MOVE_DEST_VAL])) {
+                remove[j] = 1;
+                continue;
+            }
+
+            /* Comparing the result of math with 0 leaves the result registers
+               as they were, but something might jump to the cmp. */
+            if(first->generic >= CRUSTY_INSTRUCTION_TYPE_ADD &&
+               first->generic <= CRUSTY_INSTRUCTION_TYPE_SHL &&
+               second->generic == CRUSTY_INSTRUCTION_TYPE_CMP &&
+               !target[cvm->line[j + 1].instruction] &&
+               same_dest(a, b) &&
+               second->src == CRUSTY_OPERAND_IMMEDIATE &&
+               b[MOVE_SRC_VAL] == 0) {
+                remove[j + 1] = 1;
+                j++;
+                continue;
+            }
+        }
+
+        for(j = 0; j < cvm->lines; j++) {
+            if(remove[j]) {
+                if(remove_lines(cvm, instline, remove) < 0) {
+                    goto done;
+                }
+                changed = 1;
+                break;
+            }
+        }
+    } while(changed);
+
+    ret = 0;
+done:
+    free(work);
+    free(target);
+    free(remove);
+    free(instline);
+    return(ret);
+}
+
+/* do a lot of checking now so a lot can be skipped later when actually
+   executing. */
+static int check_move_arg(CrustyVM *cvm,
+                          int dest,
+                          int flags,
+                          int val,
+                          int index) {
+    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_IMMEDIATE) {
+        if(dest) {
+            LOG_PRINTF_LINE(cvm, "Destination flagged as immediate.\n");
+            return(-1);
+        }
+
+#ifdef CRUSTY_TEST
+        LOG_PRINTF_BARE(cvm, "%d", val);
+#endif
+    } else if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+        if(dest) {
+            LOG_PRINTF_LINE(cvm, "Destination flagged as array length.\n");
+            return(-1);
+        }
+
+        if(val < 0 || val > (int)(cvm->vars) - 1) {
+            LOG_PRINTF_LINE(cvm, "Var out of range (%d).\n", val);
+            return(-1);
+        }
+
+#ifdef CRUSTY_TEST
+        LOG_PRINTF_BARE(cvm, "%d(%s):", val, cvm->var[val].name);
+#endif
+    } else if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
+        if(val < 0 || val > (int)(cvm->vars) - 1) {
+            LOG_PRINTF_LINE(cvm, "Var out of range (%d).\n", val);
+            return(-1);
+        }
+
+        if(index < 0) {
+            LOG_PRINTF_LINE(cvm, "Negative index %d.\n", index);
+            return(-1);
+        }
+
+        if(dest) {
+            if(cvm->var[val].read != NULL && cvm->var[val].write == NULL) {
+                LOG_PRINTF_LINE(cvm, "Read only callback variable as "
+                                     "destination (%s).\n", cvm->var[val].name);
+                return(-1);
+            }
+        } else {
+            if(cvm->var[val].write != NULL && cvm->var[val].read == NULL) {
+                LOG_PRINTF_LINE(cvm, "Write only callback variable as "
+                                     "source (%s).\n", cvm->var[val].name);
+                return(-1);
+            }
+        }
+
+        if((flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
+            if(index < 0 || index > (int)(cvm->vars) - 1) {
+                LOG_PRINTF_LINE(cvm, "Index var out of range (%d).\n", index);
+                return(-1);
+            }
+
+            if(cvm->var[index].write != NULL && cvm->var[index].read == NULL) {
+                LOG_PRINTF_LINE(cvm, "Write only callback variable "
+                                     "as index (%s).\n", cvm->var[val].name);
+                return(-1);
+            }
+
+#ifdef CRUSTY_TEST
+            LOG_PRINTF_BARE(cvm, "%d(%s):%d(%s)",
+                            val, cvm->var[val].name,
+                            index, cvm->var[index].name);
+#endif
+        } else if((flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_IMMEDIATE) {
+            if(index < 0 ||
+               (cvm->var[val].length > 0 &&
+                index > (int)(cvm->var[val].length) - 1)) {
+                LOG_PRINTF_LINE(cvm, "Index out of range %d.\n", index);
+                return(-1);
+            }
+
+#ifdef CRUSTY_TEST
+            LOG_PRINTF_BARE(cvm, "%d(%s):%d", val, cvm->var[val].name, index);
+#endif
+        }
+    } else {
+        LOG_PRINTF_LINE(cvm, "Invalid variable type.\n");
+        return(-1);
+    }
+
+    return(0);
+}
+
+static int check_math_instruction(CrustyVM *cvm,
+                                  const char *name,
+                                  unsigned int i,
+                                  unsigned int notcmp) {
+    if(i + MOVE_ARGS > cvm->insts - 1) {
+        LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
+                             "of %s instruction.\n", name);
+        return(-1);
+    }
+
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "%s ", name);
+#endif
+    if(check_move_arg(cvm,
+                      notcmp,
+                      cvm->inst[i+MOVE_DEST_FLAGS],
+                      cvm->inst[i+MOVE_DEST_VAL],
+                      cvm->inst[i+MOVE_DEST_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, " ");
+#endif
+    if(check_move_arg(cvm,
+                      0,
+                      cvm->inst[i+MOVE_SRC_FLAGS],
+                      cvm->inst[i+MOVE_SRC_VAL],
+                      cvm->inst[i+MOVE_SRC_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "\n");
+#endif
+    return(0);
+}
+
+#define MATH_INSTRUCTION(NAME, NOTCMP) \
+    if(check_math_instruction(cvm, NAME, i, (NOTCMP)) < 0) { \
+        return(-1); \
+    }
+
+/* make sure somewhere a jump or switch can go lands on the start of an
+   instruction in the same procedure */
+static int check_jump_target(CrustyVM *cvm,
+                             CrustyProcedure *proc,
+                             int target) {
+    unsigned int j;
+    unsigned int line;
+    unsigned int found;
+
+    found = 0;
+    for(j = 0; j < cvm->lines; j++) {
+        if(target < 0 ) {
+            LOG_PRINTF_LINE(cvm, "Negative jump pointer?\n");
+            return(-1);
+        }
+
+        if((unsigned int)target == cvm->line[j].instruction) {
+            line = j;
+            found = 1;
+            break;
+        }
+    }
+
+    if(found == 0) {
+        LOG_PRINTF_LINE(cvm, "Jump argument doesn't land on an instruction.\n");
+        return(-1);
+    }
+
+    if(line > 0 &&
+       cvm->inst[cvm->line[line - 1].instruction] >=
+       (int)CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED &&
+       cvm->inst[cvm->line[line - 1].instruction] <
+       CRUSTY_INSTRUCTION_TYPE_INVALID) {
+        LOG_PRINTF_LINE(cvm, "Jump in to the middle of a fused "
+                             "instruction.\n");
+        return(-1);
+    }
+
+    if(proc != NULL) {
+        if(line < proc->start || line > proc->start + proc->length) {
+            LOG_PRINTF_LINE(cvm, "Jump outside of procedure.\n");
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+static int check_jump_instruction(CrustyVM *cvm,
+                                  const char *name,
+                                  CrustyProcedure *proc,
+                                  unsigned int i) {
+    if(i + JUMP_ARGS > cvm->insts - 1) {
+        LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
+                             "of %s instruction.\n", name);
+        return(-1);
+    }
+
+    if(check_jump_target(cvm, proc, cvm->inst[i+JUMP_LOCATION]) < 0) {
+        return(-1);
+    }
+
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "%s %d\n", name, cvm->inst[i+JUMP_LOCATION]);
+#endif
+    return(0);
+}
+
+/* the value is read like a source, and every label is checked like a jump's */
+static int check_switch_instruction(CrustyVM *cvm,
+                                    CrustyProcedure *proc,
+                                    unsigned int i) {
+    int j;
+
+    if(i + SWITCH_DEFAULT > cvm->insts - 1 ||
+       cvm->inst[i+SWITCH_COUNT] < 0 ||
+       (unsigned int)(cvm->inst[i+SWITCH_COUNT]) >
+       cvm->insts - 1 - (i + SWITCH_DEFAULT)) {
+        LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
+                             "of switch instruction.\n");
+        return(-1);
+    }
+
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "switch ");
+#endif
+    if(check_move_arg(cvm,
+                      0,
+                      cvm->inst[i+SWITCH_VALUE_FLAGS],
+                      cvm->inst[i+SWITCH_VALUE_VAL],
+                      cvm->inst[i+SWITCH_VALUE_INDEX]) < 0) {
+        return(-1);
+    }
+
+    for(j = 0; j <= cvm->inst[i+SWITCH_COUNT]; j++) {
+        if(check_jump_target(cvm, proc, cvm->inst[i+SWITCH_DEFAULT+j]) < 0) {
+            return(-1);
+        }
+#ifdef CRUSTY_TEST
+        LOG_PRINTF_BARE(cvm, " %d", cvm->inst[i+SWITCH_DEFAULT+j]);
+#endif
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "\n");
+#endif
+
+    return(0);
+}
+
+#define JUMP_INSTRUCTION(NAME) \
+    if(proc == NULL) { \
+        if(check_jump_instruction(cvm, NAME, NULL, i) < 0) { \
+            return(-1); \
+        } \
+    } else { \
+        if(check_jump_instruction(cvm, NAME, *proc, i) < 0) { \
+            return(-1); \
+        } \
+    }
+
+static int check_bulk_instruction(CrustyVM *cvm,
+                                  const char *name,
+                                  unsigned int i) {
+    if(i + BULK_ARGS > cvm->insts - 1) {
+        LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
+                             "of %s instruction.\n", name);
+        return(-1);
+    }
+
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "%s ", name);
+#endif
+    if(check_move_arg(cvm,
+                      1,
+                      cvm->inst[i+BULK_DEST_FLAGS],
+                      cvm->inst[i+BULK_DEST_VAL],
+                      cvm->inst[i+BULK_DEST_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, " ");
+#endif
+    if(check_move_arg(cvm,
+                      0,
+                      cvm->inst[i+BULK_SRC_FLAGS],
+                      cvm->inst[i+BULK_SRC_VAL],
+                      cvm->inst[i+BULK_SRC_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, " ");
+#endif
+    if(check_move_arg(cvm,
+                      0,
+                      cvm->inst[i+BULK_COUNT_FLAGS],
+                      cvm->inst[i+BULK_COUNT_VAL],
+                      cvm->inst[i+BULK_COUNT_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "\n");
+#endif
+
+    /* the ranges are in memory */
+    if((cvm->inst[i + BULK_DEST_FLAGS] & MOVE_FLAG_TYPE_MASK) !=
+       MOVE_FLAG_VAR ||
+       variable_is_callback(&(cvm->var[cvm->inst[i + BULK_DEST_VAL]])) ||
+       (!bulk_takes_value(cvm->inst[i]) &&
+        ((cvm->inst[i + BULK_SRC_FLAGS] & MOVE_FLAG_TYPE_MASK) !=
+         MOVE_FLAG_VAR ||
+         variable_is_callback(&(cvm->var[cvm->inst[i + BULK_SRC_VAL]]))))) {
+        LOG_PRINTF_LINE(cvm, "%s operand isn't an array in memory.\n", name);
+        return(-1);
+    }
+
+    return(0);
+}
+
+#define BULK_INSTRUCTION(NAME) \
+    if(check_bulk_instruction(cvm, NAME, i) < 0) { \
+        return(-1); \
+    }
+
+/* min, max and abs are checked like math, and clamp and select have one more
+   source to check */
+static int check_pick_instruction(CrustyVM *cvm,
+                                  const char *name,
+                                  unsigned int i) {
+    if(!pick_takes_other(cvm->inst[i])) {
+        return(check_math_instruction(cvm, name, i, 1));
+    }
+
+    if(i + PICK_ARGS > cvm->insts - 1) {
+        LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
+                             "of %s instruction.\n", name);
+        return(-1);
+    }
+
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "%s ", name);
+#endif
+    if(check_move_arg(cvm,
+                      1,
+                      cvm->inst[i+MOVE_DEST_FLAGS],
+                      cvm->inst[i+MOVE_DEST_VAL],
+                      cvm->inst[i+MOVE_DEST_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, " ");
+#endif
+    if(check_move_arg(cvm,
+                      0,
+                      cvm->inst[i+MOVE_SRC_FLAGS],
+                      cvm->inst[i+MOVE_SRC_VAL],
+                      cvm->inst[i+MOVE_SRC_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, " ");
+#endif
+    if(check_move_arg(cvm,
+                      0,
+                      cvm->inst[i+PICK_OTHER_FLAGS],
+                      cvm->inst[i+PICK_OTHER_VAL],
+                      cvm->inst[i+PICK_OTHER_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "\n");
+#endif
+
+    return(0);
+}
+
+#define PICK_INSTRUCTION(NAME) \
+    if(check_pick_instruction(cvm, NAME, i) < 0) { \
+        return(-1); \
+    }
+
+static int check_specialized_operand(CrustyVM *cvm,
+                                     int dest,
+                                     CrustyOperandKind kind,
+                                     int flags,
+                                     int val,
+                                     int index) {
+    CrustyVariable *var;
+    int size;
+
+    if(kind == CRUSTY_OPERAND_IMMEDIATE) {
+        if((flags & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_IMMEDIATE) {
+            LOG_PRINTF_LINE(cvm, "Immediate operand not flagged as "
+                                 "immediate.\n");
+            return(-1);
+        }
+
+        return(check_move_arg(cvm, dest, flags, val, index));
+    }
+
+    if((flags & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR &&
+       kind != CRUSTY_OPERAND_ARGUMENT &&
+       kind != CRUSTY_OPERAND_REFERENCE) {
+        LOG_PRINTF_LINE(cvm, "Variable operand not flagged as variable.\n");
+        return(-1);
+    }
+
+    if(val < 0 || val > (int)(cvm->vars) - 1) {
+        LOG_PRINTF_LINE(cvm, "Var out of range (%d).\n", val);
+        return(-1);
+    }
+    var = &(cvm->var[val]);
+
+    switch(kind) {
+        case CRUSTY_OPERAND_GLOBAL:
+        case CRUSTY_OPERAND_LOCAL:
+            if(variable_is_argument(var) ||
+               variable_is_callback(var) ||
+               variable_is_global(var) != (kind == CRUSTY_OPERAND_GLOBAL)) {
+                LOG_PRINTF_LINE(cvm, "Operand kind doesn't match variable "
+                                     "%s.\n", var->name);
+                return(-1);
+            }
+
+            if((flags & MOVE_FLAG_INDEX_TYPE_MASK) != MOVE_FLAG_INDEX_IMMEDIATE) {
+                LOG_PRINTF_LINE(cvm, "Variable index on resolved operand.\n");
+                return(-1);
+            }
+
+            /* get the index back from the address */
+            size = type_size(var->type);
+            if(kind == CRUSTY_OPERAND_GLOBAL) {
+                index -= var->offset;
+            } else {
+                index = var->offset - index;
+            }
+            if(index < 0 || index % size != 0) {
+                LOG_PRINTF_LINE(cvm, "Address not in variable %s.\n",
+                                     var->name);
+                return(-1);
+            }
+
+            return(check_move_arg(cvm, dest, flags, val, index / size));
+        case CRUSTY_OPERAND_ARRAY:
+            if(variable_is_argument(var) ||
+               variable_is_callback(var) ||
+               (flags & MOVE_FLAG_INDEX_TYPE_MASK) != MOVE_FLAG_INDEX_VAR) {
+                LOG_PRINTF_LINE(cvm, "Operand kind doesn't match variable "
+                                     "%s.\n", var->name);
+                return(-1);
+            }
+
+            if(check_move_arg(cvm, dest, flags, val, index) < 0) {
+                return(-1);
+            }
+
+            if(variable_is_argument(&(cvm->var[index]))) {
+                LOG_PRINTF_LINE(cvm, "Argument as index of array operand.\n");
+                return(-1);
+            }
+            break;
+        case CRUSTY_OPERAND_INDEXED:
+            /* the index is read straight from memory, whether it's in range
+               is checked once everything else is */
+            if(variable_is_argument(var) ||
+               variable_is_callback(var) ||
+               (flags & MOVE_FLAG_INDEX_TYPE_MASK) != MOVE_FLAG_INDEX_VAR) {
+                LOG_PRINTF_LINE(cvm, "Operand kind doesn't match variable "
+                                     "%s.\n", var->name);
+                return(-1);
+            }
+
+            if(check_move_arg(cvm, dest, flags, val, index) < 0) {
+                return(-1);
+            }
+
+            if(!variable_is_plain_int(&(cvm->var[index]))) {
+                LOG_PRINTF_LINE(cvm, "Unchecked index isn't a plain int.\n");
+                return(-1);
+            }
+            break;
+        case CRUSTY_OPERAND_ARGUMENT:
+            if(!variable_is_argument(var) ||
+               flags != (MOVE_FLAG_VAR | MOVE_FLAG_INDEX_IMMEDIATE) ||
+               index != (int)(var->offset * sizeof(CrustyStackArg))) {
+                LOG_PRINTF_LINE(cvm, "Operand kind doesn't match variable "
+                                     "%s.\n", var->name);
+                return(-1);
+            }
+
+            return(check_move_arg(cvm, dest, flags, val, 0));
+        case CRUSTY_OPERAND_REFERENCE:
+            if(check_move_arg(cvm, dest, flags, val, index) < 0) {
+                return(-1);
+            }
+
+            if(!variable_is_argument(var) &&
+               ((flags & MOVE_FLAG_INDEX_TYPE_MASK) != MOVE_FLAG_INDEX_VAR ||
+                !variable_is_argument(&(cvm->var[index])))) {
+                LOG_PRINTF_LINE(cvm, "Reference operand without an "
+                                     "argument.\n");
+                return(-1);
+            }
+            break;
+        case CRUSTY_OPERAND_CALLBACK:
+            if(!variable_is_callback(var)) {
+                LOG_PRINTF_LINE(cvm, "Operand kind doesn't match variable "
+                                     "%s.\n", var->name);
+                return(-1);
+            }
+
+            return(check_move_arg(cvm, dest, flags, val, index));
+        default:
+            LOG_PRINTF_LINE(cvm, "Invalid operand kind %d.\n", kind);
+            return(-1);
+    }
+
+    return(0);
+}
+
+static int check_specialized_instruction(CrustyVM *cvm,
+                                         unsigned int i,
+                                         unsigned int type) {
+    const CrustySpecialization *spec;
+
+    spec = &(CRUSTY_SPECIALIZATIONS[type -
+                                    CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED]);
+
+    if(i + MOVE_ARGS > cvm->insts - 1) {
+        LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
+                             "of %s instruction.\n", spec->name);
+        return(-1);
+    }
+
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "%s ", spec->name);
+#endif
+    if(check_specialized_operand(cvm,
+                                 spec->generic != CRUSTY_INSTRUCTION_TYPE_CMP,
+                                 spec->dest,
+                                 cvm->inst[i+MOVE_DEST_FLAGS],
+                                 cvm->inst[i+MOVE_DEST_VAL],
+                                 cvm->inst[i+MOVE_DEST_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, " ");
+#endif
+    if(check_specialized_operand(cvm,
+                                 0,
+                                 spec->src,
+                                 cvm->inst[i+MOVE_SRC_FLAGS],
+                                 cvm->inst[i+MOVE_SRC_VAL],
+                                 cvm->inst[i+MOVE_SRC_INDEX]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "\n");
+#endif
+
+    /* the types of arguments are checked against every call once everything
+       else is */
+    if(spec->desttype != CRUSTY_TYPE_NONE) {
+        if((spec->dest != CRUSTY_OPERAND_ARGUMENT &&
+            cvm->var[cvm->inst[i+MOVE_DEST_VAL]].type != spec->desttype) ||
+           (spec->src != CRUSTY_OPERAND_IMMEDIATE &&
+            spec->src != CRUSTY_OPERAND_ARGUMENT &&
+            cvm->var[cvm->inst[i+MOVE_SRC_VAL]].type != spec->srctype)) {
+            LOG_PRINTF_LINE(cvm, "Operand types don't match %s "
+                                 "instruction.\n", spec->name);
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+/* the first instruction is checked here and the second is checked on its own
+   as the next instruction */
+static int check_fused_instruction(CrustyVM *cvm, unsigned int i) {
+    const CrustyFusion *fusion;
+
+    fusion = &(CRUSTY_FUSIONS[cvm->inst[i] -
+                              CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED]);
+
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "%s: ", fusion->name);
+#endif
+    if(check_specialized_instruction(cvm, i, fusion->first) < 0) {
+        return(-1);
+    }
+
+    if(i + MOVE_ARGS + 1 > cvm->insts - 1 ||
+       cvm->inst[i + MOVE_ARGS + 1] != fusion->second) {
+        LOG_PRINTF_LINE(cvm, "%s not followed by its second instruction.\n",
+                             fusion->name);
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* The counter is written like add's destination and the step and bound are
+   read like sources, or for a typed loop they're checked like a typed
+   instruction's operands.  The label is checked like a jump's. */
+static int check_loop_instruction(CrustyVM *cvm,
+                                  CrustyProcedure *proc,
+                                  unsigned int i) {
+    const CrustyLoop *loop;
+    const int *inst;
+
+    if(i + LOOP_ARGS > cvm->insts - 1) {
+        LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
+                             "of loop instruction.\n");
+        return(-1);
+    }
+    inst = &(cvm->inst[i]);
+    loop = typed_loop(inst[0]);
+
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, "%s ", loop == NULL ? "loop" : loop->name);
+#endif
+    if(loop == NULL) {
+        if(check_move_arg(cvm,
+                          1,
+                          inst[LOOP_COUNTER_FLAGS],
+                          inst[LOOP_COUNTER_VAL],
+                          inst[LOOP_COUNTER_INDEX]) < 0) {
+            return(-1);
+        }
+#ifdef CRUSTY_TEST
+        LOG_PRINTF_BARE(cvm, " ");
+#endif
+        if(check_move_arg(cvm,
+                          0,
+                          inst[LOOP_STEP_FLAGS],
+                          inst[LOOP_STEP_VAL],
+                          inst[LOOP_STEP_INDEX]) < 0) {
+            return(-1);
+        }
+#ifdef CRUSTY_TEST
+        LOG_PRINTF_BARE(cvm, " ");
+#endif
+        if(check_move_arg(cvm,
+                          0,
+                          inst[LOOP_BOUND_FLAGS],
+                          inst[LOOP_BOUND_VAL],
+                          inst[LOOP_BOUND_INDEX]) < 0) {
+            return(-1);
+        }
+    } else {
+        if(check_specialized_operand(cvm,
+                                     1,
+                                     loop->counter,
+                                     inst[LOOP_COUNTER_FLAGS],
+                                     inst[LOOP_COUNTER_VAL],
+                                     inst[LOOP_COUNTER_INDEX]) < 0) {
+            return(-1);
+        }
+#ifdef CRUSTY_TEST
+        LOG_PRINTF_BARE(cvm, " ");
+#endif
+        if(check_specialized_operand(cvm,
+                                     0,
+                                     CRUSTY_OPERAND_IMMEDIATE,
+                                     inst[LOOP_STEP_FLAGS],
+                                     inst[LOOP_STEP_VAL],
+                                     inst[LOOP_STEP_INDEX]) < 0) {
+            return(-1);
+        }
+#ifdef CRUSTY_TEST
+        LOG_PRINTF_BARE(cvm, " ");
+#endif
+        if(check_specialized_operand(cvm,
+                                     0,
+                                     loop->bound,
+                                     inst[LOOP_BOUND_FLAGS],
+                                     inst[LOOP_BOUND_VAL],
+                                     inst[LOOP_BOUND_INDEX]) < 0) {
+            return(-1);
+        }
+
+        if(cvm->var[inst[LOOP_COUNTER_VAL]].type != CRUSTY_TYPE_INT ||
+           (loop->bound != CRUSTY_OPERAND_IMMEDIATE &&
+            cvm->var[inst[LOOP_BOUND_VAL]].type != CRUSTY_TYPE_INT)) {
+            LOG_PRINTF_LINE(cvm, "Operand types don't match %s "
+                                 "instruction.\n", loop->name);
+            return(-1);
+        }
+    }
+
+    if(check_jump_target(cvm, proc, inst[LOOP_LOCATION]) < 0) {
+        return(-1);
+    }
+#ifdef CRUSTY_TEST
+    LOG_PRINTF_BARE(cvm, " %d\n", inst[LOOP_LOCATION]);
+#endif
+
+    return(0);
+}
+
+/* The frame a tail call is made from is gone by the time the procedure it
+   calls runs, so nothing can be passed which refers in to it.  Arguments are
+   fine since they refer to what they were passed, as are index variables since
+   they're read during the call. */
+static int check_tail_call(CrustyVM *cvm,
+                           CrustyProcedure *callee,
+                           unsigned int i) {
+    CrustyVariable *var;
+    unsigned int j;
+    int *arg;
+
+    for(j = 0; j < callee->args; j++) {
+        arg = &(cvm->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE)]);
+        if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR) {
+            continue;
+        }
+
+        var = &(cvm->var[arg[CALL_ARG_VAL]]);
+        if(!variable_is_global(var) && !variable_is_argument(var)) {
+            LOG_PRINTF_LINE(cvm, "Tail call passes local variable %s.\n",
+                                 var->name);
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+static int check_instruction(CrustyVM *cvm,
+                      CrustyProcedure **proc,
+                      unsigned int i) {
+#ifdef CRUSTY_TEST
+    LOG_PRINTF(cvm, "%d: ", i);
+#endif
+    switch(cvm->inst[i]) {
+        case CRUSTY_INSTRUCTION_TYPE_MOVE:
+            MATH_INSTRUCTION("move", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_ADD:
+            MATH_INSTRUCTION("add", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_SUB:
+            MATH_INSTRUCTION("sub", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_MUL:
+            MATH_INSTRUCTION("mul", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_DIV:
+            MATH_INSTRUCTION("div", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_MOD:
+            MATH_INSTRUCTION("mod", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_AND:
+            MATH_INSTRUCTION("and", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_OR:
+            MATH_INSTRUCTION("or", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_XOR:
+            MATH_INSTRUCTION("xor", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_SHR:
+            MATH_INSTRUCTION("shr", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_SHL:
+            MATH_INSTRUCTION("shl", 1)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_CMP:
+            MATH_INSTRUCTION("cmp", 0)
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_MIN:
+            PICK_INSTRUCTION("min")
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_MAX:
+            PICK_INSTRUCTION("max")
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_ABS:
+            PICK_INSTRUCTION("abs")
+            return(MOVE_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_CLAMP:
+            PICK_INSTRUCTION("clamp")
+            return(PICK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_SELECT:
+            PICK_INSTRUCTION("select")
+            return(PICK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_JUMP:
+            JUMP_INSTRUCTION("jump")
+            return(JUMP_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+            JUMP_INSTRUCTION("jumpn")
+            return(JUMP_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+            JUMP_INSTRUCTION("jumpz")
+            return(JUMP_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+            JUMP_INSTRUCTION("jumpl")
+            return(JUMP_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_JUMPG:
+            JUMP_INSTRUCTION("jumpg")
+            return(JUMP_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_SWITCH:
+            if(check_switch_instruction(cvm,
+                                        proc == NULL ? NULL : *proc,
+                                        i) < 0) {
+                return(-1);
+            }
+            return(SWITCH_START_TARGETS + cvm->inst[i+SWITCH_COUNT]);
+        case CRUSTY_INSTRUCTION_TYPE_LOOP:
+#define TYPED_LOOP(COUNTER, BOUND) \
+        case CRUSTY_INSTRUCTION_TYPE_LOOP_##COUNTER##_##BOUND:
+        CRUSTY_TYPED_LOOPS(TYPED_LOOP)
+#undef TYPED_LOOP
+            if(check_loop_instruction(cvm,
+                                      proc == NULL ? NULL : *proc,
+                                      i) < 0) {
+                return(-1);
+            }
+            return(LOOP_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_CALL:
+        case CRUSTY_INSTRUCTION_TYPE_TAILCALL:
+            if(i + JUMP_ARGS > cvm->insts - 1) {
+                LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
+                                     "of call instruction.\n");
+                return(-1);
+            }
+
+            if(cvm->inst[i+CALL_PROCEDURE] < 0 ||
+               cvm->inst[i+CALL_PROCEDURE] > (int)(cvm->procs) - 1) {
+                LOG_PRINTF_LINE(cvm, "Call to procedure out of range.\n");
+                return(-1);
+            }
+
+            CrustyProcedure *callProc = &(cvm->proc[cvm->inst[i+CALL_PROCEDURE]]);
+            unsigned int j;
+
+#ifdef CRUSTY_TEST
+            LOG_PRINTF_BARE(cvm, "call %d(%s)", cvm->inst[i+CALL_PROCEDURE],
+                            callProc->name);
+#endif
+
+            for(j = 0; j < callProc->args; j++) {
+#ifdef CRUSTY_TEST
+                LOG_PRINTF_BARE(cvm, " ");
+#endif
+                if(check_move_arg(cvm,
+                                  0,
+                                  cvm->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_FLAGS],
+                                  cvm->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_VAL],
+                                  cvm->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_INDEX]) < 0) {
+                    return(-1);
+                }
+            }
+
+#ifdef CRUSTY_TEST
+            LOG_PRINTF_BARE(cvm, "\n");
+#endif
+
+            if(cvm->inst[i] == CRUSTY_INSTRUCTION_TYPE_TAILCALL &&
+               check_tail_call(cvm, callProc, i) < 0) {
+                return(-1);
+            }
+
+            return(CALL_PROCEDURE + (callProc->args * 3) + 1);
+        case CRUSTY_INSTRUCTION_TYPE_COPY:
+            BULK_INSTRUCTION("copy")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_SHIFT:
+            BULK_INSTRUCTION("shift")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_FILL:
+            BULK_INSTRUCTION("fill")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_VADD:
+            BULK_INSTRUCTION("vadd")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_VSUB:
+            BULK_INSTRUCTION("vsub")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_VMUL:
+            BULK_INSTRUCTION("vmul")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_VMIN:
+            BULK_INSTRUCTION("vmin")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_VMAX:
+            BULK_INSTRUCTION("vmax")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_VSCALE:
+            BULK_INSTRUCTION("vscale")
+            return(BULK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_RET:
+            /* takes no arguments so it can't end early */
+#ifdef CRUSTY_TEST
+            LOG_PRINTF_BARE(cvm, "ret\n");
+#endif
+            if(proc != NULL) {
+                *proc = NULL;
+            }
+
+            return(RET_ARGS + 1);
+        default:
+            if(cvm->inst[i] >= CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED &&
+               cvm->inst[i] < (int)CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED) {
+                if(check_specialized_instruction(cvm, i, cvm->inst[i]) < 0) {
+                    return(-1);
+                }
+                return(MOVE_ARGS + 1);
+            } else if(cvm->inst[i] >= (int)CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED &&
+                      cvm->inst[i] < CRUSTY_INSTRUCTION_TYPE_INVALID) {
+                if(check_fused_instruction(cvm, i) < 0) {
+                    return(-1);
+                }
+                return(MOVE_ARGS + 1);
+            }
+
+            LOG_PRINTF_LINE(cvm, "Invalid instruction %u.\n", cvm->inst[i]);
+            return(-1);
+    }
+}
+
+#undef PICK_INSTRUCTION
+#undef BULK_INSTRUCTION
+#undef JUMP_INSTRUCTION
+#undef MATH_INSTRUCTION
+
+/* size of an instruction which has already been verified */
+static int instruction_size(CrustyVM *cvm, unsigned int i) {
+    switch(cvm->inst[i]) {
+        case CRUSTY_INSTRUCTION_TYPE_JUMP:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+        case CRUSTY_INSTRUCTION_TYPE_JUMPG:
+            return(JUMP_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_SWITCH:
+            return(SWITCH_START_TARGETS + cvm->inst[i + SWITCH_COUNT]);
+        case CRUSTY_INSTRUCTION_TYPE_LOOP:
+#define TYPED_LOOP(COUNTER, BOUND) \
+        case CRUSTY_INSTRUCTION_TYPE_LOOP_##COUNTER##_##BOUND:
+        CRUSTY_TYPED_LOOPS(TYPED_LOOP)
+#undef TYPED_LOOP
+            return(LOOP_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_CLAMP:
+        case CRUSTY_INSTRUCTION_TYPE_SELECT:
+            return(PICK_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_CALL:
+        case CRUSTY_INSTRUCTION_TYPE_TAILCALL:
+            return(CALL_START_ARGS +
+                   (cvm->proc[cvm->inst[i + CALL_PROCEDURE]].args *
+                    CALL_ARG_SIZE));
+        case CRUSTY_INSTRUCTION_TYPE_RET:
+            return(RET_ARGS + 1);
+        case CRUSTY_INSTRUCTION_TYPE_COPY:
+        case CRUSTY_INSTRUCTION_TYPE_SHIFT:
+        case CRUSTY_INSTRUCTION_TYPE_FILL:
+        case CRUSTY_INSTRUCTION_TYPE_VADD:
+        case CRUSTY_INSTRUCTION_TYPE_VSUB:
+        case CRUSTY_INSTRUCTION_TYPE_VMUL:
+        case CRUSTY_INSTRUCTION_TYPE_VMIN:
+        case CRUSTY_INSTRUCTION_TYPE_VMAX:
+        case CRUSTY_INSTRUCTION_TYPE_VSCALE:
+            return(BULK_ARGS + 1);
+        default: /* move, math, cmp, min, max and abs */
+            return(MOVE_ARGS + 1);
+    }
+}
+
+/* the generic instruction a specialized or fused one does the work of, or
+   the first half of it for a fused one */
+static int generic_instruction(int type) {
+    if(type >= (int)CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED &&
+       type < CRUSTY_INSTRUCTION_TYPE_INVALID) {
+        type = CRUSTY_FUSIONS[type - CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED].first;
+    }
+
+    if(type >= CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED &&
+       type < (int)CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED) {
+        type = CRUSTY_SPECIALIZATIONS[type -
+                   CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED].generic;
+    }
+
+    return(type);
+}
+
+/* Bounds checks are removed from array operands whose index can be proven to
+   always be in range.  Each procedure is stepped through keeping the range of
+   values each int used as an index could hold before each instruction, which
+   are learned from moves of known values, adding or subtracting them, masking
+   and from which way a conditional jump after a cmp went.  Where paths meet the
+   ranges are joined, and once an instruction has been joined a few times the
+   ranges are widened out to the next constant the procedure compares against
+   or indexes with, so loops settle quickly on the range their counter stays
+   in. */
+#define RANGE_PROVEN_DEST (1 << 0)
+#define RANGE_PROVEN_SRC  (1 << 1)
+
+/* times the ranges before an instruction can grow before they're widened */
+#define RANGE_WIDEN_AFTER (2)
+
+typedef struct {
+    long long lo;
+    long long hi;
+} CrustyInterval;
+
+/* what's known before an instruction besides the ranges */
+typedef struct {
+    unsigned int visits; /* 0 until reached */
+    /* the result registers hold this tracked variable minus something in sub,
+       or -1 */
+    int resultvar;
+    CrustyInterval sub;
+} CrustyRangeState;
+
+typedef struct {
+    CrustyVM *cvm;
+    CrustyProcedure *proc;
+
+    /* index variables being tracked and the tracked number of each variable,
+       or -1 */
+    int *cand;
+    int *candof;
+    unsigned int cands;
+
+    /* constants ranges are widened out to, in order */
+    long long *limit;
+    unsigned int limits;
+
+    /* instructions in the procedure and the slot of each one, or -1 */
+    unsigned int *slotip;
+    int *slotof;
+    unsigned int slots;
+
+    CrustyInterval *range; /* cands for each slot */
+    CrustyRangeState *state;
+    unsigned int *work;
+    unsigned int works;
+    unsigned char *queued;
+
+    /* state being stepped through an instruction */
+    CrustyInterval *cur;
+    CrustyRangeState curstate;
+} CrustyRangeAnalysis;
+
+static CrustyInterval range_make(long long lo, long long hi) {
+    CrustyInterval range;
+
+    if(lo < INT_MIN || hi > INT_MAX) {
+        lo = INT_MIN;
+        hi = INT_MAX;
+    }
+    range.lo = lo;
+    range.hi = hi;
+
+    return(range);
+}
+
+static int range_tracked(CrustyRangeAnalysis *ra, int flags, int val) {
+    if(flags != (MOVE_FLAG_VAR | MOVE_FLAG_INDEX_IMMEDIATE)) {
+        return(-1);
+    }
+
+    return(ra->candof[val]);
+}
+
+/* a write which can't be followed could still land in a tracked variable,
+   through a variable index in to it or, through an argument, in any global, so
+   whatever it could have written is forgotten.  Returns nonzero if anything
+   was. */
+static int range_clobber(CrustyRangeAnalysis *ra, int flags, int val) {
+    CrustyVM *cvm = ra->cvm;
+    unsigned int c;
+    int clobbered = 0;
+
+    if((flags & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR) {
+        return(0);
+    }
+
+    if(ra->candof[val] >= 0) {
+        ra->cur[ra->candof[val]] = range_make(INT_MIN, INT_MAX);
+        clobbered = 1;
+    } else if(variable_is_argument(&(cvm->var[val]))) {
+        for(c = 0; c < ra->cands; c++) {
+            if(variable_is_global(&(cvm->var[ra->cand[c]]))) {
+                ra->cur[c] = range_make(INT_MIN, INT_MAX);
+                clobbered = 1;
+            }
+        }
+    }
+
+    return(clobbered);
+}
+
+/* the specialization of a specialized or typed instruction, or NULL */
+static const CrustySpecialization *range_specialization(int type) {
+    if(type < CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED ||
+       type >= (int)CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED) {
+        return(NULL);
+    }
+
+    return(&(CRUSTY_SPECIALIZATIONS[type -
+                                    CRUSTY_INSTRUCTION_TYPE_FIRST_SPECIALIZED]));
+}
+
+static int range_array_operand(CrustyOperandKind kind) {
+    return(kind == CRUSTY_OPERAND_ARRAY || kind == CRUSTY_OPERAND_INDEXED);
+}
+
+/* the range of values an operand reads as, and whether it's read as an int */
+static CrustyInterval range_operand(CrustyRangeAnalysis *ra,
+                                    int flags,
+                                    int val,
+                                    int *isint) {
+    CrustyVariable *var;
+    int c;
+
+    *isint = 1;
+    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_IMMEDIATE) {
+        return(range_make(val, val));
+    }
+
+    var = &(ra->cvm->var[val]);
+    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+        if(variable_is_argument(var)) {
+            return(range_make(INT_MIN, INT_MAX));
+        }
+        return(range_make(var->length, var->length));
+    }
+
+    c = range_tracked(ra, flags, val);
+    if(c >= 0) {
+        return(ra->cur[c]);
+    }
+
+    if(variable_is_argument(var) ||
+       variable_is_callback(var) ||
+       var->type == CRUSTY_TYPE_FLOAT) {
+        *isint = 0;
+    } else if(var->type == CRUSTY_TYPE_CHAR) {
+        return(range_make(0, UCHAR_MAX));
+    }
+
+    return(range_make(INT_MIN, INT_MAX));
+}
+
+/* the range of the result of math on an int */
+static CrustyInterval range_math(int type, CrustyInterval d, CrustyInterval s) {
+    long long m;
+
+    switch(type) {
+        case CRUSTY_INSTRUCTION_TYPE_MOVE:
+            return(s);
+        case CRUSTY_INSTRUCTION_TYPE_ADD:
+            return(range_make(d.lo + s.lo, d.hi + s.hi));
+        case CRUSTY_INSTRUCTION_TYPE_SUB:
+            return(range_make(d.lo - s.hi, d.hi - s.lo));
+        case CRUSTY_INSTRUCTION_TYPE_AND:
+            if(d.lo >= 0 && s.lo >= 0) {
+                return(range_make(0, d.hi < s.hi ? d.hi : s.hi));
+            } else if(s.lo >= 0) {
+                return(range_make(0, s.hi));
+            } else if(d.lo >= 0) {
+                return(range_make(0, d.hi));
+            }
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_MOD:
+            /* the result has the sign of the dividend */
+            if(s.lo == s.hi && s.lo != 0) {
+                m = (s.lo < 0 ? -s.lo : s.lo) - 1;
+                if(d.lo >= 0) {
+                    return(range_make(0, d.hi < m ? d.hi : m));
+                }
+                return(range_make(-m, m));
+            }
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_DIV:
+            if(s.lo == s.hi && s.lo > 0 && d.lo >= 0) {
+                return(range_make(d.lo / s.lo, d.hi / s.lo));
+            }
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_SHR:
+            if(s.lo == s.hi && s.lo >= 0 && s.lo < 32 && d.lo >= 0) {
+                return(range_make(d.lo >> s.lo, d.hi >> s.lo));
+            }
+            break;
+        default:
+            break;
+    }
+
+    return(range_make(INT_MIN, INT_MAX));
+}
+
+/* narrow the variable the result registers were set from by which way a
+   conditional jump went, returns -1 if it can't go that way */
+static int range_refine(CrustyRangeAnalysis *ra, int type, int taken) {
+    CrustyInterval *v;
+    CrustyInterval s;
+
+    if(ra->curstate.resultvar < 0) {
+        return(0);
+    }
+    v = &(ra->cur[ra->curstate.resultvar]);
+    s = ra->curstate.sub;
+
+    /* the result is a subtraction, which only says how the two compare if it
+       can't overflow */
+    if(v->lo - s.hi < INT_MIN || v->hi - s.lo > INT_MAX) {
+        return(0);
+    }
+
+    if(type == CRUSTY_INSTRUCTION_TYPE_JUMPN) {
+        type = CRUSTY_INSTRUCTION_TYPE_JUMPZ;
+        taken = !taken;
+    }
+
+    switch(type) {
+        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+            if(taken) {
+                if(v->hi > s.hi - 1) {
+                    v->hi = s.hi - 1;
+                }
+            } else if(v->lo < s.lo) {
+                v->lo = s.lo;
+            }
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_JUMPG:
+            if(taken) {
+                if(v->lo < s.lo + 1) {
+                    v->lo = s.lo + 1;
+                }
+            } else if(v->hi > s.hi) {
+                v->hi = s.hi;
+            }
+            break;
+        default: /* JUMPZ */
+            if(taken) {
+                if(v->lo < s.lo) {
+                    v->lo = s.lo;
+                }
+                if(v->hi > s.hi) {
+                    v->hi = s.hi;
+                }
+            } else if(s.lo == s.hi) {
+                if(v->lo == s.lo) {
+                    v->lo++;
+                }
+                if(v->hi == s.hi) {
+                    v->hi--;
+                }
+            }
+            break;
+    }
+
+    if(v->lo > v->hi) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* narrow a loop's counter by which way it went, which is back while the
+   counter is short of the bound in the direction it's stepped.  Returns -1 if
+   it can't go that way. */
+static int range_loop_refine(CrustyRangeAnalysis *ra,
+                             int counter,
+                             CrustyInterval bound,
+                             int backwards,
+                             int taken) {
+    CrustyInterval *v = &(ra->cur[counter]);
+
+    if(backwards) {
+        if(taken) {
+            if(v->lo < bound.lo + 1) {
+                v->lo = bound.lo + 1;
+            }
+        } else if(v->hi > bound.hi) {
+            v->hi = bound.hi;
+        }
+    } else {
+        if(taken) {
+            if(v->hi > bound.hi - 1) {
+                v->hi = bound.hi - 1;
+            }
+        } else if(v->lo < bound.lo) {
+            v->lo = bound.lo;
+        }
+    }
+
+    if(v->lo > v->hi) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* the range of what min, max, abs, clamp or select leave in an int, given what
+   it held and the ranges of the sources */
+static CrustyInterval range_pick(int type,
+                                 CrustyInterval d,
+                                 CrustyInterval s,
+                                 CrustyInterval o) {
+    switch(type) {
+        case CRUSTY_INSTRUCTION_TYPE_MIN:
+            return(range_make(d.lo < s.lo ? d.lo : s.lo,
+                              d.hi < s.hi ? d.hi : s.hi));
+        case CRUSTY_INSTRUCTION_TYPE_MAX:
+            return(range_make(d.lo > s.lo ? d.lo : s.lo,
+                              d.hi > s.hi ? d.hi : s.hi));
+        case CRUSTY_INSTRUCTION_TYPE_ABS:
+            /* the most negative int stays negative, which range_make() gives
+               up on since it can't be made positive */
+            if(s.lo >= 0) {
+                return(s);
+            }
+            if(s.hi <= 0) {
+                return(range_make(-s.hi, -s.lo));
+            }
+            return(range_make(0, -s.lo > s.hi ? -s.lo : s.hi));
+        case CRUSTY_INSTRUCTION_TYPE_CLAMP:
+            return(range_pick(CRUSTY_INSTRUCTION_TYPE_MIN,
+                              range_pick(CRUSTY_INSTRUCTION_TYPE_MAX, d, s, o),
+                              o, o));
+        default: /* SELECT */
+            return(range_make(s.lo < o.lo ? s.lo : o.lo,
+                              s.hi > o.hi ? s.hi : o.hi));
+    }
+}
+
+static void range_add_limit(CrustyRangeAnalysis *ra, long long val) {
+    unsigned int i;
+
+    for(i = 0; i < ra->limits; i++) {
+        if(ra->limit[i] == val) {
+            return;
+        } else if(ra->limit[i] > val) {
+            break;
+        }
+    }
+
+    memmove(&(ra->limit[i + 1]),
+            &(ra->limit[i]),
+            sizeof(long long) * (ra->limits - i));
+    ra->limit[i] = val;
+    ra->limits++;
+}
+
+/* join a range in to the range before an instruction, returns whether it
+   changed */
+static int range_join(CrustyRangeAnalysis *ra,
+                      CrustyInterval *into,
+                      CrustyInterval from,
+                      unsigned int visits) {
+    int changed = 0;
+    unsigned int i;
+
+    if(from.lo < into->lo) {
+        into->lo = from.lo;
+        if(visits > RANGE_WIDEN_AFTER) {
+            into->lo = INT_MIN;
+            for(i = ra->limits; i > 0; i--) {
+                if(ra->limit[i - 1] <= from.lo) {
+                    into->lo = ra->limit[i - 1];
+                    break;
+                }
+            }
+        }
+        changed = 1;
+    }
+
+    if(from.hi > into->hi) {
+        into->hi = from.hi;
+        if(visits > RANGE_WIDEN_AFTER) {
+            into->hi = INT_MAX;
+            for(i = 0; i < ra->limits; i++) {
+                if(ra->limit[i] >= from.hi) {
+                    into->hi = ra->limit[i];
+                    break;
+                }
+            }
+        }
+        changed = 1;
+    }
+
+    return(changed);
+}
+
+/* pass the state after an instruction on to the next one it can go to */
+static void range_flow(CrustyRangeAnalysis *ra, int slot) {
+    CrustyInterval *range;
+    CrustyRangeState *state;
+    unsigned int c;
+    int changed = 0;
+
+    if(slot < 0 || (unsigned int)slot >= ra->slots) {
+        return;
+    }
+    range = &(ra->range[slot * ra->cands]);
+    state = &(ra->state[slot]);
+
+    if(state->visits == 0) {
+        memcpy(range, ra->cur, sizeof(CrustyInterval) * ra->cands);
+        *state = ra->curstate;
+        changed = 1;
+    } else {
+        for(c = 0; c < ra->cands; c++) {
+            changed |= range_join(ra, &(range[c]), ra->cur[c], state->visits);
+        }
+
+        if(state->resultvar != ra->curstate.resultvar) {
+            if(state->resultvar >= 0) {
+                state->resultvar = -1;
+                changed = 1;
+            }
+        } else if(state->resultvar >= 0) {
+            changed |= range_join(ra,
+                                  &(state->sub),
+                                  ra->curstate.sub,
+                                  state->visits);
+        }
+    }
+
+    if(changed) {
+        state->visits++;
+        if(!ra->queued[slot]) {
+            ra->queued[slot] = 1;
+            ra->work[ra->works] = slot;
+            ra->works++;
+        }
+    }
+}
+
+/* step the state before an instruction through it */
+static void range_step(CrustyRangeAnalysis *ra, unsigned int slot) {
+    CrustyVM *cvm = ra->cvm;
+    const int *inst;
+    CrustyInterval src, bound, stepped, other;
+    unsigned int c, j;
+    int type, dest, isint, boundint, otherint;
+
+    inst = &(cvm->inst[ra->slotip[slot]]);
+    type = generic_instruction(inst[0]);
+
+    memcpy(ra->cur,
+           &(ra->range[slot * ra->cands]),
+           sizeof(CrustyInterval) * ra->cands);
+    ra->curstate = ra->state[slot];
+
+    if(type >= CRUSTY_INSTRUCTION_TYPE_MOVE &&
+       type <= CRUSTY_INSTRUCTION_TYPE_CMP) {
+        src = range_operand(ra,
+                            inst[MOVE_SRC_FLAGS],
+                            inst[MOVE_SRC_VAL],
+                            &isint);
+        dest = range_tracked(ra, inst[MOVE_DEST_FLAGS], inst[MOVE_DEST_VAL]);
+
+        ra->curstate.resultvar = -1;
+        if(type == CRUSTY_INSTRUCTION_TYPE_CMP) {
+            if(dest >= 0 && isint) {
+                ra->curstate.resultvar = dest;
+                ra->curstate.sub = src;
+            }
+        } else if(dest >= 0) {
+            if(isint) {
+                ra->cur[dest] = range_math(type, ra->cur[dest], src);
+                ra->curstate.resultvar = dest;
+                ra->curstate.sub = range_make(0, 0);
+            } else {
+                ra->cur[dest] = range_make(INT_MIN, INT_MAX);
+            }
+        } else if(type != CRUSTY_INSTRUCTION_TYPE_CMP) {
+            range_clobber(ra, inst[MOVE_DEST_FLAGS], inst[MOVE_DEST_VAL]);
+        }
+
+        range_flow(ra, slot + 1);
+    } else if(type == CRUSTY_INSTRUCTION_TYPE_JUMP) {
+        range_flow(ra, ra->slotof[inst[JUMP_LOCATION]]);
+    } else if(is_jump(type)) {
+        if(range_refine(ra, type, 1) == 0) {
+            range_flow(ra, ra->slotof[inst[JUMP_LOCATION]]);
+        }
+
+        memcpy(ra->cur,
+               &(ra->range[slot * ra->cands]),
+               sizeof(CrustyInterval) * ra->cands);
+        if(range_refine(ra, type, 0) == 0) {
+            range_flow(ra, slot + 1);
+        }
+    } else if(is_loop(type)) {
+        /* the counter is stepped like add, but the result registers are left
+           alone, so they no longer say anything about it */
+        src = range_operand(ra,
+                            inst[LOOP_STEP_FLAGS],
+                            inst[LOOP_STEP_VAL],
+                            &isint);
+        bound = range_operand(ra,
+                              inst[LOOP_BOUND_FLAGS],
+                              inst[LOOP_BOUND_VAL],
+                              &boundint);
+        dest = range_tracked(ra,
+                             inst[LOOP_COUNTER_FLAGS],
+                             inst[LOOP_COUNTER_VAL]);
+
+        if(dest >= 0) {
+            if(isint) {
+                ra->cur[dest] = range_math(CRUSTY_INSTRUCTION_TYPE_ADD,
+                                           ra->cur[dest],
+                                           src);
+            } else {
+                ra->cur[dest] = range_make(INT_MIN, INT_MAX);
+            }
+            if(ra->curstate.resultvar == dest) {
+                ra->curstate.resultvar = -1;
+            }
+        } else if(range_clobber(ra,
+                                inst[LOOP_COUNTER_FLAGS],
+                                inst[LOOP_COUNTER_VAL])) {
+            ra->curstate.resultvar = -1;
+        }
+
+        /* which way it goes only says something if the step's sign is
+           known */
+        if(dest < 0 || !isint || !boundint || (src.lo < 0 && src.hi >= 0)) {
+            range_flow(ra, ra->slotof[inst[LOOP_LOCATION]]);
+            range_flow(ra, slot + 1);
+        } else {
+            stepped = ra->cur[dest];
+            if(range_loop_refine(ra, dest, bound, src.hi < 0, 1) == 0) {
+                range_flow(ra, ra->slotof[inst[LOOP_LOCATION]]);
+            }
+
+            ra->cur[dest] = stepped;
+            if(range_loop_refine(ra, dest, bound, src.hi < 0, 0) == 0) {
+                range_flow(ra, slot + 1);
+            }
+        }
+    } else if(is_pick(type)) {
+        /* set the result registers like math does, except select which leaves
+           them alone, so they no longer say anything about what it wrote */
+        src = range_operand(ra,
+                            inst[MOVE_SRC_FLAGS],
+                            inst[MOVE_SRC_VAL],
+                            &isint);
+        other = src;
+        otherint = isint;
+        if(pick_takes_other(type)) {
+            other = range_operand(ra,
+                                  inst[PICK_OTHER_FLAGS],
+                                  inst[PICK_OTHER_VAL],
+                                  &otherint);
+        }
+        dest = range_tracked(ra, inst[MOVE_DEST_FLAGS], inst[MOVE_DEST_VAL]);
+
+        ra->curstate.resultvar = -1;
+        if(dest >= 0) {
+            if(isint && otherint) {
+                ra->cur[dest] = range_pick(type, ra->cur[dest], src, other);
+                if(type != CRUSTY_INSTRUCTION_TYPE_SELECT) {
+                    ra->curstate.resultvar = dest;
+                    ra->curstate.sub = range_make(0, 0);
+                }
+            } else {
+                ra->cur[dest] = range_make(INT_MIN, INT_MAX);
+            }
+        } else {
+            range_clobber(ra, inst[MOVE_DEST_FLAGS], inst[MOVE_DEST_VAL]);
+        }
+
+        range_flow(ra, slot + 1);
+    } else if(type == CRUSTY_INSTRUCTION_TYPE_SWITCH) {
+        /* nothing is written, it only picks where to go */
+        for(j = 0; j <= (unsigned int)inst[SWITCH_COUNT]; j++) {
+            range_flow(ra, ra->slotof[inst[SWITCH_DEFAULT + j]]);
+        }
+    } else if(type == CRUSTY_INSTRUCTION_TYPE_CALL) {
+        /* arguments are passed by reference and globals could be changed by
+           anything called */
+        for(j = 0; j < cvm->proc[inst[CALL_PROCEDURE]].args; j++) {
+            range_clobber(ra,
+                    inst[CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_FLAGS],
+                    inst[CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_VAL]);
+        }
+        for(c = 0; c < ra->cands; c++) {
+            if(variable_is_global(&(cvm->var[ra->cand[c]]))) {
+                ra->cur[c] = range_make(INT_MIN, INT_MAX);
+            }
+        }
+        ra->curstate.resultvar = -1;
+
+        range_flow(ra, slot + 1);
+    } else if(is_bulk(type)) {
+        /* the range written could start at a tracked variable or, through
+           an argument, at any global, and the result registers are left
+           alone but what they were compared with may have changed */
+        range_clobber(ra, MOVE_FLAG_VAR, inst[BULK_DEST_VAL]);
+        ra->curstate.resultvar = -1;
+
+        range_flow(ra, slot + 1);
+    }
+}
+
+/* whether an array operand's index is always in range before an instruction */
+static int range_in_bounds(CrustyRangeAnalysis *ra,
+                           unsigned int slot,
+                           int val,
+                           int index) {
+    CrustyInterval *range;
+    int c;
+
+    c = ra->candof[index];
+    if(c < 0) {
+        return(0);
+    }
+    range = &(ra->range[(slot * ra->cands) + c]);
+
+    return(range->lo >= 0 &&
+           range->hi <= (long long)(ra->cvm->var[val].length) - 1);
+}
+
+static int range_procedure(CrustyRangeAnalysis *ra,
+                           unsigned int procnum,
+                           unsigned char *proven) {
+    CrustyVM *cvm = ra->cvm;
+    CrustyProcedure *proc = &(cvm->proc[procnum]);
+    const CrustySpecialization *spec;
+    CrustyVariable *var;
+    const int *inst;
+    CrustyInterval src;
+    unsigned int i, end, slot, c;
+    int val, isint;
+    int ret = -1;
+
+    ra->proc = proc;
+    if(procnum + 1 < cvm->procs) {
+        end = cvm->proc[procnum + 1].instruction;
+    } else {
+        end = cvm->insts;
+    }
+
+    ra->slots = 0;
+    ra->cands = 0;
+    for(i = proc->instruction; i < end; i += instruction_size(cvm, i)) {
+        ra->slotof[i] = ra->slots;
+        ra->slotip[ra->slots] = i;
+        ra->slots++;
+
+        spec = range_specialization(cvm->inst[i]);
+        if(spec == NULL) {
+            continue;
+        }
+        if(range_array_operand(spec->dest) &&
+           ra->candof[cvm->inst[i + MOVE_DEST_INDEX]] < 0 &&
+           variable_is_plain_int(&(cvm->var[cvm->inst[i + MOVE_DEST_INDEX]]))) {
+            ra->candof[cvm->inst[i + MOVE_DEST_INDEX]] = ra->cands;
+            ra->cand[ra->cands] = cvm->inst[i + MOVE_DEST_INDEX];
+            ra->cands++;
+        }
+        if(range_array_operand(spec->src) &&
+           ra->candof[cvm->inst[i + MOVE_SRC_INDEX]] < 0 &&
+           variable_is_plain_int(&(cvm->var[cvm->inst[i + MOVE_SRC_INDEX]]))) {
+            ra->candof[cvm->inst[i + MOVE_SRC_INDEX]] = ra->cands;
+            ra->cand[ra->cands] = cvm->inst[i + MOVE_SRC_INDEX];
+            ra->cands++;
+        }
+    }
+
+    if(ra->cands == 0) {
+        ret = 0;
+        goto done;
+    }
+
+    ra->limit = malloc(sizeof(long long) * ((ra->slots * 3) + 1));
+    ra->range = malloc(sizeof(CrustyInterval) * ra->slots * ra->cands);
+    ra->cur = malloc(sizeof(CrustyInterval) * ra->cands);
+    if(ra->limit == NULL || ra->range == NULL || ra->cur == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for range analysis.\n");
+        goto done;
+    }
+
+    /* limits are any constant compared against and the ends of arrays */
+    ra->limits = 0;
+    range_add_limit(ra, 0);
+    for(slot = 0; slot < ra->slots; slot++) {
+        inst = &(cvm->inst[ra->slotip[slot]]);
+        ra->state[slot].visits = 0;
+        ra->queued[slot] = 0;
+
+        if(generic_instruction(inst[0]) == CRUSTY_INSTRUCTION_TYPE_CMP &&
+           (inst[MOVE_SRC_FLAGS] & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR) {
+            src = range_operand(ra,
+                                inst[MOVE_SRC_FLAGS],
+                                inst[MOVE_SRC_VAL],
+                                &isint);
+            if(src.lo == src.hi) {
+                range_add_limit(ra, src.lo - 1);
+                range_add_limit(ra, src.lo);
+                range_add_limit(ra, src.lo + 1);
+            }
+        } else if(is_loop(inst[0]) &&
+                  (inst[LOOP_BOUND_FLAGS] & MOVE_FLAG_TYPE_MASK) !=
+                  MOVE_FLAG_VAR) {
+            src = range_operand(ra,
+                                inst[LOOP_BOUND_FLAGS],
+                                inst[LOOP_BOUND_VAL],
+                                &isint);
+            if(src.lo == src.hi) {
+                range_add_limit(ra, src.lo - 1);
+                range_add_limit(ra, src.lo);
+                range_add_limit(ra, src.lo + 1);
+            }
+        }
+
+        spec = range_specialization(inst[0]);
+        if(spec != NULL && range_array_operand(spec->dest)) {
+            range_add_limit(ra, cvm->var[inst[MOVE_DEST_VAL]].length - 1);
+        }
+        if(spec != NULL && range_array_operand(spec->src)) {
+            range_add_limit(ra, cvm->var[inst[MOVE_SRC_VAL]].length - 1);
+        }
+    }
+
+    /* Globals could be anything on entry, but locals start out with their
+       initial values.  Locals left alone by the call because they're set
+       before being read never have their initial value looked at. */
+    for(c = 0; c < ra->cands; c++) {
+        var = &(cvm->var[ra->cand[c]]);
+        ra->cur[c] = range_make(INT_MIN, INT_MAX);
+        if(!variable_is_global(var) && proc->initializer != NULL) {
+            memcpy(&val,
+                   &(proc->initializer[proc->stackneeded - var->offset]),
+                   sizeof(int));
+            ra->cur[c] = range_make(val, val);
+        }
+    }
+    ra->curstate.visits = 0;
+    ra->curstate.resultvar = -1;
+    ra->works = 0;
+    range_flow(ra, 0);
+
+    while(ra->works > 0) {
+        ra->works--;
+        slot = ra->work[ra->works];
+        ra->queued[slot] = 0;
+        range_step(ra, slot);
+    }
+
+    for(slot = 0; slot < ra->slots; slot++) {
+        if(ra->state[slot].visits == 0) {
+            continue;
+        }
+        inst = &(cvm->inst[ra->slotip[slot]]);
+        spec = range_specialization(inst[0]);
+        if(spec == NULL) {
+            continue;
+        }
+
+        if(range_array_operand(spec->dest) &&
+           range_in_bounds(ra, slot, inst[MOVE_DEST_VAL], inst[MOVE_DEST_INDEX])) {
+            proven[ra->slotip[slot]] |= RANGE_PROVEN_DEST;
+        }
+        if(range_array_operand(spec->src) &&
+           range_in_bounds(ra, slot, inst[MOVE_SRC_VAL], inst[MOVE_SRC_INDEX])) {
+            proven[ra->slotip[slot]] |= RANGE_PROVEN_SRC;
+        }
+    }
+
+    ret = 0;
+done:
+    for(c = 0; c < ra->cands; c++) {
+        ra->candof[ra->cand[c]] = -1;
+    }
+    for(slot = 0; slot < ra->slots; slot++) {
+        ra->slotof[ra->slotip[slot]] = -1;
+    }
+    free(ra->cur);
+    ra->cur = NULL;
+    free(ra->range);
+    ra->range = NULL;
+    free(ra->limit);
+    ra->limit = NULL;
+    return(ret);
+}
+
+/* mark which array operands of instructions which have already been verified
+   are proven to always be in range */
+static int prove_indexes(CrustyVM *cvm, unsigned char *proven) {
+    CrustyRangeAnalysis ra;
+    unsigned int i, j, k, start, end;
+    unsigned int targets, loc;
+    int target;
+    int ret = -1;
+
+    memset(proven, 0, cvm->insts);
+
+    /* verification only keeps jumps near their procedure, anything jumping
+       in to another procedure would need its state carried over */
+    for(i = 0; i < cvm->procs; i++) {
+        start = cvm->proc[i].instruction;
+        if(i + 1 < cvm->procs) {
+            end = cvm->proc[i + 1].instruction;
+        } else {
+            end = cvm->insts;
+        }
+        for(j = start; j < end; j += instruction_size(cvm, j)) {
+            targets = jump_targets(&(cvm->inst[j]), &loc);
+            for(k = 0; k < targets; k++) {
+                target = cvm->inst[j + loc + k];
+                if(target < (int)start || target >= (int)end) {
+                    return(0);
+                }
+            }
+        }
+    }
+
+    memset(&ra, 0, sizeof(ra));
+    ra.cvm = cvm;
+    ra.cand = malloc(sizeof(int) * cvm->vars);
+    ra.candof = malloc(sizeof(int) * cvm->vars);
+    ra.slotip = malloc(sizeof(unsigned int) * cvm->insts);
+    ra.slotof = malloc(sizeof(int) * cvm->insts);
+    ra.state = malloc(sizeof(CrustyRangeState) * cvm->insts);
+    ra.work = malloc(sizeof(unsigned int) * cvm->insts);
+    ra.queued = malloc(cvm->insts);
+    if(ra.cand == NULL || ra.candof == NULL ||
+       ra.slotip == NULL || ra.slotof == NULL ||
+       ra.state == NULL || ra.work == NULL || ra.queued == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for range analysis.\n");
+        goto done;
+    }
+    for(i = 0; i < cvm->vars; i++) {
+        ra.candof[i] = -1;
+    }
+    for(i = 0; i < cvm->insts; i++) {
+        ra.slotof[i] = -1;
+    }
+
+    for(i = 0; i < cvm->procs; i++) {
+        if(range_procedure(&ra, i, proven) < 0) {
+            goto done;
+        }
+    }
+
+    ret = 0;
+done:
+    free(ra.queued);
+    free(ra.work);
+    free(ra.state);
+    free(ra.slotof);
+    free(ra.slotip);
+    free(ra.candof);
+    free(ra.cand);
+    return(ret);
+}
+
+/* replace array operands which are always in range with ones which aren't
+   checked */
+static int remove_bounds_checks(CrustyVM *cvm) {
+    unsigned char *proven;
+    const CrustySpecialization *spec;
+    CrustyOperandKind dest, src;
+    unsigned int j;
+    int *inst;
+
+    proven = malloc(cvm->insts);
+    if(proven == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for range analysis.\n");
+        return(-1);
+    }
+
+    if(prove_indexes(cvm, proven) < 0) {
+        free(proven);
+        return(-1);
+    }
+
+    for(j = 0; j < cvm->lines; j++) {
+        inst = &(cvm->inst[cvm->line[j].instruction]);
+        spec = range_specialization(inst[0]);
+        if(spec == NULL) {
+            continue;
+        }
+
+        dest = spec->dest;
+        src = spec->src;
+        if(dest == CRUSTY_OPERAND_ARRAY &&
+           (proven[cvm->line[j].instruction] & RANGE_PROVEN_DEST)) {
+            dest = CRUSTY_OPERAND_INDEXED;
+        }
+        if(src == CRUSTY_OPERAND_ARRAY &&
+           (proven[cvm->line[j].instruction] & RANGE_PROVEN_SRC)) {
+            src = CRUSTY_OPERAND_INDEXED;
+        }
+        if(dest != spec->dest || src != spec->src) {
+#ifdef CRUSTY_TEST
+            cvm->logline = j;
+            LOG_PRINTF_LINE(cvm, "Removed bounds check from %s.\n",
+                                 spec->name);
+#endif
+            inst[0] = CRUSTY_SPECIALIZE[spec->generic][dest][src];
+        }
+    }
+
+    free(proven);
+    return(0);
+}
+
+/* an image could claim any index is in range, so make sure the ones which
+   aren't checked really can be proven */
+static int check_indexes(CrustyVM *cvm) {
+    unsigned char *proven;
+    const CrustySpecialization *spec;
+    unsigned int i, j;
+    int ret = -1;
+
+    for(j = 0; j < cvm->lines; j++) {
+        spec = range_specialization(cvm->inst[cvm->line[j].instruction]);
+        if(spec != NULL &&
+           (spec->dest == CRUSTY_OPERAND_INDEXED ||
+            spec->src == CRUSTY_OPERAND_INDEXED)) {
+            break;
+        }
+    }
+    if(j == cvm->lines) {
+        return(0);
+    }
+
+    proven = malloc(cvm->insts);
+    if(proven == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for range analysis.\n");
+        return(-1);
+    }
+
+    if(prove_indexes(cvm, proven) < 0) {
+        goto done;
+    }
+
+    for(j = 0; j < cvm->lines; j++) {
+        i = cvm->line[j].instruction;
+        spec = range_specialization(cvm->inst[i]);
+        if(spec == NULL) {
+            continue;
+        }
+
+        if((spec->dest == CRUSTY_OPERAND_INDEXED &&
+            !(proven[i] & RANGE_PROVEN_DEST)) ||
+           (spec->src == CRUSTY_OPERAND_INDEXED &&
+            !(proven[i] & RANGE_PROVEN_SRC))) {
+            cvm->logline = j;
+            LOG_PRINTF_LINE(cvm, "Index of unchecked operand can't be proven "
+                                 "in range.\n");
+            goto done;
+        }
+    }
+
+    ret = 0;
+done:
+    free(proven);
+    return(ret);
+}
+
+/* Procedures are copied for each set of argument types they're called with, so
+   the copies can use typed instructions on their arguments.  Only arguments
+   which are passed ints or floats which aren't callbacks get a type, and only
+   the ones a procedure uses directly or passes on to another call are looked
+   at, so calls which only differ in what the procedure doesn't care about share
+   a copy. */
+#define MONO_MAX_COPIES (8)
+
+/* the first instruction past the end of a procedure */
+static unsigned int procedure_end(CrustyVM *cvm, unsigned int procnum) {
+    if(procnum + 1 < cvm->procs) {
+        return(cvm->proc[procnum + 1].instruction);
+    }
+
+    return(cvm->insts);
+}
+
+/* the type an operand passed as an argument is known to be, or
+   CRUSTY_TYPE_NONE */
+static unsigned char mono_class(CrustyVM *cvm,
+                                const unsigned char *sig,
+                                int flags,
+                                int val) {
+    CrustyVariable *var;
+
+    if((flags & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR) {
+        return(CRUSTY_TYPE_NONE);
+    }
+
+    var = &(cvm->var[val]);
+    if(variable_is_argument(var)) {
+        return(sig[var->offset - 1]);
+    }
+    if(variable_is_callback(var) ||
+       (var->type != CRUSTY_TYPE_INT && var->type != CRUSTY_TYPE_FLOAT)) {
+        return(CRUSTY_TYPE_NONE);
+    }
+
+    return(var->type);
+}
+
+/* find which arguments a procedure uses directly or passes on */
+static void mono_find_used(CrustyVM *cvm,
+                           unsigned int procnum,
+                           unsigned char *used) {
+    const CrustySpecialization *spec;
+    CrustyVariable *var;
+    unsigned int i, end;
+    unsigned int k;
+    int *arg;
+
+    end = procedure_end(cvm, procnum);
+    for(i = cvm->proc[procnum].instruction;
+        i < end;
+        i += instruction_size(cvm, i)) {
+        if(cvm->inst[i] == CRUSTY_INSTRUCTION_TYPE_CALL) {
+            for(k = 0; k < cvm->proc[cvm->inst[i + CALL_PROCEDURE]].args; k++) {
+                arg = &(cvm->inst[i + CALL_START_ARGS + (k * CALL_ARG_SIZE)]);
+                if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK) ==
+                   MOVE_FLAG_VAR) {
+                    var = &(cvm->var[arg[CALL_ARG_VAL]]);
+                    if(variable_is_argument(var)) {
+                        used[var->offset - 1] = 1;
+                    }
+                }
+            }
+            continue;
+        }
+
+        spec = range_specialization(cvm->inst[i]);
+        if(spec == NULL) {
+            continue;
+        }
+        if(spec->dest == CRUSTY_OPERAND_ARGUMENT) {
+            used[cvm->var[cvm->inst[i + MOVE_DEST_VAL]].offset - 1] = 1;
+        }
+        if(spec->src == CRUSTY_OPERAND_ARGUMENT) {
+            used[cvm->var[cvm->inst[i + MOVE_SRC_VAL]].offset - 1] = 1;
+        }
+    }
+}
+
+/* the copy of a procedure's variable, given the index of the first copy */
+static int mono_variable(CrustyProcedure *proc, int first, int var) {
+    unsigned int j;
+
+    for(j = 0; j < proc->vars; j++) {
+        if(proc->varIndex[j] == var) {
+            return(first + j);
+        }
+    }
+
+    return(var);
+}
+
+static void mono_operand(CrustyProcedure *proc,
+                         int first,
+                         int *flags,
+                         int *val,
+                         int *index) {
+    if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR ||
+       (*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+        *val = mono_variable(proc, first, *val);
+    }
+    if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
+        *index = mono_variable(proc, first, *index);
+    }
+}
+
+/* the type index an operand has in a copy, or -1 if it can't be typed */
+static int mono_type(CrustyVM *cvm,
+                     const unsigned char *sig,
+                     CrustyOperandKind kind,
+                     int val) {
+    if(kind != CRUSTY_OPERAND_ARGUMENT) {
+        return(typed_type(cvm, kind, val));
+    }
+
+    switch(sig[cvm->var[val].offset - 1]) {
+        case CRUSTY_TYPE_INT:
+            return(CRUSTY_TYPED_I);
+        case CRUSTY_TYPE_FLOAT:
+            return(CRUSTY_TYPED_F);
+        default:
+            break;
+    }
+
+    return(-1);
+}
+
+/* Add a copy of a procedure to the end of the program with its own variables,
+   lines and instructions, with argument operands given the types in sig.
+   Returns the new procedure. */
+static int mono_copy(CrustyVM *cvm,
+                     unsigned int procnum,
+                     const unsigned char *sig) {
+    const CrustySpecialization *spec;
+    CrustyProcedure *proc;
+    CrustyProcedure newproc;
+    void *temp;
+    unsigned int start, end, size, lines;
+    unsigned int i, j, k;
+    int first, delta;
+    int dt, st;
+    int *inst;
+
+    proc = &(cvm->proc[procnum]);
+    start = proc->instruction;
+    end = procedure_end(cvm, procnum);
+    size = end - start;
+    if(procnum + 1 < cvm->procs) {
+        lines = cvm->proc[procnum + 1].start - proc->start;
+    } else {
+        lines = cvm->lines - proc->start;
+    }
+    first = cvm->vars;
+    delta = cvm->insts - start;
+
+    newproc = *proc;
+    newproc.start = cvm->lines;
+    newproc.length = lines;
+    newproc.instruction = cvm->insts;
+    newproc.varIndex = NULL;
+    newproc.var = NULL;
+    newproc.initializer = NULL;
+    newproc.copy = NULL;
+    newproc.copies = 0;
+    newproc.zero = NULL;
+    newproc.zeros = 0;
+    newproc.label = NULL;
+    newproc.labels = 0;
+
+    if(proc->vars > 0) {
+        newproc.varIndex = malloc(sizeof(int) * proc->vars);
+        newproc.var = malloc(sizeof(CrustyVariable *) * proc->vars);
+        if(newproc.varIndex == NULL || newproc.var == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for procedure "
+                            "variable list.\n");
+            goto error;
+        }
+    }
+    if(proc->stackneeded > 0) {
+        newproc.initializer = malloc(proc->stackneeded);
+        if(newproc.initializer == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for initializer.\n");
+            goto error;
+        }
+        memcpy(newproc.initializer, proc->initializer, proc->stackneeded);
+    }
+
+    temp = realloc(cvm->proc, sizeof(CrustyProcedure) * (cvm->procs + 1));
+    if(temp == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for procedure.\n");
+        goto error;
+    }
+    cvm->proc = temp;
+    proc = &(cvm->proc[procnum]);
+
+    temp = realloc(cvm->var, sizeof(CrustyVariable) * (cvm->vars + proc->vars));
+    if(temp == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for variables.\n");
+        goto error;
+    }
+    cvm->var = temp;
+
+    temp = realloc(cvm->line, sizeof(CrustyLine) * (cvm->lines + lines));
+    if(temp == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for lines.\n");
+        goto error;
+    }
+    cvm->line = temp;
+
+    temp = realloc(cvm->inst, sizeof(int) * (cvm->insts + size));
+    if(temp == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for instructions.\n");
+        goto error;
+    }
+    cvm->inst = temp;
+
+    /* everything which can fail is done, except the token offsets of each line,
+       which are counted as they're copied */
+    for(j = 0; j < proc->vars; j++) {
+        cvm->var[first + j] = cvm->var[proc->varIndex[j]];
+        cvm->var[first + j].procIndex = cvm->procs;
+        newproc.varIndex[j] = first + j;
+    }
+    cvm->vars += proc->vars;
+
+    memcpy(&(cvm->inst[cvm->insts]), &(cvm->inst[start]), sizeof(int) * size);
+    cvm->insts += size;
+
+    cvm->proc[cvm->procs] = newproc;
+    cvm->procs++;
+    cvm->stacksize += newproc.stackneeded;
+
+    for(j = 0; j < lines; j++) {
+        cvm->line[cvm->lines] = cvm->line[proc->start + j];
+        cvm->line[cvm->lines].instruction += delta;
+        if(cvm->line[cvm->lines].offset != NULL) {
+            cvm->line[cvm->lines].offset =
+                malloc(sizeof(unsigned long) *
+                       cvm->line[cvm->lines].tokencount);
+            if(cvm->line[cvm->lines].offset == NULL) {
+                LOG_PRINTF(cvm, "Failed to allocate memory for line.\n");
+                return(-1);
+            }
+            memcpy(cvm->line[cvm->lines].offset,
+                   cvm->line[proc->start + j].offset,
+                   sizeof(unsigned long) * cvm->line[cvm->lines].tokencount);
+        }
+        cvm->lines++;
+    }
+
+    /* point the copy at its own variables and lines, and give its argument
+       operands the types it's made for */
+    for(i = newproc.instruction; i < cvm->insts; i += instruction_size(cvm, i)) {
+        inst = &(cvm->inst[i]);
+        if(is_jump(inst[0])) {
+            inst[JUMP_LOCATION] += delta;
+            continue;
+        }
+
+        if(inst[0] == CRUSTY_INSTRUCTION_TYPE_SWITCH) {
+            for(k = 0; k <= (unsigned int)inst[SWITCH_COUNT]; k++) {
+                inst[SWITCH_DEFAULT + k] += delta;
+            }
+            mono_operand(proc, first,
+                         &(inst[SWITCH_VALUE_FLAGS]),
+                         &(inst[SWITCH_VALUE_VAL]),
+                         &(inst[SWITCH_VALUE_INDEX]));
+            continue;
+        }
+
+        if(is_loop(inst[0])) {
+            inst[LOOP_LOCATION] += delta;
+            mono_operand(proc, first,
+                         &(inst[LOOP_COUNTER_FLAGS]),
+                         &(inst[LOOP_COUNTER_VAL]),
+                         &(inst[LOOP_COUNTER_INDEX]));
+            mono_operand(proc, first,
+                         &(inst[LOOP_STEP_FLAGS]),
+                         &(inst[LOOP_STEP_VAL]),
+                         &(inst[LOOP_STEP_INDEX]));
+            mono_operand(proc, first,
+                         &(inst[LOOP_BOUND_FLAGS]),
+                         &(inst[LOOP_BOUND_VAL]),
+                         &(inst[LOOP_BOUND_INDEX]));
+            continue;
+        }
+
+        if(inst[0] == CRUSTY_INSTRUCTION_TYPE_CALL) {
+            for(k = 0; k < cvm->proc[inst[CALL_PROCEDURE]].args; k++) {
+                j = CALL_START_ARGS + (k * CALL_ARG_SIZE);
+                mono_operand(proc, first,
+                             &(inst[j + CALL_ARG_FLAGS]),
+                             &(inst[j + CALL_ARG_VAL]),
+                             &(inst[j + CALL_ARG_INDEX]));
+            }
+            continue;
+        }
+
+        if(inst[0] == CRUSTY_INSTRUCTION_TYPE_RET) {
+            continue;
+        }
+
+        if(is_bulk(inst[0])) {
+            mono_operand(proc, first,
+                         &(inst[BULK_COUNT_FLAGS]),
+                         &(inst[BULK_COUNT_VAL]),
+                         &(inst[BULK_COUNT_INDEX]));
+        } else if(pick_takes_other(inst[0])) {
+            mono_operand(proc, first,
+                         &(inst[PICK_OTHER_FLAGS]),
+                         &(inst[PICK_OTHER_VAL]),
+                         &(inst[PICK_OTHER_INDEX]));
+        }
+
+        mono_operand(proc, first,
+                     &(inst[MOVE_DEST_FLAGS]),
+                     &(inst[MOVE_DEST_VAL]),
+                     &(inst[MOVE_DEST_INDEX]));
+        mono_operand(proc, first,
+                     &(inst[MOVE_SRC_FLAGS]),
+                     &(inst[MOVE_SRC_VAL]),
+                     &(inst[MOVE_SRC_INDEX]));
+
+        spec = range_specialization(inst[0]);
+        if(spec == NULL ||
+           spec->desttype != CRUSTY_TYPE_NONE ||
+           (spec->dest != CRUSTY_OPERAND_ARGUMENT &&
+            spec->src != CRUSTY_OPERAND_ARGUMENT)) {
+            continue;
+        }
+
+        dt = mono_type(cvm, sig,
+                       spec->dest, inst[MOVE_DEST_VAL]);
+        st = mono_type(cvm, sig,
+                       spec->src, inst[MOVE_SRC_VAL]);
+        if(dt >= 0 && st >= 0 &&
+           CRUSTY_TYPED[spec->generic][spec->dest][spec->src][dt][st] != 0) {
+            inst[0] = CRUSTY_TYPED[spec->generic][spec->dest][spec->src][dt][st];
+        }
+    }
+
+    return(cvm->procs - 1);
+
+error:
+    if(newproc.varIndex != NULL) {
+        free(newproc.varIndex);
+    }
+    if(newproc.var != NULL) {
+        free(newproc.var);
+    }
+    if(newproc.initializer != NULL) {
+        free(newproc.initializer);
+    }
+    return(-1);
+}
+
+static int monomorphize(CrustyVM *cvm) {
+    unsigned int procs = cvm->procs;
+    int *origin = NULL;
+    unsigned char **sig = NULL;
+    unsigned char **used = NULL;
+    unsigned int *copies = NULL;
+    unsigned char *want = NULL;
+    unsigned int maxargs;
+    unsigned int i, j, k;
+    int callee, target;
+    int typed;
+    int *arg;
+    int ret = -1;
+
+    maxargs = 0;
+    for(i = 0; i < procs; i++) {
+        if(cvm->proc[i].args > maxargs) {
+            maxargs = cvm->proc[i].args;
+        }
+    }
+    if(maxargs == 0) {
+        return(0);
+    }
+
+    origin = malloc(sizeof(int) * procs * (MONO_MAX_COPIES + 1));
+    sig = calloc(procs * (MONO_MAX_COPIES + 1), sizeof(unsigned char *));
+    used = calloc(procs, sizeof(unsigned char *));
+    copies = calloc(procs, sizeof(unsigned int));
+    want = malloc(maxargs);
+    if(origin == NULL || sig == NULL || used == NULL ||
+       copies == NULL || want == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for procedure copies.\n");
+        goto done;
+    }
+
+    for(i = 0; i < procs; i++) {
+        origin[i] = i;
+        /* originals have no argument types */
+        sig[i] = calloc(cvm->proc[i].args + 1, 1);
+        used[i] = calloc(cvm->proc[i].args + 1, 1);
+        if(sig[i] == NULL || used[i] == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for procedure "
+                            "copies.\n");
+            goto done;
+        }
+        mono_find_used(cvm, i, used[i]);
+    }
+
+    /* copies are added to the end, so they get their calls pointed at the
+       right copies too */
+    for(i = 0; i < cvm->procs; i++) {
+        for(j = cvm->proc[i].instruction;
+            j < procedure_end(cvm, i);
+            j += instruction_size(cvm, j)) {
+            if(cvm->inst[j] != CRUSTY_INSTRUCTION_TYPE_CALL) {
+                continue;
+            }
+
+            callee = origin[cvm->inst[j + CALL_PROCEDURE]];
+            typed = 0;
+            for(k = 0; k < cvm->proc[callee].args; k++) {
+                arg = &(cvm->inst[j + CALL_START_ARGS + (k * CALL_ARG_SIZE)]);
+                want[k] = CRUSTY_TYPE_NONE;
+                if(used[callee][k]) {
+                    want[k] = mono_class(cvm, sig[i],
+                                         arg[CALL_ARG_FLAGS],
+                                         arg[CALL_ARG_VAL]);
+                }
+                if(want[k] != CRUSTY_TYPE_NONE) {
+                    typed = 1;
+                }
+            }
+
+            target = callee;
+            if(typed) {
+                for(k = procs; k < cvm->procs; k++) {
+                    if(origin[k] == callee &&
+                       memcmp(sig[k], want, cvm->proc[callee].args) == 0) {
+                        target = k;
+                        break;
+                    }
+                }
+
+                if(k == cvm->procs && copies[callee] < MONO_MAX_COPIES) {
+                    sig[k] = malloc(cvm->proc[callee].args);
+                    if(sig[k] == NULL) {
+                        LOG_PRINTF(cvm, "Failed to allocate memory for "
+                                        "procedure copies.\n");
+                        goto done;
+                    }
+                    memcpy(sig[k], want, cvm->proc[callee].args);
+
+                    target = mono_copy(cvm, callee, sig[k]);
+                    if(target < 0) {
+                        goto done;
+                    }
+                    origin[target] = callee;
+                    copies[callee]++;
+#ifdef CRUSTY_TEST
+                    LOG_PRINTF(cvm, "Copied procedure %s.\n",
+                                    cvm->proc[callee].name);
+#endif
+                }
+            }
+
+            cvm->inst[j + CALL_PROCEDURE] = target;
+        }
+    }
+
+    /* the variables and procedures have probably moved */
+    for(i = 0; i < cvm->procs; i++) {
+        for(j = 0; j < cvm->proc[i].vars; j++) {
+            cvm->proc[i].var[j] = &(cvm->var[cvm->proc[i].varIndex[j]]);
+            cvm->proc[i].var[j]->proc = &(cvm->proc[i]);
+        }
+    }
+
+    ret = 0;
+done:
+    if(sig != NULL) {
+        for(i = 0; i < procs * (MONO_MAX_COPIES + 1); i++) {
+            if(sig[i] != NULL) {
+                free(sig[i]);
+            }
+        }
+        free(sig);
+    }
+    if(used != NULL) {
+        for(i = 0; i < procs; i++) {
+            if(used[i] != NULL) {
+                free(used[i]);
+            }
+        }
+        free(used);
+    }
+    free(want);
+    free(copies);
+    free(origin);
+    return(ret);
+}
+
+/* how many jumps to follow looking for the return after a call, so a loop of
+   jumps can't be followed forever */
+#define TAIL_CALL_MAX_JUMPS (8)
+
+/* whether the instruction at i leads straight to a return, maybe through some
+   jumps, without doing anything else */
+static int returns_after(CrustyVM *cvm, unsigned int i, unsigned int end) {
+    unsigned int hops;
+
+    for(hops = 0; hops < TAIL_CALL_MAX_JUMPS; hops++) {
+        if(i >= end) {
+            return(0);
+        }
+
+        if(cvm->inst[i] == CRUSTY_INSTRUCTION_TYPE_RET) {
+            return(1);
+        }
+        if(cvm->inst[i] != CRUSTY_INSTRUCTION_TYPE_JUMP) {
+            return(0);
+        }
+
+        i = cvm->inst[i + JUMP_LOCATION];
+    }
+
+    return(0);
+}
+
+/* Turn calls which are followed only by a return in to tail calls, which
+   reuse the frame of the procedure they're made from instead of stacking a new
+   one on top of it.  Calls passing anything from their own frame have to be
+   left alone. */
+static void find_tail_calls(CrustyVM *cvm) {
+    unsigned int i, j, k, end;
+    CrustyVariable *var;
+    int *arg;
+
+    for(i = 0; i < cvm->procs; i++) {
+        end = procedure_end(cvm, i);
+        for(j = cvm->proc[i].instruction; j < end; j += instruction_size(cvm, j)) {
+            if(cvm->inst[j] != CRUSTY_INSTRUCTION_TYPE_CALL ||
+               !returns_after(cvm, j + instruction_size(cvm, j), end)) {
+                continue;
+            }
+
+            for(k = 0; k < cvm->proc[cvm->inst[j + CALL_PROCEDURE]].args; k++) {
+                arg = &(cvm->inst[j + CALL_START_ARGS + (k * CALL_ARG_SIZE)]);
+                if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR) {
+                    continue;
+                }
+
+                var = &(cvm->var[arg[CALL_ARG_VAL]]);
+                if(!variable_is_global(var) && !variable_is_argument(var)) {
+                    break;
                 }
-            } else {
-                lenj = sizeof(CrustyStackArg);
-                offj = cvm->proc[i].var[j]->offset * sizeof(CrustyStackArg);
-                offj -= lenj;
             }
-            if(offj > cvm->proc[i].stackneeded) {
-                LOG_PRINTF(cvm, "Variable %s from procedure %s exceeds "
-                                "needed stack: %u > %u\n",
-                                cvm->proc[i].var[j]->name,
-                                cvm->proc[i].name,
-                                offj,
-                                cvm->proc[i].stackneeded);
-                ret = -1;
+
+            if(k == cvm->proc[cvm->inst[j + CALL_PROCEDURE]].args) {
+                cvm->inst[j] = CRUSTY_INSTRUCTION_TYPE_TAILCALL;
             }
-            for(k = j + 1; k < cvm->proc[i].vars; k++) {
-                if(!variable_is_argument(cvm->proc[i].var[k])) {
-                    if(cvm->proc[i].var[k]->type == CRUSTY_TYPE_INT) {
-                        leni = cvm->proc[i].var[k]->length * sizeof(int);
-                        offi = cvm->proc[i].var[k]->offset;
-                        offi -= leni; /* stack is indexed from top */
-                    } else if(cvm->proc[i].var[k]->type == CRUSTY_TYPE_FLOAT) {
-                        leni = cvm->proc[i].var[k]->length * sizeof(double);
-                        offi = cvm->proc[i].var[k]->offset;
-                        offi -= leni; /* stack is indexed from top */
-                    } else { /* CHAR */
-                        leni = cvm->proc[i].var[k]->length;
-                        offi = cvm->proc[i].var[k]->offset;
-                        offi -= leni;
+        }
+    }
+}
+
+static int need_argument_type(CrustyVM *cvm,
+                              unsigned char *need,
+                              const unsigned int *first,
+                              unsigned int procnum,
+                              int val,
+                              unsigned char type) {
+    CrustyVariable *var = &(cvm->var[val]);
+    unsigned char *arg;
+
+    if(var->procIndex != (int)procnum) {
+        LOG_PRINTF_LINE(cvm, "Typed argument %s isn't from this "
+                             "procedure.\n", var->name);
+        return(-1);
+    }
+
+    arg = &(need[first[procnum] + var->offset - 1]);
+    if(*arg == CRUSTY_TYPE_NONE) {
+        *arg = type;
+        return(1);
+    }
+    if(*arg != type) {
+        LOG_PRINTF_LINE(cvm, "Argument %s used as more than one type.\n",
+                             var->name);
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* Typed instructions on arguments don't check what they're given, so make sure
+   every call passes them the type they expect, including arguments which are
+   passed straight through to procedures which expect a type. */
+static int check_argument_types(CrustyVM *cvm) {
+    const CrustySpecialization *spec;
+    unsigned int *first = NULL;
+    unsigned char *need = NULL;
+    CrustyProcedure *callee;
+    CrustyVariable *var;
+    unsigned int i, j, k, end;
+    unsigned int args;
+    unsigned char type;
+    int changed;
+    int *inst;
+    int *arg;
+    int ret = -1;
+
+    first = malloc(sizeof(unsigned int) * cvm->procs);
+    if(first == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for argument types.\n");
+        goto done;
+    }
+    args = 0;
+    for(i = 0; i < cvm->procs; i++) {
+        first[i] = args;
+        args += cvm->proc[i].args;
+    }
+    need = calloc(args + 1, 1);
+    if(need == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for argument types.\n");
+        goto done;
+    }
+
+    for(i = 0; i < cvm->procs; i++) {
+        end = (i + 1 < cvm->procs) ? cvm->proc[i + 1].start : cvm->lines;
+        for(j = cvm->proc[i].start; j < end; j++) {
+            cvm->logline = j;
+            spec = typed_instruction(cvm->inst[cvm->line[j].instruction]);
+            if(spec == NULL) {
+                continue;
+            }
+
+            if(spec->dest == CRUSTY_OPERAND_ARGUMENT &&
+               need_argument_type(cvm, need, first, i,
+                                  cvm->inst[cvm->line[j].instruction +
+                                            MOVE_DEST_VAL],
+                                  spec->desttype) < 0) {
+                goto done;
+            }
+            if(spec->src == CRUSTY_OPERAND_ARGUMENT &&
+               need_argument_type(cvm, need, first, i,
+                                  cvm->inst[cvm->line[j].instruction +
+                                            MOVE_SRC_VAL],
+                                  spec->srctype) < 0) {
+                goto done;
+            }
+        }
+    }
+
+    do {
+        changed = 0;
+        for(i = 0; i < cvm->procs; i++) {
+            end = (i + 1 < cvm->procs) ? cvm->proc[i + 1].start : cvm->lines;
+            for(j = cvm->proc[i].start; j < end; j++) {
+                cvm->logline = j;
+                inst = &(cvm->inst[cvm->line[j].instruction]);
+                if(inst[0] != CRUSTY_INSTRUCTION_TYPE_CALL &&
+                   inst[0] != CRUSTY_INSTRUCTION_TYPE_TAILCALL) {
+                    continue;
+                }
+
+                callee = &(cvm->proc[inst[CALL_PROCEDURE]]);
+                for(k = 0; k < callee->args; k++) {
+                    type = need[first[inst[CALL_PROCEDURE]] + k];
+                    if(type == CRUSTY_TYPE_NONE) {
+                        continue;
                     }
-                } else {
-                    leni = sizeof(CrustyStackArg);
-                    offi = cvm->proc[i].var[k]->offset * sizeof(CrustyStackArg);
-                    offi -= leni;
+
+                    arg = &(inst[CALL_START_ARGS + (k * CALL_ARG_SIZE)]);
+                    if((arg[CALL_ARG_FLAGS] & MOVE_FLAG_TYPE_MASK) !=
+                       MOVE_FLAG_VAR) {
+                        var = NULL;
+                    } else {
+                        var = &(cvm->var[arg[CALL_ARG_VAL]]);
+                    }
+
+                    if(var != NULL && variable_is_argument(var)) {
+                        switch(need_argument_type(cvm, need, first, i,
+                                                  arg[CALL_ARG_VAL], type)) {
+                            case -1:
+                                goto done;
+                            case 1:
+                                changed = 1;
+                                break;
+                            default:
+                                break;
+                        }
+                    } else if(var == NULL ||
+                              variable_is_callback(var) ||
+                              var->type != type) {
+                        LOG_PRINTF_LINE(cvm, "Argument %u to %s isn't the "
+                                             "type it's used as.\n",
+                                             k + 1, callee->name);
+                        goto done;
+                    }
+                }
+            }
+        }
+    } while(changed);
+
+    ret = 0;
+done:
+    free(need);
+    free(first);
+    return(ret);
+}
+
+static int codeverify(CrustyVM *cvm) {
+    CrustyProcedure *curproc = NULL;
+    int procnum = 0;
+    int instsize;
+    unsigned int i = 0;
+    cvm->logline = 0;
+
+    while(i < cvm->insts) {
+        if(curproc == NULL) {
+            if(cvm->logline == cvm->proc[procnum].start) {
+                curproc = &(cvm->proc[procnum]);
+                procnum++;
+#ifdef CRUSTY_TEST
+                LOG_PRINTF(cvm, "proc %s\n", curproc->name);
+#endif
+            } else {
+                LOG_PRINTF_LINE(cvm, "BUG: code line not in a procedure.\n");
+                check_instruction(cvm, NULL, i);
+                return(-1);
+            }
+        }
+
+        instsize = check_instruction(cvm, &curproc, i);
+        if(instsize < 0) {
+            return(-1);
+        }
+
+        i += instsize;
+        cvm->logline++;
+    }
+
+    if(curproc != NULL) {
+        LOG_PRINTF_LINE(cvm, "Procedure without ret?\n");
+        return(-1);
+    }
+
+    if(check_argument_types(cvm) < 0) {
+        return(-1);
+    }
+
+    return(check_indexes(cvm));
+}
+
+#ifdef CRUSTY_NATIVE
+/* the typed instruction a line starts with, including the first half of a fused
+   instruction, or NULL.  Arguments are left to the interpreter. */
+static const CrustySpecialization *native_typed_instruction(int type) {
+    const CrustySpecialization *spec;
+
+    if(type >= (int)CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED &&
+       type < CRUSTY_INSTRUCTION_TYPE_INVALID) {
+        type = CRUSTY_FUSIONS[type - CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED].first;
+    }
+
+    spec = typed_instruction(type);
+    if(spec != NULL &&
+       (spec->dest == CRUSTY_OPERAND_ARGUMENT ||
+        spec->src == CRUSTY_OPERAND_ARGUMENT)) {
+        return(NULL);
+    }
+
+    return(spec);
+}
+
+/* jumps can be translated too, except a jump to self, which ends the program
+   and is left to the interpreter */
+static int native_jump_instruction(CrustyVM *cvm, unsigned int ip) {
+    return(is_jump(cvm->inst[ip]) &&
+           (cvm->inst[ip] != CRUSTY_INSTRUCTION_TYPE_JUMP ||
+            (unsigned int)(cvm->inst[ip + JUMP_LOCATION]) != ip));
+}
+
+#define NATIVE_TRANSLATED (1 << 0)
+#define NATIVE_ENTRY      (1 << 1)
+#define NATIVE_TARGET     (1 << 2)
+
+/* Find runs of typed instructions and jumps worth translating to native code.
+   Anything which can fail or needs callbacks is left to the interpreter, so
+   native code can never change the status.  Each instruction gets whether it's
+   translated, whether it's a jump target and whether the interpreter can enter
+   native code there, which is at the start of each run and anywhere a jump can
+   land in one.  Returns NULL on failure. */
+static unsigned char *native_mark(CrustyVM *cvm) {
+    unsigned char *mark;
+    unsigned int i, j, k;
+    unsigned int ip, typed;
+    unsigned int targets, loc;
+
+    mark = calloc(cvm->insts, 1);
+    if(mark == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for native code marks.\n");
+        return(NULL);
+    }
+
+    for(j = 0; j < cvm->lines; j++) {
+        ip = cvm->line[j].instruction;
+        targets = jump_targets(&(cvm->inst[ip]), &loc);
+        for(k = 0; k < targets; k++) {
+            mark[cvm->inst[ip + loc + k]] |= NATIVE_TARGET;
+        }
+    }
+
+    /* a ret ends every procedure, so runs never cross in to another */
+    for(j = 0; j < cvm->lines; j = k + 1) {
+        typed = 0;
+        for(k = j; k < cvm->lines; k++) {
+            ip = cvm->line[k].instruction;
+            if(native_typed_instruction(cvm->inst[ip]) != NULL ||
+               typed_loop(cvm->inst[ip]) != NULL) {
+                typed++;
+            } else if(!native_jump_instruction(cvm, ip)) {
+                break;
+            }
+        }
+
+        /* not worth calling in to */
+        if(typed == 0 || k - j < 2) {
+            continue;
+        }
+
+        for(i = j; i < k; i++) {
+            ip = cvm->line[i].instruction;
+            mark[ip] |= NATIVE_TRANSLATED;
+            if(i == j || (mark[ip] & NATIVE_TARGET)) {
+                mark[ip] |= NATIVE_ENTRY;
+            }
+        }
+    }
+
+    return(mark);
+}
+#endif
+
+#ifdef CRUSTY_JIT
+/* Native code keeps a pointer to the stack in RDI, the stack at the stack
+   pointer in R8 and the result registers in R9.  EAX, ECX, EDX, XMM0 and XMM1
+   are scratch. */
+#define NATIVE_EAX  (0)
+#define NATIVE_ECX  (1)
+#define NATIVE_RDI  (7)
+#define NATIVE_R8   (8)
+#define NATIVE_R9   (9)
+#define NATIVE_XMM0 (0)
+#define NATIVE_XMM1 (1)
+#define NATIVE_IMMEDIATE (-1)
+
+/* second bytes of the long forms of the conditional jumps */
+#define NATIVE_JE (0x84)
+#define NATIVE_JNE (0x85)
+#define NATIVE_JA (0x87)
+#define NATIVE_JP (0x8A)
+#define NATIVE_JL (0x8C)
+#define NATIVE_JG (0x8F)
+
+#define NATIVE_INTRESULT ((int)offsetof(CrustyNativeRegs, intresult))
+#define NATIVE_FLOATRESULT ((int)offsetof(CrustyNativeRegs, floatresult))
+#define NATIVE_RESULTTYPE ((int)offsetof(CrustyNativeRegs, resulttype))
+
+/* set up the registers from the arguments as passed in to CrustyNativeFunc */
+static const unsigned char NATIVE_PROLOGUE[] = {
+    0x49, 0x89, 0xD1, /* mov r9, rdx */
+    0x89, 0xF6, /* mov esi, esi */
+    0x4C, 0x8D, 0x04, 0x37 /* lea r8, [rdi + rsi] */
+};
+
+/* result type isn't known at the start of a run or where a jump lands */
+#define NATIVE_UNKNOWN (-1)
+
+typedef struct {
+    unsigned int pos;
+    unsigned int target;
+} CrustyFixup;
+
+typedef struct {
+    unsigned char *buf;
+    unsigned int len;
+    unsigned int size;
+
+    /* jumps to be pointed at an instruction once everything is emitted */
+    CrustyFixup *fixup;
+    unsigned int fixups;
+    unsigned int fixupsize;
+
+    int failed;
+} CrustyEmitter;
+
+typedef struct {
+    int base; /* NATIVE_IMMEDIATE if disp is an immediate value */
+    int disp;
+} CrustyNativeOperand;
+
+static void emit_byte(CrustyEmitter *e, unsigned char b) {
+    unsigned char *temp;
+
+    if(e->failed) {
+        return;
+    }
+
+    if(e->len == e->size) {
+        temp = realloc(e->buf, e->size == 0 ? 4096 : e->size * 2);
+        if(temp == NULL) {
+            e->failed = 1;
+            return;
+        }
+        e->buf = temp;
+        e->size = e->size == 0 ? 4096 : e->size * 2;
+    }
+
+    e->buf[e->len] = b;
+    e->len++;
+}
+
+static void emit_int(CrustyEmitter *e, int val) {
+    unsigned int i;
+
+    for(i = 0; i < 4; i++) {
+        emit_byte(e, ((unsigned int)val >> (i * 8)) & 0xFF);
+    }
+}
+
+static void patch_int(CrustyEmitter *e, unsigned int pos, int val) {
+    unsigned int i;
+
+    if(e->failed) {
+        return;
+    }
+
+    for(i = 0; i < 4; i++) {
+        e->buf[pos + i] = ((unsigned int)val >> (i * 8)) & 0xFF;
+    }
+}
+
+/* emit an instruction with an optional prefix and 0F escape, taking REG and a
+   [BASE + DISP] memory operand */
+static void emit_mem(CrustyEmitter *e,
+                     unsigned char prefix,
+                     int escape,
+                     unsigned char opcode,
+                     int reg,
+                     int base,
+                     int disp) {
+    if(prefix != 0) {
+        emit_byte(e, prefix);
+    }
+    if(reg >= 8 || base >= 8) {
+        emit_byte(e, 0x40 | ((reg >> 3) << 2) | (base >> 3));
+    }
+    if(escape) {
+        emit_byte(e, 0x0F);
+    }
+    emit_byte(e, opcode);
+    emit_byte(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    emit_int(e, disp);
+}
+
+/* same but with two of the low 8 registers */
+static void emit_reg(CrustyEmitter *e,
+                     unsigned char prefix,
+                     int escape,
+                     unsigned char opcode,
+                     int reg,
+                     int rm) {
+    if(prefix != 0) {
+        emit_byte(e, prefix);
+    }
+    if(escape) {
+        emit_byte(e, 0x0F);
+    }
+    emit_byte(e, opcode);
+    emit_byte(e, 0xC0 | (reg << 3) | rm);
+}
+
+/* jump (or conditional jump if COND isn't 0) to an instruction, which is
+   filled in later */
+static void emit_jump(CrustyEmitter *e, unsigned char cond, unsigned int target) {
+    CrustyFixup *temp;
+
+    if(cond == 0) {
+        emit_byte(e, 0xE9);
+    } else {
+        emit_byte(e, 0x0F);
+        emit_byte(e, cond);
+    }
+
+    if(e->failed) {
+        return;
+    }
+
+    if(e->fixups == e->fixupsize) {
+        temp = realloc(e->fixup, sizeof(CrustyFixup) *
+                                 (e->fixupsize == 0 ? 64 : e->fixupsize * 2));
+        if(temp == NULL) {
+            e->failed = 1;
+            return;
+        }
+        e->fixup = temp;
+        e->fixupsize = e->fixupsize == 0 ? 64 : e->fixupsize * 2;
+    }
+
+    e->fixup[e->fixups].pos = e->len;
+    e->fixup[e->fixups].target = target;
+    e->fixups++;
+
+    emit_int(e, 0);
+}
+
+/* return to the interpreter to continue from IP */
+static void emit_exit(CrustyEmitter *e, unsigned int ip) {
+    emit_byte(e, 0xB8 + NATIVE_EAX); /* mov eax, ip */
+    emit_int(e, ip);
+    emit_byte(e, 0xC3); /* ret */
+}
+
+static void native_operand(CrustyNativeOperand *op,
+                           CrustyOperandKind kind,
+                           int val,
+                           int index) {
+    switch(kind) {
+        case CRUSTY_OPERAND_GLOBAL:
+            op->base = NATIVE_RDI;
+            op->disp = index;
+            break;
+        case CRUSTY_OPERAND_LOCAL:
+            op->base = NATIVE_R8;
+            op->disp = -index;
+            break;
+        default:
+            op->base = NATIVE_IMMEDIATE;
+            op->disp = val;
+    }
+}
+
+static void native_load_int(CrustyEmitter *e,
+                            int reg,
+                            const CrustyNativeOperand *op) {
+    if(op->base == NATIVE_IMMEDIATE) {
+        emit_byte(e, 0xB8 + reg); /* mov reg, imm32 */
+        emit_int(e, op->disp);
+    } else {
+        emit_mem(e, 0, 0, 0x8B, reg, op->base, op->disp); /* mov reg, m32 */
+    }
+}
+
+static void native_store_int(CrustyEmitter *e,
+                             int reg,
+                             const CrustyNativeOperand *op) {
+    emit_mem(e, 0, 0, 0x89, reg, op->base, op->disp); /* mov m32, reg */
+}
+
+static void native_load_float(CrustyEmitter *e,
+                              int xmm,
+                              const CrustyNativeOperand *op) {
+    emit_mem(e, 0xF2, 1, 0x10, xmm, op->base, op->disp); /* movsd xmm, m64 */
+}
+
+static void native_store_float(CrustyEmitter *e,
+                               int xmm,
+                               const CrustyNativeOperand *op) {
+    emit_mem(e, 0xF2, 1, 0x11, xmm, op->base, op->disp); /* movsd m64, xmm */
+}
+
+static void native_int_to_float(CrustyEmitter *e,
+                                int xmm,
+                                const CrustyNativeOperand *op) {
+    if(op->base == NATIVE_IMMEDIATE) {
+        native_load_int(e, NATIVE_ECX, op);
+        emit_reg(e, 0xF2, 1, 0x2A, xmm, NATIVE_ECX); /* cvtsi2sd xmm, ecx */
+    } else {
+        /* cvtsi2sd xmm, m32 */
+        emit_mem(e, 0xF2, 1, 0x2A, xmm, op->base, op->disp);
+    }
+}
+
+static void native_result_int(CrustyEmitter *e) {
+    emit_mem(e, 0, 0, 0x89, NATIVE_EAX, NATIVE_R9, NATIVE_INTRESULT);
+}
+
+static void native_result_float(CrustyEmitter *e) {
+    emit_mem(e, 0xF2, 1, 0x11, NATIVE_XMM0, NATIVE_R9, NATIVE_FLOATRESULT);
+}
+
+static void native_result_type(CrustyEmitter *e, CrustyType type) {
+    emit_mem(e, 0, 0, 0xC7, 0, NATIVE_R9, NATIVE_RESULTTYPE); /* mov m32, imm32 */
+    emit_int(e, type);
+}
+
+/* EAX = EAX OP src */
+static void native_int_op(CrustyEmitter *e,
+                          int type,
+                          const CrustyNativeOperand *src) {
+    /* opcodes for op eax, m32 and op eax, imm32 */
+    unsigned char memop, immop;
+
+    switch(type) {
+        case CRUSTY_INSTRUCTION_TYPE_ADD:
+            memop = 0x03; immop = 0x05;
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_SUB:
+        case CRUSTY_INSTRUCTION_TYPE_CMP:
+            memop = 0x2B; immop = 0x2D;
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_AND:
+            memop = 0x23; immop = 0x25;
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_OR:
+            memop = 0x0B; immop = 0x0D;
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_XOR:
+            memop = 0x33; immop = 0x35;
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_MUL:
+            if(src->base == NATIVE_IMMEDIATE) {
+                emit_reg(e, 0, 0, 0x69, NATIVE_EAX, NATIVE_EAX); /* imul */
+                emit_int(e, src->disp);
+            } else {
+                emit_mem(e, 0, 1, 0xAF, NATIVE_EAX, src->base, src->disp);
+            }
+            return;
+        case CRUSTY_INSTRUCTION_TYPE_DIV:
+            native_load_int(e, NATIVE_ECX, src);
+            emit_byte(e, 0x99); /* cdq */
+            emit_reg(e, 0, 0, 0xF7, 7, NATIVE_ECX); /* idiv ecx */
+            return;
+        case CRUSTY_INSTRUCTION_TYPE_SHR:
+            native_load_int(e, NATIVE_ECX, src);
+            emit_reg(e, 0, 0, 0xD3, 7, NATIVE_EAX); /* sar eax, cl */
+            return;
+        default: /* SHL */
+            native_load_int(e, NATIVE_ECX, src);
+            emit_reg(e, 0, 0, 0xD3, 4, NATIVE_EAX); /* shl eax, cl */
+            return;
+    }
+
+    if(src->base == NATIVE_IMMEDIATE) {
+        emit_byte(e, immop);
+        emit_int(e, src->disp);
+    } else {
+        emit_mem(e, 0, 0, memop, NATIVE_EAX, src->base, src->disp);
+    }
+}
+
+/* opcode for op xmm, xmm/m64 */
+static unsigned char native_float_op(int type) {
+    switch(type) {
+        case CRUSTY_INSTRUCTION_TYPE_ADD:
+            return(0x58);
+        case CRUSTY_INSTRUCTION_TYPE_MUL:
+            return(0x59);
+        case CRUSTY_INSTRUCTION_TYPE_DIV:
+            return(0x5E);
+        default: /* SUB and CMP */
+            return(0x5C);
+    }
+}
+
+/* Emit a typed instruction, leaving the result registers and destination the
+   same as the interpreter would.  Returns the result type after, or KNOWN if it
+   doesn't change it. */
+static int native_typed(CrustyEmitter *e,
+                        const int *inst,
+                        const CrustySpecialization *spec,
+                        int known) {
+    CrustyNativeOperand dest, src;
+    unsigned char op;
+
+    native_operand(&dest, spec->dest,
+                   inst[MOVE_DEST_VAL], inst[MOVE_DEST_INDEX]);
+    native_operand(&src, spec->src,
+                   inst[MOVE_SRC_VAL], inst[MOVE_SRC_INDEX]);
+    op = native_float_op(spec->generic);
+
+    switch(spec->generic) {
+        case CRUSTY_INSTRUCTION_TYPE_MOVE:
+            if(spec->srctype == CRUSTY_TYPE_INT) {
+                native_load_int(e, NATIVE_EAX, &src);
+                native_result_int(e);
+                if(spec->desttype == CRUSTY_TYPE_INT) {
+                    native_store_int(e, NATIVE_EAX, &dest);
+                    return(known);
                 }
-                if((offi > offj &&
-                    offi < offj + lenj - 1) ||
-                   (offi + leni - 1 > offj &&
-                    offi + leni - 1 < offj + lenj - 1)) {
-                    LOG_PRINTF(cvm, "Variables %s and %s from procedure %s "
-                                    "overlap: (%u -> %u) (%u -> %u)\n",
-                               cvm->proc[i].var[j]->name,
-                               cvm->proc[i].var[k]->name,
-                               cvm->proc[i].name,
-                               offj, offj + lenj - 1,
-                               offi, offi + leni - 1);
-                    ret = -1;
+                /* cvtsi2sd xmm0, eax */
+                emit_reg(e, 0xF2, 1, 0x2A, NATIVE_XMM0, NATIVE_EAX);
+                native_result_float(e);
+                native_result_type(e, CRUSTY_TYPE_FLOAT);
+                native_store_float(e, NATIVE_XMM0, &dest);
+                return(CRUSTY_TYPE_FLOAT);
+            }
+
+            native_load_float(e, NATIVE_XMM0, &src);
+            native_result_float(e);
+            if(spec->desttype == CRUSTY_TYPE_FLOAT) {
+                native_store_float(e, NATIVE_XMM0, &dest);
+                return(known);
+            }
+            /* cvttsd2si eax, xmm0 */
+            emit_reg(e, 0xF2, 1, 0x2C, NATIVE_EAX, NATIVE_XMM0);
+            native_result_int(e);
+            native_result_type(e, CRUSTY_TYPE_INT);
+            native_store_int(e, NATIVE_EAX, &dest);
+            return(CRUSTY_TYPE_INT);
+        case CRUSTY_INSTRUCTION_TYPE_CMP:
+            if(spec->desttype == CRUSTY_TYPE_INT) {
+                native_load_int(e, NATIVE_EAX, &dest);
+                if(spec->srctype == CRUSTY_TYPE_INT) {
+                    native_int_op(e, spec->generic, &src);
+                    native_result_int(e);
+                    native_result_type(e, CRUSTY_TYPE_INT);
+                    return(CRUSTY_TYPE_INT);
+                }
+                native_result_int(e);
+                emit_reg(e, 0xF2, 1, 0x2A, NATIVE_XMM0, NATIVE_EAX);
+                emit_mem(e, 0xF2, 1, op, NATIVE_XMM0, src.base, src.disp);
+            } else {
+                native_load_float(e, NATIVE_XMM0, &dest);
+                if(spec->srctype == CRUSTY_TYPE_INT) {
+                    native_int_to_float(e, NATIVE_XMM1, &src);
+                    emit_reg(e, 0xF2, 1, op, NATIVE_XMM0, NATIVE_XMM1);
+                } else {
+                    emit_mem(e, 0xF2, 1, op, NATIVE_XMM0, src.base, src.disp);
                 }
             }
+            native_result_float(e);
+            native_result_type(e, CRUSTY_TYPE_FLOAT);
+            return(CRUSTY_TYPE_FLOAT);
+        default:
+            break;
+    }
+
+    /* math */
+    if(spec->desttype == CRUSTY_TYPE_INT) {
+        if(spec->srctype == CRUSTY_TYPE_INT) {
+            native_load_int(e, NATIVE_EAX, &dest);
+            native_int_op(e, spec->generic, &src);
+        } else {
+            native_int_to_float(e, NATIVE_XMM0, &dest);
+            emit_mem(e, 0xF2, 1, op, NATIVE_XMM0, src.base, src.disp);
+            emit_reg(e, 0xF2, 1, 0x2C, NATIVE_EAX, NATIVE_XMM0);
         }
+        native_result_int(e);
+        native_result_type(e, CRUSTY_TYPE_INT);
+        native_store_int(e, NATIVE_EAX, &dest);
+        return(CRUSTY_TYPE_INT);
     }
 
-    return(ret);
+    native_load_float(e, NATIVE_XMM0, &dest);
+    if(spec->srctype == CRUSTY_TYPE_INT) {
+        native_int_to_float(e, NATIVE_XMM1, &src);
+        emit_reg(e, 0xF2, 1, op, NATIVE_XMM0, NATIVE_XMM1);
+    } else {
+        emit_mem(e, 0xF2, 1, op, NATIVE_XMM0, src.base, src.disp);
+    }
+    native_result_float(e);
+    native_result_type(e, CRUSTY_TYPE_FLOAT);
+    native_store_float(e, NATIVE_XMM0, &dest);
+    return(CRUSTY_TYPE_FLOAT);
 }
 
-static int populate_var(CrustyVM *cvm,
-                        char *name,
-                        CrustyProcedure *proc,
-                        int readable,
-                        int writable,
-                        int *flags,
-                        int *var,
-                        int *index) {
-    CrustyVariable *varObj, *indexObj;
-    char *colon;
-    char *vararray = NULL;
-    char *end;
+/* conditional jump on the float result, which has to be false for NaN like the
+   comparisons in C */
+static void native_float_branch(CrustyEmitter *e,
+                                int type,
+                                unsigned int target) {
+    emit_reg(e, 0x66, 1, 0x57, NATIVE_XMM1, NATIVE_XMM1); /* xorpd */
+    emit_mem(e, 0xF2, 1, 0x10, NATIVE_XMM0, NATIVE_R9, NATIVE_FLOATRESULT);
 
-    *flags = 0;
-    *index = 0;
+    switch(type) {
+        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+            emit_reg(e, 0x66, 1, 0x2E, NATIVE_XMM0, NATIVE_XMM1); /* ucomisd */
+            emit_jump(e, NATIVE_JP, target);
+            emit_jump(e, NATIVE_JNE, target);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+            emit_reg(e, 0x66, 1, 0x2E, NATIVE_XMM0, NATIVE_XMM1);
+            emit_byte(e, 0x7A); /* jp over the je */
+            emit_byte(e, 6);
+            emit_jump(e, NATIVE_JE, target);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+            /* 0.0 above the result */
+            emit_reg(e, 0x66, 1, 0x2E, NATIVE_XMM1, NATIVE_XMM0);
+            emit_jump(e, NATIVE_JA, target);
+            break;
+        default: /* JUMPG */
+            emit_reg(e, 0x66, 1, 0x2E, NATIVE_XMM0, NATIVE_XMM1);
+            emit_jump(e, NATIVE_JA, target);
+    }
+}
 
-    /* test to see if we have an immediate value */
-    *var = strtol(name, &end, 0);
-    if(name != end && *end == '\0') {
-        /* immediate value */
-        if(writable) {
-            LOG_PRINTF_LINE(cvm, "Immediate values aren't writable.\n");
-            return(-1);
+static void native_int_branch(CrustyEmitter *e,
+                              int type,
+                              unsigned int target) {
+    /* cmp dword [r9 + intresult], 0 */
+    emit_mem(e, 0, 0, 0x83, 7, NATIVE_R9, NATIVE_INTRESULT);
+    emit_byte(e, 0);
+
+    switch(type) {
+        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+            emit_jump(e, NATIVE_JNE, target);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+            emit_jump(e, NATIVE_JE, target);
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+            emit_jump(e, NATIVE_JL, target);
+            break;
+        default: /* JUMPG */
+            emit_jump(e, NATIVE_JG, target);
+    }
+}
+
+/* Emit a jump at IP.  Conditional jumps only check the result type if it isn't
+   known from the instructions before it. */
+static void native_jump(CrustyEmitter *e,
+                        const int *inst,
+                        unsigned int ip,
+                        int known) {
+    unsigned int target = inst[JUMP_LOCATION];
+    unsigned int skip;
+
+    if(inst[0] == CRUSTY_INSTRUCTION_TYPE_JUMP) {
+        emit_jump(e, 0, target);
+        return;
+    }
+
+    if(known == CRUSTY_TYPE_INT) {
+        native_int_branch(e, inst[0], target);
+        return;
+    } else if(known == CRUSTY_TYPE_FLOAT) {
+        native_float_branch(e, inst[0], target);
+        return;
+    }
+
+    /* cmp dword [r9 + resulttype], CRUSTY_TYPE_INT */
+    emit_mem(e, 0, 0, 0x83, 7, NATIVE_R9, NATIVE_RESULTTYPE);
+    emit_byte(e, CRUSTY_TYPE_INT);
+    emit_byte(e, 0x75); /* jne to the float branch */
+    emit_byte(e, 0);
+    skip = e->len;
+    native_int_branch(e, inst[0], target);
+    emit_jump(e, 0, ip + JUMP_ARGS + 1);
+    if(!e->failed) {
+        e->buf[skip - 1] = e->len - skip;
+    }
+    native_float_branch(e, inst[0], target);
+}
+
+/* Emit a typed loop, which leaves the result registers alone so whatever's
+   known about them still is. */
+static void native_loop(CrustyEmitter *e,
+                        const int *inst,
+                        const CrustyLoop *loop) {
+    CrustyNativeOperand counter, step, bound;
+
+    native_operand(&counter, loop->counter,
+                   inst[LOOP_COUNTER_VAL], inst[LOOP_COUNTER_INDEX]);
+    native_operand(&step, CRUSTY_OPERAND_IMMEDIATE,
+                   inst[LOOP_STEP_VAL], inst[LOOP_STEP_INDEX]);
+    native_operand(&bound, loop->bound,
+                   inst[LOOP_BOUND_VAL], inst[LOOP_BOUND_INDEX]);
+
+    native_load_int(e, NATIVE_EAX, &counter);
+    native_int_op(e, CRUSTY_INSTRUCTION_TYPE_ADD, &step);
+    native_store_int(e, NATIVE_EAX, &counter);
+    if(bound.base == NATIVE_IMMEDIATE) {
+        emit_byte(e, 0x3D); /* cmp eax, imm32 */
+        emit_int(e, bound.disp);
+    } else {
+        emit_mem(e, 0, 0, 0x3B, NATIVE_EAX, bound.base, bound.disp);
+    }
+    emit_jump(e,
+              inst[LOOP_STEP_VAL] < 0 ? NATIVE_JG : NATIVE_JL,
+              inst[LOOP_LOCATION]);
+}
+
+/* Generate native code for everything native_mark() marks as translated.
+   Jumps to anything translated stay in native code, otherwise it returns to the
+   interpreter with the instruction to continue from. */
+static int native_compile(CrustyVM *cvm) {
+    CrustyEmitter e;
+    unsigned char *mark = NULL;
+    int *offset = NULL;
+    int *exitoffset = NULL;
+    unsigned int i, j;
+    unsigned int ip;
+    int known = NATIVE_UNKNOWN;
+    unsigned char *native;
+    size_t size;
+
+    e.buf = NULL;
+    e.len = 0;
+    e.size = 0;
+    e.fixup = NULL;
+    e.fixups = 0;
+    e.fixupsize = 0;
+    e.failed = 0;
+
+    mark = native_mark(cvm);
+    if(mark == NULL) {
+        goto error;
+    }
+
+    offset = malloc(sizeof(int) * cvm->insts);
+    exitoffset = malloc(sizeof(int) * cvm->insts);
+    if(offset == NULL || exitoffset == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for native code "
+                        "generation.\n");
+        goto error;
+    }
+
+    for(i = 0; i < cvm->insts; i++) {
+        offset[i] = -1;
+        exitoffset[i] = -1;
+    }
+
+    for(j = 0; j < cvm->lines; j++) {
+        ip = cvm->line[j].instruction;
+        if(!(mark[ip] & NATIVE_TRANSLATED)) {
+            continue;
         }
 
-        *flags |= MOVE_FLAG_IMMEDIATE;
+        if(mark[ip] & (NATIVE_ENTRY | NATIVE_TARGET)) {
+            known = NATIVE_UNKNOWN;
+        }
+        offset[ip] = e.len;
+
+        if(is_jump(cvm->inst[ip])) {
+            native_jump(&e, &(cvm->inst[ip]), ip, known);
+        } else if(typed_loop(cvm->inst[ip]) != NULL) {
+            native_loop(&e, &(cvm->inst[ip]), typed_loop(cvm->inst[ip]));
+        } else {
+            known = native_typed(&e,
+                                 &(cvm->inst[ip]),
+                                 native_typed_instruction(cvm->inst[ip]),
+                                 known);
+        }
+
+        /* a ret ends every procedure, so there's always a next line */
+        if(!(mark[cvm->line[j + 1].instruction] & NATIVE_TRANSLATED) &&
+           cvm->inst[ip] != CRUSTY_INSTRUCTION_TYPE_JUMP) {
+            emit_exit(&e, cvm->line[j + 1].instruction);
+        }
+    }
+
+    /* point jumps at their native code, or somewhere to return to the
+       interpreter from */
+    for(i = 0; i < e.fixups; i++) {
+        ip = e.fixup[i].target;
+        if(offset[ip] < 0) {
+            if(exitoffset[ip] < 0) {
+                exitoffset[ip] = e.len;
+                emit_exit(&e, ip);
+            }
+            patch_int(&e, e.fixup[i].pos,
+                      exitoffset[ip] - (int)(e.fixup[i].pos + 4));
+        } else {
+            patch_int(&e, e.fixup[i].pos,
+                      offset[ip] - (int)(e.fixup[i].pos + 4));
+        }
+    }
+
+    /* Entry points take the arguments of CrustyNativeFunc and jump to the code
+       for their instruction.  Reuse exitoffset for where they are. */
+    for(i = 0; i < cvm->insts; i++) {
+        if(!(mark[i] & NATIVE_ENTRY)) {
+            continue;
+        }
+
+        exitoffset[i] = e.len;
+        for(j = 0; j < sizeof(NATIVE_PROLOGUE); j++) {
+            emit_byte(&e, NATIVE_PROLOGUE[j]);
+        }
+        emit_byte(&e, 0xE9); /* jmp */
+        emit_int(&e, offset[i] - (int)(e.len + 4));
+    }
+
+    if(e.failed) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for native code.\n");
+        goto error;
+    }
+
+    if(e.len == 0) {
+        /* nothing to translate */
+        free(exitoffset);
+        free(offset);
+        free(mark);
         return(0);
     }
 
-    /* find colon */
-    colon = strrchr(name, ':');
+    cvm->nativeentry = calloc(cvm->insts, sizeof(CrustyNativeFunc));
+    if(cvm->nativeentry == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for native entry points.\n");
+        goto error;
+    }
 
-    if(colon != NULL) {
-        /* replace : with 0 and start at beginning of offset, if any */
-        *colon = '\0';
-        vararray = &(colon[1]);
+    size = e.len;
+    native = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(native != MAP_FAILED) {
+        memcpy(native, e.buf, e.len);
+        if(mprotect(native, size, PROT_READ | PROT_EXEC) < 0) {
+            munmap(native, size);
+            native = MAP_FAILED;
+        }
     }
 
-    *var = find_variable(cvm, proc, name);
-    if(*var == -1) {
-        LOG_PRINTF_LINE(cvm, "Variable %s not found.\n", name);
-        goto failure;
+    if(native == MAP_FAILED) {
+        /* not fatal, everything can still be interpreted */
+        LOG_PRINTF(cvm, "Couldn't map native code, it will be interpreted.\n");
+        free(cvm->nativeentry);
+        cvm->nativeentry = NULL;
+    } else {
+        cvm->native = native;
+        cvm->nativesize = size;
+
+        for(i = 0; i < cvm->insts; i++) {
+            if(mark[i] & NATIVE_ENTRY) {
+                cvm->nativeentry[i] =
+                    (CrustyNativeFunc)(&(native[exitoffset[i]]));
+            }
+        }
     }
-    varObj = &(cvm->var[*var]);
 
-    if(writable) {
-        if(varObj->read != NULL && varObj->write == NULL) {
-            LOG_PRINTF_LINE(cvm, "%s isn't a writable callback.\n", name);
-            goto failure;
+    free(e.fixup);
+    free(e.buf);
+    free(exitoffset);
+    free(offset);
+    free(mark);
+    return(0);
+
+error:
+    if(e.fixup != NULL) {
+        free(e.fixup);
+    }
+    if(e.buf != NULL) {
+        free(e.buf);
+    }
+    if(exitoffset != NULL) {
+        free(exitoffset);
+    }
+    if(offset != NULL) {
+        free(offset);
+    }
+    if(mark != NULL) {
+        free(mark);
+    }
+    return(-1);
+}
+
+#undef NATIVE_UNKNOWN
+#undef NATIVE_RESULTTYPE
+#undef NATIVE_FLOATRESULT
+#undef NATIVE_INTRESULT
+#undef NATIVE_JG
+#undef NATIVE_JL
+#undef NATIVE_JP
+#undef NATIVE_JA
+#undef NATIVE_JNE
+#undef NATIVE_JE
+#undef NATIVE_IMMEDIATE
+#undef NATIVE_XMM1
+#undef NATIVE_XMM0
+#undef NATIVE_R9
+#undef NATIVE_R8
+#undef NATIVE_RDI
+#undef NATIVE_ECX
+#undef NATIVE_EAX
+#endif
+
+int crustyvm_reset(CrustyVM *cvm) {
+    const char *temp = cvm->stage;
+    unsigned int i;
+    int restored;
+
+    cvm->stage = "reset";
+#ifdef CRUSTY_TEST
+    LOG_PRINTF(cvm, "Start\n");
+#endif
+
+    restored = 0;
+    if(cvm->dirty == RESET_ALL) {
+        memcpy(cvm->stack, cvm->initializer, cvm->initialstack);
+        restored = cvm->initialstack;
+    } else if(cvm->dirty == RESET_WRITTEN) {
+        for(i = 0; i < cvm->resetranges; i++) {
+            memcpy(&(cvm->stack[cvm->resetrange[i].offset]),
+                   &(cvm->initializer[cvm->resetrange[i].offset]),
+                   cvm->resetrange[i].length);
+            restored += cvm->resetrange[i].length;
         }
     }
-    if(readable) {
-        if(varObj->write != NULL && varObj->read == NULL) {
-            LOG_PRINTF_LINE(cvm, "%s isn't a readable callback.\n", name);
-            goto failure;
+    cvm->dirty = RESET_NONE;
+
+    cvm->status = CRUSTY_STATUS_READY;
+    cvm->stage = temp;
+
+    return(restored);
+}
+
+/* the most arguments any procedure takes */
+static unsigned int most_args(CrustyVM *cvm) {
+    unsigned int i;
+    unsigned int args = 0;
+
+    for(i = 0; i < cvm->procs; i++) {
+        if(cvm->proc[i].args > args) {
+            args = cvm->proc[i].args;
         }
     }
 
-    if(vararray != NULL) {
-        if(*vararray == '\0') {
-            /* array length */
-            if(writable) {
-                LOG_PRINTF_LINE(cvm, "Array length isn't writable.\n");
-                goto failure;
-            }
+    return(args);
+}
 
-            *flags |= MOVE_FLAG_LENGTH;
-        } else {
-            *flags |= MOVE_FLAG_VAR;
-            *index = strtol(vararray, &end, 0);
-            if(end != vararray && *end == '\0') {
-                /* array with immediate index, if length is 0, it's a local
-                 * variable and we can't know until runtime. */
-                if(*index < 0 ||
-                   ((int)(varObj->length) > 0 &&
-                    *index > (int)(varObj->length) - 1)) {
-                    LOG_PRINTF_LINE(cvm, "Immediate index out of array size.\n");
-                    goto failure;
-                }
-                *flags |= MOVE_FLAG_INDEX_IMMEDIATE;
-            } else {
-                /* array with variable index */
-                *index = find_variable(cvm, proc, vararray);
-                if(*index == -1) {
-                    LOG_PRINTF_LINE(cvm, "Array index variable %s not found.\n", vararray);
-                    goto failure;
-                }
-                indexObj = &(cvm->var[*index]);
+CrustyVM *crustyvm_clone(CrustyVM *cvm) {
+    CrustyVM *clone;
 
-                if(indexObj->write != NULL &&
-                   indexObj->read == NULL) {
-                    LOG_PRINTF_LINE(cvm, "%s isn't a readable callback.\n", vararray);
-                    goto failure;
+    clone = malloc(sizeof(CrustyVM));
+    if(clone == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for clone.\n");
+        return(NULL);
+    }
+
+    /* everything but the stacks and registers is the shared program */
+    memcpy(clone, cvm, sizeof(CrustyVM));
+    clone->stage = "clone";
+
+    clone->stack = malloc(clone->stacksize);
+    if(clone->stack == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate stack memory.\n");
+        free(clone);
+        return(NULL);
+    }
+
+    clone->cstack = malloc(sizeof(CrustyCallStackArg) * clone->callstacksize);
+    if(clone->cstack == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate callstack memory.\n");
+        free(clone->stack);
+        free(clone);
+        return(NULL);
+    }
+
+    clone->tailarg = malloc(sizeof(CrustyStackArg) * (most_args(clone) + 1));
+    if(clone->tailarg == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate tail call memory.\n");
+        free(clone->cstack);
+        free(clone->stack);
+        free(clone);
+        return(NULL);
+    }
+
+    cvm->program->refs++;
+
+    clone->dirty = RESET_ALL;
+    if(crustyvm_reset(clone) < 0) {
+        crustyvm_free(clone);
+        return(NULL);
+    }
+
+    return(clone);
+}
+
+#ifdef CRUSTY_TEST
+static int write_lines(CrustyVM *cvm, const char *name) {
+    FILE *out;
+    unsigned int i, j;
+    char *temp;
+
+    out = fopen(name, "wb");
+    if(out == NULL) {
+        LOG_PRINTF(cvm, "Couldn't open file %s for writing.\n", name);
+        return(-1);
+    }
+
+    for(i = 0; i < cvm->lines; i++) {
+        for(j = 0; j < cvm->line[i].tokencount; j++) {
+            if(fprintf(out, "%s", GET_TOKEN(i, j)) < 0) {
+                LOG_PRINTF(cvm, "Couldn't write to file.\n");
+                return(-1);
+            }
+            if(j < cvm->line[i].tokencount - 1) {
+                if(fprintf(out, " ") < 0) {
+                    LOG_PRINTF(cvm, "Couldn't write to file.\n");
+                    return(-1);
                 }
-
-                *flags |= MOVE_FLAG_INDEX_VAR;
             }
         }
-    } else {
-        /* variable */
-        *flags |= MOVE_FLAG_VAR | MOVE_FLAG_INDEX_IMMEDIATE;
-        *index = 0;
+        if(fprintf(out, "\n") < 0) {
+            LOG_PRINTF(cvm, "Couldn't write to file.\n");
+            return(-1);
+        }
     }
 
-    if(colon != NULL) {
-        *colon = ':';
-    }
-    return(0);
+    fclose(out);
 
-failure:
-    if(colon != NULL) {
-        *colon = ':';
-    }
-    return(-1);
+    return(0);
 }
+#endif
 
-static int *new_instruction(CrustyVM *cvm, unsigned int args) {
-    int *temp;
+/* defined with the interpreter below */
+static int run_threaded(CrustyVM *cvm, int prepare);
+
+/* defined with the range instructions below */
+static const CrustyVectorKernels *vector_kernels(void);
+
+/* Add ranges covering every byte in map which is set to which, joining any
+   closer together than gap.  Everything covered is cleared in map, including
+   the gaps. */
+static int build_ranges(CrustyRange **range,
+                        unsigned int *ranges,
+                        unsigned char *map,
+                        unsigned int size,
+                        unsigned char which,
+                        unsigned int gap) {
+    unsigned int i, j, start, end;
+    void *temp;
+
+    i = 0;
+    while(i < size) {
+        if(map[i] != which) {
+            i++;
+            continue;
+        }
 
-    temp = realloc(cvm->inst, sizeof(int) * (cvm->insts + args + 1));
-    if(temp == NULL) {
-        LOG_PRINTF_LINE(cvm, "Failed to allocate memory for instructions.\n");
-        return(NULL);
+        /* carry on through matching bytes and any gaps small enough */
+        start = i;
+        end = i + 1;
+        for(j = end; j < size && j - end < gap; j++) {
+            if(map[j] == which) {
+                end = j + 1;
+            }
+        }
+        i = j;
+        memset(&(map[start]), 0, end - start);
+
+        temp = realloc(*range, sizeof(CrustyRange) * (*ranges + 1));
+        if(temp == NULL) {
+            return(-1);
+        }
+        *range = temp;
+        (*range)[*ranges].offset = start;
+        (*range)[*ranges].length = end - start;
+        (*ranges)++;
     }
-    cvm->inst = temp;
-    temp = &(cvm->inst[cvm->insts]);
-    cvm->insts += (args + 1);
 
-    return(temp);
+    return(0);
 }
 
-static int find_label(CrustyProcedure *proc, const char *name) {
-    unsigned int i;
+/* mark a global which an operand might write to */
+static void mark_written(CrustyVM *cvm,
+                         unsigned char *written,
+                         int flags,
+                         int val) {
+    CrustyVariable *var;
 
-    for(i = 0; i < proc->labels; i++) {
-        if(strcmp(proc->label[i].name, name) == 0) {
-            return(proc->label[i].line);
-        }
+    if((flags & MOVE_FLAG_TYPE_MASK) != MOVE_FLAG_VAR) {
+        return;
     }
 
-    return(-1);
+    var = &(cvm->var[val]);
+    if(!variable_is_global(var) || variable_is_callback(var)) {
+        return;
+    }
+
+    memset(&(written[var->offset]), 1, var->length * type_size(var->type));
 }
 
-#define MATH_INSTRUCTION(NAME, ENUM) \
-    else if(compare_token_and_string(cvm, \
-                                     GET_TOKEN_OFFSET(cvm->logline, 0), \
-                                     NAME) == 0) { \
-        if(cvm->line[cvm->logline].tokencount != 3) { \
-            LOG_PRINTF_LINE(cvm, NAME " takes two operands.\n"); \
-            return(-1); \
-        } \
-    \
-        inst = new_instruction(cvm, MOVE_ARGS); \
-        if(inst == NULL) { \
-            return(-1); \
-        } \
-    \
-        inst[0] = ENUM; \
-    \
-        if(populate_var(cvm, \
-                        GET_TOKEN(cvm->logline, 1), \
-                        curproc, \
-                        1, 1, \
-                        &(inst[MOVE_DEST_FLAGS]), \
-                        &(inst[MOVE_DEST_VAL]), \
-                        &(inst[MOVE_DEST_INDEX])) < 0) { \
-            return(-1); \
-        } \
-    \
-        if(populate_var(cvm, \
-                        GET_TOKEN(cvm->logline, 2), \
-                        curproc, \
-                        1, 0, \
-                        &(inst[MOVE_SRC_FLAGS]), \
-                        &(inst[MOVE_SRC_VAL]), \
-                        &(inst[MOVE_SRC_INDEX])) < 0) { \
-            return(-1); \
-        }
+/* Find every part of the globals the program could possibly write to, which is
+   any global used as the destination of an instruction and, since the callee
+   might write through it, any global passed to a procedure.  Anything else
+   always has its initial value, so a reset can skip it. */
+static int build_reset_ranges(CrustyVM *cvm) {
+    unsigned char *written;
+    unsigned int i, j;
+    int type;
 
-#define JUMP_INSTRUCTION(NAME, ENUM) \
-    else if(compare_token_and_string(cvm, \
-                                     GET_TOKEN_OFFSET(cvm->logline, 0), \
-                                     NAME) == 0) { \
-        if(cvm->line[cvm->logline].tokencount != 2) { \
-            LOG_PRINTF_LINE(cvm, NAME " takes a label.\n"); \
-            return(-1); \
-        } \
-    \
-        inst = new_instruction(cvm, JUMP_ARGS); \
-        if(inst == NULL) { \
-            return(-1); \
-        } \
-    \
-        inst[0] = ENUM; \
-    \
-        inst[JUMP_LOCATION] = find_label(curproc, GET_TOKEN(cvm->logline, 1)); \
-        if(inst[JUMP_LOCATION] == -1) { \
-            LOG_PRINTF_LINE(cvm, "Couldn't find label %s.\n", \
-                                 GET_TOKEN(cvm->logline, 1)); \
-            return(-1); \
-        }
+    if(cvm->initialstack == 0) {
+        return(0);
+    }
 
-static int codegen(CrustyVM *cvm) {
-    CrustyProcedure *curproc = NULL;
-    int procnum = 0;
-    int *inst;
-    unsigned int j;
+    written = calloc(cvm->initialstack, 1);
+    if(written == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for reset ranges.\n");
+        return(-1);
+    }
 
-    for(cvm->logline = 0; cvm->logline < cvm->lines; cvm->logline++) {
-        if(curproc == NULL) {
-            if(cvm->logline == cvm->proc[procnum].start) {
-                curproc = &(cvm->proc[procnum]);
-                curproc->instruction = cvm->insts;
-            }
+    for(i = 0; i < cvm->insts; i += instruction_size(cvm, i)) {
+        type = generic_instruction(cvm->inst[i]);
+        if(type == CRUSTY_INSTRUCTION_TYPE_CALL ||
+           type == CRUSTY_INSTRUCTION_TYPE_TAILCALL) {
+            for(j = 0; j < cvm->proc[cvm->inst[i + CALL_PROCEDURE]].args; j++) {
+                mark_written(cvm,
+                             written,
+                             cvm->inst[i + CALL_START_ARGS +
+                                       (j * CALL_ARG_SIZE) + CALL_ARG_FLAGS],
+                             cvm->inst[i + CALL_START_ARGS +
+                                       (j * CALL_ARG_SIZE) + CALL_ARG_VAL]);
+            }
+        } else if((type >= CRUSTY_INSTRUCTION_TYPE_MOVE &&
+                   type <= CRUSTY_INSTRUCTION_TYPE_SHL) ||
+                  is_bulk(type) ||
+                  is_loop(type) ||
+                  is_pick(type)) {
+            mark_written(cvm,
+                         written,
+                         cvm->inst[i + MOVE_DEST_FLAGS],
+                         cvm->inst[i + MOVE_DEST_VAL]);
         }
+    }
 
-        if(curproc == NULL) {
-            LOG_PRINTF_LINE(cvm, "BUG: code line not in a procedure.\n");
-            return(-1);
-        }
+    if(build_ranges(&(cvm->resetrange),
+                    &(cvm->resetranges),
+                    written,
+                    cvm->initialstack,
+                    1,
+                    RESET_GAP) < 0) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for reset ranges.\n");
+        free(written);
+        return(-1);
+    }
 
-        cvm->line[cvm->logline].instruction = cvm->insts;
+    free(written);
+    return(0);
+}
 
-        if(compare_token_and_string(cvm,
-                                    GET_TOKEN_OFFSET(cvm->logline, 0),
-                                    "move") == 0) {
-            if(cvm->line[cvm->logline].tokencount != 3) {
-                LOG_PRINTF_LINE(cvm, "move takes a destination and source.\n");
-                return(-1);
-            }
+/* progress of measure_calls() through each procedure */
+#define MEASURE_UNVISITED (0)
+#define MEASURE_VISITING  (1)
+#define MEASURE_DONE      (2)
 
-            inst = new_instruction(cvm, MOVE_ARGS);
-            if(inst == NULL) {
-                return(-1);
-            }
+/* what each byte of a new frame needs */
+#define FRAME_UNUSED (0)
+#define FRAME_ZERO   (1)
+#define FRAME_DATA   (2)
 
-            inst[0] = CRUSTY_INSTRUCTION_TYPE_MOVE;
+/* ranges of a frame closer together than this are initialized together */
+#define FRAME_GAP (32)
 
-            if(populate_var(cvm,
-                            GET_TOKEN(cvm->logline, 1),
-                            curproc,
-                            0, 1,
-                            &(inst[MOVE_DEST_FLAGS]),
-                            &(inst[MOVE_DEST_VAL]),
-                            &(inst[MOVE_DEST_INDEX])) < 0) {
-                return(-1);
-            }
+/* how a procedure first uses each of its locals */
+#define FIRST_USE_NONE (0)
+#define FIRST_USE_READ (1)
+#define FIRST_USE_SET  (2)
 
-            if(populate_var(cvm,
-                            GET_TOKEN(cvm->logline, 2),
-                            curproc,
-                            1, 0,
-                            &(inst[MOVE_SRC_FLAGS]),
-                            &(inst[MOVE_SRC_VAL]),
-                            &(inst[MOVE_SRC_INDEX])) < 0) {
-                return(-1);
-            }
-        } MATH_INSTRUCTION("add", CRUSTY_INSTRUCTION_TYPE_ADD)
-        } MATH_INSTRUCTION("sub", CRUSTY_INSTRUCTION_TYPE_SUB)
-        } MATH_INSTRUCTION("mul", CRUSTY_INSTRUCTION_TYPE_MUL)
-        } MATH_INSTRUCTION("div", CRUSTY_INSTRUCTION_TYPE_DIV)
-        } MATH_INSTRUCTION("mod", CRUSTY_INSTRUCTION_TYPE_MOD)
-        } MATH_INSTRUCTION("and", CRUSTY_INSTRUCTION_TYPE_AND)
-        } MATH_INSTRUCTION("or",  CRUSTY_INSTRUCTION_TYPE_OR )
-        } MATH_INSTRUCTION("xor", CRUSTY_INSTRUCTION_TYPE_XOR)
-        } MATH_INSTRUCTION("shr", CRUSTY_INSTRUCTION_TYPE_SHR)
-        } MATH_INSTRUCTION("shl", CRUSTY_INSTRUCTION_TYPE_SHL)
-        } else if(compare_token_and_string(cvm,
-                                           GET_TOKEN_OFFSET(cvm->logline, 0),
-                                           "cmp") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 2 ||
-               cvm->line[cvm->logline].tokencount > 3) {
-                LOG_PRINTF_LINE(cvm, "cmp takes one or two operands.\n");
-                return(-1);
-            }
+static void first_use(unsigned char *use, int var, unsigned char how) {
+    if(use[var] == FIRST_USE_NONE) {
+        use[var] = how;
+    }
+}
 
-            inst = new_instruction(cvm, MOVE_ARGS);
-            if(inst == NULL) {
-                return(-1);
-            }
+/* note the variables an operand reads, its value or length and its index */
+static void first_use_operand(unsigned char *use, int flags, int val, int index) {
+    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR ||
+       (flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
+        first_use(use, val, FIRST_USE_READ);
+    }
+    if((flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
+        first_use(use, index, FIRST_USE_READ);
+    }
+}
 
-            inst[0] = CRUSTY_INSTRUCTION_TYPE_CMP;
+/* Find which variables a procedure sets before reading them.  Only the run of
+   instructions at the start of the procedure which every call goes through is
+   looked at, up to the first jump, return or place something could jump to.
+   Calls return to the next instruction so they're followed, but anything
+   passed to one counts as read. */
+static void find_first_use(CrustyVM *cvm,
+                           CrustyProcedure *proc,
+                           const unsigned char *target,
+                           unsigned char *use) {
+    unsigned int i, j;
+    int type;
+    const int *inst;
 
-            if(populate_var(cvm,
-                            GET_TOKEN(cvm->logline, 1),
-                            curproc,
-                            1, 0,
-                            &(inst[MOVE_DEST_FLAGS]),
-                            &(inst[MOVE_DEST_VAL]),
-                            &(inst[MOVE_DEST_INDEX])) < 0) {
-                return(-1);
-            }
+    for(i = proc->instruction; i < cvm->insts; i += instruction_size(cvm, i)) {
+        if(i != proc->instruction && target[i]) {
+            break;
+        }
 
-            if(cvm->line[cvm->logline].tokencount == 3) {
-                if(populate_var(cvm,
-                                GET_TOKEN(cvm->logline, 2),
-                                curproc,
-                                1, 0,
-                                &(inst[MOVE_SRC_FLAGS]),
-                                &(inst[MOVE_SRC_VAL]),
-                                &(inst[MOVE_SRC_INDEX])) < 0) {
-                    return(-1);
-                }
+        inst = &(cvm->inst[i]);
+        type = generic_instruction(inst[0]);
+        if(type == CRUSTY_INSTRUCTION_TYPE_CALL) {
+            for(j = 0; j < cvm->proc[inst[CALL_PROCEDURE]].args; j++) {
+                first_use_operand(use,
+                    inst[CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_FLAGS],
+                    inst[CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_VAL],
+                    inst[CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_INDEX]);
+            }
+        } else if(type >= CRUSTY_INSTRUCTION_TYPE_MOVE &&
+                  type <= CRUSTY_INSTRUCTION_TYPE_CMP) {
+            first_use_operand(use,
+                              inst[MOVE_SRC_FLAGS],
+                              inst[MOVE_SRC_VAL],
+                              inst[MOVE_SRC_INDEX]);
+            /* a move sets the whole of a single value, anything else reads
+               the destination first */
+            if(type == CRUSTY_INSTRUCTION_TYPE_MOVE &&
+               inst[MOVE_DEST_FLAGS] == (MOVE_FLAG_VAR |
+                                         MOVE_FLAG_INDEX_IMMEDIATE) &&
+               cvm->var[inst[MOVE_DEST_VAL]].length == 1) {
+                first_use(use, inst[MOVE_DEST_VAL], FIRST_USE_SET);
             } else {
-                inst[MOVE_SRC_FLAGS] = MOVE_FLAG_IMMEDIATE;
-                inst[MOVE_SRC_VAL] = 0;
-                inst[MOVE_SRC_INDEX] = 0; /* ignored but may as well */
-            }
-        } JUMP_INSTRUCTION("jump",  CRUSTY_INSTRUCTION_TYPE_JUMP )
-        } JUMP_INSTRUCTION("jumpn", CRUSTY_INSTRUCTION_TYPE_JUMPN)
-        } JUMP_INSTRUCTION("jumpz", CRUSTY_INSTRUCTION_TYPE_JUMPZ)
-        } JUMP_INSTRUCTION("jumpl", CRUSTY_INSTRUCTION_TYPE_JUMPL)
-        } JUMP_INSTRUCTION("jumpg", CRUSTY_INSTRUCTION_TYPE_JUMPG)
-        } else if(compare_token_and_string(cvm,
-                                           GET_TOKEN_OFFSET(cvm->logline, 0),
-                                           "call") == 0) {
-            if(cvm->line[cvm->logline].tokencount < 2) {
-                LOG_PRINTF_LINE(cvm, "call takes a procedure and possible arguments.\n");
-                return(-1);
+                first_use_operand(use,
+                                  inst[MOVE_DEST_FLAGS],
+                                  inst[MOVE_DEST_VAL],
+                                  inst[MOVE_DEST_INDEX]);
             }
+        } else {
+            break;
+        }
+    }
+}
 
-            unsigned int args = cvm->line[cvm->logline].tokencount - 2;
-            unsigned int i;
+/* Work out the least each call has to do to set up a procedure's frame:
+   copy the parts with initial values, clear the parts which start out zero
+   and leave alone the arguments, which are filled in by the call, any
+   padding and any variables set before they're read. */
+static int build_frame_ranges(CrustyVM *cvm) {
+    unsigned char *target = NULL;
+    unsigned char *use = NULL;
+    unsigned char *map = NULL;
+    CrustyProcedure *proc;
+    CrustyVariable *var;
+    unsigned int i, j, k, start, len;
+    unsigned int targets, loc;
+    int ret = -1;
 
-            inst = new_instruction(cvm, (args * 3) + 1);
-            if(inst == NULL) {
-                return(-1);
-            }
+    target = calloc(cvm->insts, 1);
+    use = calloc(cvm->vars + 1, 1);
+    if(target == NULL || use == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for frame analysis.\n");
+        goto done;
+    }
 
-            inst[0] = CRUSTY_INSTRUCTION_TYPE_CALL;
+    for(i = 0; i < cvm->insts; i += instruction_size(cvm, i)) {
+        targets = jump_targets(&(cvm->inst[i]), &loc);
+        for(j = 0; j < targets; j++) {
+            target[cvm->inst[i + loc + j]] = 1;
+        }
+    }
 
-            inst[1] = find_procedure(cvm,
-                                     GET_TOKEN(cvm->logline, 1));
-            if(inst[1] == -1) {
-                LOG_PRINTF_LINE(cvm, "Couldn't find procedure %s.\n",
-                                     GET_TOKEN(cvm->logline, 1));
-                return(-1);
-            }
+    for(i = 0; i < cvm->procs; i++) {
+        proc = &(cvm->proc[i]);
+        if(proc->stackneeded == 0) {
+            continue;
+        }
+
+        find_first_use(cvm, proc, target, use);
+
+        map = calloc(proc->stackneeded, 1);
+        if(map == NULL) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for frame analysis.\n");
+            goto done;
+        }
 
-            if(args != cvm->proc[inst[1]].args) {
-                LOG_PRINTF_LINE(cvm, "Procedure %s takes %u args, %u given.\n",
-                                cvm->proc[inst[1]].name,
-                                cvm->proc[inst[1]].args,
-                                args);
-                return(-1);
+        for(j = 0; j < proc->vars; j++) {
+            var = proc->var[j];
+            if(variable_is_argument(var) ||
+               use[proc->varIndex[j]] == FIRST_USE_SET) {
+                continue;
             }
 
-            for(i = 0; i < args; i++) {
-                if(populate_var(cvm,
-                            GET_TOKEN(cvm->logline, i + 2),
-                            curproc,
-                            0, 0,
-                            &(inst[CALL_START_ARGS + (i * CALL_ARG_SIZE) + CALL_ARG_FLAGS]),
-                            &(inst[CALL_START_ARGS + (i * CALL_ARG_SIZE) + CALL_ARG_VAL]),
-                            &(inst[CALL_START_ARGS + (i * CALL_ARG_SIZE) + CALL_ARG_INDEX]))
-                            < 0 ) {
-                    return(-1);
-                }
-            }
-        } else if(compare_token_and_string(cvm,
-                                           GET_TOKEN_OFFSET(cvm->logline, 0),
-                                           "ret") == 0) {
-            if(cvm->line[cvm->logline].tokencount != 1) {
-                LOG_PRINTF_LINE(cvm, "ret takes no arguments.\n");
-                return(-1);
+            start = proc->stackneeded - var->offset;
+            len = var->length * type_size(var->type);
+            for(k = start; k < start + len; k++) {
+                map[k] = proc->initializer[k] != 0 ? FRAME_DATA : FRAME_ZERO;
             }
+        }
 
-            inst = new_instruction(cvm, 0);
-            if(inst == NULL) {
-                return(-1);
-            }
+        if(build_ranges(&(proc->copy), &(proc->copies),
+                        map, proc->stackneeded, FRAME_DATA, FRAME_GAP) < 0 ||
+           build_ranges(&(proc->zero), &(proc->zeros),
+                        map, proc->stackneeded, FRAME_ZERO, FRAME_GAP) < 0) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for frame ranges.\n");
+            goto done;
+        }
 
-            inst[0] = CRUSTY_INSTRUCTION_TYPE_RET;
+        free(map);
+        map = NULL;
+    }
 
-            procnum++;
-            curproc = NULL;
-        } else {
-            LOG_PRINTF_LINE(cvm, "Invalid instruction mnemonic: %s\n",
-                                 GET_TOKEN(cvm->logline, 0));
-            return(-1);
-        }
+    ret = 0;
+done:
+    free(map);
+    free(use);
+    free(target);
+    return(ret);
+}
+
+static int build_varinfo(CrustyVM *cvm) {
+    unsigned int i;
+    CrustyVariable *var;
+
+    cvm->vinfo = malloc(sizeof(CrustyVarInfo) * (cvm->vars + 1));
+    if(cvm->vinfo == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for variable table.\n");
+        return(-1);
     }
 
-    /* convert jump arguments from line to ip */
-    for(j = 0; j < cvm->lines; j++) {
-        switch(cvm->inst[cvm->line[j].instruction]) {
-            case CRUSTY_INSTRUCTION_TYPE_JUMP:
-            case CRUSTY_INSTRUCTION_TYPE_JUMPN:
-            case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
-            case CRUSTY_INSTRUCTION_TYPE_JUMPL:
-            case CRUSTY_INSTRUCTION_TYPE_JUMPG:
-                cvm->inst[cvm->line[j].instruction + JUMP_LOCATION] =
-                cvm->line[cvm->inst[cvm->line[j].instruction + JUMP_LOCATION]].instruction;
-            default:
-                break;
+    for(i = 0; i < cvm->vars; i++) {
+        var = &(cvm->var[i]);
+        cvm->vinfo[i].offset = var->offset;
+        cvm->vinfo[i].length = var->length;
+        cvm->vinfo[i].type = var->type;
+        cvm->vinfo[i].flags = 0;
+        if(variable_is_global(var)) {
+            cvm->vinfo[i].flags |= VARINFO_GLOBAL;
+        }
+        if(variable_is_argument(var)) {
+            cvm->vinfo[i].flags |= VARINFO_ARGUMENT;
+        }
+        if(var->read != NULL) {
+            cvm->vinfo[i].flags |= VARINFO_READ;
+        }
+        if(var->write != NULL) {
+            cvm->vinfo[i].flags |= VARINFO_WRITE;
         }
     }
 
     return(0);
 }
 
-#undef JUMP_INSTRUCTION
-#undef MATH_INSTRUCTION
+/* Find the deepest calls a procedure could make and the most stack they could
+   use, including its own frame.  A tail call replaces the frame and call it's
+   made from, so only what the procedure it calls uses counts.  Returns -1 if
+   it could end up calling itself, in which case there's no limit. */
+static int measure_calls(CrustyVM *cvm,
+                         unsigned int procnum,
+                         unsigned char *state,
+                         unsigned int *depth,
+                         unsigned int *stack) {
+    unsigned int i, end;
+    unsigned int taildepth, tailstack;
+    int callee;
+
+    if(state[procnum] == MEASURE_VISITING) {
+        return(-1);
+    } else if(state[procnum] == MEASURE_DONE) {
+        return(0);
+    }
+    state[procnum] = MEASURE_VISITING;
 
-/* do a lot of checking now so a lot can be skipped later when actually
-   executing. */
-static int check_move_arg(CrustyVM *cvm,
-                          int dest,
-                          int flags,
-                          int val,
-                          int index) {
-    if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_IMMEDIATE) {
-        if(dest) {
-            LOG_PRINTF_LINE(cvm, "Destination flagged as immediate.\n");
-            return(-1);
+    if(procnum + 1 < cvm->procs) {
+        end = cvm->proc[procnum + 1].instruction;
+    } else {
+        end = cvm->insts;
+    }
+
+    depth[procnum] = 0;
+    stack[procnum] = 0;
+    taildepth = 0;
+    tailstack = 0;
+    for(i = cvm->proc[procnum].instruction; i < end; i += instruction_size(cvm, i)) {
+        if(cvm->inst[i] != CRUSTY_INSTRUCTION_TYPE_CALL &&
+           cvm->inst[i] != CRUSTY_INSTRUCTION_TYPE_TAILCALL) {
+            continue;
         }
 
-#ifdef CRUSTY_TEST
-        LOG_PRINTF_BARE(cvm, "%d", val);
-#endif
-    } else if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
-        if(dest) {
-            LOG_PRINTF_LINE(cvm, "Destination flagged as array length.\n");
+        callee = cvm->inst[i + CALL_PROCEDURE];
+        if(measure_calls(cvm, callee, state, depth, stack) < 0) {
             return(-1);
         }
+        if(cvm->inst[i] == CRUSTY_INSTRUCTION_TYPE_TAILCALL) {
+            if(depth[callee] > taildepth) {
+                taildepth = depth[callee];
+            }
+            if(stack[callee] > tailstack) {
+                tailstack = stack[callee];
+            }
+            continue;
+        }
+        if(depth[callee] > depth[procnum]) {
+            depth[procnum] = depth[callee];
+        }
+        if(stack[callee] > stack[procnum]) {
+            stack[procnum] = stack[callee];
+        }
+    }
+    depth[procnum]++;
+    stack[procnum] += cvm->proc[procnum].stackneeded;
+    if(taildepth > depth[procnum]) {
+        depth[procnum] = taildepth;
+    }
+    if(tailstack > stack[procnum]) {
+        stack[procnum] = tailstack;
+    }
 
-        if(val < 0 || val > (int)(cvm->vars) - 1) {
-            LOG_PRINTF_LINE(cvm, "Var out of range (%d).\n", val);
-            return(-1);
+    state[procnum] = MEASURE_DONE;
+    return(0);
+}
+
+/* Size the stacks for the deepest calls which could be made starting from any
+   procedure, if the program can't recurse. */
+static int measure_program(CrustyVM *cvm,
+                           unsigned int *maxdepth,
+                           unsigned int *maxstack) {
+    unsigned char *state;
+    unsigned int *depth, *stack;
+    unsigned int i;
+    int ret = -1;
+
+    state = calloc(cvm->procs, 1);
+    depth = malloc(sizeof(unsigned int) * cvm->procs);
+    stack = malloc(sizeof(unsigned int) * cvm->procs);
+    if(state == NULL || depth == NULL || stack == NULL) {
+        goto done;
+    }
+
+    *maxdepth = 0;
+    *maxstack = 0;
+    for(i = 0; i < cvm->procs; i++) {
+        if(measure_calls(cvm, i, state, depth, stack) < 0) {
+            goto done;
         }
+        if(depth[i] > *maxdepth) {
+            *maxdepth = depth[i];
+        }
+        if(stack[i] > *maxstack) {
+            *maxstack = stack[i];
+        }
+    }
+
+    ret = 0;
+done:
+    free(stack);
+    free(depth);
+    free(state);
+    return(ret);
+}
 
+/* everything after code verification which gets the program ready to run,
+   shared by loading from source and loading from an image */
+static int prepare_run(CrustyVM *cvm, unsigned int callstacksize) {
+    unsigned int depth, stack;
+
+#ifdef CRUSTY_JIT
+    /* stepping through for tracing never calls in to native code */
+    if((cvm->flags & CRUSTY_FLAG_JIT) && !(cvm->flags & CRUSTY_FLAG_TRACE)) {
+        cvm->stage = "native code generation";
 #ifdef CRUSTY_TEST
-        LOG_PRINTF_BARE(cvm, "%d(%s):", val, cvm->var[val].name);
+        LOG_PRINTF(cvm, "Start\n");
 #endif
-    } else if((flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-        if(val < 0 || val > (int)(cvm->vars) - 1) {
-            LOG_PRINTF_LINE(cvm, "Var out of range (%d).\n", val);
-            return(-1);
-        }
 
-        if(index < 0) {
-            LOG_PRINTF_LINE(cvm, "Negative index %d.\n", index);
+        if(native_compile(cvm) < 0) {
+            LOG_PRINTF(cvm, "Native code generation failed.\n");
             return(-1);
         }
+    }
+#endif
 
-        if(dest) {
-            if(cvm->var[val].read != NULL && cvm->var[val].write == NULL) {
-                LOG_PRINTF_LINE(cvm, "Read only callback variable as "
-                                     "destination (%s).\n", cvm->var[val].name);
-                return(-1);
-            }
-        } else {
-            if(cvm->var[val].write != NULL && cvm->var[val].read == NULL) {
-                LOG_PRINTF_LINE(cvm, "Write only callback variable as "
-                                     "source (%s).\n", cvm->var[val].name);
-                return(-1);
-            }
-        }
+    if(build_varinfo(cvm) < 0) {
+        return(-1);
+    }
 
-        if((flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-            if(index < 0 || index > (int)(cvm->vars) - 1) {
-                LOG_PRINTF_LINE(cvm, "Index var out of range (%d).\n", index);
-                return(-1);
-            }
+    cvm->vector = vector_kernels();
 
-            if(cvm->var[index].write != NULL && cvm->var[index].read == NULL) {
-                LOG_PRINTF_LINE(cvm, "Write only callback variable "
-                                     "as index (%s).\n", cvm->var[val].name);
-                return(-1);
-            }
+    if(build_reset_ranges(cvm) < 0) {
+        return(-1);
+    }
 
+    if(build_frame_ranges(cvm) < 0) {
+        return(-1);
+    }
+
+    cvm->stage = "threading";
 #ifdef CRUSTY_TEST
-            LOG_PRINTF_BARE(cvm, "%d(%s):%d(%s)",
-                            val, cvm->var[val].name,
-                            index, cvm->var[index].name);
+    LOG_PRINTF(cvm, "Start\n");
 #endif
-        } else if((flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_IMMEDIATE) {
-            if(index < 0 ||
-               (cvm->var[val].length > 0 &&
-                index > (int)(cvm->var[val].length) - 1)) {
-                LOG_PRINTF_LINE(cvm, "Index out of range %d.\n", index);
-                return(-1);
-            }
 
+    if(run_threaded(cvm, 1) < 0) {
+        return(-1);
+    }
+
+    cvm->stage = "memory allocation";
 #ifdef CRUSTY_TEST
-            LOG_PRINTF_BARE(cvm, "%d(%s):%d", val, cvm->var[val].name, index);
+    LOG_PRINTF(cvm, "Start\n");
 #endif
-        }
+
+    /* without recursion, the stacks can be made just big enough and never
+       need checking, unless a smaller callstack was asked for */
+    if(measure_program(cvm, &depth, &stack) == 0 &&
+       (callstacksize == 0 || callstacksize >= depth)) {
+        cvm->bounded = 1;
+        cvm->stacksize = cvm->initialstack + stack;
+        callstacksize = depth;
+    }
+
+    cvm->stack = malloc(cvm->stacksize);
+    if(cvm->stack == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate stack memory.\n");
+        return(-1);
+    }
+
+    if(callstacksize == 0) {
+        cvm->callstacksize = DEFAULT_CALLSTACK_SIZE;
     } else {
-        LOG_PRINTF_LINE(cvm, "Invalid variable type.\n");
+        cvm->callstacksize = callstacksize;
+    }
+
+    cvm->cstack = malloc(sizeof(CrustyCallStackArg) * cvm->callstacksize);
+    if(cvm->cstack == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate callstack memory.\n");
+        return(-1);
+    }
+
+    cvm->tailarg = malloc(sizeof(CrustyStackArg) * (most_args(cvm) + 1));
+    if(cvm->tailarg == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate tail call memory.\n");
+        return(-1);
+    }
+
+    if(crustyvm_reset(cvm) < 0) {
         return(-1);
     }
 
+
     return(0);
 }
 
-static int check_math_instruction(CrustyVM *cvm,
-                                  const char *name,
-                                  unsigned int i,
-                                  unsigned int notcmp) {
-    if(i + MOVE_ARGS > cvm->insts - 1) {
-        LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
-                             "of %s instruction.\n", name);
-        return(-1);
+/* hash of everything besides included files which goes in to building a
+   program, so a saved image can tell if it's still current */
+static unsigned long long image_key(const char *name,
+                                    const char *program,
+                                    long len,
+                                    unsigned int flags,
+                                    const CrustyCallback *cb,
+                                    unsigned int cbcount,
+                                    const char **var,
+                                    const char **value,
+                                    unsigned int vars) {
+    unsigned long long hash = IMAGE_HASH_START;
+    unsigned int version = IMAGE_VERSION;
+    unsigned long slen;
+    unsigned int i;
+    int cbinfo[4];
+
+    hash = image_hash(hash, &version, sizeof(version));
+    /* the rest of the flags don't change the generated code */
+    flags &= IMAGE_KEY_FLAGS;
+    hash = image_hash(hash, &flags, sizeof(flags));
+    /* lengths are hashed too so strings can't run together */
+    slen = strlen(name);
+    hash = image_hash(hash, &slen, sizeof(slen));
+    hash = image_hash(hash, name, slen);
+    hash = image_hash(hash, &len, sizeof(len));
+    hash = image_hash(hash, program, len);
+
+    for(i = 0; i < vars; i++) {
+        slen = strlen(var[i]);
+        hash = image_hash(hash, &slen, sizeof(slen));
+        hash = image_hash(hash, var[i], slen);
+        slen = strlen(value[i]);
+        hash = image_hash(hash, &slen, sizeof(slen));
+        hash = image_hash(hash, value[i], slen);
     }
 
-#ifdef CRUSTY_TEST
-    LOG_PRINTF_BARE(cvm, "%s ", name);
-#endif
-    if(check_move_arg(cvm,
-                      notcmp,
-                      cvm->inst[i+MOVE_DEST_FLAGS],
-                      cvm->inst[i+MOVE_DEST_VAL],
-                      cvm->inst[i+MOVE_DEST_INDEX]) < 0) {
-        return(-1);
+    for(i = 0; i < cbcount; i++) {
+        slen = strlen(cb[i].name);
+        hash = image_hash(hash, &slen, sizeof(slen));
+        hash = image_hash(hash, cb[i].name, slen);
+        cbinfo[0] = cb[i].length;
+        cbinfo[1] = cb[i].readType;
+        cbinfo[2] = cb[i].read != NULL;
+        cbinfo[3] = cb[i].write != NULL;
+        hash = image_hash(hash, cbinfo, sizeof(cbinfo));
     }
+
+    return(hash);
+}
+
+CrustyVM *crustyvm_new(const char *name,
+                       char *safepath,
+                       const char *program,
+                       long len,
+                       unsigned int flags,
+                       unsigned int callstacksize,
+                       const CrustyCallback *cb,
+                       unsigned int cbcount,
+                       const char **var,
+                       const char **value,
+                       unsigned int vars,
+                       void (*log_cb)(void *priv, const char *fmt, ...),
+                       void *log_priv) {
+    CrustyVM *cvm;
+    int foundmacro;
+    unsigned int i, j;
+    char namebuffer[] = "preprocess###.cvm";
+    long tokenstart;
+    unsigned long *varOffset;
+    unsigned long *valueOffset;
+
 #ifdef CRUSTY_TEST
-    LOG_PRINTF_BARE(cvm, " ");
+    unsigned int k;
 #endif
-    if(check_move_arg(cvm,
-                      0,
-                      cvm->inst[i+MOVE_SRC_FLAGS],
-                      cvm->inst[i+MOVE_SRC_VAL],
-                      cvm->inst[i+MOVE_SRC_INDEX]) < 0) {
-        return(-1);
+
+    if(name == NULL) {
+        /* nothing is defined yet so don't use the macro */
+        log_cb(log_priv, "NULL passed as program name.\n");
+        return(NULL);
+    }
+
+    cvm = init();
+    if(cvm == NULL) {
+        return(NULL);
     }
+
+    cvm->flags = flags;
+    cvm->key = image_key(name, program, len, flags,
+                         cb, cbcount, var, value, vars);
+
+    cvm->log_cb = log_cb;
+    cvm->log_priv = log_priv;
+
+    cvm->stage = "tokenize";
 #ifdef CRUSTY_TEST
-    LOG_PRINTF_BARE(cvm, "\n");
+    LOG_PRINTF(cvm, "Start\n");
 #endif
-    return(0);
-}
 
-#define MATH_INSTRUCTION(NAME, NOTCMP) \
-    if(check_math_instruction(cvm, NAME, i, (NOTCMP)) < 0) { \
-        return(-1); \
+    if(tokenize(cvm, name, safepath, program, len) < 0) {
+        crustyvm_free(cvm);
+        return(NULL);
     }
 
-static int check_jump_instruction(CrustyVM *cvm,
-                                  const char *name,
-                                  CrustyProcedure *proc,
-                                  unsigned int i) {
-    unsigned int j;
-    unsigned int line;
-    unsigned int found;
+#ifdef CRUSTY_TEST
+    if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
+    /* this outputs ugly nonsense that's full of nulls and other crap and not
+       really useful outside of debugging the program itself. */
+        FILE *out;
+        out = fopen("tokens.bin", "wb");
+        if(out == NULL) {
+            LOG_PRINTF(cvm, "Failed to open tokenizer output file for writing.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
 
-    if(i + JUMP_ARGS > cvm->insts - 1) {
-        LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
-                             "of %s instruction.\n", name);
-        return(-1);
+        if(fwrite(cvm->tokenmem, 1, cvm->tokenmemlen, out) <
+           (unsigned long)cvm->tokenmemlen) {
+            LOG_PRINTF(cvm, "Failed to write tokenizer output.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+        fclose(out);
     }
+#endif
 
-    found = 0;
-    for(j = 0; j < cvm->lines; j++) {
-        if(cvm->inst[i+JUMP_LOCATION] < 0 ) {
-            LOG_PRINTF_LINE(cvm, "Negative jump pointer?\n");
-            return(-1);
-        }
+    if(cvm->lines == 0) {
+        LOG_PRINTF(cvm, "No lines remain after pass.\n");
+        crustyvm_free(cvm);
+        return(NULL);
+    }
 
-        if((unsigned int)(cvm->inst[i+JUMP_LOCATION]) == cvm->line[j].instruction) {
-            line = j;
-            found = 1;
-            break;
+#ifdef CRUSTY_TEST
+    if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
+        FILE *out;
+        out = fopen("tokens_meta.txt", "wb");
+        if(out == NULL) {
+            LOG_PRINTF(cvm, "Failed to open tokenizer metadata output file for writing.\n");
+            crustyvm_free(cvm);
+            return(NULL);
         }
-    }
 
-    if(found == 0) {
-        LOG_PRINTF_LINE(cvm, "Jump argument doesn't land on an instruction.\n");
-        return(-1);
+        for(i = 0; i < cvm->lines; i++) {
+            fprintf(out, "%s %04u ",
+                    TOKENVAL(cvm->line[i].moduleOffset),
+                    cvm->line[i].line);
+            for(j = 0; j < cvm->line[i].tokencount; j++) {
+                fprintf(out, "%s", GET_TOKEN(i, j));
+                if(j < cvm->line[i].tokencount - 1) {
+                    fprintf(out, " ");
+                }
+            }
+            fprintf(out, "\n");
+        }
+        fclose(out);
     }
 
-    if(proc != NULL) {
-        if(line < proc->start || line > proc->start + proc->length) {
-            LOG_PRINTF_LINE(cvm, "Jump outside of procedure.\n");
-            return(-1);
+    if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
+        if(write_lines(cvm, "tokenize.cvm", 1) < 0) {
+            LOG_PRINTF(cvm, "Failed to write tokenize pass.\n");
+            crustyvm_free(cvm);
+            return(NULL);
         }
     }
+#endif
 
+    cvm->stage = "input variables";
 #ifdef CRUSTY_TEST
-    LOG_PRINTF_BARE(cvm, "%s %d\n", name, cvm->inst[i+JUMP_LOCATION]);
+    LOG_PRINTF(cvm, "Start\n");
 #endif
-    return(0);
-}
 
-#define JUMP_INSTRUCTION(NAME) \
-    if(proc == NULL) { \
-        if(check_jump_instruction(cvm, NAME, NULL, i) < 0) { \
-            return(-1); \
-        } \
-    } else { \
-        if(check_jump_instruction(cvm, NAME, *proc, i) < 0) { \
-            return(-1); \
-        } \
+    varOffset = malloc(sizeof(long) * vars);
+    if(varOffset == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for input variables list.\n");
+        crustyvm_free(cvm);
+        return(NULL);
+    }
+    valueOffset = malloc(sizeof(long) * vars);
+    if(valueOffset == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for input values list.\n");
+        crustyvm_free(cvm);
+        return(NULL);
+    }
+
+    for(i = 0; i < vars; i++) {
+        tokenstart = add_token(cvm, var[i], strlen(var[i]), 0, NULL);
+        if(tokenstart < 0) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for input variable.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+        varOffset[i] = tokenstart;
+        tokenstart = add_token(cvm, value[i], strlen(value[i]), 0, NULL);
+        if(tokenstart < 0) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for input value.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+        valueOffset[i] = tokenstart;
     }
 
-static int check_instruction(CrustyVM *cvm,
-                      CrustyProcedure **proc,
-                      unsigned int i) {
 #ifdef CRUSTY_TEST
-    LOG_PRINTF(cvm, "%d: ", i);
+    for(i = 0; i < vars; i++) {
+        LOG_PRINTF(cvm, "%s = %s\n",
+                   TOKENVAL(varOffset[i]),
+                   TOKENVAL(valueOffset[i]));
+    }
 #endif
-    switch(cvm->inst[i]) {
-        case CRUSTY_INSTRUCTION_TYPE_MOVE:
-            MATH_INSTRUCTION("move", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_ADD:
-            MATH_INSTRUCTION("add", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_SUB:
-            MATH_INSTRUCTION("sub", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_MUL:
-            MATH_INSTRUCTION("mul", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_DIV:
-            MATH_INSTRUCTION("div", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_MOD:
-            MATH_INSTRUCTION("mod", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_AND:
-            MATH_INSTRUCTION("and", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_OR:
-            MATH_INSTRUCTION("or", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_XOR:
-            MATH_INSTRUCTION("xor", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_SHR:
-            MATH_INSTRUCTION("shr", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_SHL:
-            MATH_INSTRUCTION("shl", 1)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_CMP:
-            MATH_INSTRUCTION("cmp", 0)
-            return(MOVE_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_JUMP:
-            JUMP_INSTRUCTION("jump")
-            return(JUMP_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
-            JUMP_INSTRUCTION("jumpn")
-            return(JUMP_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
-            JUMP_INSTRUCTION("jumpz")
-            return(JUMP_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
-            JUMP_INSTRUCTION("jumpl")
-            return(JUMP_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_JUMPG:
-            JUMP_INSTRUCTION("jumpg")
-            return(JUMP_ARGS + 1);
-        case CRUSTY_INSTRUCTION_TYPE_CALL:
-            if(i + JUMP_ARGS > cvm->insts - 1) {
-                LOG_PRINTF_LINE(cvm, "Instruction memory ends before end "
-                                     "of call instruction.\n");
-                return(-1);
-            }
-
-            if(cvm->inst[i+CALL_PROCEDURE] < 0 ||
-               cvm->inst[i+CALL_PROCEDURE] > (int)(cvm->procs) - 1) {
-                LOG_PRINTF_LINE(cvm, "Call to procedure out of range.\n");
-                return(-1);
-            }
-
-            CrustyProcedure *callProc = &(cvm->proc[cvm->inst[i+CALL_PROCEDURE]]);
-            unsigned int j;
 
+    for(i = 0; i < MAX_PASSES; i++) {
+        snprintf(namebuffer, sizeof(namebuffer), "preprocess %d", i + 1);
+        cvm->stage = namebuffer;
 #ifdef CRUSTY_TEST
-            LOG_PRINTF_BARE(cvm, "call %d(%s)", cvm->inst[i+CALL_PROCEDURE],
-                            callProc->name);
+        LOG_PRINTF(cvm, "Start\n", i);
 #endif
 
-            for(j = 0; j < callProc->args; j++) {
+        foundmacro = preprocess(cvm, varOffset, valueOffset, vars);
+        if(foundmacro < 0) {
+            LOG_PRINTF(cvm, "Failed preprocess at pass %d.\n", i + 1);
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+
+        if(cvm->lines == 0) {
+            LOG_PRINTF(cvm, "No lines remain after pass.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+
 #ifdef CRUSTY_TEST
-                LOG_PRINTF_BARE(cvm, " ");
-#endif
-                if(check_move_arg(cvm,
-                                  0,
-                                  cvm->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_FLAGS],
-                                  cvm->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_VAL],
-                                  cvm->inst[i + CALL_START_ARGS + (j * CALL_ARG_SIZE) + CALL_ARG_INDEX]) < 0) {
-                    return(-1);
-                }
+        if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
+            snprintf(namebuffer, sizeof(namebuffer), "preprocess%03d.cvm", i + 1);
+            if(write_lines(cvm, namebuffer, 1) < 0) {
+                LOG_PRINTF(cvm, "Failed to write pass %d.\n", i + 1);
+                crustyvm_free(cvm);
+                return(NULL);
             }
+        }
+#endif
+
+        if(foundmacro == 0) {
+            break;
+        }
+    }
+    free(varOffset);
+    free(valueOffset);
+    if(i == MAX_PASSES) {
+        LOG_PRINTF(cvm, "Preprocess passes exceeded.\n");
+        crustyvm_free(cvm);
+        return(NULL);
+    }
 
+    cvm->stage = "adding callbacks";
 #ifdef CRUSTY_TEST
-            LOG_PRINTF_BARE(cvm, "\n");
+    LOG_PRINTF(cvm, "Start\n");
 #endif
 
-            return(CALL_PROCEDURE + (callProc->args * 3) + 1);
-        case CRUSTY_INSTRUCTION_TYPE_RET:
-            /* takes no arguments so it can't end early */
-#ifdef CRUSTY_TEST
-            LOG_PRINTF_BARE(cvm, "ret\n");
-#endif
-            if(proc != NULL) {
-                *proc = NULL;
-            }
+    for(i = 0; i < cbcount; i++) {
+        if(cb[i].read == NULL && cb[i].write == NULL) {
+            LOG_PRINTF(cvm, "Callback variables must have a non-NULL read and/or write function.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
 
-            return(RET_ARGS + 1);
-        default:
-            LOG_PRINTF_LINE(cvm, "Invalid instruction %u.\n", cvm->inst[i]);
-            return(-1);
+        tokenstart = add_token(cvm, cb[i].name, strlen(cb[i].name), 0, NULL);
+        if(tokenstart < 0) {
+            LOG_PRINTF(cvm, "Failed to allocate memory for callback name.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
+        /* callback variables have 0 length and read or write must be non-NULL */
+        if(new_variable(cvm,
+                        tokenstart,
+                        cb[i].readType,
+                        cb[i].length,
+                        NULL,
+                        &(cb[i]),
+                        -1) < 0) {
+            /* reason will have already been printed */
+            crustyvm_free(cvm);
+            return(NULL);
+        }
     }
-}
-
-#undef JUMP_INSTRUCTION
-#undef MATH_INSTRUCTION
 
-static int codeverify(CrustyVM *cvm) {
-    CrustyProcedure *curproc = NULL;
-    int procnum = 0;
-    int instsize;
-    unsigned int i = 0;
-    cvm->logline = 0;
-
-    while(i < cvm->insts) {
-        if(curproc == NULL) {
-            if(cvm->logline == cvm->proc[procnum].start) {
-                curproc = &(cvm->proc[procnum]);
-                procnum++;
+    if(cvm->flags & CRUSTY_FLAG_OPTIMIZE) {
+        cvm->stage = "inlining";
 #ifdef CRUSTY_TEST
-                LOG_PRINTF(cvm, "proc %s\n", curproc->name);
+        LOG_PRINTF(cvm, "Start\n");
 #endif
-            } else {
-                LOG_PRINTF_LINE(cvm, "BUG: code line not in a procedure.\n");
-                check_instruction(cvm, NULL, i);
-                return(-1);
-            }
-        }
 
-        instsize = check_instruction(cvm, &curproc, i);
-        if(instsize < 0) {
-            return(-1);
+        if(inline_procedures(cvm) < 0) {
+            crustyvm_free(cvm);
+            return(NULL);
         }
+    }
 
-        i += instsize;
-        cvm->logline++;
+    cvm->stage = "symbols scan";
+#ifdef CRUSTY_TEST
+    LOG_PRINTF(cvm, "Start\n");
+#endif
+
+    if(symbols_scan(cvm, safepath) < 0) {
+        LOG_PRINTF(cvm, "Symbols scan failed.\n");
+        crustyvm_free(cvm);
+        return(NULL);
     }
 
-    if(curproc != NULL) {
-        LOG_PRINTF_LINE(cvm, "Procedure without ret?\n");
-        return(-1);
+    if(cvm->lines == 0) {
+        LOG_PRINTF(cvm, "No lines remain after pass.\n");
+        crustyvm_free(cvm);
+        return(NULL);
     }
 
-    return(0);
-}
+    for(i = 0; i < cvm->procs; i++) {
+        cvm->proc[i].name = TOKENVAL(cvm->proc[i].nameOffset);
+        for(j = 0; j < cvm->proc[i].labels; j++) {
+            cvm->proc[i].label[j].name =
+                TOKENVAL(cvm->proc[i].label[j].nameOffset);
+        }
+    }
 
-int crustyvm_reset(CrustyVM *cvm) {
-    const char *temp = cvm->stage;
+    for(i = 0; i < cvm->vars; i++) {
+        cvm->var[i].name = TOKENVAL(cvm->var[i].nameOffset);
+    }
 
-    cvm->stage = "reset";
+    cvm->stage = "variable layout";
 #ifdef CRUSTY_TEST
     LOG_PRINTF(cvm, "Start\n");
 #endif
 
-    memcpy(cvm->stack, cvm->initializer, cvm->initialstack);
-
-    cvm->status = CRUSTY_STATUS_READY;
-    cvm->stage = temp;
-
-    return(0);
-}
+    if(layout_variables(cvm) < 0) {
+        LOG_PRINTF(cvm, "Variable layout failed.\n");
+        crustyvm_free(cvm);
+        return(NULL);
+    }
 
 #ifdef CRUSTY_TEST
-static int write_lines(CrustyVM *cvm, const char *name) {
-    FILE *out;
-    unsigned int i, j;
-    char *temp;
-
-    out = fopen(name, "wb");
-    if(out == NULL) {
-        LOG_PRINTF(cvm, "Couldn't open file %s for writing.\n", name);
-        return(-1);
+    /* output a text file because it is no longer a valid cvm source file */
+    if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
+        if(write_lines(cvm, "symbols scan.txt", 0) < 0) {
+            LOG_PRINTF(cvm, "Failed to write tokenize pass.\n");
+            crustyvm_free(cvm);
+            return(NULL);
+        }
     }
 
-    for(i = 0; i < cvm->lines; i++) {
-        for(j = 0; j < cvm->line[i].tokencount; j++) {
-            if(fprintf(out, "%s", GET_TOKEN(i, j)) < 0) {
-                LOG_PRINTF(cvm, "Couldn't write to file.\n");
-                return(-1);
+    cvm->stage = "symbols list";
+    LOG_PRINTF(cvm, "Global Variables:\n");
+    for(i = 0; i < cvm->vars; i++) {
+        if(variable_is_global(&(cvm->var[i]))) {
+            LOG_PRINTF(cvm, " %s", cvm->var[i].name);
+            if(cvm->var[i].read != NULL) {
+                LOG_PRINTF_BARE(cvm, " r");
             }
-            if(j < cvm->line[i].tokencount - 1) {
-                if(fprintf(out, " ") < 0) {
-                    LOG_PRINTF(cvm, "Couldn't write to file.\n");
-                    return(-1);
+            if(cvm->var[i].write != NULL) {
+                LOG_PRINTF_BARE(cvm, " w");
+            }
+            LOG_PRINTF_BARE(cvm, "\n");
+            if(cvm->var[i].length > 0) {
+                if(cvm->var[i].type == CRUSTY_TYPE_CHAR) {
+                    LOG_PRINTF(cvm, "  String initializer: \"");
+                    for(j = 0; j < cvm->var[i].length; j++) {
+                        LOG_PRINTF_BARE(cvm, "%c",
+                            ((char *)&(cvm->initializer[cvm->var[i].offset]))[j]);
+                    }
+                    LOG_PRINTF_BARE(cvm, "\"");
+                }
+                if(cvm->var[i].type == CRUSTY_TYPE_INT) {
+                    LOG_PRINTF(cvm, "  Integer initializer:");
+                    for(j = 0; j < cvm->var[i].length; j++) {
+                        LOG_PRINTF_BARE(cvm, " %d",
+                            ((int *)&(cvm->initializer[cvm->var[i].offset]))[j]);
+                    }
+                }
+                if(cvm->var[i].type == CRUSTY_TYPE_FLOAT) {
+                    LOG_PRINTF(cvm, "  Float initializer:");
+                    for(j = 0; j < cvm->var[i].length; j++) {
+                        LOG_PRINTF_BARE(cvm, " %g",
+                            ((double *)&(cvm->initializer[cvm->var[i].offset]))[j]);
+                    }
                 }
+                LOG_PRINTF_BARE(cvm, "\n");
             }
         }
-        if(fprintf(out, "\n") < 0) {
-            LOG_PRINTF(cvm, "Couldn't write to file.\n");
-            return(-1);
+    }
+    for(i = 0; i < cvm->procs; i++) {
+        LOG_PRINTF(cvm, "Procedure: %s @%u, %u, args: %u\n", cvm->proc[i].name,
+                                                             cvm->proc[i].start,
+                                                             cvm->proc[i].length,
+                                                             cvm->proc[i].args);
+        if(cvm->proc[i].vars > 0) {
+            LOG_PRINTF(cvm, " Variables:\n");
+            for(j = 0; j < cvm->proc[i].vars; j++) {
+                LOG_PRINTF(cvm, "  %s", cvm->proc[i].var[j]->name);
+                if(j < cvm->proc[i].args) {
+                    LOG_PRINTF_BARE(cvm, " arg %u\n", j);
+                } else {
+                    LOG_PRINTF_BARE(cvm, "\n");
+                }
+                if(cvm->proc[i].var[j]->length > 0) {
+                    if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_CHAR) {
+                        LOG_PRINTF(cvm, "   String initializer: \"");
+                        for(k = 0; k < cvm->proc[i].var[j]->length; k++) {
+                            LOG_PRINTF_BARE(cvm, "%c",
+                                ((char *)&(cvm->initializer[cvm->proc[i].var[j].offset]))[k]);
+                        }
+                        LOG_PRINTF_BARE(cvm, "\"");
+                    }
+                    if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_INT) {
+                        LOG_PRINTF(cvm, "   Integer initializer:");
+                        for(k = 0; k < cvm->proc[i].var[j]->length; k++) {
+                            LOG_PRINTF_BARE(cvm, "%c",
+                                ((int *)&(cvm->initializer[cvm->proc[i].var[j].offset]))[k]);
+                        }
+                    }
+                    if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_FLOAT) {
+                        LOG_PRINTF(cvm, "   Float initializer:");
+                        for(k = 0; k < cvm->proc[i].var[j]->length; k++) {
+                            LOG_PRINTF_BARE(cvm, "%c",
+                                ((float *)&(cvm->initializer[cvm->proc[i].var[j].offset]))[k]);
+                        }
+                    }
+                    LOG_PRINTF_BARE(cvm, "\n");
+                }
+                if(cvm->proc[i].var[j]->proc != &(cvm->proc[i])) {
+                    LOG_PRINTF(cvm, "   Improperly pointed procedure!\n");
+                }
+            }
+        }
+        if(cvm->proc[i].labels > 0) {
+            LOG_PRINTF(cvm, " Labels:\n");
+            for(j = 0; j < cvm->proc[i].labels; j++) {
+                LOG_PRINTF(cvm, "  %s @%u\n",
+                    cvm->proc[i].label[j].name,
+                    cvm->proc[i].label[j].line);
+            }
         }
     }
+#endif
 
-    fclose(out);
-
-    return(0);
-}
-#endif
-
-CrustyVM *crustyvm_new(const char *name,
-                       char *safepath,
-                       const char *program,
-                       long len,
-                       unsigned int flags,
-                       unsigned int callstacksize,
-                       const CrustyCallback *cb,
-                       unsigned int cbcount,
-                       const char **var,
-                       const char **value,
-                       unsigned int vars,
-                       void (*log_cb)(void *priv, const char *fmt, ...),
-                       void *log_priv) {
-    CrustyVM *cvm;
-    int foundmacro;
-    unsigned int i, j;
-    char namebuffer[] = "preprocess###.cvm";
-    long tokenstart;
-    unsigned long *varOffset;
-    unsigned long *valueOffset;
-
+    cvm->stage = "symbols verification";
 #ifdef CRUSTY_TEST
-    unsigned int k;
+    LOG_PRINTF(cvm, "Start\n");
 #endif
 
-    if(name == NULL) {
-        /* nothing is defined yet so don't use the macro */
-        log_cb(log_priv, "NULL passed as program name.\n");
-        return(NULL);
-    }
-
-    cvm = init();
-    if(cvm == NULL) {
+    if(symbols_verify(cvm) < 0) {
+        LOG_PRINTF(cvm, "Symbols verification failed.\n");
+        crustyvm_free(cvm);
         return(NULL);
     }
 
-    cvm->flags = flags;
-
-    cvm->log_cb = log_cb;
-    cvm->log_priv = log_priv;
-
-    cvm->stage = "tokenize";
+    cvm->stage = "code generation";
 #ifdef CRUSTY_TEST
     LOG_PRINTF(cvm, "Start\n");
 #endif
 
-    if(tokenize(cvm, name, safepath, program, len) < 0) {
+    if(codegen(cvm) < 0) {
+        LOG_PRINTF(cvm, "Code generation failed.\n");
         crustyvm_free(cvm);
         return(NULL);
     }
 
+    if(cvm->flags & CRUSTY_FLAG_OPTIMIZE) {
+        cvm->stage = "optimization";
 #ifdef CRUSTY_TEST
-    if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
-    /* this outputs ugly nonsense that's full of nulls and other crap and not
-       really useful outside of debugging the program itself. */
-        FILE *out;
-        out = fopen("tokens.bin", "wb");
-        if(out == NULL) {
-            LOG_PRINTF(cvm, "Failed to open tokenizer output file for writing.\n");
+        LOG_PRINTF(cvm, "Start\n");
+#endif
+
+        if(optimize(cvm) < 0) {
+            LOG_PRINTF(cvm, "Optimization failed.\n");
             crustyvm_free(cvm);
             return(NULL);
         }
 
-        if(fwrite(cvm->tokenmem, 1, cvm->tokenmemlen, out) <
-           (unsigned long)cvm->tokenmemlen) {
-            LOG_PRINTF(cvm, "Failed to write tokenizer output.\n");
+        cvm->stage = "procedure copying";
+#ifdef CRUSTY_TEST
+        LOG_PRINTF(cvm, "Start\n");
+#endif
+
+        if(monomorphize(cvm) < 0) {
             crustyvm_free(cvm);
             return(NULL);
         }
-        fclose(out);
-    }
+
+        cvm->stage = "tail calls";
+#ifdef CRUSTY_TEST
+        LOG_PRINTF(cvm, "Start\n");
 #endif
 
-    if(cvm->lines == 0) {
-        LOG_PRINTF(cvm, "No lines remain after pass.\n");
-        crustyvm_free(cvm);
-        return(NULL);
-    }
+        find_tail_calls(cvm);
 
+        cvm->stage = "bounds check elimination";
 #ifdef CRUSTY_TEST
-    if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
-        FILE *out;
-        out = fopen("tokens_meta.txt", "wb");
-        if(out == NULL) {
-            LOG_PRINTF(cvm, "Failed to open tokenizer metadata output file for writing.\n");
-            crustyvm_free(cvm);
-            return(NULL);
-        }
-
-        for(i = 0; i < cvm->lines; i++) {
-            fprintf(out, "%s %04u ",
-                    TOKENVAL(cvm->line[i].moduleOffset),
-                    cvm->line[i].line);
-            for(j = 0; j < cvm->line[i].tokencount; j++) {
-                fprintf(out, "%s", GET_TOKEN(i, j));
-                if(j < cvm->line[i].tokencount - 1) {
-                    fprintf(out, " ");
-                }
-            }
-            fprintf(out, "\n");
-        }
-        fclose(out);
-    }
+        LOG_PRINTF(cvm, "Start\n");
+#endif
 
-    if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
-        if(write_lines(cvm, "tokenize.cvm", 1) < 0) {
-            LOG_PRINTF(cvm, "Failed to write tokenize pass.\n");
+        if(remove_bounds_checks(cvm) < 0) {
             crustyvm_free(cvm);
             return(NULL);
         }
     }
+
+    cvm->stage = "instruction fusion";
+#ifdef CRUSTY_TEST
+    LOG_PRINTF(cvm, "Start\n");
 #endif
 
-    cvm->stage = "input variables";
+    if(fuse_instructions(cvm) < 0) {
+        crustyvm_free(cvm);
+        return(NULL);
+    }
+
+    cvm->stage = "code verification";
 #ifdef CRUSTY_TEST
     LOG_PRINTF(cvm, "Start\n");
 #endif
 
-    varOffset = malloc(sizeof(long) * vars);
-    if(varOffset == NULL) {
-        LOG_PRINTF(cvm, "Failed to allocate memory for input variables list.\n");
+    if(codeverify(cvm) < 0) {
+        LOG_PRINTF(cvm, "Code verification failed.\n");
         crustyvm_free(cvm);
         return(NULL);
     }
-    valueOffset = malloc(sizeof(long) * vars);
-    if(valueOffset == NULL) {
-        LOG_PRINTF(cvm, "Failed to allocate memory for input values list.\n");
+
+    if(prepare_run(cvm, callstacksize) < 0) {
         crustyvm_free(cvm);
         return(NULL);
     }
 
-    for(i = 0; i < vars; i++) {
-        tokenstart = add_token(cvm, var[i], strlen(var[i]), 0, NULL);
-        if(tokenstart < 0) {
-            LOG_PRINTF(cvm, "Failed to allocate memory for input variable.\n");
-            crustyvm_free(cvm);
-            return(NULL);
-        }
-        varOffset[i] = tokenstart;
-        tokenstart = add_token(cvm, value[i], strlen(value[i]), 0, NULL);
-        if(tokenstart < 0) {
-            LOG_PRINTF(cvm, "Failed to allocate memory for input value.\n");
-            crustyvm_free(cvm);
-            return(NULL);
+    return(cvm);
+}
+
+/* Saved images hold everything needed to run a program after code
+   verification, laid out so the file can be mapped and used mostly in place.
+   Names are kept in a small token memory of their own, so offsets in to it
+   work with TOKENVAL() like they do while compiling. */
+
+typedef struct {
+    unsigned int offset;
+    unsigned int count;
+} CrustyImageSection;
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    /* native sizes and byte order the image was built with */
+    unsigned int abi;
+    unsigned long long key;
+    unsigned int size;
+
+    unsigned int stacksize;
+    unsigned int initialstack;
+
+    CrustyImageSection dep;
+    CrustyImageSection line;
+    CrustyImageSection var;
+    CrustyImageSection proc;
+    CrustyImageSection varindex;
+    CrustyImageSection inst;
+    CrustyImageSection initializer;
+    CrustyImageSection procinit;
+    CrustyImageSection tokenmem;
+} CrustyImageHeader;
+
+typedef struct {
+    unsigned int name;
+    unsigned long long hash;
+} CrustyImageDep;
+
+typedef struct {
+    unsigned int module;
+    unsigned int line;
+    unsigned int instruction;
+} CrustyImageLine;
+
+typedef struct {
+    unsigned int name;
+    int type;
+    int procIndex;
+    unsigned int length;
+    unsigned int offset;
+    unsigned int callback;
+} CrustyImageVar;
+
+typedef struct {
+    unsigned int name;
+    unsigned int start;
+    unsigned int length;
+    unsigned int args;
+    unsigned int instruction;
+    unsigned int varIndex;
+    unsigned int vars;
+    unsigned int stackneeded;
+    unsigned int initializer;
+} CrustyImageProc;
+
+#define IMAGE_ABI ((sizeof(int)) | \
+                   (sizeof(double) << 8) | \
+                   (sizeof(CrustyStackArg) << 16) | \
+                   (0x01 << 24))
+
+/* names written out to an image, with the last module name remembered
+   because consecutive lines are almost always from the same one */
+typedef struct {
+    char *mem;
+    unsigned int len;
+
+    long lastModule;
+    unsigned int lastModuleOffset;
+} CrustyImageStrings;
+
+static unsigned int image_align(unsigned int size) {
+    if(size % IMAGE_ALIGNMENT != 0) {
+        size += IMAGE_ALIGNMENT - (size % IMAGE_ALIGNMENT);
+    }
+
+    return(size);
+}
+
+/* add a string in the same format as add_token(), reusing a copy if it's
+   already there */
+static long image_string(CrustyImageStrings *str, const char *val) {
+    unsigned int len = strlen(val);
+    unsigned int pos;
+    unsigned int newlen;
+    char *temp;
+
+    for(pos = 0; pos < str->len;) {
+        if(*((unsigned int *)&(str->mem[pos])) == len &&
+           memcmp(&(str->mem[pos + sizeof(unsigned int)]), val, len) == 0) {
+            return(pos);
         }
-        valueOffset[i] = tokenstart;
+        newlen = sizeof(unsigned int) + *((unsigned int *)&(str->mem[pos])) + 1;
+        FIND_ALIGNMENT_VALUE(newlen)
+        pos += newlen;
     }
 
-#ifdef CRUSTY_TEST
-    for(i = 0; i < vars; i++) {
-        LOG_PRINTF(cvm, "%s = %s\n",
-                   TOKENVAL(varOffset[i]),
-                   TOKENVAL(valueOffset[i]));
+    newlen = str->len + sizeof(unsigned int) + len + 1;
+    FIND_ALIGNMENT_VALUE(newlen)
+    temp = realloc(str->mem, newlen);
+    if(temp == NULL) {
+        return(-1);
     }
-#endif
+    str->mem = temp;
 
-    for(i = 0; i < MAX_PASSES; i++) {
-        snprintf(namebuffer, sizeof(namebuffer), "preprocess %d", i + 1);
-        cvm->stage = namebuffer;
+    memset(&(str->mem[str->len]), 0, newlen - str->len);
+    *((unsigned int *)&(str->mem[str->len])) = len;
+    memcpy(&(str->mem[str->len + sizeof(unsigned int)]), val, len);
+    pos = str->len;
+    str->len = newlen;
+
+    return(pos);
+}
+
+static CrustyImageSection image_section(unsigned int *size,
+                                        unsigned int count,
+                                        unsigned int itemsize) {
+    CrustyImageSection sec;
+
+    sec.offset = *size;
+    sec.count = count;
+    *size = image_align(*size + (count * itemsize));
+
+    return(sec);
+}
+
+int crustyvm_save_image(CrustyVM *cvm, const char *filename) {
+    const char *temp = cvm->stage;
+    CrustyImageStrings str;
+    CrustyImageHeader hdr;
+    CrustyImageDep *dep;
+    CrustyImageLine *line;
+    CrustyImageVar *var;
+    CrustyImageProc *proc;
+    int *varindex;
+    unsigned char *procinit;
+    unsigned char *image = NULL;
+    char *tempname = NULL;
+    FILE *out = NULL;
+    unsigned int varindexes = 0;
+    unsigned int procinits = 0;
+    unsigned int size;
+    unsigned int i;
+    long offset;
+
+    cvm->stage = "image saving";
 #ifdef CRUSTY_TEST
-        LOG_PRINTF(cvm, "Start\n", i);
+    LOG_PRINTF(cvm, "Start\n");
 #endif
 
-        foundmacro = preprocess(cvm, varOffset, valueOffset, vars);
-        if(foundmacro < 0) {
-            LOG_PRINTF(cvm, "Failed preprocess at pass %d.\n", i + 1);
-            crustyvm_free(cvm);
-            return(NULL);
-        }
+    str.mem = NULL;
+    str.len = 0;
+    str.lastModule = -1;
+    str.lastModuleOffset = 0;
 
-        if(cvm->lines == 0) {
-            LOG_PRINTF(cvm, "No lines remain after pass.\n");
-            crustyvm_free(cvm);
-            return(NULL);
+    for(i = 0; i < cvm->procs; i++) {
+        varindexes += cvm->proc[i].vars;
+        procinits += image_align(cvm->proc[i].stackneeded);
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = IMAGE_VERSION;
+    hdr.abi = IMAGE_ABI;
+    hdr.key = cvm->key;
+    hdr.stacksize = cvm->stacksize;
+    hdr.initialstack = cvm->initialstack;
+
+    /* names go last because their size isn't known until they're all added */
+    size = image_align(sizeof(CrustyImageHeader));
+    hdr.dep = image_section(&size, cvm->deps, sizeof(CrustyImageDep));
+    hdr.line = image_section(&size, cvm->lines, sizeof(CrustyImageLine));
+    hdr.var = image_section(&size, cvm->vars, sizeof(CrustyImageVar));
+    hdr.proc = image_section(&size, cvm->procs, sizeof(CrustyImageProc));
+    hdr.varindex = image_section(&size, varindexes, sizeof(int));
+    hdr.inst = image_section(&size, cvm->insts, sizeof(int));
+    hdr.initializer = image_section(&size, cvm->initialstack, 1);
+    hdr.procinit = image_section(&size, procinits, 1);
+
+    image = calloc(1, size);
+    if(image == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for image.\n");
+        goto error;
+    }
+
+    dep = (CrustyImageDep *)&(image[hdr.dep.offset]);
+    for(i = 0; i < cvm->deps; i++) {
+        offset = image_string(&str, TOKENVAL(cvm->dep[i].nameOffset));
+        if(offset < 0) {
+            goto nomem;
         }
+        dep[i].name = offset;
+        dep[i].hash = cvm->dep[i].hash;
+    }
 
-#ifdef CRUSTY_TEST
-        if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
-            snprintf(namebuffer, sizeof(namebuffer), "preprocess%03d.cvm", i + 1);
-            if(write_lines(cvm, namebuffer, 1) < 0) {
-                LOG_PRINTF(cvm, "Failed to write pass %d.\n", i + 1);
-                crustyvm_free(cvm);
-                return(NULL);
+    line = (CrustyImageLine *)&(image[hdr.line.offset]);
+    for(i = 0; i < cvm->lines; i++) {
+        if(cvm->line[i].moduleOffset != str.lastModule) {
+            offset = image_string(&str, TOKENVAL(cvm->line[i].moduleOffset));
+            if(offset < 0) {
+                goto nomem;
             }
+            str.lastModule = cvm->line[i].moduleOffset;
+            str.lastModuleOffset = offset;
         }
-#endif
+        line[i].module = str.lastModuleOffset;
+        line[i].line = cvm->line[i].line;
+        line[i].instruction = cvm->line[i].instruction;
+    }
 
-        if(foundmacro == 0) {
-            break;
+    var = (CrustyImageVar *)&(image[hdr.var.offset]);
+    for(i = 0; i < cvm->vars; i++) {
+        offset = image_string(&str, cvm->var[i].name);
+        if(offset < 0) {
+            goto nomem;
         }
+        var[i].name = offset;
+        var[i].type = cvm->var[i].type;
+        var[i].procIndex = cvm->var[i].procIndex;
+        var[i].length = cvm->var[i].length;
+        var[i].offset = cvm->var[i].offset;
+        var[i].callback = variable_is_callback(&(cvm->var[i]));
+    }
+
+    proc = (CrustyImageProc *)&(image[hdr.proc.offset]);
+    varindex = (int *)&(image[hdr.varindex.offset]);
+    procinit = &(image[hdr.procinit.offset]);
+    varindexes = 0;
+    procinits = 0;
+    for(i = 0; i < cvm->procs; i++) {
+        offset = image_string(&str, cvm->proc[i].name);
+        if(offset < 0) {
+            goto nomem;
+        }
+        proc[i].name = offset;
+        proc[i].start = cvm->proc[i].start;
+        proc[i].length = cvm->proc[i].length;
+        proc[i].args = cvm->proc[i].args;
+        proc[i].instruction = cvm->proc[i].instruction;
+        proc[i].varIndex = varindexes;
+        proc[i].vars = cvm->proc[i].vars;
+        proc[i].stackneeded = cvm->proc[i].stackneeded;
+        proc[i].initializer = procinits;
+
+        if(cvm->proc[i].vars > 0) {
+            memcpy(&(varindex[varindexes]),
+                   cvm->proc[i].varIndex,
+                   sizeof(int) * cvm->proc[i].vars);
+            varindexes += cvm->proc[i].vars;
+        }
+        if(cvm->proc[i].stackneeded > 0) {
+            memcpy(&(procinit[procinits]),
+                   cvm->proc[i].initializer,
+                   cvm->proc[i].stackneeded);
+            procinits += image_align(cvm->proc[i].stackneeded);
+        }
+    }
+
+    memcpy(&(image[hdr.inst.offset]), cvm->inst, sizeof(int) * cvm->insts);
+    if(cvm->initialstack > 0) {
+        memcpy(&(image[hdr.initializer.offset]),
+               cvm->initializer,
+               cvm->initialstack);
+    }
+
+    hdr.tokenmem.offset = size;
+    hdr.tokenmem.count = str.len;
+    hdr.size = size + str.len;
+    memcpy(image, &hdr, sizeof(hdr));
+
+    /* write to a temporary file and move it in to place, so anything loading
+       the image at the same time never sees a partial one */
+    i = strlen(filename) + sizeof(".new");
+    tempname = malloc(i);
+    if(tempname == NULL) {
+        goto nomem;
+    }
+    snprintf(tempname, i, "%s.new", filename);
+
+    out = fopen(tempname, "wb");
+    if(out == NULL) {
+        LOG_PRINTF(cvm, "Failed to open %s for writing.\n", tempname);
+        goto error;
+    }
+
+    if(fwrite(image, 1, size, out) < size ||
+       fwrite(str.mem, 1, str.len, out) < str.len) {
+        LOG_PRINTF(cvm, "Failed to write image.\n");
+        goto error;
+    }
+
+    if(fclose(out) != 0) {
+        out = NULL;
+        LOG_PRINTF(cvm, "Failed to write image.\n");
+        goto error;
+    }
+    out = NULL;
+
+    if(rename(tempname, filename) < 0) {
+        LOG_PRINTF(cvm, "Failed to move image in to place at %s.\n", filename);
+        goto error;
+    }
+
+    free(tempname);
+    free(image);
+    free(str.mem);
+    cvm->stage = temp;
+    return(0);
+
+nomem:
+    LOG_PRINTF(cvm, "Failed to allocate memory for image names.\n");
+error:
+    if(out != NULL) {
+        fclose(out);
+    }
+    if(tempname != NULL) {
+        remove(tempname);
+        free(tempname);
+    }
+    if(image != NULL) {
+        free(image);
+    }
+    if(str.mem != NULL) {
+        free(str.mem);
+    }
+    cvm->stage = temp;
+    return(-1);
+}
+
+/* get a section of a mapped image, making sure it's in bounds */
+static void *image_get_section(CrustyVM *cvm,
+                               CrustyImageSection *sec,
+                               unsigned int itemsize) {
+    if(sec->offset % IMAGE_ALIGNMENT != 0 ||
+       sec->offset > cvm->imagesize ||
+       sec->count > (cvm->imagesize - sec->offset) / itemsize) {
+        LOG_PRINTF(cvm, "Image section out of range.\n");
+        return(NULL);
+    }
+
+    return(&(((unsigned char *)(cvm->image))[sec->offset]));
+}
+
+/* make sure a name in the image's token memory is in bounds and terminated */
+static int image_check_token(CrustyVM *cvm, unsigned int offset) {
+    if(offset % ALIGNMENT != 0 ||
+       offset > (unsigned int)cvm->tokenmemlen ||
+       (unsigned int)cvm->tokenmemlen - offset < sizeof(unsigned int) + 1 ||
+       (unsigned int)TOKENLEN(offset) >
+           (unsigned int)cvm->tokenmemlen - offset - sizeof(unsigned int) - 1 ||
+       TOKENVAL(offset)[TOKENLEN(offset)] != '\0') {
+        LOG_PRINTF(cvm, "Image name out of range.\n");
+        return(-1);
+    }
+
+    return(0);
+}
+
+CrustyVM *crustyvm_load_image(const char *filename,
+                              const char *name,
+                              const char *program,
+                              long len,
+                              unsigned int flags,
+                              unsigned int callstacksize,
+                              const CrustyCallback *cb,
+                              unsigned int cbcount,
+                              const char **var,
+                              const char **value,
+                              unsigned int vars,
+                              void (*log_cb)(void *priv, const char *fmt, ...),
+                              void *log_priv) {
+    CrustyVM *cvm;
+    int fd;
+    struct stat filestat;
+    CrustyImageHeader *hdr;
+    CrustyImageDep *dep;
+    CrustyImageLine *line;
+    CrustyImageVar *ivar;
+    CrustyImageProc *proc;
+    int *varindex;
+    unsigned char *procinit;
+    FILE *in;
+    unsigned long long hash;
+    CrustyProcedure *curproc;
+    unsigned int i, j;
+
+    if(name == NULL) {
+        log_cb(log_priv, "NULL passed as program name.\n");
+        return(NULL);
     }
-    free(varOffset);
-    free(valueOffset);
-    if(i == MAX_PASSES) {
-        LOG_PRINTF(cvm, "Preprocess passes exceeded.\n");
-        crustyvm_free(cvm);
+
+    cvm = init();
+    if(cvm == NULL) {
         return(NULL);
     }
 
-    cvm->stage = "adding callbacks";
+    cvm->flags = flags;
+    cvm->key = image_key(name, program, len, flags,
+                         cb, cbcount, var, value, vars);
+
+    cvm->log_cb = log_cb;
+    cvm->log_priv = log_priv;
+
+    cvm->stage = "image loading";
 #ifdef CRUSTY_TEST
     LOG_PRINTF(cvm, "Start\n");
 #endif
 
-    for(i = 0; i < cbcount; i++) {
-        if(cb[i].read == NULL && cb[i].write == NULL) {
-            LOG_PRINTF(cvm, "Callback variables must have a non-NULL read and/or write function.\n");
-            crustyvm_free(cvm);
-            return(NULL);
-        }
-
-        tokenstart = add_token(cvm, cb[i].name, strlen(cb[i].name), 0, NULL);
-        if(tokenstart < 0) {
-            LOG_PRINTF(cvm, "Failed to allocate memory for callback name.\n");
-            crustyvm_free(cvm);
-            return(NULL);
-        }
-        /* callback variables have 0 length and read or write must be non-NULL */
-        if(new_variable(cvm,
-                        tokenstart,
-                        cb[i].readType,
-                        cb[i].length,
-                        NULL,
-                        &(cb[i]),
-                        -1) < 0) {
-            /* reason will have already been printed */
-            crustyvm_free(cvm);
-            return(NULL);
-        }
+    fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        LOG_PRINTF(cvm, "Failed to open image %s.\n", filename);
+        goto error;
+    }
+    if(fstat(fd, &filestat) < 0) {
+        LOG_PRINTF(cvm, "Failed to stat image %s.\n", filename);
+        close(fd);
+        goto error;
+    }
+    if(!S_ISREG(filestat.st_mode) ||
+       (unsigned long)filestat.st_size < sizeof(CrustyImageHeader) ||
+       (unsigned long)filestat.st_size > UINT_MAX) {
+        LOG_PRINTF(cvm, "%s isn't an image.\n", filename);
+        close(fd);
+        goto error;
     }
 
-    cvm->stage = "symbols scan";
-#ifdef CRUSTY_TEST
-    LOG_PRINTF(cvm, "Start\n");
-#endif
+    cvm->imagesize = filestat.st_size;
+    cvm->image = mmap(NULL, cvm->imagesize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(cvm->image == MAP_FAILED) {
+        cvm->image = NULL;
+        LOG_PRINTF(cvm, "Failed to map image %s.\n", filename);
+        goto error;
+    }
 
-    if(symbols_scan(cvm, safepath) < 0) {
-        LOG_PRINTF(cvm, "Symbols scan failed.\n");
-        crustyvm_free(cvm);
-        return(NULL);
+    hdr = (CrustyImageHeader *)(cvm->image);
+    if(memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) != 0 ||
+       hdr->size != cvm->imagesize) {
+        LOG_PRINTF(cvm, "%s isn't an image.\n", filename);
+        goto error;
+    }
+    if(hdr->version != IMAGE_VERSION || hdr->abi != IMAGE_ABI) {
+        LOG_PRINTF(cvm, "Image %s is from a different build.\n", filename);
+        goto error;
+    }
+    if(hdr->key != cvm->key) {
+        LOG_PRINTF(cvm, "Image %s is out of date.\n", filename);
+        goto error;
     }
 
-    if(cvm->lines == 0) {
-        LOG_PRINTF(cvm, "No lines remain after pass.\n");
-        crustyvm_free(cvm);
-        return(NULL);
+    dep = image_get_section(cvm, &(hdr->dep), sizeof(CrustyImageDep));
+    line = image_get_section(cvm, &(hdr->line), sizeof(CrustyImageLine));
+    ivar = image_get_section(cvm, &(hdr->var), sizeof(CrustyImageVar));
+    proc = image_get_section(cvm, &(hdr->proc), sizeof(CrustyImageProc));
+    varindex = image_get_section(cvm, &(hdr->varindex), sizeof(int));
+    cvm->inst = image_get_section(cvm, &(hdr->inst), sizeof(int));
+    cvm->initializer = image_get_section(cvm, &(hdr->initializer), 1);
+    procinit = image_get_section(cvm, &(hdr->procinit), 1);
+    cvm->tokenmem = image_get_section(cvm, &(hdr->tokenmem), 1);
+    if(dep == NULL || line == NULL || ivar == NULL || proc == NULL ||
+       varindex == NULL || cvm->inst == NULL || cvm->initializer == NULL ||
+       procinit == NULL || cvm->tokenmem == NULL) {
+        goto error;
+    }
+    cvm->tokenmemlen = hdr->tokenmem.count;
+    cvm->insts = hdr->inst.count;
+    cvm->stacksize = hdr->stacksize;
+    cvm->initialstack = hdr->initialstack;
+    if(cvm->initialstack != hdr->initializer.count ||
+       cvm->initialstack % STACK_ALIGNMENT != 0 ||
+       cvm->initialstack > cvm->stacksize ||
+       hdr->line.count == 0 || hdr->proc.count == 0 || cvm->insts == 0) {
+        LOG_PRINTF(cvm, "Invalid image.\n");
+        goto error;
     }
 
-    for(i = 0; i < cvm->procs; i++) {
-        cvm->proc[i].name = TOKENVAL(cvm->proc[i].nameOffset);
-        for(j = 0; j < cvm->proc[i].labels; j++) {
-            cvm->proc[i].label[j].name =
-                TOKENVAL(cvm->proc[i].label[j].nameOffset);
+    /* included files may have changed */
+    for(i = 0; i < hdr->dep.count; i++) {
+        if(image_check_token(cvm, dep[i].name) < 0) {
+            goto error;
+        }
+        in = fopen(TOKENVAL(dep[i].name), "rb");
+        if(in == NULL) {
+            LOG_PRINTF(cvm, "Failed to open %s.\n", TOKENVAL(dep[i].name));
+            goto error;
+        }
+        if(image_hash_file(in, &hash) < 0) {
+            LOG_PRINTF(cvm, "Failed to read %s.\n", TOKENVAL(dep[i].name));
+            fclose(in);
+            goto error;
+        }
+        fclose(in);
+        if(hash != dep[i].hash) {
+            LOG_PRINTF(cvm, "Image %s is out of date.\n", filename);
+            goto error;
         }
     }
 
-    for(i = 0; i < cvm->vars; i++) {
-        cvm->var[i].name = TOKENVAL(cvm->var[i].nameOffset);
+    cvm->dep = malloc(sizeof(CrustyDependency) * hdr->dep.count);
+    if(cvm->dep == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for dependency list.\n");
+        goto error;
+    }
+    for(i = 0; i < hdr->dep.count; i++) {
+        cvm->dep[i].nameOffset = dep[i].name;
+        cvm->dep[i].hash = dep[i].hash;
     }
+    cvm->deps = hdr->dep.count;
 
-#ifdef CRUSTY_TEST
-    /* output a text file because it is no longer a valid cvm source file */
-    if(cvm->flags & CRUSTY_FLAG_OUTPUT_PASSES) {
-        if(write_lines(cvm, "symbols scan.txt", 0) < 0) {
-            LOG_PRINTF(cvm, "Failed to write tokenize pass.\n");
-            crustyvm_free(cvm);
-            return(NULL);
+    cvm->line = calloc(hdr->line.count, sizeof(CrustyLine));
+    if(cvm->line == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for lines.\n");
+        goto error;
+    }
+    cvm->lines = hdr->line.count;
+    for(i = 0; i < cvm->lines; i++) {
+        if(image_check_token(cvm, line[i].module) < 0) {
+            goto error;
         }
+        if(line[i].instruction >= cvm->insts ||
+           (i > 0 && line[i].instruction <= line[i - 1].instruction)) {
+            LOG_PRINTF(cvm, "Invalid image line.\n");
+            goto error;
+        }
+        cvm->line[i].moduleOffset = line[i].module;
+        cvm->line[i].line = line[i].line;
+        cvm->line[i].instruction = line[i].instruction;
     }
 
-    cvm->stage = "symbols list";
-    LOG_PRINTF(cvm, "Global Variables:\n");
-    for(i = 0; i < cvm->vars; i++) {
-        if(variable_is_global(&(cvm->var[i]))) {
-            LOG_PRINTF(cvm, " %s", cvm->var[i].name);
-            if(cvm->var[i].read != NULL) {
-                LOG_PRINTF_BARE(cvm, " r");
-            }
-            if(cvm->var[i].write != NULL) {
-                LOG_PRINTF_BARE(cvm, " w");
-            }
-            LOG_PRINTF_BARE(cvm, "\n");
-            if(cvm->var[i].length > 0) {
-                if(cvm->var[i].type == CRUSTY_TYPE_CHAR) {
-                    LOG_PRINTF(cvm, "  String initializer: \"");
-                    for(j = 0; j < cvm->var[i].length; j++) {
-                        LOG_PRINTF_BARE(cvm, "%c",
-                            ((char *)&(cvm->initializer[cvm->var[i].offset]))[j]);
-                    }
-                    LOG_PRINTF_BARE(cvm, "\"");
-                }
-                if(cvm->var[i].type == CRUSTY_TYPE_INT) {
-                    LOG_PRINTF(cvm, "  Integer initializer:");
-                    for(j = 0; j < cvm->var[i].length; j++) {
-                        LOG_PRINTF_BARE(cvm, " %d",
-                            ((int *)&(cvm->initializer[cvm->var[i].offset]))[j]);
-                    }
-                }
-                if(cvm->var[i].type == CRUSTY_TYPE_FLOAT) {
-                    LOG_PRINTF(cvm, "  Float initializer:");
-                    for(j = 0; j < cvm->var[i].length; j++) {
-                        LOG_PRINTF_BARE(cvm, " %g",
-                            ((double *)&(cvm->initializer[cvm->var[i].offset]))[j]);
-                    }
-                }
-                LOG_PRINTF_BARE(cvm, "\n");
-            }
-        }
+    cvm->proc = calloc(hdr->proc.count, sizeof(CrustyProcedure));
+    if(cvm->proc == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for procedures.\n");
+        goto error;
     }
+    cvm->procs = hdr->proc.count;
+
+    cvm->var = malloc(sizeof(CrustyVariable) * hdr->var.count);
+    if(cvm->var == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for variables.\n");
+        goto error;
+    }
+    cvm->vars = hdr->var.count;
+
     for(i = 0; i < cvm->procs; i++) {
-        LOG_PRINTF(cvm, "Procedure: %s @%u, %u, args: %u\n", cvm->proc[i].name,
-                                                             cvm->proc[i].start,
-                                                             cvm->proc[i].length,
-                                                             cvm->proc[i].args);
-        if(cvm->proc[i].vars > 0) {
-            LOG_PRINTF(cvm, " Variables:\n");
-            for(j = 0; j < cvm->proc[i].vars; j++) {
-                LOG_PRINTF(cvm, "  %s", cvm->proc[i].var[j]->name);
-                if(j < cvm->proc[i].args) {
-                    LOG_PRINTF_BARE(cvm, " arg %u\n", j);
-                } else {
-                    LOG_PRINTF_BARE(cvm, "\n");
-                }
-                if(cvm->proc[i].var[j]->length > 0) {
-                    if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_CHAR) {
-                        LOG_PRINTF(cvm, "   String initializer: \"");
-                        for(k = 0; k < cvm->proc[i].var[j]->length; k++) {
-                            LOG_PRINTF_BARE(cvm, "%c",
-                                ((char *)&(cvm->initializer[cvm->proc[i].var[j].offset]))[k]);
-                        }
-                        LOG_PRINTF_BARE(cvm, "\"");
-                    }
-                    if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_INT) {
-                        LOG_PRINTF(cvm, "   Integer initializer:");
-                        for(k = 0; k < cvm->proc[i].var[j]->length; k++) {
-                            LOG_PRINTF_BARE(cvm, "%c",
-                                ((int *)&(cvm->initializer[cvm->proc[i].var[j].offset]))[k]);
-                        }
-                    }
-                    if(cvm->proc[i].var[j]->type == CRUSTY_TYPE_FLOAT) {
-                        LOG_PRINTF(cvm, "   Float initializer:");
-                        for(k = 0; k < cvm->proc[i].var[j]->length; k++) {
-                            LOG_PRINTF_BARE(cvm, "%c",
-                                ((float *)&(cvm->initializer[cvm->proc[i].var[j].offset]))[k]);
-                        }
-                    }
-                    LOG_PRINTF_BARE(cvm, "\n");
-                }
-                if(cvm->proc[i].var[j]->proc != &(cvm->proc[i])) {
-                    LOG_PRINTF(cvm, "   Improperly pointed procedure!\n");
-                }
-            }
+        curproc = &(cvm->proc[i]);
+        if(image_check_token(cvm, proc[i].name) < 0) {
+            goto error;
         }
-        if(cvm->proc[i].labels > 0) {
-            LOG_PRINTF(cvm, " Labels:\n");
-            for(j = 0; j < cvm->proc[i].labels; j++) {
-                LOG_PRINTF(cvm, "  %s @%u\n",
-                    cvm->proc[i].label[j].name,
-                    cvm->proc[i].label[j].line);
+        if(proc[i].start >= cvm->lines ||
+           (i > 0 && proc[i].start <= proc[i - 1].start) ||
+           proc[i].instruction != line[proc[i].start].instruction ||
+           proc[i].vars > hdr->varindex.count ||
+           proc[i].varIndex > hdr->varindex.count - proc[i].vars ||
+           proc[i].args > proc[i].vars ||
+           proc[i].initializer > hdr->procinit.count ||
+           proc[i].stackneeded % STACK_ALIGNMENT != 0 ||
+           proc[i].stackneeded > hdr->procinit.count - proc[i].initializer) {
+            LOG_PRINTF(cvm, "Invalid image procedure.\n");
+            goto error;
+        }
+
+        curproc->nameOffset = proc[i].name;
+        curproc->name = TOKENVAL(proc[i].name);
+        curproc->start = proc[i].start;
+        curproc->length = proc[i].length;
+        curproc->args = proc[i].args;
+        curproc->instruction = proc[i].instruction;
+        curproc->stackneeded = proc[i].stackneeded;
+        curproc->initializer = &(procinit[proc[i].initializer]);
+
+        if(proc[i].vars > 0) {
+            curproc->varIndex = malloc(sizeof(int) * proc[i].vars);
+            if(curproc->varIndex == NULL) {
+                LOG_PRINTF(cvm, "Failed to allocate memory for procedure variable list.\n");
+                goto error;
+            }
+            curproc->var = malloc(sizeof(CrustyVariable *) * proc[i].vars);
+            if(curproc->var == NULL) {
+                LOG_PRINTF(cvm, "Failed to allocate memory for procedure variable pointer list.\n");
+                goto error;
             }
+            curproc->vars = proc[i].vars;
         }
     }
-#endif
 
-    cvm->stage = "symbols verification";
-#ifdef CRUSTY_TEST
-    LOG_PRINTF(cvm, "Start\n");
-#endif
+    for(i = 0; i < cvm->vars; i++) {
+        if(image_check_token(cvm, ivar[i].name) < 0) {
+            goto error;
+        }
+        cvm->var[i].nameOffset = ivar[i].name;
+        cvm->var[i].name = TOKENVAL(ivar[i].name);
+        cvm->var[i].type = ivar[i].type;
+        cvm->var[i].procIndex = ivar[i].procIndex;
+        cvm->var[i].proc = NULL;
+        cvm->var[i].length = ivar[i].length;
+        cvm->var[i].offset = ivar[i].offset;
+        cvm->var[i].read = NULL;
+        cvm->var[i].readpriv = NULL;
+        cvm->var[i].write = NULL;
+        cvm->var[i].writepriv = NULL;
+
+        if(ivar[i].type < CRUSTY_TYPE_NONE ||
+           ivar[i].type > CRUSTY_TYPE_FLOAT ||
+           ivar[i].procIndex < -1 ||
+           ivar[i].procIndex >= (int)cvm->procs) {
+            LOG_PRINTF(cvm, "Invalid image variable.\n");
+            goto error;
+        }
 
-    if(symbols_verify(cvm) < 0) {
-        LOG_PRINTF(cvm, "Symbols verification failed.\n");
-        crustyvm_free(cvm);
-        return(NULL);
+        if(ivar[i].callback) {
+            /* bind callbacks again by name */
+            for(j = 0; j < cbcount; j++) {
+                if(strcmp(cb[j].name, cvm->var[i].name) == 0) {
+                    break;
+                }
+            }
+            if(j == cbcount || ivar[i].procIndex != -1) {
+                LOG_PRINTF(cvm, "Image %s is out of date.\n", filename);
+                goto error;
+            }
+            cvm->var[i].read = cb[j].read;
+            cvm->var[i].readpriv = cb[j].readpriv;
+            cvm->var[i].write = cb[j].write;
+            cvm->var[i].writepriv = cb[j].writepriv;
+        } else if(variable_is_global(&(cvm->var[i]))) {
+            if(ivar[i].type == CRUSTY_TYPE_NONE ||
+               ivar[i].length == 0 ||
+               ivar[i].offset % type_size(ivar[i].type) != 0 ||
+               ivar[i].offset > cvm->initialstack ||
+               ivar[i].length > (cvm->initialstack - ivar[i].offset) /
+                                type_size(ivar[i].type)) {
+                LOG_PRINTF(cvm, "Invalid image variable.\n");
+                goto error;
+            }
+        } else if(variable_is_argument(&(cvm->var[i]))) {
+            if(ivar[i].offset == 0 ||
+               ivar[i].offset > proc[ivar[i].procIndex].args) {
+                LOG_PRINTF(cvm, "Invalid image variable.\n");
+                goto error;
+            }
+        } else {
+            if(ivar[i].type == CRUSTY_TYPE_NONE ||
+               ivar[i].offset % type_size(ivar[i].type) != 0 ||
+               ivar[i].offset > proc[ivar[i].procIndex].stackneeded ||
+               ivar[i].length > ivar[i].offset / type_size(ivar[i].type)) {
+                LOG_PRINTF(cvm, "Invalid image variable.\n");
+                goto error;
+            }
+        }
     }
 
-    cvm->stage = "code generation";
-#ifdef CRUSTY_TEST
-    LOG_PRINTF(cvm, "Start\n");
-#endif
-
-    if(codegen(cvm) < 0) {
-        LOG_PRINTF(cvm, "Code generation failed.\n");
-        crustyvm_free(cvm);
-        return(NULL);
+    /* point CrustyVariables in CrustyProcedures and vise versa */
+    for(i = 0; i < cvm->procs; i++) {
+        curproc = &(cvm->proc[i]);
+        for(j = 0; j < curproc->vars; j++) {
+            curproc->varIndex[j] = varindex[proc[i].varIndex + j];
+            if(curproc->varIndex[j] < 0 ||
+               curproc->varIndex[j] >= (int)cvm->vars ||
+               cvm->var[curproc->varIndex[j]].procIndex != (int)i) {
+                LOG_PRINTF(cvm, "Invalid image procedure variable.\n");
+                goto error;
+            }
+            curproc->var[j] = &(cvm->var[curproc->varIndex[j]]);
+            curproc->var[j]->proc = curproc;
+        }
     }
 
+    /* the same checks as after compiling, so a damaged image can't do anything
+       a program couldn't */
     cvm->stage = "code verification";
 #ifdef CRUSTY_TEST
     LOG_PRINTF(cvm, "Start\n");
@@ -4575,50 +11897,31 @@ CrustyVM *crustyvm_new(const char *name,
 
     if(codeverify(cvm) < 0) {
         LOG_PRINTF(cvm, "Code verification failed.\n");
-        crustyvm_free(cvm);
-        return(NULL);
-    }
-
-    cvm->stage = "memory allocation";
-#ifdef CRUSTY_TEST
-    LOG_PRINTF(cvm, "Start\n");
-#endif
-
-    cvm->stack = malloc(cvm->stacksize);
-    if(cvm->stack == NULL) {
-        LOG_PRINTF(cvm, "Failed to allocate stack memory.\n");
-        crustyvm_free(cvm);
-        return(NULL);
-    }
-
-    if(callstacksize == 0) {
-        cvm->callstacksize = DEFAULT_CALLSTACK_SIZE;
-    } else {
-        cvm->callstacksize = callstacksize;
-    }
-
-    cvm->cstack = malloc(sizeof(CrustyCallStackArg) * cvm->callstacksize);
-    if(cvm->cstack == NULL) {
-        LOG_PRINTF(cvm, "Failed to allocate callstack memory.\n");
-        crustyvm_free(cvm);
-        return(NULL);
+        goto error;
     }
 
-    if(crustyvm_reset(cvm) < 0) {
-        crustyvm_free(cvm);
-        return(NULL);
+    if(prepare_run(cvm, callstacksize) < 0) {
+        goto error;
     }
 
     return(cvm);
+
+error:
+    crustyvm_free(cvm);
+    return(NULL);
 }
 
 static int read_var(CrustyVM *cvm,
                     int *intval,
                     double *floatval,
                     int ptr,
-                    CrustyVariable *var,
+                    unsigned int varnum,
                     unsigned int index) {
-    if(var->read != NULL) {
+    const CrustyVarInfo *info = &(cvm->vinfo[varnum]);
+    CrustyVariable *var;
+
+    if(info->flags & VARINFO_READ) {
+        var = &(cvm->var[varnum]);
         if(var->type == CRUSTY_TYPE_CHAR) {
             /* the function will assume only 1 byte of storage so make sure it
              * is all clear. */
@@ -4631,9 +11934,9 @@ static int read_var(CrustyVM *cvm,
         }
     }
 
-    if(var->type == CRUSTY_TYPE_CHAR) {
+    if(info->type == CRUSTY_TYPE_CHAR) {
         *intval = (int)(cvm->stack[ptr + index]);
-    } else if(var->type == CRUSTY_TYPE_FLOAT) {
+    } else if(info->type == CRUSTY_TYPE_FLOAT) {
         *floatval = *((double *)(&(cvm->stack[ptr + (index * sizeof(double))])));
     } else { /* INT */
         *intval = *((int *)(&(cvm->stack[ptr + (index * sizeof(int))])));
@@ -4646,11 +11949,13 @@ static void write_var(CrustyVM *cvm,
                       int intval,
                       double floatval,
                       int ptr,
-                      CrustyVariable *var,
+                      unsigned int varnum,
                       unsigned int index) {
-    if(var->type == CRUSTY_TYPE_CHAR) {
+    const CrustyVarInfo *info = &(cvm->vinfo[varnum]);
+
+    if(info->type == CRUSTY_TYPE_CHAR) {
         cvm->stack[ptr + index] = ((unsigned char)intval);
-    } else if(var->type == CRUSTY_TYPE_FLOAT) {
+    } else if(info->type == CRUSTY_TYPE_FLOAT) {
         *((double *)(&(cvm->stack[ptr + (index * sizeof(double))]))) = floatval;
     } else { /* INT */
         *((int *)(&(cvm->stack[ptr + (index * sizeof(int))]))) = intval;
@@ -4662,30 +11967,31 @@ static void write_var(CrustyVM *cvm,
                                      (sizeof(CrustyStackArg) * (IDX))])))
 
 #define GET_PTR(VAR, SP) \
-    (variable_is_global(&(cvm->var[VAR])) ? \
-        (cvm->var[VAR].offset) : \
-        ((SP) - cvm->var[VAR].offset))
+    ((cvm->vinfo[VAR].flags & VARINFO_GLOBAL) ? \
+        (cvm->vinfo[VAR].offset) : \
+        ((SP) - cvm->vinfo[VAR].offset))
 
 /* see variable permutations.txt for more information on what these do */
 
 /* only returns an index to another variable (which may contain a float) or an
    integer */
 static int update_src_ref(CrustyVM *cvm,
+                          unsigned int sp,
                           int *flags,
                           int *val,
                           int *index,
                           int *ptr) {
     if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-        if(variable_is_argument(&(cvm->var[*val]))) {
-            if((STACK_ARG(cvm->sp, cvm->var[*val].offset)->flags &
+        if((cvm->vinfo[*val].flags & VARINFO_ARGUMENT)) {
+            if((STACK_ARG(sp, cvm->vinfo[*val].offset)->flags &
                 MOVE_FLAG_TYPE_MASK) ==
                MOVE_FLAG_VAR) {
                 if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                    if(variable_is_argument(&(cvm->var[*index]))) {
-                        if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                    if((cvm->vinfo[*index].flags & VARINFO_ARGUMENT)) {
+                        if((STACK_ARG(sp, cvm->vinfo[*index].offset)->flags &
                            MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-                            if(cvm->var[STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->val].type ==
+                            if(cvm->vinfo[STACK_ARG(sp,
+                                                  cvm->vinfo[*index].offset)->val].type ==
                                CRUSTY_TYPE_FLOAT) {
                                 cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                                 return(-1);
@@ -4694,19 +12000,19 @@ static int update_src_ref(CrustyVM *cvm,
                             if(read_var(cvm,
                                         index,
                                         NULL,
-                                        STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                        &(cvm->var[STACK_ARG(cvm->sp,
-                                                             cvm->var[*index].offset)->val]),
-                                        STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->index) < 0) {
+                                        STACK_ARG(sp, cvm->vinfo[*index].offset)->ptr,
+                                        STACK_ARG(sp,
+                                                             cvm->vinfo[*index].offset)->val,
+                                        STACK_ARG(sp,
+                                                  cvm->vinfo[*index].offset)->index) < 0) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(-1);
                             }
                         } else {
-                            *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                            *index = STACK_ARG(sp, cvm->vinfo[*index].offset)->val;
                         }
                     } else {
-                        if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                        if(cvm->vinfo[*index].type == CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
                         }
@@ -4715,7 +12021,7 @@ static int update_src_ref(CrustyVM *cvm,
                                     index,
                                     NULL,
                                     GET_PTR(*index, *ptr),
-                                    &(cvm->var[*index]),
+                                    *index,
                                     0) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
@@ -4729,27 +12035,27 @@ static int update_src_ref(CrustyVM *cvm,
                     return(-1);
                 }
 
-                *index += STACK_ARG(cvm->sp, cvm->var[*val].offset)->index;
+                *index += STACK_ARG(sp, cvm->vinfo[*val].offset)->index;
                 if(*index >
-                   (int)(cvm->var[STACK_ARG(cvm->sp, 
-                                            cvm->var[*val].offset)->val].length -
+                   (int)(cvm->vinfo[STACK_ARG(sp, 
+                                            cvm->vinfo[*val].offset)->val].length -
                    1)) {
                     cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
                     return(-1);
                 }
 
                 *flags = MOVE_FLAG_VAR;
-                *ptr = STACK_ARG(cvm->sp, cvm->var[*val].offset)->ptr;
-                *val = STACK_ARG(cvm->sp, cvm->var[*val].offset)->val;
+                *ptr = STACK_ARG(sp, cvm->vinfo[*val].offset)->ptr;
+                *val = STACK_ARG(sp, cvm->vinfo[*val].offset)->val;
                 /* index is already updated */
             } else {
                 if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                    if(variable_is_argument(&(cvm->var[*index]))) {
-                        if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                    if((cvm->vinfo[*index].flags & VARINFO_ARGUMENT)) {
+                        if((STACK_ARG(sp, cvm->vinfo[*index].offset)->flags &
                             MOVE_FLAG_TYPE_MASK) ==
                            MOVE_FLAG_VAR) {
-                            if(cvm->var[STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->val].type ==
+                            if(cvm->vinfo[STACK_ARG(sp,
+                                                  cvm->vinfo[*index].offset)->val].type ==
                                CRUSTY_TYPE_FLOAT) {
                                 cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                                 return(-1);
@@ -4758,19 +12064,19 @@ static int update_src_ref(CrustyVM *cvm,
                             if(read_var(cvm,
                                         index,
                                         NULL,
-                                        STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                        &(cvm->var[STACK_ARG(cvm->sp,
-                                                             cvm->var[*index].offset)->val]),
-                                        STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->index) < 0) {
+                                        STACK_ARG(sp, cvm->vinfo[*index].offset)->ptr,
+                                        STACK_ARG(sp,
+                                                             cvm->vinfo[*index].offset)->val,
+                                        STACK_ARG(sp,
+                                                  cvm->vinfo[*index].offset)->index) < 0) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(-1);
                             }
                         } else {
-                            *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                            *index = STACK_ARG(sp, cvm->vinfo[*index].offset)->val;
                         }
                     } else {
-                        if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                        if(cvm->vinfo[*index].type == CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
                         }
@@ -4779,7 +12085,7 @@ static int update_src_ref(CrustyVM *cvm,
                                     index,
                                     NULL,
                                     GET_PTR(*index, *ptr),
-                                    &(cvm->var[*index]),
+                                    *index,
                                     0) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
@@ -4794,15 +12100,15 @@ static int update_src_ref(CrustyVM *cvm,
                 }
 
                 *flags = MOVE_FLAG_IMMEDIATE;
-                *val = STACK_ARG(cvm->sp, cvm->var[*val].offset)->val;
+                *val = STACK_ARG(sp, cvm->vinfo[*val].offset)->val;
             }
         } else {
             if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                if(variable_is_argument(&(cvm->var[*index]))) {
-                    if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                if((cvm->vinfo[*index].flags & VARINFO_ARGUMENT)) {
+                    if((STACK_ARG(sp, cvm->vinfo[*index].offset)->flags &
                        MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-                        if(cvm->var[STACK_ARG(cvm->sp,
-                                              cvm->var[*index].offset)->val].type ==
+                        if(cvm->vinfo[STACK_ARG(sp,
+                                              cvm->vinfo[*index].offset)->val].type ==
                            CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
@@ -4811,19 +12117,19 @@ static int update_src_ref(CrustyVM *cvm,
                         if(read_var(cvm,
                                     index,
                                     NULL,
-                                    STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                    &(cvm->var[STACK_ARG(cvm->sp,
-                                                         cvm->var[*index].offset)->val]),
-                                    STACK_ARG(cvm->sp,
-                                              cvm->var[*index].offset)->index) < 0) {
+                                    STACK_ARG(sp, cvm->vinfo[*index].offset)->ptr,
+                                    STACK_ARG(sp,
+                                                         cvm->vinfo[*index].offset)->val,
+                                    STACK_ARG(sp,
+                                              cvm->vinfo[*index].offset)->index) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
                         }
                     } else {
-                        *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                        *index = STACK_ARG(sp, cvm->vinfo[*index].offset)->val;
                     }
                 } else {
-                    if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                    if(cvm->vinfo[*index].type == CRUSTY_TYPE_FLOAT) {
                         cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                         return(-1);
                     }
@@ -4832,7 +12138,7 @@ static int update_src_ref(CrustyVM *cvm,
                                 index,
                                 NULL,
                                 GET_PTR(*index, *ptr),
-                                &(cvm->var[*index]),
+                                *index,
                                 0) < 0) {
                         cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                         return(-1);
@@ -4841,7 +12147,7 @@ static int update_src_ref(CrustyVM *cvm,
             } /* else {
                 do nothing
             } */
-            if(*index < 0 || *index > (int)(cvm->var[*val].length - 1)) {
+            if(*index < 0 || *index > (int)(cvm->vinfo[*val].length - 1)) {
                 cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
                 return(-1);
             }
@@ -4851,14 +12157,14 @@ static int update_src_ref(CrustyVM *cvm,
             *ptr = GET_PTR(*val, *ptr);
         }
     } else if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_LENGTH) {
-        if(variable_is_argument(&(cvm->var[*val]))) {
-            if((STACK_ARG(cvm->sp, cvm->var[*val].offset)->flags &
+        if((cvm->vinfo[*val].flags & VARINFO_ARGUMENT)) {
+            if((STACK_ARG(sp, cvm->vinfo[*val].offset)->flags &
                 MOVE_FLAG_TYPE_MASK) ==
                MOVE_FLAG_VAR) {
                 *flags = MOVE_FLAG_IMMEDIATE;
-                *index = STACK_ARG(cvm->sp, cvm->var[*val].offset)->index;
-                *val = cvm->var[STACK_ARG(cvm->sp,
-                                          cvm->var[*val].offset)->val].length -
+                *index = STACK_ARG(sp, cvm->vinfo[*val].offset)->index;
+                *val = cvm->vinfo[STACK_ARG(sp,
+                                          cvm->vinfo[*val].offset)->val].length -
                        *index;
             } else {
                 *flags = MOVE_FLAG_IMMEDIATE;
@@ -4866,7 +12172,7 @@ static int update_src_ref(CrustyVM *cvm,
             }
         } else {
             *flags = MOVE_FLAG_IMMEDIATE;
-            *val = cvm->var[*val].length;
+            *val = cvm->vinfo[*val].length;
         }
     } else if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_IMMEDIATE) {
         *flags = MOVE_FLAG_IMMEDIATE;
@@ -4879,45 +12185,93 @@ static int update_src_ref(CrustyVM *cvm,
     return(0);
 }
 
-static int call(CrustyVM *cvm, unsigned int procindex, unsigned int argsindex) {
+/* initialize the local variables of a new frame starting at base.  Cleared
+   ranges may run over copied ones, so the copies have to come last. */
+static void init_frame(CrustyVM *cvm,
+                       const CrustyProcedure *proc,
+                       unsigned int base) {
     unsigned int i;
-    unsigned int newsp;
-    CrustyProcedure *callee;
+
+    for(i = 0; i < proc->zeros; i++) {
+        memset(&(cvm->stack[base + proc->zero[i].offset]),
+               0,
+               proc->zero[i].length);
+    }
+
+    for(i = 0; i < proc->copies; i++) {
+        memcpy(&(cvm->stack[base + proc->copy[i].offset]),
+               &(proc->initializer[proc->copy[i].offset]),
+               proc->copy[i].length);
+    }
+}
+
+/* Resolve argument number i of a call from a procedure with its stack pointer
+   at sp all the way to what it refers to, so an argument passed straight on to
+   another procedure just has what it was resolved to copied along. */
+static int resolve_arg(CrustyVM *cvm,
+                       const int *inst,
+                       unsigned int sp,
+                       unsigned int argsindex,
+                       unsigned int i,
+                       CrustyStackArg *arg) {
     int flags, val, index, ptr;
 
-    if(cvm->csp == cvm->callstacksize) {
-        cvm->status = CRUSTY_STATUS_STACK_OVERFLOW;
+    flags = inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_FLAGS];
+    val = inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_VAL];
+    index = inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_INDEX];
+    ptr = sp;
+
+    if(flags == (MOVE_FLAG_VAR | MOVE_FLAG_INDEX_IMMEDIATE) &&
+       index == 0 &&
+       (cvm->vinfo[val].flags & VARINFO_ARGUMENT)) {
+        *arg = *STACK_ARG(sp, cvm->vinfo[val].offset);
+        return(0);
+    }
+
+    if(update_src_ref(cvm, sp, &flags, &val, &index, &ptr) < 0) {
         return(-1);
     }
 
+    arg->flags = flags;
+    arg->val = val;
+    arg->index = index;
+    arg->ptr = ptr;
+
+    return(0);
+}
+
+/* set up the frame and call stack for a call to procindex from a procedure
+   with its stack pointer at sp.  The arguments are read from inst, which is
+   either the instructions or the threaded code, and the return address is in
+   the same one.  The caller is responsible for moving its stack and
+   instruction pointers in to the new procedure on success. */
+static int call(CrustyVM *cvm,
+                const int *inst,
+                unsigned int sp,
+                unsigned int procindex,
+                unsigned int argsindex) {
+    unsigned int i;
+    unsigned int newsp;
+    CrustyProcedure *callee;
+
     callee = &(cvm->proc[procindex]);
-    newsp = cvm->sp + callee->stackneeded;
+    newsp = sp + callee->stackneeded;
 
-    if(newsp > cvm->stacksize) {
-        cvm->status = CRUSTY_STATUS_STACK_OVERFLOW;
-        return(-1);
+    if(!cvm->bounded) {
+        if(cvm->csp == cvm->callstacksize ||
+           newsp > cvm->stacksize) {
+            cvm->status = CRUSTY_STATUS_STACK_OVERFLOW;
+            return(-1);
+        }
     }
 
-    /* initialize local variables */
-    memcpy(&(cvm->stack[cvm->sp]),
-           callee->initializer,
-           callee->stackneeded);
+    init_frame(cvm, callee, sp);
 
     /* set up procedure arguments */
     for(i = 0; i < callee->args; i++) {
-        flags = cvm->inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_FLAGS];
-        val = cvm->inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_VAL];
-        index = cvm->inst[argsindex + (i * CALL_ARG_SIZE) + CALL_ARG_INDEX];
-        ptr = cvm->sp;
-
-        if(update_src_ref(cvm, &flags, &val, &index, &ptr) < 0) {
+        if(resolve_arg(cvm, inst, sp, argsindex, i, STACK_ARG(newsp, i + 1)) < 0) {
             return(-1);
         }
-
-        STACK_ARG(newsp, i + 1)->flags = flags;
-        STACK_ARG(newsp, i + 1)->val = val;
-        STACK_ARG(newsp, i + 1)->index = index;
-        STACK_ARG(newsp, i + 1)->ptr = ptr;
     }
 
     /* push return and procedure to be called on to the stack */
@@ -4927,28 +12281,64 @@ static int call(CrustyVM *cvm, unsigned int procindex, unsigned int argsindex) {
         argsindex + (cvm->proc[procindex].args * CALL_ARG_SIZE);
     cvm->cstack[cvm->csp - 1].proc = procindex;
 
-    cvm->sp = newsp;
-    cvm->ip = callee->instruction;
+    return(0);
+}
+
+/* Replace the frame of the running procedure, which has its stack pointer at
+   sp, with a new frame for procindex, the same as calling it and returning
+   straight after.  The arguments are all resolved before the old frame is
+   overwritten.  The caller is responsible for moving its stack and instruction
+   pointers in to the new procedure and making the call stack say it's running
+   on success. */
+static int tail_call(CrustyVM *cvm,
+                     const int *inst,
+                     unsigned int sp,
+                     unsigned int procindex,
+                     unsigned int argsindex) {
+    unsigned int i;
+    unsigned int base, newsp;
+    CrustyProcedure *callee;
+
+    callee = &(cvm->proc[procindex]);
+    base = sp - cvm->proc[cvm->cstack[cvm->csp - 1].proc].stackneeded;
+    newsp = base + callee->stackneeded;
+
+    if(!cvm->bounded && newsp > cvm->stacksize) {
+        cvm->status = CRUSTY_STATUS_STACK_OVERFLOW;
+        return(-1);
+    }
+
+    for(i = 0; i < callee->args; i++) {
+        if(resolve_arg(cvm, inst, sp, argsindex, i, &(cvm->tailarg[i])) < 0) {
+            return(-1);
+        }
+    }
+
+    init_frame(cvm, callee, base);
+    for(i = 0; i < callee->args; i++) {
+        *STACK_ARG(newsp, i + 1) = cvm->tailarg[i];
+    }
 
     return(0);
 }
 
 static int update_dest_ref(CrustyVM *cvm,
+                           unsigned int sp,
                            int *flags,
                            int *val,
                            int *index,
                            int *ptr) {
     if((*flags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-        if(variable_is_argument(&(cvm->var[*val]))) {
-            if((STACK_ARG(cvm->sp, cvm->var[*val].offset)->flags &
+        if((cvm->vinfo[*val].flags & VARINFO_ARGUMENT)) {
+            if((STACK_ARG(sp, cvm->vinfo[*val].offset)->flags &
                 MOVE_FLAG_TYPE_MASK) ==
                MOVE_FLAG_VAR) {
                 if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                    if(variable_is_argument(&(cvm->var[*index]))) {
-                        if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                    if((cvm->vinfo[*index].flags & VARINFO_ARGUMENT)) {
+                        if((STACK_ARG(sp, cvm->vinfo[*index].offset)->flags &
                            MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-                            if(cvm->var[STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->val].type ==
+                            if(cvm->vinfo[STACK_ARG(sp,
+                                                  cvm->vinfo[*index].offset)->val].type ==
                                CRUSTY_TYPE_FLOAT) {
                                 cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                                 return(-1);
@@ -4957,19 +12347,19 @@ static int update_dest_ref(CrustyVM *cvm,
                             if(read_var(cvm,
                                         index,
                                         NULL,
-                                        STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                        &(cvm->var[STACK_ARG(cvm->sp,
-                                                             cvm->var[*index].offset)->val]),
-                                        STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->index) < 0) {
+                                        STACK_ARG(sp, cvm->vinfo[*index].offset)->ptr,
+                                        STACK_ARG(sp,
+                                                             cvm->vinfo[*index].offset)->val,
+                                        STACK_ARG(sp,
+                                                  cvm->vinfo[*index].offset)->index) < 0) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(-1);
                             }
                         } else {
-                            *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                            *index = STACK_ARG(sp, cvm->vinfo[*index].offset)->val;
                         }
                     } else {
-                        if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                        if(cvm->vinfo[*index].type == CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
                         }
@@ -4978,7 +12368,7 @@ static int update_dest_ref(CrustyVM *cvm,
                                     index,
                                     NULL,
                                     GET_PTR(*index, *ptr),
-                                    &(cvm->var[*index]),
+                                    *index,
                                     0) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
@@ -4992,26 +12382,26 @@ static int update_dest_ref(CrustyVM *cvm,
                     return(-1);
                 }
 
-                *index += STACK_ARG(cvm->sp, cvm->var[*val].offset)->index;
+                *index += STACK_ARG(sp, cvm->vinfo[*val].offset)->index;
                 if(*index >
-                   (int)(cvm->var[STACK_ARG(cvm->sp, 
-                                            cvm->var[*val].offset)->val].length -
+                   (int)(cvm->vinfo[STACK_ARG(sp, 
+                                            cvm->vinfo[*val].offset)->val].length -
                    1)) {
                     cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
                     return(-1);
                 }
 
-                *ptr = STACK_ARG(cvm->sp, cvm->var[*val].offset)->ptr;
-                *val = STACK_ARG(cvm->sp, cvm->var[*val].offset)->val;
+                *ptr = STACK_ARG(sp, cvm->vinfo[*val].offset)->ptr;
+                *val = STACK_ARG(sp, cvm->vinfo[*val].offset)->val;
                 /* index is already updated */
             } else {
                 if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                    if(variable_is_argument(&(cvm->var[*index]))) {
-                        if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                    if((cvm->vinfo[*index].flags & VARINFO_ARGUMENT)) {
+                        if((STACK_ARG(sp, cvm->vinfo[*index].offset)->flags &
                             MOVE_FLAG_TYPE_MASK) ==
                            MOVE_FLAG_VAR) {
-                            if(cvm->var[STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->val].type ==
+                            if(cvm->vinfo[STACK_ARG(sp,
+                                                  cvm->vinfo[*index].offset)->val].type ==
                                CRUSTY_TYPE_FLOAT) {
                                 cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                                 return(-1);
@@ -5020,19 +12410,19 @@ static int update_dest_ref(CrustyVM *cvm,
                             if(read_var(cvm,
                                         index,
                                         NULL,
-                                        STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                        &(cvm->var[STACK_ARG(cvm->sp,
-                                                             cvm->var[*index].offset)->val]),
-                                        STACK_ARG(cvm->sp,
-                                                  cvm->var[*index].offset)->index) < 0) {
+                                        STACK_ARG(sp, cvm->vinfo[*index].offset)->ptr,
+                                        STACK_ARG(sp,
+                                                             cvm->vinfo[*index].offset)->val,
+                                        STACK_ARG(sp,
+                                                  cvm->vinfo[*index].offset)->index) < 0) {
                                 cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                                 return(-1);
                             }
                         } else {
-                            *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                            *index = STACK_ARG(sp, cvm->vinfo[*index].offset)->val;
                         }
                     } else {
-                        if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                        if(cvm->vinfo[*index].type == CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
                         }
@@ -5041,7 +12431,7 @@ static int update_dest_ref(CrustyVM *cvm,
                                     index,
                                     NULL,
                                     GET_PTR(*index, *ptr),
-                                    &(cvm->var[*index]),
+                                    *index,
                                     0) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
@@ -5064,17 +12454,17 @@ static int update_dest_ref(CrustyVM *cvm,
                  */
                 /* do some goofy nonsense to get the pointer (in VM memory) in
                    to the stack of the value referenced by val */
-                *ptr = cvm->sp -
-                       (cvm->var[*val].offset * sizeof(CrustyStackArg)) +
+                *ptr = sp -
+                       (cvm->vinfo[*val].offset * sizeof(CrustyStackArg)) +
                        offsetof(CrustyStackArg, val);
             }
         } else {
             if((*flags & MOVE_FLAG_INDEX_TYPE_MASK) == MOVE_FLAG_INDEX_VAR) {
-                if(variable_is_argument(&(cvm->var[*index]))) {
-                    if((STACK_ARG(cvm->sp, cvm->var[*index].offset)->flags &
+                if((cvm->vinfo[*index].flags & VARINFO_ARGUMENT)) {
+                    if((STACK_ARG(sp, cvm->vinfo[*index].offset)->flags &
                        MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-                        if(cvm->var[STACK_ARG(cvm->sp,
-                                              cvm->var[*index].offset)->val].type ==
+                        if(cvm->vinfo[STACK_ARG(sp,
+                                              cvm->vinfo[*index].offset)->val].type ==
                            CRUSTY_TYPE_FLOAT) {
                             cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                             return(-1);
@@ -5083,19 +12473,19 @@ static int update_dest_ref(CrustyVM *cvm,
                         if(read_var(cvm,
                                     index,
                                     NULL,
-                                    STACK_ARG(cvm->sp, cvm->var[*index].offset)->ptr,
-                                    &(cvm->var[STACK_ARG(cvm->sp,
-                                                         cvm->var[*index].offset)->val]),
-                                    STACK_ARG(cvm->sp,
-                                              cvm->var[*index].offset)->index) < 0) {
+                                    STACK_ARG(sp, cvm->vinfo[*index].offset)->ptr,
+                                    STACK_ARG(sp,
+                                                         cvm->vinfo[*index].offset)->val,
+                                    STACK_ARG(sp,
+                                              cvm->vinfo[*index].offset)->index) < 0) {
                             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                             return(-1);
                         }
                     } else {
-                        *index = STACK_ARG(cvm->sp, cvm->var[*index].offset)->val;
+                        *index = STACK_ARG(sp, cvm->vinfo[*index].offset)->val;
                     }
                 } else {
-                    if(cvm->var[*index].type == CRUSTY_TYPE_FLOAT) {
+                    if(cvm->vinfo[*index].type == CRUSTY_TYPE_FLOAT) {
                         cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
                         return(-1);
                     }
@@ -5104,7 +12494,7 @@ static int update_dest_ref(CrustyVM *cvm,
                                 index,
                                 NULL,
                                 GET_PTR(*index, *ptr),
-                                &(cvm->var[*index]),
+                                *index,
                                 0) < 0) {
                         cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
                         return(-1);
@@ -5113,7 +12503,7 @@ static int update_dest_ref(CrustyVM *cvm,
             } /* else {
                 do nothing
             } */
-            if(*index < 0 || *index > (int)(cvm->var[*val].length - 1)) {
+            if(*index < 0 || *index > (int)(cvm->vinfo[*val].length - 1)) {
                 cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
                 return(-1);
             }
@@ -5143,7 +12533,7 @@ static int fetch_val(CrustyVM *cvm,
                     intval,
                     floatval,
                     ptr,
-                    &(cvm->var[val]),
+                    val,
                     index) < 0) {
             cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
             return(-1);
@@ -5155,47 +12545,860 @@ static int fetch_val(CrustyVM *cvm,
     return(0);
 }
 
+/* read the index of an array operand from a variable which isn't an argument,
+   and check it against the length of the array */
+static int read_index(CrustyVM *cvm,
+                      unsigned int sp,
+                      int indexvar,
+                      int arrayvar,
+                      int *index) {
+    if(cvm->vinfo[indexvar].type == CRUSTY_TYPE_FLOAT) {
+        cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
+        return(-1);
+    }
+
+    if(read_var(cvm,
+                index,
+                NULL,
+                GET_PTR(indexvar, sp),
+                indexvar,
+                0) < 0) {
+        cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
+        return(-1);
+    }
+
+    if(*index < 0 || *index > (int)(cvm->vinfo[arrayvar].length - 1)) {
+        cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
+        return(-1);
+    }
+
+    return(0);
+}
+
 /* if flags isn't VAR, calling this is invalid */
 static void store_result(CrustyVM *cvm,
+                         int intval,
+                         double floatval,
                          int val,
                          int index,
                          int ptr) {
     write_var(cvm,
-              cvm->intresult,
-              cvm->floatresult,
+              intval,
+              floatval,
               ptr,
-              &(cvm->var[val]),
+              val,
               index);
 }
 
-#define POPULATE_ARGS \
-    destflags = cvm->inst[cvm->ip + MOVE_DEST_FLAGS]; \
-    destval = cvm->inst[cvm->ip + MOVE_DEST_VAL]; \
-    destindex = cvm->inst[cvm->ip + MOVE_DEST_INDEX]; \
-    destptr = cvm->sp; \
-    srcflags = cvm->inst[cvm->ip + MOVE_SRC_FLAGS]; \
-    srcval = cvm->inst[cvm->ip + MOVE_SRC_VAL]; \
-    srcindex = cvm->inst[cvm->ip + MOVE_SRC_INDEX]; \
-    srcptr = cvm->sp; \
-    if(update_dest_ref(cvm, \
-                       &destflags, \
-                       &destval, \
-                       &destindex, \
-                       &destptr) < 0) { \
-        break; \
+/* Resolve a range operand of an instruction working on arrays to the variable the range it
+   starts is in, the address it starts at, the type of the values and how many
+   values there are from there to the end of the variable.  An argument which
+   was passed an immediate is a single int. */
+static int resolve_range(CrustyVM *cvm,
+                         unsigned int sp,
+                         const int *operand,
+                         int *val,
+                         int *ptr,
+                         CrustyType *type,
+                         unsigned int *left) {
+    int flags = operand[0];
+    int index = operand[2];
+
+    *val = operand[1];
+    *ptr = sp;
+    if(update_dest_ref(cvm, sp, &flags, val, &index, ptr) < 0) {
+        return(-1);
+    }
+
+    /* callbacks don't have any memory to work on */
+    if(cvm->vinfo[*val].flags & (VARINFO_READ | VARINFO_WRITE)) {
+        cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
+        return(-1);
+    }
+
+    if(cvm->vinfo[*val].flags & VARINFO_ARGUMENT) {
+        *type = CRUSTY_TYPE_INT;
+        *left = 1;
+    } else {
+        *type = cvm->vinfo[*val].type;
+        /* the start is already known to be in range */
+        *left = cvm->vinfo[*val].length - index;
+    }
+    *ptr += index * type_size(*type);
+
+    return(0);
+}
+
+/* Kernels for arithmetic over ranges of ints and floats.  Each kernel works
+   through as many values as fit in a vector register at a time then finishes
+   the rest one at a time, the same as the scalar fallback does throughout.
+   Float min and max only keep dest when it's strictly less or greater than
+   src, which is what minpd and maxpd do with these operands, so NaNs come out
+   the same whichever kernels are used. */
+#define VECTOR_TYPE_I int
+#define VECTOR_TYPE_F double
+
+#define VECTOR_SCALAR_ADD(A, B)   ((A) + (B))
+#define VECTOR_SCALAR_SUB(A, B)   ((A) - (B))
+#define VECTOR_SCALAR_MUL(A, B)   ((A) * (B))
+#define VECTOR_SCALAR_MIN(A, B)   ((A) < (B) ? (A) : (B))
+#define VECTOR_SCALAR_MAX(A, B)   ((A) > (B) ? (A) : (B))
+#define VECTOR_SCALAR_SCALE(A, B) ((A) * (B))
+
+/* how far src moves along for each value, scale always uses the one value */
+#define VECTOR_STEP_ADD   (1)
+#define VECTOR_STEP_SUB   (1)
+#define VECTOR_STEP_MUL   (1)
+#define VECTOR_STEP_MIN   (1)
+#define VECTOR_STEP_MAX   (1)
+#define VECTOR_STEP_SCALE (0)
+
+#define VECTOR_SCALAR_LOOP(OP) \
+    for(; i < count; i++) { \
+        d[i] = VECTOR_SCALAR_##OP(d[i], s[i * VECTOR_STEP_##OP]); \
+    }
+
+#ifdef CRUSTY_SIMD
+/* SSE2 is always there on x86-64 but doesn't have 32 bit multiply, min or
+   max */
+static __m128i vector_sse2_mullo(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+    return(_mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0))));
+}
+
+static __m128i vector_sse2_min(__m128i a, __m128i b) {
+    __m128i gt = _mm_cmpgt_epi32(a, b);
+
+    return(_mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a)));
+}
+
+static __m128i vector_sse2_max(__m128i a, __m128i b) {
+    __m128i gt = _mm_cmpgt_epi32(a, b);
+
+    return(_mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b)));
+}
+
+#define VECTOR_SSE2_ATTR
+#define VECTOR_SSE2_VEC_I         __m128i
+#define VECTOR_SSE2_WIDTH_I       (4)
+#define VECTOR_SSE2_LOAD_I(P)     _mm_loadu_si128((const __m128i *)(P))
+#define VECTOR_SSE2_STORE_I(P, V) _mm_storeu_si128((__m128i *)(P), (V))
+#define VECTOR_SSE2_SET1_I        _mm_set1_epi32
+#define VECTOR_SSE2_ADD_I         _mm_add_epi32
+#define VECTOR_SSE2_SUB_I         _mm_sub_epi32
+#define VECTOR_SSE2_MUL_I         vector_sse2_mullo
+#define VECTOR_SSE2_MIN_I         vector_sse2_min
+#define VECTOR_SSE2_MAX_I         vector_sse2_max
+#define VECTOR_SSE2_SCALE_I       vector_sse2_mullo
+#define VECTOR_SSE2_VEC_F         __m128d
+#define VECTOR_SSE2_WIDTH_F       (2)
+#define VECTOR_SSE2_LOAD_F        _mm_loadu_pd
+#define VECTOR_SSE2_STORE_F       _mm_storeu_pd
+#define VECTOR_SSE2_SET1_F        _mm_set1_pd
+#define VECTOR_SSE2_ADD_F         _mm_add_pd
+#define VECTOR_SSE2_SUB_F         _mm_sub_pd
+#define VECTOR_SSE2_MUL_F         _mm_mul_pd
+#define VECTOR_SSE2_MIN_F         _mm_min_pd
+#define VECTOR_SSE2_MAX_F         _mm_max_pd
+#define VECTOR_SSE2_SCALE_F       _mm_mul_pd
+
+#define VECTOR_AVX2_ATTR          __attribute__((target("avx2")))
+#define VECTOR_AVX2_VEC_I         __m256i
+#define VECTOR_AVX2_WIDTH_I       (8)
+#define VECTOR_AVX2_LOAD_I(P)     _mm256_loadu_si256((const __m256i *)(P))
+#define VECTOR_AVX2_STORE_I(P, V) _mm256_storeu_si256((__m256i *)(P), (V))
+#define VECTOR_AVX2_SET1_I        _mm256_set1_epi32
+#define VECTOR_AVX2_ADD_I         _mm256_add_epi32
+#define VECTOR_AVX2_SUB_I         _mm256_sub_epi32
+#define VECTOR_AVX2_MUL_I         _mm256_mullo_epi32
+#define VECTOR_AVX2_MIN_I         _mm256_min_epi32
+#define VECTOR_AVX2_MAX_I         _mm256_max_epi32
+#define VECTOR_AVX2_SCALE_I       _mm256_mullo_epi32
+#define VECTOR_AVX2_VEC_F         __m256d
+#define VECTOR_AVX2_WIDTH_F       (4)
+#define VECTOR_AVX2_LOAD_F        _mm256_loadu_pd
+#define VECTOR_AVX2_STORE_F       _mm256_storeu_pd
+#define VECTOR_AVX2_SET1_F        _mm256_set1_pd
+#define VECTOR_AVX2_ADD_F         _mm256_add_pd
+#define VECTOR_AVX2_SUB_F         _mm256_sub_pd
+#define VECTOR_AVX2_MUL_F         _mm256_mul_pd
+#define VECTOR_AVX2_MIN_F         _mm256_min_pd
+#define VECTOR_AVX2_MAX_F         _mm256_max_pd
+#define VECTOR_AVX2_SCALE_F       _mm256_mul_pd
+
+/* src is only ever read where it's in range, scale's value is always there
+   because there's nothing to do for an empty range */
+#define VECTOR_KERNEL(TIER, OP, T) \
+VECTOR_##TIER##_ATTR static void vector_##TIER##_##OP##_##T(void *dest, \
+                                                           const void *src, \
+                                                           int count) { \
+    VECTOR_TYPE_##T *d = dest; \
+    const VECTOR_TYPE_##T *s = src; \
+    VECTOR_##TIER##_VEC_##T scale = VECTOR_##TIER##_SET1_##T(*s); \
+    int i; \
+\
+    for(i = 0; i + VECTOR_##TIER##_WIDTH_##T <= count; \
+        i += VECTOR_##TIER##_WIDTH_##T) { \
+        VECTOR_##TIER##_STORE_##T(&(d[i]), \
+            VECTOR_##TIER##_##OP##_##T(VECTOR_##TIER##_LOAD_##T(&(d[i])), \
+                                       VECTOR_STEP_##OP ? \
+                                       VECTOR_##TIER##_LOAD_##T(&(s[i])) : \
+                                       scale)); \
+    } \
+    VECTOR_SCALAR_LOOP(OP) \
+}
+#else
+#define VECTOR_KERNEL(TIER, OP, T) \
+static void vector_##TIER##_##OP##_##T(void *dest, \
+                                       const void *src, \
+                                       int count) { \
+    VECTOR_TYPE_##T *d = dest; \
+    const VECTOR_TYPE_##T *s = src; \
+    int i = 0; \
+\
+    VECTOR_SCALAR_LOOP(OP) \
+}
+#endif
+
+#define VECTOR_KERNELS(TIER) \
+    VECTOR_KERNEL(TIER, ADD, I) VECTOR_KERNEL(TIER, ADD, F) \
+    VECTOR_KERNEL(TIER, SUB, I) VECTOR_KERNEL(TIER, SUB, F) \
+    VECTOR_KERNEL(TIER, MUL, I) VECTOR_KERNEL(TIER, MUL, F) \
+    VECTOR_KERNEL(TIER, MIN, I) VECTOR_KERNEL(TIER, MIN, F) \
+    VECTOR_KERNEL(TIER, MAX, I) VECTOR_KERNEL(TIER, MAX, F) \
+    VECTOR_KERNEL(TIER, SCALE, I) VECTOR_KERNEL(TIER, SCALE, F)
+
+#define VECTOR_TABLE_OP(TIER, OP) \
+    [VECTOR_OP_##OP] = { \
+        [CRUSTY_TYPED_I] = vector_##TIER##_##OP##_I, \
+        [CRUSTY_TYPED_F] = vector_##TIER##_##OP##_F \
+    }
+
+#define VECTOR_TABLE(TIER) \
+static const CrustyVectorKernels vector_##TIER = { \
+    .kernel = { \
+        VECTOR_TABLE_OP(TIER, ADD), \
+        VECTOR_TABLE_OP(TIER, SUB), \
+        VECTOR_TABLE_OP(TIER, MUL), \
+        VECTOR_TABLE_OP(TIER, MIN), \
+        VECTOR_TABLE_OP(TIER, MAX), \
+        VECTOR_TABLE_OP(TIER, SCALE) \
+    } \
+};
+
+#ifdef CRUSTY_SIMD
+VECTOR_KERNELS(SSE2)
+VECTOR_TABLE(SSE2)
+VECTOR_KERNELS(AVX2)
+VECTOR_TABLE(AVX2)
+
+static const CrustyVectorKernels *vector_kernels(void) {
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        return(&vector_AVX2);
+    }
+
+    return(&vector_SSE2);
+}
+#else
+VECTOR_KERNELS(SCALAR)
+VECTOR_TABLE(SCALAR)
+
+static const CrustyVectorKernels *vector_kernels(void) {
+    return(&vector_SCALAR);
+}
+#endif
+
+/* the same as the kernels but for any other combination of types, worked out
+   in floats if either side is one like the math instructions */
+static double vector_float_op(int op, double a, double b) {
+    switch(op) {
+        case VECTOR_OP_ADD:
+            return(VECTOR_SCALAR_ADD(a, b));
+        case VECTOR_OP_SUB:
+            return(VECTOR_SCALAR_SUB(a, b));
+        case VECTOR_OP_MIN:
+            return(VECTOR_SCALAR_MIN(a, b));
+        case VECTOR_OP_MAX:
+            return(VECTOR_SCALAR_MAX(a, b));
+        default: /* MUL, SCALE */
+            return(VECTOR_SCALAR_MUL(a, b));
+    }
+}
+
+static int vector_int_op(int op, int a, int b) {
+    switch(op) {
+        case VECTOR_OP_ADD:
+            return(VECTOR_SCALAR_ADD(a, b));
+        case VECTOR_OP_SUB:
+            return(VECTOR_SCALAR_SUB(a, b));
+        case VECTOR_OP_MIN:
+            return(VECTOR_SCALAR_MIN(a, b));
+        case VECTOR_OP_MAX:
+            return(VECTOR_SCALAR_MAX(a, b));
+        default: /* MUL, SCALE */
+            return(VECTOR_SCALAR_MUL(a, b));
+    }
+}
+
+/* Copy, shift or fill a range of an array, or do arithmetic over it, with one
+   range check for the whole thing.  Ranges of the same type are copied or
+   filled directly in memory and ints and floats go through the vector kernels,
+   anything else is converted one value at a time, the same as move or the
+   math instructions would.  The result registers are left alone. */
+static int bulk(CrustyVM *cvm,
+                CrustyInstructionType type,
+                const int *inst,
+                unsigned int sp) {
+    CrustyType desttype, srctype;
+    int destval, destptr;
+    int srcflags, srcval, srcindex, srcptr;
+    int countflags, countval, countindex, countptr;
+    unsigned int destleft, srcleft;
+    int count, intval, i;
+    int destint, srcint;
+    double floatval, destfloat, srcfloat;
+    int op, typed;
+    size_t size;
+
+    if(resolve_range(cvm, sp, &(inst[BULK_DEST_FLAGS]),
+                     &destval, &destptr, &desttype, &destleft) < 0) {
+        return(-1);
+    }
+
+    srcflags = inst[BULK_SRC_FLAGS];
+    srcval = inst[BULK_SRC_VAL];
+    srcindex = inst[BULK_SRC_INDEX];
+    srcptr = sp;
+    srctype = CRUSTY_TYPE_INT;
+    srcleft = 0;
+    if(bulk_takes_value(type)) {
+        if(update_src_ref(cvm, sp,
+                          &srcflags, &srcval, &srcindex, &srcptr) < 0) {
+            return(-1);
+        }
+    } else {
+        if(resolve_range(cvm, sp, &(inst[BULK_SRC_FLAGS]),
+                         &srcval, &srcptr, &srctype, &srcleft) < 0) {
+            return(-1);
+        }
+    }
+
+    countflags = inst[BULK_COUNT_FLAGS];
+    countval = inst[BULK_COUNT_VAL];
+    countindex = inst[BULK_COUNT_INDEX];
+    countptr = sp;
+    if(update_src_ref(cvm, sp,
+                      &countflags, &countval, &countindex, &countptr) < 0) {
+        return(-1);
+    }
+    if(countflags == MOVE_FLAG_VAR &&
+       cvm->vinfo[countval].type == CRUSTY_TYPE_FLOAT) {
+        cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
+        return(-1);
+    }
+    if(fetch_val(cvm, countflags, countval, countindex,
+                 &count, &floatval, countptr) < 0) {
+        return(-1);
+    }
+
+    if(count < 0 ||
+       (unsigned int)count > destleft ||
+       (!bulk_takes_value(type) &&
+        (unsigned int)count > srcleft)) {
+        cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
+        return(-1);
+    }
+
+    if(bulk_takes_value(type)) {
+        if(fetch_val(cvm, srcflags, srcval, srcindex,
+                     &intval, &floatval, srcptr) < 0) {
+            return(-1);
+        }
+        if(srcflags == MOVE_FLAG_VAR &&
+           cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT) {
+            srctype = CRUSTY_TYPE_FLOAT;
+            intval = floatval;
+        } else {
+            floatval = intval;
+        }
+    }
+
+    if(type == CRUSTY_INSTRUCTION_TYPE_FILL) {
+        if(desttype == CRUSTY_TYPE_CHAR) {
+            memset(&(cvm->stack[destptr]), (unsigned char)intval, count);
+        } else if(desttype == CRUSTY_TYPE_FLOAT) {
+            for(i = 0; i < count; i++) {
+                ((double *)(&(cvm->stack[destptr])))[i] = floatval;
+            }
+        } else { /* INT */
+            for(i = 0; i < count; i++) {
+                ((int *)(&(cvm->stack[destptr])))[i] = intval;
+            }
+        }
+
+        return(0);
+    }
+
+    size = count * type_size(desttype);
+    if(srctype == desttype && !bulk_takes_value(type)) {
+        /* shift is the only one which can work on ranges which partly
+           overlap, the others would see values they'd already changed.
+           arithmetic on a range with itself is fine though. */
+        if(type != CRUSTY_INSTRUCTION_TYPE_SHIFT &&
+           (size_t)destptr < srcptr + size &&
+           (size_t)srcptr < destptr + size &&
+           (type == CRUSTY_INSTRUCTION_TYPE_COPY || destptr != srcptr)) {
+            cvm->status = CRUSTY_STATUS_OUT_OF_RANGE;
+            return(-1);
+        }
+
+        if(type == CRUSTY_INSTRUCTION_TYPE_SHIFT) {
+            memmove(&(cvm->stack[destptr]), &(cvm->stack[srcptr]), size);
+            return(0);
+        } else if(type == CRUSTY_INSTRUCTION_TYPE_COPY) {
+            memcpy(&(cvm->stack[destptr]), &(cvm->stack[srcptr]), size);
+            return(0);
+        }
+    }
+
+    if(type == CRUSTY_INSTRUCTION_TYPE_COPY ||
+       type == CRUSTY_INSTRUCTION_TYPE_SHIFT) {
+        /* different types are never the same memory */
+        for(i = 0; i < count; i++) {
+            read_var(cvm, &intval, &floatval, srcptr, srcval, i);
+            if(srctype == CRUSTY_TYPE_FLOAT) {
+                intval = floatval;
+            } else {
+                floatval = intval;
+            }
+            write_var(cvm, intval, floatval, destptr, destval, i);
+        }
+
+        return(0);
+    }
+
+    if(count == 0) {
+        return(0);
+    }
+
+    op = type - CRUSTY_INSTRUCTION_TYPE_VADD;
+    typed = -1;
+    if(desttype == CRUSTY_TYPE_FLOAT &&
+       (srctype == CRUSTY_TYPE_FLOAT || type == CRUSTY_INSTRUCTION_TYPE_VSCALE)) {
+        typed = CRUSTY_TYPED_F;
+    } else if(desttype == CRUSTY_TYPE_INT && srctype == CRUSTY_TYPE_INT) {
+        typed = CRUSTY_TYPED_I;
+    }
+
+    if(typed >= 0) {
+        if(type == CRUSTY_INSTRUCTION_TYPE_VSCALE) {
+            cvm->vector->kernel[op][typed](&(cvm->stack[destptr]),
+                                           typed == CRUSTY_TYPED_F ?
+                                           (void *)&floatval :
+                                           (void *)&intval,
+                                           count);
+        } else {
+            cvm->vector->kernel[op][typed](&(cvm->stack[destptr]),
+                                           &(cvm->stack[srcptr]),
+                                           count);
+        }
+
+        return(0);
+    }
+
+    destint = 0;
+    destfloat = 0.0;
+    srcint = intval;
+    srcfloat = floatval;
+    for(i = 0; i < count; i++) {
+        read_var(cvm, &destint, &destfloat, destptr, destval, i);
+        if(!bulk_takes_value(type)) {
+            read_var(cvm, &srcint, &srcfloat, srcptr, srcval, i);
+        }
+
+        if(desttype == CRUSTY_TYPE_FLOAT) {
+            if(srctype != CRUSTY_TYPE_FLOAT) {
+                srcfloat = srcint;
+            }
+            destfloat = vector_float_op(op, destfloat, srcfloat);
+        } else if(srctype == CRUSTY_TYPE_FLOAT) {
+            destint = vector_float_op(op, (double)destint, srcfloat);
+        } else {
+            destint = vector_int_op(op, destint, srcint);
+        }
+
+        write_var(cvm, destint, destfloat, destptr, destval, i);
+    }
+
+    return(0);
+}
+
+/* Pick which of a switch's labels to go to, returning where it is in the
+   instruction.  Anything without its own label goes to the default. */
+static int switch_slot(CrustyVM *cvm, const int *inst, unsigned int sp) {
+    int flags = inst[SWITCH_VALUE_FLAGS];
+    int val = inst[SWITCH_VALUE_VAL];
+    int index = inst[SWITCH_VALUE_INDEX];
+    int ptr = sp;
+    int intval;
+    double floatval;
+
+    if(update_src_ref(cvm, sp, &flags, &val, &index, &ptr) < 0) {
+        return(-1);
+    }
+    if(flags == MOVE_FLAG_VAR &&
+       cvm->vinfo[val].type == CRUSTY_TYPE_FLOAT) {
+        cvm->status = CRUSTY_STATUS_FLOAT_INDEX;
+        return(-1);
+    }
+    if(fetch_val(cvm, flags, val, index, &intval, &floatval, ptr) < 0) {
+        return(-1);
+    }
+
+    if(intval < 0 || intval >= inst[SWITCH_COUNT]) {
+        return(SWITCH_DEFAULT);
+    }
+
+    return(SWITCH_START_TARGETS + intval);
+}
+
+/* Step a loop's counter and see whether it goes around again, which is while
+   the counter is short of the bound in the direction it's stepped.  The
+   counter is stepped the way add would and compared as it was stored.  Returns
+   1 to jump back, 0 to carry on or -1 on failure. */
+static int loop_step(CrustyVM *cvm, const int *inst, unsigned int sp) {
+    int cflags = inst[LOOP_COUNTER_FLAGS];
+    int cval = inst[LOOP_COUNTER_VAL];
+    int cindex = inst[LOOP_COUNTER_INDEX];
+    int cptr = sp;
+    int sflags = inst[LOOP_STEP_FLAGS];
+    int sval = inst[LOOP_STEP_VAL];
+    int sindex = inst[LOOP_STEP_INDEX];
+    int sptr = sp;
+    int bflags = inst[LOOP_BOUND_FLAGS];
+    int bval = inst[LOOP_BOUND_VAL];
+    int bindex = inst[LOOP_BOUND_INDEX];
+    int bptr = sp;
+    int count, step, bound;
+    double fcount, fstep, fbound;
+    int cfloat, sfloat, bfloat, backwards;
+
+    if(update_dest_ref(cvm, sp, &cflags, &cval, &cindex, &cptr) < 0 ||
+       update_src_ref(cvm, sp, &sflags, &sval, &sindex, &sptr) < 0 ||
+       update_src_ref(cvm, sp, &bflags, &bval, &bindex, &bptr) < 0) {
+        return(-1);
+    }
+
+    /* like math, the result can't be passed to a callback */
+    if(cvm->vinfo[cval].flags & VARINFO_WRITE) {
+        cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
+        return(-1);
+    }
+
+    if(fetch_val(cvm, cflags, cval, cindex, &count, &fcount, cptr) < 0 ||
+       fetch_val(cvm, sflags, sval, sindex, &step, &fstep, sptr) < 0) {
+        return(-1);
+    }
+    cfloat = cvm->vinfo[cval].type == CRUSTY_TYPE_FLOAT;
+    sfloat = sflags == MOVE_FLAG_VAR &&
+             cvm->vinfo[sval].type == CRUSTY_TYPE_FLOAT;
+
+    if(cfloat) {
+        fcount += sfloat ? fstep : (double)step;
+    } else if(sfloat) {
+        count = ((double)count) + fstep;
+    } else {
+        count += step;
+    }
+    store_result(cvm, count, fcount, cval, cindex, cptr);
+
+    /* a char counter wraps, so read back what was stored, and the bound is
+       read after in case it's the counter */
+    if(fetch_val(cvm, cflags, cval, cindex, &count, &fcount, cptr) < 0 ||
+       fetch_val(cvm, bflags, bval, bindex, &bound, &fbound, bptr) < 0) {
+        return(-1);
+    }
+    bfloat = bflags == MOVE_FLAG_VAR &&
+             cvm->vinfo[bval].type == CRUSTY_TYPE_FLOAT;
+    backwards = sfloat ? fstep < 0.0 : step < 0;
+
+    if(cfloat || bfloat) {
+        if(!cfloat) {
+            fcount = count;
+        }
+        if(!bfloat) {
+            fbound = bound;
+        }
+        return(backwards ? fcount > fbound : fcount < fbound);
+    }
+
+    return(backwards ? count > bound : count < bound);
+}
+
+/* Work out min, max, abs, clamp or select and store it in the destination.
+   Like math, it's worked out with floats if the destination or any value
+   looked at is a float, then converted to the type of the destination, which
+   is what's returned for the result registers.  nonzero is whether the result
+   registers are nonzero, for select.  The type is passed in since threaded
+   code has replaced it in the instruction.  Returns the type of the value
+   returned or -1 on failure. */
+static int pick_value(CrustyVM *cvm,
+                      int type,
+                      const int *inst,
+                      unsigned int sp,
+                      int nonzero,
+                      int *intval,
+                      double *floatval) {
+    int dflags = inst[MOVE_DEST_FLAGS];
+    int dval = inst[MOVE_DEST_VAL];
+    int dindex = inst[MOVE_DEST_INDEX];
+    int dptr = sp;
+    int sflags = inst[MOVE_SRC_FLAGS];
+    int sval = inst[MOVE_SRC_VAL];
+    int sindex = inst[MOVE_SRC_INDEX];
+    int sptr = sp;
+    int oflags, oval, oindex;
+    int optr = sp;
+    int d = 0, s = 0, o = 0;
+    double fd = 0.0, fs = 0.0, fo = 0.0;
+    int dfloat, sfloat = 0, ofloat = 0;
+
+    if(update_dest_ref(cvm, sp, &dflags, &dval, &dindex, &dptr) < 0 ||
+       update_src_ref(cvm, sp, &sflags, &sval, &sindex, &sptr) < 0) {
+        return(-1);
+    }
+
+    /* like math, the result can't be passed to a callback */
+    if(cvm->vinfo[dval].flags & VARINFO_WRITE) {
+        cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
+        return(-1);
+    }
+
+    /* select only reads the source it picks */
+    if(type != CRUSTY_INSTRUCTION_TYPE_SELECT || nonzero) {
+        if(fetch_val(cvm, sflags, sval, sindex, &s, &fs, sptr) < 0) {
+            return(-1);
+        }
+        sfloat = sflags == MOVE_FLAG_VAR &&
+                 cvm->vinfo[sval].type == CRUSTY_TYPE_FLOAT;
+    }
+
+    if(pick_takes_other(type) &&
+       (type != CRUSTY_INSTRUCTION_TYPE_SELECT || !nonzero)) {
+        oflags = inst[PICK_OTHER_FLAGS];
+        oval = inst[PICK_OTHER_VAL];
+        oindex = inst[PICK_OTHER_INDEX];
+        if(update_src_ref(cvm, sp, &oflags, &oval, &oindex, &optr) < 0 ||
+           fetch_val(cvm, oflags, oval, oindex, &o, &fo, optr) < 0) {
+            return(-1);
+        }
+        ofloat = oflags == MOVE_FLAG_VAR &&
+                 cvm->vinfo[oval].type == CRUSTY_TYPE_FLOAT;
+        if(type == CRUSTY_INSTRUCTION_TYPE_SELECT) {
+            s = o;
+            fs = fo;
+            sfloat = ofloat;
+            ofloat = 0;
+        }
+    }
+
+    /* abs and select don't look at what the destination held */
+    dfloat = cvm->vinfo[dval].type == CRUSTY_TYPE_FLOAT;
+    if(type != CRUSTY_INSTRUCTION_TYPE_ABS &&
+       type != CRUSTY_INSTRUCTION_TYPE_SELECT &&
+       fetch_val(cvm, dflags, dval, dindex, &d, &fd, dptr) < 0) {
+        return(-1);
+    }
+
+    if(dfloat || sfloat || ofloat) {
+        if(!dfloat) {
+            fd = d;
+        }
+        if(!sfloat) {
+            fs = s;
+        }
+        if(!ofloat) {
+            fo = o;
+        }
+
+        switch(type) {
+            case CRUSTY_INSTRUCTION_TYPE_MIN:
+                *floatval = fd < fs ? fd : fs;
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_MAX:
+                *floatval = fd > fs ? fd : fs;
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_ABS:
+                *floatval = fabs(fs);
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_CLAMP:
+                *floatval = fd < fs ? fs : fd;
+                *floatval = *floatval > fo ? fo : *floatval;
+                break;
+            default: /* SELECT */
+                *floatval = fs;
+        }
+        *intval = *floatval;
+    } else {
+        switch(type) {
+            case CRUSTY_INSTRUCTION_TYPE_MIN:
+                *intval = d < s ? d : s;
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_MAX:
+                *intval = d > s ? d : s;
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_ABS:
+                /* the most negative int wraps around to itself */
+                *intval = s < 0 ? (int)(0u - (unsigned int)s) : s;
+                break;
+            case CRUSTY_INSTRUCTION_TYPE_CLAMP:
+                *intval = d < s ? s : d;
+                *intval = *intval > o ? o : *intval;
+                break;
+            default: /* SELECT */
+                *intval = s;
+        }
+        *floatval = *intval;
+    }
+    store_result(cvm, *intval, *floatval, dval, dindex, dptr);
+
+    return(dfloat ? CRUSTY_TYPE_FLOAT : CRUSTY_TYPE_INT);
+}
+
+/* The instruction bodies below are shared between crustyvm_step(), which works
+   directly on the VM structure one instruction at a time, and the threaded
+   loop used by crustyvm_run(), which keeps the registers in locals for the
+   whole run.  Users must define the REG_* names to whatever holds the
+   registers and INST_STOP to however execution should stop on an error or the
+   end of the program, with the reason left in cvm->status. */
+
+/* Operands are resolved in to a flags, val, index and ptr for the instruction
+   bodies to work with, which is much simpler for anything which could be
+   figured out by codegen.  REFERENCE does everything at runtime and is also used
+   by the generic instructions, so it can handle any operand. */
+#define RESOLVE_REFERENCE(OPERAND, SLOT, UPDATE) \
+    OPERAND##flags = REG_INST[REG_IP + SLOT##_FLAGS]; \
+    OPERAND##val = REG_INST[REG_IP + SLOT##_VAL]; \
+    OPERAND##index = REG_INST[REG_IP + SLOT##_INDEX]; \
+    OPERAND##ptr = REG_SP; \
+    if(UPDATE(cvm, \
+              REG_SP, \
+              &OPERAND##flags, \
+              &OPERAND##val, \
+              &OPERAND##index, \
+              &OPERAND##ptr) < 0) { \
+        INST_STOP; \
+    }
+
+/* index has already been folded in to the address */
+#define RESOLVE_GLOBAL(OPERAND, SLOT, UPDATE) \
+    OPERAND##flags = MOVE_FLAG_VAR; \
+    OPERAND##val = REG_INST[REG_IP + SLOT##_VAL]; \
+    OPERAND##index = 0; \
+    OPERAND##ptr = REG_INST[REG_IP + SLOT##_INDEX];
+
+#define RESOLVE_LOCAL(OPERAND, SLOT, UPDATE) \
+    OPERAND##flags = MOVE_FLAG_VAR; \
+    OPERAND##val = REG_INST[REG_IP + SLOT##_VAL]; \
+    OPERAND##index = 0; \
+    OPERAND##ptr = REG_SP - REG_INST[REG_IP + SLOT##_INDEX];
+
+#define RESOLVE_IMMEDIATE(OPERAND, SLOT, UPDATE) \
+    OPERAND##flags = MOVE_FLAG_IMMEDIATE; \
+    OPERAND##val = REG_INST[REG_IP + SLOT##_VAL]; \
+    OPERAND##index = 0; \
+    OPERAND##ptr = 0;
+
+#define RESOLVE_ARRAY(OPERAND, SLOT, UPDATE) \
+    OPERAND##flags = MOVE_FLAG_VAR; \
+    OPERAND##val = REG_INST[REG_IP + SLOT##_VAL]; \
+    if(read_index(cvm, \
+                  REG_SP, \
+                  REG_INST[REG_IP + SLOT##_INDEX], \
+                  OPERAND##val, \
+                  &OPERAND##index) < 0) { \
+        INST_STOP; \
+    } \
+    OPERAND##ptr = GET_PTR(OPERAND##val, REG_SP);
+
+/* the index is a plain int which is known to be in range */
+#define RESOLVE_INDEXED(OPERAND, SLOT, UPDATE) \
+    OPERAND##flags = MOVE_FLAG_VAR; \
+    OPERAND##val = REG_INST[REG_IP + SLOT##_VAL]; \
+    OPERAND##index = *((int *)(&(cvm->stack[ \
+        GET_PTR(REG_INST[REG_IP + SLOT##_INDEX], REG_SP)]))); \
+    OPERAND##ptr = GET_PTR(OPERAND##val, REG_SP);
+
+/* An argument which refers to a variable was resolved to it by the call, which
+   already checked it's in range, so it can be used as is.  Anything else
+   passed in needs the extra care the full resolve takes with it. */
+#define RESOLVE_ARGUMENT(OPERAND, SLOT, UPDATE) \
+    OPERAND##val = REG_INST[REG_IP + SLOT##_VAL]; \
+    arg = (CrustyStackArg *)(&(cvm->stack[REG_SP - \
+                                          REG_INST[REG_IP + SLOT##_INDEX]])); \
+    if(arg->flags == MOVE_FLAG_VAR) { \
+        OPERAND##flags = MOVE_FLAG_VAR; \
+        OPERAND##val = arg->val; \
+        OPERAND##index = arg->index; \
+        OPERAND##ptr = arg->ptr; \
+    } else { \
+        OPERAND##flags = REG_INST[REG_IP + SLOT##_FLAGS]; \
+        OPERAND##index = 0; \
+        OPERAND##ptr = REG_SP; \
+        if(UPDATE(cvm, \
+                  REG_SP, \
+                  &OPERAND##flags, \
+                  &OPERAND##val, \
+                  &OPERAND##index, \
+                  &OPERAND##ptr) < 0) { \
+            INST_STOP; \
+        } \
+    }
+
+/* callbacks don't need a pointer */
+#define RESOLVE_CALLBACK(OPERAND, SLOT, UPDATE) \
+    OPERAND##flags = MOVE_FLAG_VAR; \
+    OPERAND##val = REG_INST[REG_IP + SLOT##_VAL]; \
+    OPERAND##index = REG_INST[REG_IP + SLOT##_INDEX]; \
+    OPERAND##ptr = 0; \
+    if((REG_INST[REG_IP + SLOT##_FLAGS] & MOVE_FLAG_INDEX_TYPE_MASK) == \
+       MOVE_FLAG_INDEX_VAR) { \
+        if(read_index(cvm, \
+                      REG_SP, \
+                      OPERAND##index, \
+                      OPERAND##val, \
+                      &OPERAND##index) < 0) { \
+            INST_STOP; \
+        } \
+    }
+
+/* fetch a value in to the result registers.  Only the register matching the
+   type of the value is updated. */
+#define FETCH_RESULT(FLAGS, VAL, INDEX, PTR) \
+    if(fetch_val(cvm, \
+                 FLAGS, \
+                 VAL, \
+                 INDEX, \
+                 &intval, \
+                 &floatval, \
+                 PTR) < 0) { \
+        INST_STOP; \
     } \
-    if(update_src_ref(cvm, \
-                      &srcflags, \
-                      &srcval, \
-                      &srcindex, \
-                      &srcptr) < 0) { \
-        break; \
+    if((FLAGS) == MOVE_FLAG_VAR && \
+       cvm->vinfo[VAL].type == CRUSTY_TYPE_FLOAT) { \
+        REG_FLOATRESULT = floatval; \
+    } else { \
+        REG_INTRESULT = intval; \
     }
- 
+
 #define FETCH_VALS \
-    if(cvm->var[destval].write != NULL) { \
+    if(cvm->vinfo[destval].flags & VARINFO_WRITE) { \
         cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION; \
-        return(cvm->status); \
+        INST_STOP; \
     } \
     \
     if(fetch_val(cvm, \
@@ -5205,97 +13408,655 @@ static void store_result(CrustyVM *cvm,
                  &intoperand, \
                  &floatoperand, \
                  srcptr) < 0) { \
-        break; \
+        INST_STOP; \
     } \
-    if(fetch_val(cvm, \
-                 destflags, \
+    FETCH_RESULT(destflags, destval, destindex, destptr)
+
+#define STORE_RESULT \
+    store_result(cvm, \
+                 REG_INTRESULT, \
+                 REG_FLOATRESULT, \
                  destval, \
                  destindex, \
-                 &(cvm->intresult), \
-                 &(cvm->floatresult), \
-                 destptr) < 0) { \
-        break; \
-    }
-
-#define MATH_INSTRUCTION(OP) \
-    POPULATE_ARGS \
+                 destptr);
+
+/* because "write" callbacks accept a pointer now, a result of a math operation
+ * can't be passed to a callback, so only move can be used with a callback as a
+ * destination.  All operations can still use "read" callbacks. */
+#define MOVE_BODY \
+    /* destval should be an index to a variable */ \
+    if(cvm->vinfo[destval].flags & VARINFO_WRITE) { /* destination is callback */ \
+        dest = &(cvm->var[destval]); \
+        if((srcflags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) { \
+            src = &(cvm->var[srcval]); \
+            if(src->read != NULL) { \
+                if(src->type == CRUSTY_TYPE_CHAR) { \
+                    /* the function will assume only 1 byte of storage \
+                     * so make sure it is all clear. */ \
+                    intval = 0; \
+                    if(src->read(src->readpriv, &intval, srcindex)) { \
+                        cvm->status = CRUSTY_STATUS_CALLBACK_FAILED; \
+                        INST_STOP; \
+                    } \
+                    REG_INTRESULT = intval; \
+                    REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+                } else if(src->type == CRUSTY_TYPE_FLOAT) { \
+                    if(src->read(src->readpriv, &floatval, srcindex)) { \
+                        cvm->status = CRUSTY_STATUS_CALLBACK_FAILED; \
+                        INST_STOP; \
+                    } \
+                    REG_FLOATRESULT = floatval; \
+                    REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+                } else { /* INT */ \
+                    if(src->read(src->readpriv, &intval, srcindex)) { \
+                        cvm->status = CRUSTY_STATUS_CALLBACK_FAILED; \
+                        INST_STOP; \
+                    } \
+                    REG_INTRESULT = intval; \
+                    REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+                } \
+                \
+                if(dest->write(dest->writepriv, \
+                               REG_RESULTTYPE, \
+                               1, \
+                               REG_RESULTTYPE == CRUSTY_TYPE_INT ? \
+                                   (void *)&intval : \
+                                   (void *)&floatval, \
+                               destindex) < 0) { \
+                    cvm->status = CRUSTY_STATUS_CALLBACK_FAILED; \
+                    INST_STOP; \
+                } \
+            } else { \
+                if(src->type == CRUSTY_TYPE_INT) { \
+                    srcptr += srcindex * sizeof(int); \
+                    REG_INTRESULT = *(int *)(&(cvm->stack[srcptr])); \
+                    REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+                } else if(src->type == CRUSTY_TYPE_FLOAT) { \
+                    srcptr += srcindex * sizeof(double); \
+                    REG_FLOATRESULT = *(float *)(&(cvm->stack[srcptr])); \
+                    REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+                } else { \
+                    srcptr += srcindex; \
+                    REG_INTRESULT = cvm->stack[srcptr]; \
+                    REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+                } \
+                \
+                if(dest->write(dest->writepriv, \
+                               src->type, \
+                               src->length - srcindex, \
+                               &(cvm->stack[srcptr]), \
+                               destindex) < 0) { \
+                    cvm->status = CRUSTY_STATUS_CALLBACK_FAILED; \
+                    INST_STOP; \
+                } \
+            } \
+        } else { \
+            if(dest->write(dest->writepriv, \
+                           CRUSTY_TYPE_INT, \
+                           1, \
+                           &srcval, \
+                           destindex) < 0) { \
+                cvm->status = CRUSTY_STATUS_CALLBACK_FAILED; \
+                INST_STOP; \
+            } \
+        } \
+    } else { /* destination is memory */ \
+        FETCH_RESULT(srcflags, srcval, srcindex, srcptr) \
+        \
+        if(srcflags == MOVE_FLAG_VAR) { \
+            if(cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT && \
+               cvm->vinfo[destval].type != CRUSTY_TYPE_FLOAT) { \
+                REG_INTRESULT = REG_FLOATRESULT; \
+                REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+            } else if((cvm->vinfo[srcval].type != \
+                       CRUSTY_TYPE_FLOAT) && \
+                      (cvm->vinfo[destval].type == \
+                       CRUSTY_TYPE_FLOAT)) { \
+                REG_FLOATRESULT = REG_INTRESULT; \
+                REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+            } \
+            /* if src and dest are the same type, no \
+             * conversion is necessary */ \
+        } else { \
+            /* immediates can only be ints */ \
+            if(cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+                REG_FLOATRESULT = REG_INTRESULT; \
+                REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+            } \
+        } \
+        \
+        STORE_RESULT \
+    } \
     \
+    REG_IP += MOVE_ARGS + 1;
+
+#define MATH_BODY(OP) \
     FETCH_VALS \
     \
     if(srcflags == MOVE_FLAG_VAR) { \
-        if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT && \
-           cvm->var[destval].type != CRUSTY_TYPE_FLOAT) { \
-            cvm->intresult = ((double)(cvm->intresult)) OP floatoperand; \
-            cvm->resulttype = CRUSTY_TYPE_INT; \
-        } else if(cvm->var[srcval].type != CRUSTY_TYPE_FLOAT && \
-                  cvm->var[destval].type == CRUSTY_TYPE_FLOAT) { \
-            cvm->floatresult = cvm->floatresult OP ((double)intoperand); \
-            cvm->resulttype = CRUSTY_TYPE_FLOAT; \
-        } else if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT && \
-                  cvm->var[destval].type == CRUSTY_TYPE_FLOAT) { \
-            cvm->floatresult = cvm->floatresult OP floatoperand; \
-            cvm->resulttype = CRUSTY_TYPE_FLOAT; \
+        if(cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT && \
+           cvm->vinfo[destval].type != CRUSTY_TYPE_FLOAT) { \
+            REG_INTRESULT = ((double)(REG_INTRESULT)) OP floatoperand; \
+            REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+        } else if(cvm->vinfo[srcval].type != CRUSTY_TYPE_FLOAT && \
+                  cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+            REG_FLOATRESULT = REG_FLOATRESULT OP ((double)intoperand); \
+            REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+        } else if(cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT && \
+                  cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+            REG_FLOATRESULT = REG_FLOATRESULT OP floatoperand; \
+            REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
         } else { /* both not float */ \
-            cvm->intresult = cvm->intresult OP intoperand; \
-            cvm->resulttype = CRUSTY_TYPE_INT; \
+            REG_INTRESULT = REG_INTRESULT OP intoperand; \
+            REG_RESULTTYPE = CRUSTY_TYPE_INT; \
         } \
     } else { \
         /* immediates can only be ints */ \
-        if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) { \
-            cvm->floatresult = cvm->floatresult OP ((double)intoperand); \
-            cvm->resulttype = CRUSTY_TYPE_FLOAT; \
+        if(cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+            REG_FLOATRESULT = REG_FLOATRESULT OP ((double)intoperand); \
+            REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
         } else { \
-            cvm->intresult = cvm->intresult OP intoperand; \
-            cvm->resulttype = CRUSTY_TYPE_INT; \
+            REG_INTRESULT = REG_INTRESULT OP intoperand; \
+            REG_RESULTTYPE = CRUSTY_TYPE_INT; \
         } \
     } \
     \
-    store_result(cvm, destval, destindex, destptr); \
+    STORE_RESULT \
     \
-    cvm->ip += MOVE_ARGS + 1;
+    REG_IP += MOVE_ARGS + 1;
 
-#define LOGIC_INSTRUCTION(OP) \
-    POPULATE_ARGS \
+#define MOD_BODY \
+    FETCH_VALS \
+    \
+    if(srcflags == MOVE_FLAG_VAR) { \
+        if(cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT && \
+           cvm->vinfo[destval].type != CRUSTY_TYPE_FLOAT) { \
+            REG_INTRESULT = fmod((double)REG_INTRESULT, floatoperand); \
+            REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+        } else if(cvm->vinfo[srcval].type != CRUSTY_TYPE_FLOAT && \
+                  cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+            REG_FLOATRESULT = fmod(REG_FLOATRESULT, (double)intoperand); \
+            REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+        } else if(cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT && \
+                  cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+            REG_FLOATRESULT = fmod(REG_FLOATRESULT, floatoperand); \
+            REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+        } else { /* both not float */ \
+            REG_INTRESULT = REG_INTRESULT % intoperand; \
+            REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+        } \
+    } else { \
+        /* immediates can only be ints */ \
+        if(cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+            REG_FLOATRESULT = fmod(REG_FLOATRESULT, (double)intoperand); \
+            REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+        } else { \
+            REG_INTRESULT = REG_INTRESULT % intoperand; \
+            REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+        } \
+    } \
     \
+    STORE_RESULT \
+    \
+    REG_IP += MOVE_ARGS + 1;
+
+#define LOGIC_BODY(OP) \
     FETCH_VALS \
     \
     if(srcflags == MOVE_FLAG_VAR) { \
-        if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT || \
-           cvm->var[destval].type == CRUSTY_TYPE_FLOAT) { \
+        if(cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT || \
+           cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+            cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION; \
+            INST_STOP; \
+        } \
+    } \
+    \
+    REG_INTRESULT = REG_INTRESULT OP intoperand; \
+    REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+    \
+    STORE_RESULT \
+    \
+    REG_IP += MOVE_ARGS + 1;
+
+/* make sure we're shifting by an integer, so just truncate the float value to
+   an integer */
+#define SHIFT_BODY(OP) \
+    FETCH_VALS \
+    \
+    if(srcflags == MOVE_FLAG_VAR && \
+       cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT) { \
+        if(cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+            cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION; \
+            INST_STOP; \
+        } else { \
+            REG_INTRESULT = REG_INTRESULT OP intoperand; \
+            REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+        } \
+    } else { \
+        if(cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
             cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION; \
-            break; \
+            INST_STOP; \
+        } else { \
+            REG_INTRESULT = REG_INTRESULT OP intoperand; \
+            REG_RESULTTYPE = CRUSTY_TYPE_INT; \
         } \
     } \
     \
-    cvm->intresult = cvm->intresult OP intoperand; \
-    cvm->resulttype = CRUSTY_TYPE_INT; \
+    STORE_RESULT \
+    \
+    REG_IP += MOVE_ARGS + 1;
+
+#define CMP_BODY \
+    if(fetch_val(cvm, \
+                 srcflags, \
+                 srcval, \
+                 srcindex, \
+                 &intoperand, \
+                 &floatoperand, \
+                 srcptr) < 0) { \
+        INST_STOP; \
+    } \
+    FETCH_RESULT(destflags, destval, destindex, destptr) \
     \
-    store_result(cvm, destval, destindex, destptr); \
+    if(srcflags == MOVE_FLAG_VAR) { \
+        if(destflags == MOVE_FLAG_VAR) { \
+            if(cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT && \
+               cvm->vinfo[destval].type != CRUSTY_TYPE_FLOAT) { \
+                REG_FLOATRESULT = ((double)(REG_INTRESULT)) - floatoperand; \
+                REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+            } else if(cvm->vinfo[srcval].type != CRUSTY_TYPE_FLOAT && \
+                      cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+                REG_FLOATRESULT = REG_FLOATRESULT - ((double)intoperand); \
+                REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+            } else if(cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT && \
+                      cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+                REG_FLOATRESULT -= floatoperand; \
+                REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+            } else { /* both not float */ \
+                REG_INTRESULT -= intoperand; \
+                REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+            } \
+        } else { /* with cmp, destination can be an immediate */ \
+            if(cvm->vinfo[srcval].type == CRUSTY_TYPE_FLOAT) { \
+                REG_FLOATRESULT = ((double)(REG_INTRESULT)) - floatoperand; \
+                REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+            } else { \
+                REG_INTRESULT -= intoperand; \
+            } \
+        } \
+    } else { \
+        /* immediates can only be ints */ \
+        if(destflags == MOVE_FLAG_VAR) { \
+            if(cvm->vinfo[destval].type == CRUSTY_TYPE_FLOAT) { \
+                REG_FLOATRESULT -= ((double)intoperand); \
+                REG_RESULTTYPE = CRUSTY_TYPE_FLOAT; \
+            } else { \
+                REG_INTRESULT -= intoperand; \
+                REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+            } \
+        } else { /* I guess we're comparing 2 immediates */ \
+            REG_INTRESULT -= intoperand; \
+            REG_RESULTTYPE = CRUSTY_TYPE_INT; \
+        } \
+    } \
     \
-    cvm->ip += MOVE_ARGS + 1;
+    REG_IP += MOVE_ARGS + 1;
+
+/* jump to self means nothing more can happen, so end execution. */
+#define JUMP_ALWAYS_INSTRUCTION \
+    if(REG_IP == (unsigned int)(REG_INST[REG_IP + JUMP_LOCATION])) { \
+        cvm->status = CRUSTY_STATUS_READY; \
+        INST_STOP; \
+    } \
+    REG_IP = (unsigned int)(REG_INST[REG_IP + JUMP_LOCATION]);
+
+/* the result registers are left alone */
+#define SWITCH_INSTRUCTION \
+    intval = switch_slot(cvm, &(REG_INST[REG_IP]), REG_SP); \
+    if(intval < 0) { \
+        INST_STOP; \
+    } \
+    REG_IP = (unsigned int)(REG_INST[REG_IP + intval]);
+
+/* select leaves the result registers alone */
+#define PICK_INSTRUCTION(TYPE, NONZERO) \
+    intval = pick_value(cvm, \
+                        CRUSTY_INSTRUCTION_TYPE_##TYPE, \
+                        &(REG_INST[REG_IP]), \
+                        REG_SP, \
+                        NONZERO, \
+                        &intoperand, \
+                        &floatoperand); \
+    if(intval < 0) { \
+        INST_STOP; \
+    } \
+    if(CRUSTY_INSTRUCTION_TYPE_##TYPE != CRUSTY_INSTRUCTION_TYPE_SELECT) { \
+        REG_INTRESULT = intoperand; \
+        REG_FLOATRESULT = floatoperand; \
+        REG_RESULTTYPE = intval; \
+    } \
+    REG_IP += pick_takes_other(CRUSTY_INSTRUCTION_TYPE_##TYPE) ? \
+              PICK_ARGS + 1 : MOVE_ARGS + 1;
+
+/* the result registers are left alone */
+#define LOOP_INSTRUCTION \
+    intval = loop_step(cvm, &(REG_INST[REG_IP]), REG_SP); \
+    if(intval < 0) { \
+        INST_STOP; \
+    } else if(intval) { \
+        REG_IP = (unsigned int)(REG_INST[REG_IP + LOOP_LOCATION]); \
+    } else { \
+        REG_IP += LOOP_ARGS + 1; \
+    }
 
 #define JUMP_INSTRUCTION(CMP) \
-    if(cvm->resulttype == CRUSTY_TYPE_INT) { \
-        if(cvm->intresult CMP 0) { \
-            cvm->ip = (unsigned int)(cvm->inst[cvm->ip + JUMP_LOCATION]); \
+    if(REG_RESULTTYPE == CRUSTY_TYPE_INT) { \
+        if(REG_INTRESULT CMP 0) { \
+            REG_IP = (unsigned int)(REG_INST[REG_IP + JUMP_LOCATION]); \
         } else { \
-            cvm->ip += JUMP_ARGS + 1; \
+            REG_IP += JUMP_ARGS + 1; \
         } \
     } else { \
-        if(cvm->floatresult CMP 0.0) { \
-            cvm->ip = (unsigned int)(cvm->inst[cvm->ip + JUMP_LOCATION]); \
+        if(REG_FLOATRESULT CMP 0.0) { \
+            REG_IP = (unsigned int)(REG_INST[REG_IP + JUMP_LOCATION]); \
         } else { \
-            cvm->ip += JUMP_ARGS + 1; \
+            REG_IP += JUMP_ARGS + 1; \
         } \
     }
 
-CrustyStatus crustyvm_step(CrustyVM *cvm) {
-    int destflags, destval, destindex, destptr;
-    int srcflags, srcval, srcindex, srcptr;
-    double floatoperand;
-    int intoperand;
+#define CALL_INSTRUCTION \
+    if(call(cvm, \
+            REG_INST, \
+            REG_SP, \
+            REG_INST[REG_IP + CALL_PROCEDURE], \
+            REG_IP + CALL_START_ARGS) < 0) { \
+        INST_STOP; \
+    } \
+    \
+    REG_SP += cvm->proc[REG_INST[REG_IP + CALL_PROCEDURE]].stackneeded; \
+    REG_IP = REG_ENTRY(REG_INST[REG_IP + CALL_PROCEDURE]);
+
+#define TAILCALL_INSTRUCTION \
+    if(tail_call(cvm, \
+                 REG_INST, \
+                 REG_SP, \
+                 REG_INST[REG_IP + CALL_PROCEDURE], \
+                 REG_IP + CALL_START_ARGS) < 0) { \
+        INST_STOP; \
+    } \
+    \
+    REG_SP -= cvm->proc[cvm->cstack[cvm->csp - 1].proc].stackneeded; \
+    REG_SP += cvm->proc[REG_INST[REG_IP + CALL_PROCEDURE]].stackneeded; \
+    cvm->cstack[cvm->csp - 1].proc = REG_INST[REG_IP + CALL_PROCEDURE]; \
+    REG_IP = REG_ENTRY(REG_INST[REG_IP + CALL_PROCEDURE]);
+
+#define BULK_INSTRUCTION(TYPE) \
+    if(bulk(cvm, \
+            CRUSTY_INSTRUCTION_TYPE_##TYPE, \
+            &(REG_INST[REG_IP]), \
+            REG_SP) < 0) { \
+        INST_STOP; \
+    } \
+    \
+    REG_IP += BULK_ARGS + 1;
+
+#define RET_INSTRUCTION \
+    /* going to return from initial call */ \
+    if(cvm->csp == 1) { \
+        cvm->status = CRUSTY_STATUS_READY; \
+        INST_STOP; \
+    } \
+    \
+    REG_IP = cvm->cstack[cvm->csp - 1].ip; \
+    REG_SP -= cvm->proc[cvm->cstack[cvm->csp - 1].proc].stackneeded; \
+    \
+    cvm->csp--;
+
+/* cmp never writes its destination, so it's treated as a source */
+#define DEST_UPDATE_MOVE update_dest_ref
+#define DEST_UPDATE_ADD  update_dest_ref
+#define DEST_UPDATE_SUB  update_dest_ref
+#define DEST_UPDATE_MUL  update_dest_ref
+#define DEST_UPDATE_DIV  update_dest_ref
+#define DEST_UPDATE_MOD  update_dest_ref
+#define DEST_UPDATE_AND  update_dest_ref
+#define DEST_UPDATE_OR   update_dest_ref
+#define DEST_UPDATE_XOR  update_dest_ref
+#define DEST_UPDATE_SHR  update_dest_ref
+#define DEST_UPDATE_SHL  update_dest_ref
+#define DEST_UPDATE_CMP  update_src_ref
+
+#define BODY_MOVE MOVE_BODY
+#define BODY_ADD  MATH_BODY(+)
+#define BODY_SUB  MATH_BODY(-)
+#define BODY_MUL  MATH_BODY(*)
+#define BODY_DIV  MATH_BODY(/)
+#define BODY_MOD  MOD_BODY
+#define BODY_AND  LOGIC_BODY(&)
+#define BODY_OR   LOGIC_BODY(|)
+#define BODY_XOR  LOGIC_BODY(^)
+#define BODY_SHR  SHIFT_BODY(>>)
+#define BODY_SHL  SHIFT_BODY(<<)
+#define BODY_CMP  CMP_BODY
+
+/* the destination is resolved first so errors come up in the same order for
+   every kind of operand */
+#define OPERATION(OP, DEST, SRC) \
+    RESOLVE_##DEST(dest, MOVE_DEST, DEST_UPDATE_##OP) \
+    RESOLVE_##SRC(src, MOVE_SRC, update_src_ref) \
+    BODY_##OP
+
+#define CRUSTY_INSTRUCTIONS(X) \
+    X(MOVE,  OPERATION(MOVE, REFERENCE, REFERENCE)) \
+    X(ADD,   OPERATION(ADD,  REFERENCE, REFERENCE)) \
+    X(SUB,   OPERATION(SUB,  REFERENCE, REFERENCE)) \
+    X(MUL,   OPERATION(MUL,  REFERENCE, REFERENCE)) \
+    X(DIV,   OPERATION(DIV,  REFERENCE, REFERENCE)) \
+    X(MOD,   OPERATION(MOD,  REFERENCE, REFERENCE)) \
+    X(AND,   OPERATION(AND,  REFERENCE, REFERENCE)) \
+    X(OR,    OPERATION(OR,   REFERENCE, REFERENCE)) \
+    X(XOR,   OPERATION(XOR,  REFERENCE, REFERENCE)) \
+    X(SHR,   OPERATION(SHR,  REFERENCE, REFERENCE)) \
+    X(SHL,   OPERATION(SHL,  REFERENCE, REFERENCE)) \
+    X(CMP,   OPERATION(CMP,  REFERENCE, REFERENCE)) \
+    X(JUMP,  JUMP_ALWAYS_INSTRUCTION) \
+    X(JUMPN, JUMP_INSTRUCTION(!=)) \
+    X(JUMPZ, JUMP_INSTRUCTION(==)) \
+    X(JUMPL, JUMP_INSTRUCTION(<)) \
+    X(JUMPG, JUMP_INSTRUCTION(>)) \
+    X(SWITCH, SWITCH_INSTRUCTION) \
+    X(LOOP,  LOOP_INSTRUCTION) \
+    X(LOOP_GLOBAL_GLOBAL,    TYPED_LOOP_INSTRUCTION(GLOBAL, GLOBAL)) \
+    X(LOOP_GLOBAL_LOCAL,     TYPED_LOOP_INSTRUCTION(GLOBAL, LOCAL)) \
+    X(LOOP_GLOBAL_IMMEDIATE, TYPED_LOOP_INSTRUCTION(GLOBAL, IMMEDIATE)) \
+    X(LOOP_LOCAL_GLOBAL,     TYPED_LOOP_INSTRUCTION(LOCAL, GLOBAL)) \
+    X(LOOP_LOCAL_LOCAL,      TYPED_LOOP_INSTRUCTION(LOCAL, LOCAL)) \
+    X(LOOP_LOCAL_IMMEDIATE,  TYPED_LOOP_INSTRUCTION(LOCAL, IMMEDIATE)) \
+    X(MIN,   PICK_INSTRUCTION(MIN,   0)) \
+    X(MAX,   PICK_INSTRUCTION(MAX,   0)) \
+    X(ABS,   PICK_INSTRUCTION(ABS,   0)) \
+    X(CLAMP, PICK_INSTRUCTION(CLAMP, 0)) \
+    X(SELECT, PICK_INSTRUCTION(SELECT, \
+                               REG_RESULTTYPE == CRUSTY_TYPE_INT ? \
+                                   REG_INTRESULT != 0 : \
+                                   REG_FLOATRESULT != 0.0)) \
+    X(CALL,  CALL_INSTRUCTION) \
+    X(RET,   RET_INSTRUCTION) \
+    X(TAILCALL, TAILCALL_INSTRUCTION) \
+    X(COPY,  BULK_INSTRUCTION(COPY)) \
+    X(SHIFT, BULK_INSTRUCTION(SHIFT)) \
+    X(FILL,  BULK_INSTRUCTION(FILL)) \
+    X(VADD,  BULK_INSTRUCTION(VADD)) \
+    X(VSUB,  BULK_INSTRUCTION(VSUB)) \
+    X(VMUL,  BULK_INSTRUCTION(VMUL)) \
+    X(VMIN,  BULK_INSTRUCTION(VMIN)) \
+    X(VMAX,  BULK_INSTRUCTION(VMAX)) \
+    X(VSCALE, BULK_INSTRUCTION(VSCALE))
+
+/* expands to INSTRUCTION for each specialized instruction */
+#define SPECIALIZED_INSTRUCTION(OP, DEST, SRC) \
+    INSTRUCTION(OP##_##DEST##_##SRC, OPERATION(OP, DEST, SRC))
+
+/* Typed instructions access the values directly and always know what the
+   result type will be.  They have to leave the result registers the same as the
+   generic instructions would. */
+#define TYPED_VALUE_GLOBAL_I(OPERAND) \
+    (*((int *)(&(cvm->stack[OPERAND##ptr]))))
+#define TYPED_VALUE_GLOBAL_F(OPERAND) \
+    (*((double *)(&(cvm->stack[OPERAND##ptr]))))
+#define TYPED_VALUE_LOCAL_I(OPERAND) TYPED_VALUE_GLOBAL_I(OPERAND)
+#define TYPED_VALUE_LOCAL_F(OPERAND) TYPED_VALUE_GLOBAL_F(OPERAND)
+#define TYPED_VALUE_IMMEDIATE_I(OPERAND) (OPERAND##val)
+#define TYPED_VALUE_ARGUMENT_I(OPERAND) \
+    (((int *)(&(cvm->stack[OPERAND##ptr])))[OPERAND##index])
+#define TYPED_VALUE_ARGUMENT_F(OPERAND) \
+    (((double *)(&(cvm->stack[OPERAND##ptr])))[OPERAND##index])
+
+#define TYPED_RESULT_I REG_INTRESULT
+#define TYPED_RESULT_F REG_FLOATRESULT
+
+/* move only changes the result type when there's a conversion */
+#define TYPED_CONVERT_I_I
+#define TYPED_CONVERT_F_F
+#define TYPED_CONVERT_I_F \
+    REG_INTRESULT = REG_FLOATRESULT; \
+    REG_RESULTTYPE = CRUSTY_TYPE_INT;
+#define TYPED_CONVERT_F_I \
+    REG_FLOATRESULT = REG_INTRESULT; \
+    REG_RESULTTYPE = CRUSTY_TYPE_FLOAT;
+
+/* a compare involving a float always has a float result */
+#define TYPED_COMPARE_I_I(SRCVAL) \
+    REG_INTRESULT -= (SRCVAL); \
+    REG_RESULTTYPE = CRUSTY_TYPE_INT;
+#define TYPED_COMPARE_I_F(SRCVAL) \
+    REG_FLOATRESULT = ((double)(REG_INTRESULT)) - (SRCVAL); \
+    REG_RESULTTYPE = CRUSTY_TYPE_FLOAT;
+#define TYPED_COMPARE_F_I(SRCVAL) \
+    REG_FLOATRESULT -= ((double)(SRCVAL)); \
+    REG_RESULTTYPE = CRUSTY_TYPE_FLOAT;
+#define TYPED_COMPARE_F_F(SRCVAL) \
+    REG_FLOATRESULT -= (SRCVAL); \
+    REG_RESULTTYPE = CRUSTY_TYPE_FLOAT;
+
+#define TYPED_MOVE_BODY(DEST, SRC, DT, ST) \
+    TYPED_RESULT_##ST = TYPED_VALUE_##SRC##_##ST(src); \
+    TYPED_CONVERT_##DT##_##ST \
+    TYPED_VALUE_##DEST##_##DT(dest) = TYPED_RESULT_##DT; \
+    \
+    REG_IP += TYPED_ARGS + 1;
+
+/* the usual arithmetic conversions do the same as the generic instructions */
+#define TYPED_MATH_BODY(OP, DEST, SRC, DT, ST) \
+    TYPED_RESULT_##DT = \
+        TYPED_VALUE_##DEST##_##DT(dest) OP TYPED_VALUE_##SRC##_##ST(src); \
+    REG_RESULTTYPE = CRUSTY_TYPED_TYPE_##DT; \
+    TYPED_VALUE_##DEST##_##DT(dest) = TYPED_RESULT_##DT; \
+    \
+    REG_IP += TYPED_ARGS + 1;
+
+#define TYPED_CMP_BODY(DEST, SRC, DT, ST) \
+    TYPED_RESULT_##DT = TYPED_VALUE_##DEST##_##DT(dest); \
+    TYPED_COMPARE_##DT##_##ST(TYPED_VALUE_##SRC##_##ST(src)) \
+    \
+    REG_IP += TYPED_ARGS + 1;
+
+#define TYPED_BODY_MOVE(DEST, SRC, DT, ST) TYPED_MOVE_BODY(DEST, SRC, DT, ST)
+#define TYPED_BODY_ADD(DEST, SRC, DT, ST)  TYPED_MATH_BODY(+, DEST, SRC, DT, ST)
+#define TYPED_BODY_SUB(DEST, SRC, DT, ST)  TYPED_MATH_BODY(-, DEST, SRC, DT, ST)
+#define TYPED_BODY_MUL(DEST, SRC, DT, ST)  TYPED_MATH_BODY(*, DEST, SRC, DT, ST)
+#define TYPED_BODY_DIV(DEST, SRC, DT, ST)  TYPED_MATH_BODY(/, DEST, SRC, DT, ST)
+#define TYPED_BODY_AND(DEST, SRC, DT, ST)  TYPED_MATH_BODY(&, DEST, SRC, DT, ST)
+#define TYPED_BODY_OR(DEST, SRC, DT, ST)   TYPED_MATH_BODY(|, DEST, SRC, DT, ST)
+#define TYPED_BODY_XOR(DEST, SRC, DT, ST)  TYPED_MATH_BODY(^, DEST, SRC, DT, ST)
+#define TYPED_BODY_SHR(DEST, SRC, DT, ST)  TYPED_MATH_BODY(>>, DEST, SRC, DT, ST)
+#define TYPED_BODY_SHL(DEST, SRC, DT, ST)  TYPED_MATH_BODY(<<, DEST, SRC, DT, ST)
+#define TYPED_BODY_CMP(DEST, SRC, DT, ST)  TYPED_CMP_BODY(DEST, SRC, DT, ST)
+
+/* each interpreter says where the one word each typed operand uses is with
+   TYPED_DEST_PTR, TYPED_SRC_PTR and TYPED_SRC_VAL, and how long a typed
+   instruction is with TYPED_ARGS */
+#define TYPED_RESOLVE_GLOBAL(OPERAND, SLOT) \
+    OPERAND##ptr = REG_INST[REG_IP + SLOT##_PTR];
+#define TYPED_RESOLVE_LOCAL(OPERAND, SLOT) \
+    OPERAND##ptr = REG_SP - REG_INST[REG_IP + SLOT##_PTR];
+#define TYPED_RESOLVE_IMMEDIATE(OPERAND, SLOT) \
+    OPERAND##val = REG_INST[REG_IP + SLOT##_VAL];
+/* what the argument refers to was resolved when the procedure was called */
+#define TYPED_RESOLVE_ARGUMENT(OPERAND, SLOT) \
+    arg = (CrustyStackArg *)(&(cvm->stack[REG_SP - \
+                                          REG_INST[REG_IP + SLOT##_PTR]])); \
+    OPERAND##ptr = arg->ptr; \
+    OPERAND##index = arg->index;
+
+#define TYPED_OPERATION(OP, DEST, SRC, DT, ST) \
+    TYPED_RESOLVE_##DEST(dest, TYPED_DEST) \
+    TYPED_RESOLVE_##SRC(src, TYPED_SRC) \
+    TYPED_BODY_##OP(DEST, SRC, DT, ST)
+
+/* the operands are found the same as a typed instruction's, and typed loops
+   are never packed down so they're where they are in the instruction */
+#define TYPED_LOOP_INSTRUCTION(COUNTER, BOUND) \
+    TYPED_RESOLVE_##COUNTER(dest, LOOP_COUNTER) \
+    TYPED_RESOLVE_##BOUND(src, LOOP_BOUND) \
+    intval = TYPED_VALUE_##COUNTER##_I(dest) + \
+             REG_INST[REG_IP + LOOP_STEP_VAL]; \
+    TYPED_VALUE_##COUNTER##_I(dest) = intval; \
+    if(REG_INST[REG_IP + LOOP_STEP_VAL] < 0 ? \
+       intval > TYPED_VALUE_##BOUND##_I(src) : \
+       intval < TYPED_VALUE_##BOUND##_I(src)) { \
+        REG_IP = (unsigned int)(REG_INST[REG_IP + LOOP_LOCATION]); \
+    } else { \
+        REG_IP += LOOP_ARGS + 1; \
+    }
+
+/* expands to INSTRUCTION for each typed instruction */
+#define TYPED_INSTRUCTION(OP, DEST, SRC, DT, ST) \
+    INSTRUCTION(OP##_##DEST##_##SRC##_##DT##_##ST, \
+                TYPED_OPERATION(OP, DEST, SRC, DT, ST))
+
+/* A typed cmp always knows which result the jump needs to look at.  Each half of
+   a fused instruction moves IP along as usual, so the second half finds its
+   arguments in the second instruction. */
+#define TYPED_BRANCH(COND) \
+    if(COND) { \
+        REG_IP = (unsigned int)(REG_INST[REG_IP + JUMP_LOCATION]); \
+    } else { \
+        REG_IP += JUMP_ARGS + 1; \
+    }
+#define TYPED_BRANCH_I_I(CMP) TYPED_BRANCH(REG_INTRESULT CMP 0)
+#define TYPED_BRANCH_I_F(CMP) TYPED_BRANCH(REG_FLOATRESULT CMP 0.0)
+#define TYPED_BRANCH_F_I(CMP) TYPED_BRANCH(REG_FLOATRESULT CMP 0.0)
+#define TYPED_BRANCH_F_F(CMP) TYPED_BRANCH(REG_FLOATRESULT CMP 0.0)
+
+#define BRANCH_CMP_JUMPN !=
+#define BRANCH_CMP_JUMPZ ==
+#define BRANCH_CMP_JUMPL <
+#define BRANCH_CMP_JUMPG >
+
+/* expands to INSTRUCTION for each fused instruction */
+#define FUSED_BRANCH(DEST, SRC, DT, ST, JUMP) \
+    INSTRUCTION(CMP_##DEST##_##SRC##_##DT##_##ST##_##JUMP, \
+                TYPED_OPERATION(CMP, DEST, SRC, DT, ST) \
+                TYPED_BRANCH_##DT##_##ST(BRANCH_CMP_##JUMP))
+
+#define FUSED_MATH(DEST, DT, MSRC, MST, OP, SRC, ST) \
+    INSTRUCTION(MOVE_##DEST##_##MSRC##_##DT##_##MST##_##\
+                    OP##_##DEST##_##SRC##_##DT##_##ST, \
+                TYPED_OPERATION(MOVE, DEST, MSRC, DT, MST) \
+                TYPED_OPERATION(OP, DEST, SRC, DT, ST))
+
+#define INSTRUCTION_LOCALS \
+    int destflags, destval, destindex, destptr; \
+    int srcflags, srcval, srcindex, srcptr; \
+    double floatoperand, floatval; \
+    int intoperand, intval; \
+    CrustyStackArg *arg; \
     CrustyVariable *dest, *src;
 
+CrustyStatus crustyvm_step(CrustyVM *cvm) {
+    INSTRUCTION_LOCALS
+
     if(cvm->status != CRUSTY_STATUS_ACTIVE) {
         return(cvm->status);
     }
@@ -5310,383 +14071,437 @@ CrustyStatus crustyvm_step(CrustyVM *cvm) {
     }
 #endif
 
+#define REG_INST (cvm->inst)
+#define REG_IP (cvm->ip)
+#define REG_SP (cvm->sp)
+#define REG_INTRESULT (cvm->intresult)
+#define REG_FLOATRESULT (cvm->floatresult)
+#define REG_RESULTTYPE (cvm->resulttype)
+#define REG_ENTRY(PROC) (cvm->proc[PROC].instruction)
+#define TYPED_DEST_PTR MOVE_DEST_INDEX
+#define TYPED_SRC_PTR MOVE_SRC_INDEX
+#define TYPED_SRC_VAL MOVE_SRC_VAL
+#define TYPED_ARGS MOVE_ARGS
+#define INST_STOP break
+#define INSTRUCTION(NAME, BODY) \
+        case CRUSTY_INSTRUCTION_TYPE_##NAME: \
+            BODY \
+            break;
+
     switch(cvm->inst[cvm->ip]) {
-        case CRUSTY_INSTRUCTION_TYPE_MOVE:
-            POPULATE_ARGS
-
-            /* because "write" callbacks accept a pointer now, a
-             * result of a math operation can't be passed to a
-             * callback, so only move can be used with a callback
-             * as a destination.  All operations can still use "read"
-             * callbacks. */
-            /* destval should be an index to a variable */
-            dest = &(cvm->var[destval]);
-            if(dest->write != NULL) { /* destination is callback */
-                if((srcflags & MOVE_FLAG_TYPE_MASK) == MOVE_FLAG_VAR) {
-                    src = &(cvm->var[srcval]);
-                    if(src->read != NULL) {
-                        if(src->type == CRUSTY_TYPE_CHAR) {
-                            /* the function will assume only 1 byte of storage
-                             * so make sure it is all clear. */
-                            cvm->intresult = 0;
-                            if(src->read(src->readpriv,
-                                         &(cvm->intresult),
-                                         srcindex)) {
-                                cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
-                                return(cvm->status);
-                            }
-                            cvm->resulttype = CRUSTY_TYPE_INT;
-                        } else if(src->type == CRUSTY_TYPE_FLOAT) {
-                            if(src->read(src->readpriv,
-                                         &(cvm->floatresult),
-                                         srcindex)) {
-                                cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
-                                return(cvm->status);
-                            }
-                            cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                        } else { /* INT */
-                            if(src->read(src->readpriv,
-                                         &(cvm->intresult),
-                                         srcindex)) {
-                                cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
-                                return(cvm->status);
-                            }
-                            cvm->resulttype = CRUSTY_TYPE_INT;
-                        }
+        CRUSTY_INSTRUCTIONS(INSTRUCTION)
+        CRUSTY_SPECIALIZED_INSTRUCTIONS(SPECIALIZED_INSTRUCTION)
+        CRUSTY_TYPED_INSTRUCTIONS(TYPED_INSTRUCTION)
+        CRUSTY_FUSED_BRANCHES(FUSED_BRANCH)
+        CRUSTY_FUSED_MATH(FUSED_MATH)
+        default:
+            cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
+    }
 
-                        if(dest->write(dest->writepriv,
-                                       cvm->resulttype,
-                                       1,
-                                       cvm->resulttype == CRUSTY_TYPE_INT ?
-                                           (void *)&(cvm->intresult) :
-                                           (void *)&(cvm->floatresult),
-                                       destindex) < 0) {
-                            cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
-                            return(cvm->status);
-                        }
-                    } else {
-                        if(src->type == CRUSTY_TYPE_INT) {
-                            srcptr += srcindex * sizeof(int);
-                            cvm->intresult = *(int *)(&(cvm->stack[srcptr]));
-                            cvm->resulttype = CRUSTY_TYPE_INT;
-                        } else if(src->type == CRUSTY_TYPE_FLOAT) {
-                            srcptr += srcindex * sizeof(double);
-                            cvm->floatresult = *(float *)(&(cvm->stack[srcptr]));
-                            cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                        } else {
-                            srcptr += srcindex;
-                            cvm->intresult = cvm->stack[srcptr];
-                            cvm->resulttype = CRUSTY_TYPE_INT;
-                        }
+#undef INSTRUCTION
+#undef INST_STOP
+#undef TYPED_ARGS
+#undef TYPED_SRC_VAL
+#undef TYPED_SRC_PTR
+#undef TYPED_DEST_PTR
+#undef REG_ENTRY
+#undef REG_RESULTTYPE
+#undef REG_FLOATRESULT
+#undef REG_INTRESULT
+#undef REG_SP
+#undef REG_IP
+#undef REG_INST
 
-                        if(dest->write(dest->writepriv,
-                                       src->type,
-                                       src->length - srcindex,
-                                       &(cvm->stack[srcptr]),
-                                       destindex) < 0) {
-                            cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
-                            return(cvm->status);
-                        }
-                    }
-                } else {
-                    if(dest->write(dest->writepriv,
-                                   CRUSTY_TYPE_INT,
-                                   1,
-                                   &srcval,
-                                   destindex) < 0) {
-                        cvm->status = CRUSTY_STATUS_CALLBACK_FAILED;
-                        return(cvm->status);
-                    }
-                }
-            } else { /* destination is memory */
-                if(fetch_val(cvm,
-                             srcflags,
-                             srcval,
-                             srcindex,
-                             &(cvm->intresult),
-                             &(cvm->floatresult),
-                             srcptr) < 0) {
-                    break;
-                }
+    return(cvm->status);
+}
 
-                if(srcflags == MOVE_FLAG_VAR) {
-                    if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT &&
-                       cvm->var[destval].type != CRUSTY_TYPE_FLOAT) {
-                        cvm->intresult = cvm->floatresult;
-                        cvm->resulttype = CRUSTY_TYPE_INT;
-                    } else if((cvm->var[srcval].type !=
-                               CRUSTY_TYPE_FLOAT) &&
-                              (cvm->var[destval].type ==
-                               CRUSTY_TYPE_FLOAT)) {
-                        cvm->floatresult = cvm->intresult;
-                        cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                    }
-                    /* if src and dest are the same type, no
-                     * conversion is necessary */
-                } else {
-                    /* immediates can only be ints */
-                    if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                        cvm->floatresult = cvm->intresult;
-                        cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                    }
-                }
+#ifdef CRUSTY_THREADED
+/* typed instructions and the first half of fused instructions in threaded code
+   only keep the one word each operand uses */
+#define THREAD_TYPED_DEST (1)
+#define THREAD_TYPED_SRC  (2)
+#define THREAD_TYPED_ARGS THREAD_TYPED_SRC
 
-                store_result(cvm, destval, destindex, destptr);
-            }
+/* the typed instruction a threaded code instruction is packed as, or NULL if
+   it's left as it is */
+static const CrustySpecialization *thread_typed_instruction(int type) {
+    if(type >= (int)CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED &&
+       type < CRUSTY_INSTRUCTION_TYPE_INVALID) {
+        type = CRUSTY_FUSIONS[type - CRUSTY_INSTRUCTION_TYPE_FIRST_FUSED].first;
+    }
 
-            cvm->ip += MOVE_ARGS + 1;
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_ADD:
-            MATH_INSTRUCTION(+)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_SUB:
-            MATH_INSTRUCTION(-)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_MUL:
-            MATH_INSTRUCTION(*)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_DIV:
-            MATH_INSTRUCTION(/)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_MOD:
-            POPULATE_ARGS
-
-            FETCH_VALS
-
-            if(srcflags == MOVE_FLAG_VAR) {
-                if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT &&
-                   cvm->var[destval].type != CRUSTY_TYPE_FLOAT) {
-                    cvm->intresult = fmod((double)cvm->intresult, floatoperand);
-                    cvm->resulttype = CRUSTY_TYPE_INT;
-                } else if(cvm->var[srcval].type != CRUSTY_TYPE_FLOAT &&
-                          cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                    cvm->floatresult = fmod(cvm->floatresult, (double)intoperand);
-                    cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                } else if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT &&
-                          cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                    cvm->floatresult = fmod(cvm->floatresult, floatoperand);
-                    cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                } else { /* both not float */
-                    cvm->intresult = cvm->intresult % intoperand;
-                    cvm->resulttype = CRUSTY_TYPE_INT;
-                }
-            } else {
-                /* immediates can only be ints */
-                if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                    cvm->floatresult = fmod(cvm->floatresult, (double)intoperand);
-                    cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                } else {
-                    cvm->intresult = cvm->intresult % intoperand;
-                    cvm->resulttype = CRUSTY_TYPE_INT;
-                }
-            }
+    return(typed_instruction(type));
+}
 
-            store_result(cvm, destval, destindex, destptr);
+/* Build the threaded code from the instructions, given the offsets of each
+   instruction's handler from the dispatch label.  Typed instructions get packed
+   and everything else is copied as it is with jump locations moved to where
+   they end up in the threaded code. */
+static int thread_code(CrustyVM *cvm,
+                       const int *handler,
+                       int nativehandler) {
+    const CrustySpecialization *spec;
+    int *thread = NULL;
+    unsigned int *threadip = NULL;
+    unsigned int *instip = NULL;
+    unsigned int threadlen;
+    unsigned int i, j, k;
+    unsigned int targets, loc;
+    int instsize;
 
-            cvm->ip += MOVE_ARGS + 1;
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_AND:
-            LOGIC_INSTRUCTION(&)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_OR:
-            LOGIC_INSTRUCTION(|)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_XOR:
-            LOGIC_INSTRUCTION(^)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_SHR:
-            POPULATE_ARGS
+    threadip = malloc(sizeof(unsigned int) * cvm->insts);
+    if(threadip == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for threaded code map.\n");
+        goto error;
+    }
 
-            FETCH_VALS
+    threadlen = 0;
+    for(i = 0; i < cvm->insts; i += instsize) {
+        instsize = instruction_size(cvm, i);
+        threadip[i] = threadlen;
+        if(thread_typed_instruction(cvm->inst[i]) != NULL) {
+            threadlen += THREAD_TYPED_ARGS + 1;
+        } else {
+            threadlen += instsize;
+        }
+    }
 
-            /* make sure we're shifting by an integer, so just truncate the float
-               value to an integer */
-            if(srcflags == MOVE_FLAG_VAR &&
-               cvm->var[srcval].type == CRUSTY_TYPE_FLOAT) {
-                if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                    cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
-                    break;
-                } else {
-                    cvm->intresult = cvm->intresult >> intoperand;
-                    cvm->resulttype = CRUSTY_TYPE_INT;
-                }
+    thread = malloc(sizeof(int) * threadlen);
+    if(thread == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for threaded code.\n");
+        goto error;
+    }
+    instip = malloc(sizeof(unsigned int) * threadlen);
+    if(instip == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for threaded code map.\n");
+        goto error;
+    }
+
+    for(i = 0; i < cvm->insts; i += instsize) {
+        instsize = instruction_size(cvm, i);
+        j = threadip[i];
+        spec = thread_typed_instruction(cvm->inst[i]);
+        if(spec != NULL) {
+            /* the destination is never an immediate */
+            thread[j + THREAD_TYPED_DEST] = cvm->inst[i + MOVE_DEST_INDEX];
+            if(spec->src == CRUSTY_OPERAND_IMMEDIATE) {
+                thread[j + THREAD_TYPED_SRC] = cvm->inst[i + MOVE_SRC_VAL];
             } else {
-                if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                    cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
-                    break;
-                } else {
-                    cvm->intresult = cvm->intresult >> intoperand;
-                    cvm->resulttype = CRUSTY_TYPE_INT;
-                }
+                thread[j + THREAD_TYPED_SRC] = cvm->inst[i + MOVE_SRC_INDEX];
             }
+            instip[j + THREAD_TYPED_DEST] = i;
+            instip[j + THREAD_TYPED_SRC] = i;
+        } else {
+            memcpy(&(thread[j]), &(cvm->inst[i]), sizeof(int) * instsize);
+            targets = jump_targets(&(cvm->inst[i]), &loc);
+            for(k = 0; k < targets; k++) {
+                thread[j + loc + k] = threadip[cvm->inst[i + loc + k]];
+            }
+            for(instsize--; instsize > 0; instsize--) {
+                instip[j + instsize] = i;
+            }
+            instsize = instruction_size(cvm, i);
+        }
+        instip[j] = i;
 
-            store_result(cvm, destval, destindex, destptr);
+        thread[j] = handler[cvm->inst[i]];
+#ifdef CRUSTY_NATIVE
+        /* go in to native code wherever it can be entered */
+        if(cvm->nativeentry != NULL && cvm->nativeentry[i] != NULL) {
+            thread[j] = nativehandler;
+        }
+#endif
+    }
 
-            cvm->ip += MOVE_ARGS + 1;
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_SHL:
-            POPULATE_ARGS
+    if(cvm->thread != NULL) {
+        free(cvm->thread);
+    }
+    if(cvm->threadip != NULL) {
+        free(cvm->threadip);
+    }
+    if(cvm->instip != NULL) {
+        free(cvm->instip);
+    }
+    cvm->thread = thread;
+    cvm->threadlen = threadlen;
+    cvm->threadip = threadip;
+    cvm->instip = instip;
 
-            FETCH_VALS
+    return(0);
 
-            /* make sure we're shifting by an integer, so just truncate the float
-               value to an integer */
-            if(srcflags == MOVE_FLAG_VAR &&
-               cvm->var[srcval].type == CRUSTY_TYPE_FLOAT) {
-                if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                    cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
-                    break;
-                } else {
-                    cvm->intresult = cvm->intresult << intoperand;
-                    cvm->resulttype = CRUSTY_TYPE_INT;
-                }
-            } else {
-                if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                    cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
-                    break;
-                } else {
-                    cvm->intresult = cvm->intresult << intoperand;
-                    cvm->resulttype = CRUSTY_TYPE_INT;
-                }
-            }
+error:
+    if(threadip != NULL) {
+        free(threadip);
+    }
+    if(thread != NULL) {
+        free(thread);
+    }
+    return(-1);
+}
+#endif
 
-            store_result(cvm, destval, destindex, destptr);
+/* Run until the program ends or stops with an error, keeping the registers in
+   locals the whole time.  With GCC's labels as values, the instructions are
+   translated to threaded code up front, where each instruction starts with the
+   offset of its handler from the dispatch label so it jumps directly to the
+   next one's handler, and typed instructions are packed down to just the words
+   they use so more of a program fits in cache.  Instruction indexes are moved
+   in to the threaded code on entry and back out on exit.  Calling with prepare
+   set only builds the threaded code, which can't be done from anywhere else
+   since the labels are local to this function, and returns negative on
+   failure.  Without it, this is just a switch in a loop over the instructions.
+   Otherwise, returns the status execution stopped with. */
+static int run_threaded(CrustyVM *cvm, int prepare) {
+    unsigned int sp = cvm->sp;
+    int intresult = cvm->intresult;
+    double floatresult = cvm->floatresult;
+    CrustyType resulttype = cvm->resulttype;
+    INSTRUCTION_LOCALS
+#ifdef CRUSTY_THREADED
+#define INSTRUCTION(NAME, BODY) \
+        [CRUSTY_INSTRUCTION_TYPE_##NAME] = &&do_##NAME,
+    static const void *handler[] = {
+        CRUSTY_INSTRUCTIONS(INSTRUCTION)
+        CRUSTY_SPECIALIZED_INSTRUCTIONS(SPECIALIZED_INSTRUCTION)
+        CRUSTY_TYPED_INSTRUCTIONS(TYPED_INSTRUCTION)
+        CRUSTY_FUSED_BRANCHES(FUSED_BRANCH)
+        CRUSTY_FUSED_MATH(FUSED_MATH)
+    };
+#undef INSTRUCTION
+    const int *inst = cvm->thread;
+    unsigned int ip;
+    unsigned int i;
+#ifdef CRUSTY_NATIVE
+    CrustyNativeRegs native;
+#endif
 
-            cvm->ip += MOVE_ARGS + 1;
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_CMP:
-            /* this one is a bit special because destination never needs to be
-               written to, so treat both as src references */
-            destflags = cvm->inst[cvm->ip + MOVE_DEST_FLAGS]; \
-            destval = cvm->inst[cvm->ip + MOVE_DEST_VAL]; \
-            destindex = cvm->inst[cvm->ip + MOVE_DEST_INDEX]; \
-            destptr = cvm->sp; \
-            srcflags = cvm->inst[cvm->ip + MOVE_SRC_FLAGS]; \
-            srcval = cvm->inst[cvm->ip + MOVE_SRC_VAL]; \
-            srcindex = cvm->inst[cvm->ip + MOVE_SRC_INDEX]; \
-            srcptr = cvm->sp; \
-
-            if(update_src_ref(cvm, &destflags, &destval, &destindex, &destptr) < 0) {
-                break;
-            }
-            if(update_src_ref(cvm, &srcflags, &srcval, &srcindex, &srcptr) < 0) {
-                break;
-            }
+    if(prepare) {
+        int offset[sizeof(handler) / sizeof(handler[0])];
+        int nativeoffset = 0;
 
-            if(fetch_val(cvm,
-                         srcflags,
-                         srcval,
-                         srcindex,
-                         &intoperand,
-                         &floatoperand,
-                         srcptr) < 0) {
-                break;
-            }
-            if(fetch_val(cvm,
-                         destflags,
-                         destval,
-                         destindex,
-                         &(cvm->intresult),
-                         &(cvm->floatresult),
-                         destptr) < 0) {
-                break;
-            }
+        for(i = 0; i < sizeof(handler) / sizeof(handler[0]); i++) {
+            offset[i] = (const char *)(handler[i]) - (const char *)&&dispatch;
+        }
+#ifdef CRUSTY_NATIVE
+        nativeoffset = (const char *)&&do_NATIVE - (const char *)&&dispatch;
+#endif
 
-            if(srcflags == MOVE_FLAG_VAR) {
-                if(destflags == MOVE_FLAG_VAR) {
-                    if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT &&
-                       cvm->var[destval].type != CRUSTY_TYPE_FLOAT) {
-                        cvm->floatresult = ((double)(cvm->intresult)) - floatoperand;
-                        cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                    } else if(cvm->var[srcval].type != CRUSTY_TYPE_FLOAT &&
-                              cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                        cvm->floatresult = cvm->floatresult - ((double)intoperand);
-                        cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                    } else if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT &&
-                              cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                        cvm->floatresult -= floatoperand;
-                        cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                    } else { /* both not float */
-                        cvm->intresult -= intoperand;
-                        cvm->resulttype = CRUSTY_TYPE_INT;
-                    }
-                } else { /* with cmp, destination can be an immediate */
-                    if(cvm->var[srcval].type == CRUSTY_TYPE_FLOAT) {
-                        cvm->floatresult = ((double)(cvm->intresult)) - floatoperand;
-                        cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                    } else {
-                        cvm->intresult -= intoperand;
-                    }
-                }
-            } else {
-                /* immediates can only be ints */
-                if(destflags == MOVE_FLAG_VAR) {
-                    if(cvm->var[destval].type == CRUSTY_TYPE_FLOAT) {
-                        cvm->floatresult -= ((double)intoperand);
-                        cvm->resulttype = CRUSTY_TYPE_FLOAT;
-                    } else {
-                        cvm->intresult -= intoperand;
-                        cvm->resulttype = CRUSTY_TYPE_INT;
-                    }
-                } else { /* I guess we're comparing 2 immediates */
-                    cvm->intresult -= intoperand;
-                    cvm->resulttype = CRUSTY_TYPE_INT;
-                }
-            }
+        return(thread_code(cvm, offset, nativeoffset));
+    }
 
-            cvm->ip += MOVE_ARGS + 1;
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_JUMP:
-            /* jump to self means nothing more can happen, so end execution. */
-            if(cvm->ip == (unsigned int)(cvm->inst[cvm->ip + JUMP_LOCATION])) {
-                cvm->status = CRUSTY_STATUS_READY;
-                break;
-            }
-            cvm->ip = (unsigned int)(cvm->inst[cvm->ip + JUMP_LOCATION]);
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
-            JUMP_INSTRUCTION(!=)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
-            JUMP_INSTRUCTION(==)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
-            JUMP_INSTRUCTION(<)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_JUMPG:
-            JUMP_INSTRUCTION(>)
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_CALL:
-            if(call(cvm,
-                    cvm->inst[cvm->ip + CALL_PROCEDURE],
-                    cvm->ip + CALL_START_ARGS) < 0) {
-                break;
-            }
+    ip = cvm->threadip[cvm->ip];
+    for(i = 0; i < cvm->csp; i++) {
+        cvm->cstack[i].ip = cvm->threadip[cvm->cstack[i].ip];
+    }
+#else
+    const int *inst = cvm->inst;
+    unsigned int ip = cvm->ip;
 
-            //crustyvm_debugtrace(cvm, 0);
-            /* no need to update ip */
-            break;
-        case CRUSTY_INSTRUCTION_TYPE_RET:
-            /* going to return from initial call */
-            if(cvm->csp == 1) {
-                cvm->status = CRUSTY_STATUS_READY;
-                break;
-            }
+    if(prepare) {
+        return(0);
+    }
+#endif
 
-            cvm->ip = cvm->cstack[cvm->csp - 1].ip;
-            cvm->sp -= cvm->proc[cvm->cstack[cvm->csp - 1].proc].stackneeded;
+#define REG_INST inst
+#define REG_IP ip
+#define REG_SP sp
+#define REG_INTRESULT intresult
+#define REG_FLOATRESULT floatresult
+#define REG_RESULTTYPE resulttype
+#define INST_STOP goto done
+
+#ifdef CRUSTY_THREADED
+#define REG_ENTRY(PROC) (cvm->threadip[cvm->proc[PROC].instruction])
+#define TYPED_DEST_PTR THREAD_TYPED_DEST
+#define TYPED_SRC_PTR THREAD_TYPED_SRC
+#define TYPED_SRC_VAL THREAD_TYPED_SRC
+#define TYPED_ARGS THREAD_TYPED_ARGS
+#define INSTRUCTION(NAME, BODY) \
+do_##NAME: \
+    BODY \
+    goto *(&&dispatch + inst[ip]);
+
+dispatch:
+    goto *(&&dispatch + inst[ip]);
+    CRUSTY_INSTRUCTIONS(INSTRUCTION)
+    CRUSTY_SPECIALIZED_INSTRUCTIONS(SPECIALIZED_INSTRUCTION)
+    CRUSTY_TYPED_INSTRUCTIONS(TYPED_INSTRUCTION)
+    CRUSTY_FUSED_BRANCHES(FUSED_BRANCH)
+    CRUSTY_FUSED_MATH(FUSED_MATH)
+#undef INSTRUCTION
+
+#ifdef CRUSTY_NATIVE
+do_NATIVE:
+    native.intresult = intresult;
+    native.resulttype = resulttype;
+    native.floatresult = floatresult;
+    ip = cvm->threadip[cvm->nativeentry[cvm->instip[ip]](cvm->stack,
+                                                           sp,
+                                                           &native,
+                                                           cvm->instip[ip])];
+    intresult = native.intresult;
+    resulttype = native.resulttype;
+    floatresult = native.floatresult;
+    goto *(&&dispatch + inst[ip]);
+#endif
+#else
+#define REG_ENTRY(PROC) (cvm->proc[PROC].instruction)
+#define TYPED_DEST_PTR MOVE_DEST_INDEX
+#define TYPED_SRC_PTR MOVE_SRC_INDEX
+#define TYPED_SRC_VAL MOVE_SRC_VAL
+#define TYPED_ARGS MOVE_ARGS
+#define INSTRUCTION(NAME, BODY) \
+            case CRUSTY_INSTRUCTION_TYPE_##NAME: \
+                BODY \
+                continue;
 
-            cvm->csp--;
-            break;
-        default:
-            cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
+    for(;;) {
+        switch(inst[ip]) {
+            CRUSTY_INSTRUCTIONS(INSTRUCTION)
+            CRUSTY_SPECIALIZED_INSTRUCTIONS(SPECIALIZED_INSTRUCTION)
+            CRUSTY_TYPED_INSTRUCTIONS(TYPED_INSTRUCTION)
+            CRUSTY_FUSED_BRANCHES(FUSED_BRANCH)
+            CRUSTY_FUSED_MATH(FUSED_MATH)
+            default:
+                cvm->status = CRUSTY_STATUS_INVALID_INSTRUCTION;
+                goto done;
+        }
+    }
+#undef INSTRUCTION
+#endif
+
+#undef TYPED_ARGS
+#undef TYPED_SRC_VAL
+#undef TYPED_SRC_PTR
+#undef TYPED_DEST_PTR
+#undef REG_ENTRY
+#undef INST_STOP
+#undef REG_RESULTTYPE
+#undef REG_FLOATRESULT
+#undef REG_INTRESULT
+#undef REG_SP
+#undef REG_IP
+#undef REG_INST
+
+done:
+#ifdef CRUSTY_THREADED
+    ip = cvm->instip[ip];
+    for(i = 0; i < cvm->csp; i++) {
+        cvm->cstack[i].ip = cvm->instip[cvm->cstack[i].ip];
     }
+#endif
+    cvm->ip = ip;
+    cvm->sp = sp;
+    cvm->intresult = intresult;
+    cvm->floatresult = floatresult;
+    cvm->resulttype = resulttype;
 
     return(cvm->status);
 }
 
+#undef INSTRUCTION_LOCALS
+#undef FUSED_MATH
+#undef FUSED_BRANCH
+#undef BRANCH_CMP_JUMPG
+#undef BRANCH_CMP_JUMPL
+#undef BRANCH_CMP_JUMPZ
+#undef BRANCH_CMP_JUMPN
+#undef TYPED_BRANCH_F_F
+#undef TYPED_BRANCH_F_I
+#undef TYPED_BRANCH_I_F
+#undef TYPED_BRANCH_I_I
+#undef TYPED_BRANCH
+#undef TYPED_INSTRUCTION
+#undef TYPED_OPERATION
+#undef TYPED_RESOLVE_ARGUMENT
+#undef TYPED_RESOLVE_IMMEDIATE
+#undef TYPED_RESOLVE_LOCAL
+#undef TYPED_RESOLVE_GLOBAL
+#undef TYPED_BODY_CMP
+#undef TYPED_BODY_SHL
+#undef TYPED_BODY_SHR
+#undef TYPED_BODY_XOR
+#undef TYPED_BODY_OR
+#undef TYPED_BODY_AND
+#undef TYPED_BODY_DIV
+#undef TYPED_BODY_MUL
+#undef TYPED_BODY_SUB
+#undef TYPED_BODY_ADD
+#undef TYPED_BODY_MOVE
+#undef TYPED_CMP_BODY
+#undef TYPED_MATH_BODY
+#undef TYPED_MOVE_BODY
+#undef TYPED_COMPARE_F_F
+#undef TYPED_COMPARE_F_I
+#undef TYPED_COMPARE_I_F
+#undef TYPED_COMPARE_I_I
+#undef TYPED_CONVERT_F_I
+#undef TYPED_CONVERT_I_F
+#undef TYPED_CONVERT_F_F
+#undef TYPED_CONVERT_I_I
+#undef TYPED_RESULT_F
+#undef TYPED_RESULT_I
+#undef TYPED_VALUE_ARGUMENT_F
+#undef TYPED_VALUE_ARGUMENT_I
+#undef TYPED_VALUE_IMMEDIATE_I
+#undef TYPED_VALUE_LOCAL_F
+#undef TYPED_VALUE_LOCAL_I
+#undef TYPED_VALUE_GLOBAL_F
+#undef TYPED_VALUE_GLOBAL_I
+#undef SPECIALIZED_INSTRUCTION
+#undef CRUSTY_INSTRUCTIONS
+#undef OPERATION
+#undef BODY_CMP
+#undef BODY_SHL
+#undef BODY_SHR
+#undef BODY_XOR
+#undef BODY_OR
+#undef BODY_AND
+#undef BODY_MOD
+#undef BODY_DIV
+#undef BODY_MUL
+#undef BODY_SUB
+#undef BODY_ADD
+#undef BODY_MOVE
+#undef DEST_UPDATE_CMP
+#undef DEST_UPDATE_SHL
+#undef DEST_UPDATE_SHR
+#undef DEST_UPDATE_XOR
+#undef DEST_UPDATE_OR
+#undef DEST_UPDATE_AND
+#undef DEST_UPDATE_MOD
+#undef DEST_UPDATE_DIV
+#undef DEST_UPDATE_MUL
+#undef DEST_UPDATE_SUB
+#undef DEST_UPDATE_ADD
+#undef DEST_UPDATE_MOVE
+#undef RET_INSTRUCTION
+#undef TAILCALL_INSTRUCTION
+#undef BULK_INSTRUCTION
+#undef CALL_INSTRUCTION
 #undef JUMP_INSTRUCTION
-#undef MATH_INSTRUCTION
+#undef SWITCH_INSTRUCTION
+#undef LOOP_INSTRUCTION
+#undef TYPED_LOOP_INSTRUCTION
+#undef PICK_INSTRUCTION
+#undef JUMP_ALWAYS_INSTRUCTION
+#undef CMP_BODY
+#undef SHIFT_BODY
+#undef LOGIC_BODY
+#undef MOD_BODY
+#undef MATH_BODY
+#undef MOVE_BODY
+#undef STORE_RESULT
+#undef FETCH_VALS
+#undef FETCH_RESULT
+#undef RESOLVE_CALLBACK
+#undef RESOLVE_ARGUMENT
+#undef RESOLVE_INDEXED
+#undef RESOLVE_ARRAY
+#undef RESOLVE_IMMEDIATE
+#undef RESOLVE_LOCAL
+#undef RESOLVE_GLOBAL
+#undef RESOLVE_REFERENCE
 
 CrustyStatus crustyvm_get_status(CrustyVM *cvm) {
     return(cvm->status);
@@ -5700,6 +14515,48 @@ const char *crustyvm_statusstr(CrustyStatus status) {
     return(CRUSTY_STATUSES[status]);
 }
 
+/* check whether a procedure can be entered from outside, which only needs to
+   be done once for an entry point handle */
+static int check_entrypoint(CrustyVM *cvm, int procnum) {
+    if(procnum < 0 || (unsigned int)procnum >= cvm->procs) {
+        return(-1);
+    }
+    if(cvm->proc[procnum].args > 0) {
+        return(-1);
+    }
+    /* the first frame always goes right after the globals */
+    if(cvm->proc[procnum].stackneeded > cvm->stacksize - cvm->initialstack) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* set up the first frame of an entry point that's already been checked.  This
+   is what call() does for a procedure with no arguments from an empty call
+   stack, with nothing that needs to be checked again each time. */
+static void enter(CrustyVM *cvm, unsigned int procnum) {
+    CrustyProcedure *proc = &(cvm->proc[procnum]);
+
+    init_frame(cvm, proc, cvm->initialstack);
+
+    /* just some nonsense value so the call stack has something reasonable on it
+       even though this will never be used */
+    cvm->cstack[0].ip = 0;
+    cvm->cstack[0].proc = procnum;
+    cvm->csp = 1;
+
+    cvm->sp = cvm->initialstack + proc->stackneeded;
+    cvm->ip = proc->instruction;
+    cvm->intresult = 0;
+    cvm->floatresult = 0.0;
+    cvm->resulttype = CRUSTY_TYPE_INT;
+    cvm->status = CRUSTY_STATUS_ACTIVE;
+    if(cvm->dirty == RESET_NONE) {
+        cvm->dirty = RESET_WRITTEN;
+    }
+}
+
 int crustyvm_begin(CrustyVM *cvm, const char *procname) {
     int procnum;
 
@@ -5722,39 +14579,30 @@ int crustyvm_begin(CrustyVM *cvm, const char *procname) {
         LOG_PRINTF(cvm, "Can't enter from procedure with arguments.\n");
         return(-1);
     }
-
-    /* just some nonsense value so the call stack has something reasonable on it
-       even though this will never be used */
-    cvm->ip = 0;
-
-    cvm->sp = cvm->initialstack;
-    cvm->csp = 0;
-    cvm->intresult = 0;
-    cvm->floatresult = 0.0;
-    cvm->resulttype = CRUSTY_TYPE_INT;
-
-    if(call(cvm, procnum, 0)) {
+    if(check_entrypoint(cvm, procnum) < 0) {
         LOG_PRINTF(cvm, "Failed to call procedure %s: %s\n", procname,
-                   crustyvm_statusstr(crustyvm_get_status(cvm)));
+                   crustyvm_statusstr(CRUSTY_STATUS_STACK_OVERFLOW));
         return(-1);
     }
 
-    cvm->status = CRUSTY_STATUS_ACTIVE;
+    enter(cvm, procnum);
 
     return(0);
 }
 
-int crustyvm_run(CrustyVM *cvm, const char *procname) {
-    if(crustyvm_begin(cvm, procname) < 0) {
-        return(-1);
-    }
-
+/* run a program which has begun until it returns or fails */
+static int run_active(CrustyVM *cvm) {
     cvm->stage = "running";
 #ifdef CRUSTY_TEST
     LOG_PRINTF(cvm, "Start\n");
 #endif
 
-    while(crustyvm_step(cvm) == CRUSTY_STATUS_ACTIVE);
+    /* stepping allows each instruction to be checked while tracing */
+    if(cvm->flags & CRUSTY_FLAG_TRACE) {
+        while(crustyvm_step(cvm) == CRUSTY_STATUS_ACTIVE);
+    } else {
+        run_threaded(cvm, 0);
+    }
 
     if(cvm->status != CRUSTY_STATUS_READY) {
         LOG_PRINTF(cvm, "Execution stopped with error: %s\n",
@@ -5765,6 +14613,40 @@ int crustyvm_run(CrustyVM *cvm, const char *procname) {
     return(0);
 }
 
+int crustyvm_run(CrustyVM *cvm, const char *procname) {
+    if(crustyvm_begin(cvm, procname) < 0) {
+        return(-1);
+    }
+
+    return(run_active(cvm));
+}
+
+int crustyvm_get_entrypoint(CrustyVM *cvm, const char *name) {
+    int procnum;
+
+    procnum = find_procedure(cvm, name);
+    if(check_entrypoint(cvm, procnum) < 0) {
+        return(-1);
+    }
+
+    return(procnum);
+}
+
+int crustyvm_run_entrypoint(CrustyVM *cvm, int entry) {
+    if(cvm->status != CRUSTY_STATUS_READY) {
+        LOG_PRINTF(cvm, "Cannot start running, status is not active.\n");
+        return(-1);
+    }
+    if(check_entrypoint(cvm, entry) < 0) {
+        LOG_PRINTF(cvm, "Invalid entry point %d.\n", entry);
+        return(-1);
+    }
+
+    enter(cvm, entry);
+
+    return(run_active(cvm));
+}
+
 static CrustyLine *inst_to_line(CrustyVM *cvm, unsigned int inst) {
     unsigned int i;
 
@@ -5777,6 +14659,19 @@ static CrustyLine *inst_to_line(CrustyVM *cvm, unsigned int inst) {
     return(NULL);
 }
 
+/* find the line of the call which will return to inst */
+static CrustyLine *return_to_line(CrustyVM *cvm, unsigned int inst) {
+    unsigned int i;
+
+    for(i = cvm->lines; i > 0; i--) {
+        if(cvm->line[i - 1].instruction < inst) {
+            return(&(cvm->line[i - 1]));
+        }
+    }
+
+    return(NULL);
+}
+
 void crustyvm_debugtrace(CrustyVM *cvm, int full) {
     unsigned int startcsp, csp, sp, ip;
     unsigned int flags, val, index, ptr;
@@ -5799,17 +14694,20 @@ void crustyvm_debugtrace(CrustyVM *cvm, int full) {
     while(csp > 0) {
         proc = &(cvm->proc[cvm->cstack[csp - 1].proc]);
         LOG_PRINTF(cvm, "%u: %s@", csp, proc->name);
-        line = inst_to_line(cvm, ip);
+        /* IP at the top of the stack is the current line, but IP further
+         * up the stack points to the next instruction, which may not be on the
+         * next line if code was removed. */
+        if(csp == startcsp) {
+            line = inst_to_line(cvm, ip);
+        } else {
+            line = return_to_line(cvm, ip);
+        }
         if(line == NULL) {
             LOG_PRINTF_BARE(cvm, "invalid");
         } else {
-            /* IP at the top of the stack is the current line, but IP further
-             * up the stack points to the next instruction. */
             LOG_PRINTF_BARE(cvm, "%s:%u",
                                  TOKENVAL(line->moduleOffset),
-                                 csp == startcsp ?
-                                 line->line :
-                                 line->line - 1);
+                                 line->line);
         }
         for(i = 0; i < proc->args; i++) {
             LOG_PRINTF_BARE(cvm, " %s", proc->var[i]->name);
@@ -5937,20 +14835,542 @@ void crustyvm_debugtrace(CrustyVM *cvm, int full) {
 }
 
 int crustyvm_has_entrypoint(CrustyVM *cvm, const char *name) {
-    int procnum;
-
-    procnum = find_procedure(cvm, name);
-    if(procnum == -1) {
+    if(crustyvm_get_entrypoint(cvm, name) < 0) {
         return(0);
     }
 
-    if(cvm->proc[procnum].args > 0) {
-        return(0);
+    return(1);
+}
+
+#ifdef CRUSTY_NATIVE
+/* identifies the exact instructions a program was translated from, so a
+   translation can't be loaded for a different program or the same program
+   built with different options */
+static unsigned int native_hash(CrustyVM *cvm) {
+    unsigned int hash = 2166136261u;
+    unsigned int i;
+
+    for(i = 0; i < cvm->insts; i++) {
+        hash ^= (unsigned int)(cvm->inst[i]);
+        hash *= 16777619u;
     }
 
-    return(1);
+    return(hash);
+}
+
+/* line after the end of a procedure */
+static unsigned int translate_end(CrustyVM *cvm, unsigned int procnum) {
+    if(procnum + 1 < cvm->procs) {
+        return(cvm->proc[procnum + 1].start);
+    }
+
+    return(cvm->lines);
+}
+
+static void translate_operand(FILE *out,
+                              CrustyOperandKind kind,
+                              CrustyType type,
+                              int val,
+                              int index) {
+    const char *access = type == CRUSTY_TYPE_INT ? "I" : "F";
+
+    switch(kind) {
+        case CRUSTY_OPERAND_GLOBAL:
+            fprintf(out, "%s(&(stack[%d]))", access, index);
+            break;
+        case CRUSTY_OPERAND_LOCAL:
+            fprintf(out, "%s(&(local[-%d]))", access, index);
+            break;
+        default:
+            /* the literal would otherwise be a long */
+            if(val == INT_MIN) {
+                fprintf(out, "(%d - 1)", val + 1);
+            } else {
+                fprintf(out, "(%d)", val);
+            }
+    }
+}
+
+static const char *translate_result(CrustyType type) {
+    return(type == CRUSTY_TYPE_INT ? "intresult" : "floatresult");
+}
+
+static const char *translate_type(CrustyType type) {
+    return(type == CRUSTY_TYPE_INT ? "TYPE_INT" : "TYPE_FLOAT");
+}
+
+/* Write a typed instruction as C, doing exactly what the interpreter's typed
+   instructions do.  Returns the result type after, or KNOWN if it doesn't
+   change it. */
+static int translate_typed(FILE *out,
+                           const int *inst,
+                           const CrustySpecialization *spec,
+                           int known) {
+    const char *op;
+
+#define DEST translate_operand(out, spec->dest, spec->desttype, \
+                               inst[MOVE_DEST_VAL], inst[MOVE_DEST_INDEX])
+#define SRC translate_operand(out, spec->src, spec->srctype, \
+                              inst[MOVE_SRC_VAL], inst[MOVE_SRC_INDEX])
+    switch(spec->generic) {
+        case CRUSTY_INSTRUCTION_TYPE_MOVE:
+            fprintf(out, "    %s = ", translate_result(spec->srctype));
+            SRC;
+            fprintf(out, ";\n");
+            if(spec->desttype != spec->srctype) {
+                fprintf(out, "    %s = %s;\n"
+                             "    resulttype = %s;\n",
+                        translate_result(spec->desttype),
+                        translate_result(spec->srctype),
+                        translate_type(spec->desttype));
+                known = spec->desttype;
+            }
+            fprintf(out, "    ");
+            DEST;
+            fprintf(out, " = %s;\n", translate_result(spec->desttype));
+            return(known);
+        case CRUSTY_INSTRUCTION_TYPE_CMP:
+            fprintf(out, "    %s = ", translate_result(spec->desttype));
+            DEST;
+            fprintf(out, ";\n");
+            if(spec->desttype == CRUSTY_TYPE_INT &&
+               spec->srctype == CRUSTY_TYPE_INT) {
+                fprintf(out, "    intresult -= ");
+                SRC;
+                fprintf(out, ";\n    resulttype = TYPE_INT;\n");
+                return(CRUSTY_TYPE_INT);
+            }
+            if(spec->desttype == CRUSTY_TYPE_INT) {
+                fprintf(out, "    floatresult = ((double)intresult) - ");
+            } else if(spec->srctype == CRUSTY_TYPE_INT) {
+                fprintf(out, "    floatresult -= (double)");
+            } else {
+                fprintf(out, "    floatresult -= ");
+            }
+            SRC;
+            fprintf(out, ";\n    resulttype = TYPE_FLOAT;\n");
+            return(CRUSTY_TYPE_FLOAT);
+        case CRUSTY_INSTRUCTION_TYPE_ADD:
+            op = "+";
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_SUB:
+            op = "-";
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_MUL:
+            op = "*";
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_DIV:
+            op = "/";
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_AND:
+            op = "&";
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_OR:
+            op = "|";
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_XOR:
+            op = "^";
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_SHR:
+            op = ">>";
+            break;
+        default: /* SHL */
+            op = "<<";
+    }
+
+    fprintf(out, "    %s = ", translate_result(spec->desttype));
+    DEST;
+    fprintf(out, " %s ", op);
+    if((spec->generic == CRUSTY_INSTRUCTION_TYPE_SHR ||
+        spec->generic == CRUSTY_INSTRUCTION_TYPE_SHL) &&
+       spec->src == CRUSTY_OPERAND_IMMEDIATE) {
+        /* a constant shift out of range could be folded to anything, so mask
+           it like x86 does when the interpreter shifts at runtime */
+        fprintf(out, "(%d)", inst[MOVE_SRC_VAL] & 31);
+    } else {
+        SRC;
+    }
+    fprintf(out, ";\n    resulttype = %s;\n    ",
+            translate_type(spec->desttype));
+    DEST;
+    fprintf(out, " = %s;\n", translate_result(spec->desttype));
+#undef SRC
+#undef DEST
+
+    return(spec->desttype);
+}
+
+/* go to translated code or return to the interpreter */
+static void translate_goto(FILE *out,
+                           const unsigned char *mark,
+                           unsigned int ip) {
+    if(mark[ip] & NATIVE_TRANSLATED) {
+        fprintf(out, "goto i%u;\n", ip);
+    } else {
+        fprintf(out, "EXIT(%u);\n", ip);
+    }
+}
+
+static void translate_jump(FILE *out,
+                           const unsigned char *mark,
+                           const int *inst,
+                           int known) {
+    const char *cmp;
+
+    switch(inst[0]) {
+        case CRUSTY_INSTRUCTION_TYPE_JUMPN:
+            cmp = "!=";
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_JUMPZ:
+            cmp = "==";
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_JUMPL:
+            cmp = "<";
+            break;
+        case CRUSTY_INSTRUCTION_TYPE_JUMPG:
+            cmp = ">";
+            break;
+        default:
+            fprintf(out, "    ");
+            translate_goto(out, mark, inst[JUMP_LOCATION]);
+            return;
+    }
+
+    if(known == CRUSTY_TYPE_INT) {
+        fprintf(out, "    if(intresult %s 0) ", cmp);
+    } else if(known == CRUSTY_TYPE_FLOAT) {
+        fprintf(out, "    if(floatresult %s 0.0) ", cmp);
+    } else {
+        fprintf(out, "    if(resulttype == TYPE_INT ?\n"
+                     "       intresult %s 0 : floatresult %s 0.0) ",
+                cmp, cmp);
+    }
+    translate_goto(out, mark, inst[JUMP_LOCATION]);
+}
+
+/* a typed loop, which leaves the result registers alone */
+static void translate_loop(FILE *out,
+                           const unsigned char *mark,
+                           const int *inst,
+                           const CrustyLoop *loop) {
+    fprintf(out, "    if((");
+    translate_operand(out, loop->counter, CRUSTY_TYPE_INT,
+                      inst[LOOP_COUNTER_VAL], inst[LOOP_COUNTER_INDEX]);
+    fprintf(out, " += ");
+    translate_operand(out, CRUSTY_OPERAND_IMMEDIATE, CRUSTY_TYPE_INT,
+                      inst[LOOP_STEP_VAL], inst[LOOP_STEP_INDEX]);
+    fprintf(out, ") %s ", inst[LOOP_STEP_VAL] < 0 ? ">" : "<");
+    translate_operand(out, loop->bound, CRUSTY_TYPE_INT,
+                      inst[LOOP_BOUND_VAL], inst[LOOP_BOUND_INDEX]);
+    fprintf(out, ") ");
+    translate_goto(out, mark, inst[LOOP_LOCATION]);
+}
+
+/* write a function for everything translated in a procedure */
+static void translate_procedure(CrustyVM *cvm,
+                                FILE *out,
+                                const unsigned char *mark,
+                                unsigned int procnum) {
+    CrustyProcedure *proc = &(cvm->proc[procnum]);
+    const CrustySpecialization *spec;
+    const CrustyLoop *loop;
+    unsigned int end = translate_end(cvm, procnum);
+    unsigned int j, ip;
+    int known = -1;
+    int locals = 0;
+
+    for(j = proc->start; j < end; j++) {
+        ip = cvm->line[j].instruction;
+        spec = native_typed_instruction(cvm->inst[ip]);
+        loop = typed_loop(cvm->inst[ip]);
+        if((mark[ip] & NATIVE_TRANSLATED) &&
+           ((spec != NULL &&
+             (spec->dest == CRUSTY_OPERAND_LOCAL ||
+              spec->src == CRUSTY_OPERAND_LOCAL)) ||
+            (loop != NULL &&
+             (loop->counter == CRUSTY_OPERAND_LOCAL ||
+              loop->bound == CRUSTY_OPERAND_LOCAL)))) {
+            locals = 1;
+        }
+    }
+
+    fprintf(out, "/* %s */\n"
+                 "static unsigned int proc_%u(unsigned char *stack,\n"
+                 "                            unsigned int sp,\n"
+                 "                            CrustyNativeRegs *regs,\n"
+                 "                            unsigned int ip) {\n",
+            proc->name, procnum);
+    if(locals) {
+        fprintf(out, "    unsigned char *local = &(stack[sp]);\n");
+    }
+    fprintf(out, "    int intresult = regs->intresult;\n"
+                 "    int resulttype = regs->resulttype;\n"
+                 "    double floatresult = regs->floatresult;\n"
+                 "\n"
+                 "    switch(ip) {\n");
+    for(j = proc->start; j < end; j++) {
+        ip = cvm->line[j].instruction;
+        if(mark[ip] & NATIVE_ENTRY) {
+            fprintf(out, "        case %u: goto i%u;\n", ip, ip);
+        }
+    }
+    fprintf(out, "    }\n"
+                 "    EXIT(ip);\n");
+
+    for(j = proc->start; j < end; j++) {
+        ip = cvm->line[j].instruction;
+        if(!(mark[ip] & NATIVE_TRANSLATED)) {
+            continue;
+        }
+
+        fprintf(out, "\n    /* %s:%u */\n",
+                TOKENVAL(cvm->line[j].moduleOffset), cvm->line[j].line);
+        if(mark[ip] & (NATIVE_ENTRY | NATIVE_TARGET)) {
+            fprintf(out, "i%u:\n", ip);
+            known = -1;
+        }
+
+        if(is_jump(cvm->inst[ip])) {
+            translate_jump(out, mark, &(cvm->inst[ip]), known);
+        } else if(typed_loop(cvm->inst[ip]) != NULL) {
+            translate_loop(out, mark, &(cvm->inst[ip]),
+                           typed_loop(cvm->inst[ip]));
+        } else {
+            spec = native_typed_instruction(cvm->inst[ip]);
+            known = translate_typed(out, &(cvm->inst[ip]), spec, known);
+        }
+
+        /* a ret ends every procedure, so there's always a next line */
+        if(!(mark[cvm->line[j + 1].instruction] & NATIVE_TRANSLATED) &&
+           cvm->inst[ip] != CRUSTY_INSTRUCTION_TYPE_JUMP) {
+            fprintf(out, "    EXIT(%u);\n", cvm->line[j + 1].instruction);
+        }
+    }
+
+    fprintf(out, "}\n\n");
+}
+
+int crustyvm_translate(CrustyVM *cvm, const char *filename) {
+    const char *temp = cvm->stage;
+    unsigned char *mark;
+    unsigned char *translated;
+    FILE *out;
+    unsigned int i, j;
+
+    cvm->stage = "translation";
+
+    mark = native_mark(cvm);
+    if(mark == NULL) {
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    translated = calloc(cvm->procs, 1);
+    if(translated == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for procedure list.\n");
+        free(mark);
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    out = fopen(filename, "wb");
+    if(out == NULL) {
+        LOG_PRINTF(cvm, "Couldn't open file %s for writing.\n", filename);
+        free(translated);
+        free(mark);
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    fprintf(out, "/* Translated from %s by crustyvm, build with something "
+                 "like:\n"
+                 "   cc -O2 -shared -fPIC -o program.so %s */\n"
+                 "\n"
+                 "typedef struct {\n"
+                 "    int intresult;\n"
+                 "    int resulttype;\n"
+                 "    double floatresult;\n"
+                 "} CrustyNativeRegs;\n"
+                 "\n"
+                 "typedef unsigned int (*CrustyNativeFunc)"
+                 "(unsigned char *stack,\n"
+                 "                                         "
+                 "unsigned int sp,\n"
+                 "                                         "
+                 "CrustyNativeRegs *regs,\n"
+                 "                                         "
+                 "unsigned int ip);\n"
+                 "\n"
+                 "typedef struct {\n"
+                 "    unsigned int ip;\n"
+                 "    CrustyNativeFunc func;\n"
+                 "} CrustyNativeEntry;\n"
+                 "\n"
+                 "#define TYPE_INT (%d)\n"
+                 "#define TYPE_FLOAT (%d)\n"
+                 "\n"
+                 "#define I(PTR) (*((int *)(PTR)))\n"
+                 "#define F(PTR) (*((double *)(PTR)))\n"
+                 "\n"
+                 "#define EXIT(IP) \\\n"
+                 "    do { \\\n"
+                 "        regs->intresult = intresult; \\\n"
+                 "        regs->resulttype = resulttype; \\\n"
+                 "        regs->floatresult = floatresult; \\\n"
+                 "        return(IP); \\\n"
+                 "    } while(0)\n"
+                 "\n",
+            TOKENVAL(cvm->line[0].moduleOffset), filename,
+            CRUSTY_TYPE_INT, CRUSTY_TYPE_FLOAT);
+
+    for(i = 0; i < cvm->procs; i++) {
+        for(j = cvm->proc[i].start; j < translate_end(cvm, i); j++) {
+            if(mark[cvm->line[j].instruction] & NATIVE_TRANSLATED) {
+                translated[i] = 1;
+                translate_procedure(cvm, out, mark, i);
+                break;
+            }
+        }
+    }
+
+    fprintf(out, "const unsigned int crusty_native_hash = 0x%08X;\n"
+                 "const unsigned int crusty_native_insts = %u;\n"
+                 "const CrustyNativeEntry crusty_native_entry[] = {\n",
+            native_hash(cvm), cvm->insts);
+    for(i = 0; i < cvm->procs; i++) {
+        if(!translated[i]) {
+            continue;
+        }
+
+        for(j = cvm->proc[i].start; j < translate_end(cvm, i); j++) {
+            if(mark[cvm->line[j].instruction] & NATIVE_ENTRY) {
+                fprintf(out, "    { %u, proc_%u },\n",
+                        cvm->line[j].instruction, i);
+            }
+        }
+    }
+    fprintf(out, "    { 0, 0 }\n"
+                 "};\n");
+
+    free(translated);
+    free(mark);
+
+    if(ferror(out)) {
+        LOG_PRINTF(cvm, "Couldn't write to file.\n");
+        fclose(out);
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    if(fclose(out) != 0) {
+        LOG_PRINTF(cvm, "Couldn't write to file.\n");
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    cvm->stage = temp;
+    return(0);
+}
+
+int crustyvm_load_native(CrustyVM *cvm, const char *filename) {
+    const char *temp = cvm->stage;
+    void *lib;
+    const unsigned int *hash;
+    const unsigned int *insts;
+    const CrustyNativeEntry *entry;
+    CrustyNativeFunc *nativeentry;
+    unsigned int i;
+
+    cvm->stage = "native loading";
+
+    /* the clones would be left pointing at the replaced threaded code */
+    if(cvm->program->refs > 1) {
+        LOG_PRINTF(cvm, "Can't load native code in to a program with clones.\n");
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    lib = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+    if(lib == NULL) {
+        LOG_PRINTF(cvm, "Failed to load %s: %s\n", filename, dlerror());
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    hash = dlsym(lib, "crusty_native_hash");
+    insts = dlsym(lib, "crusty_native_insts");
+    entry = dlsym(lib, "crusty_native_entry");
+    if(hash == NULL || insts == NULL || entry == NULL) {
+        LOG_PRINTF(cvm, "%s isn't a translated program.\n", filename);
+        dlclose(lib);
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    if(*insts != cvm->insts || *hash != native_hash(cvm)) {
+        LOG_PRINTF(cvm, "%s was translated from a different program or with "
+                        "different options.\n", filename);
+        dlclose(lib);
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    nativeentry = calloc(cvm->insts, sizeof(CrustyNativeFunc));
+    if(nativeentry == NULL) {
+        LOG_PRINTF(cvm, "Failed to allocate memory for native entry points.\n");
+        dlclose(lib);
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    for(i = 0; entry[i].func != NULL; i++) {
+        if(entry[i].ip >= cvm->insts) {
+            LOG_PRINTF(cvm, "Entry point out of range in %s.\n", filename);
+            free(nativeentry);
+            dlclose(lib);
+            cvm->stage = temp;
+            return(-1);
+        }
+        nativeentry[entry[i].ip] = entry[i].func;
+    }
+
+    /* replaces any native code there was before */
+    if(cvm->nativeentry != NULL) {
+        free(cvm->nativeentry);
+    }
+    if(cvm->nativelib != NULL) {
+        dlclose(cvm->nativelib);
+    }
+#ifdef CRUSTY_JIT
+    if(cvm->native != NULL) {
+        munmap(cvm->native, cvm->nativesize);
+        cvm->native = NULL;
+        cvm->nativesize = 0;
+    }
+#endif
+    cvm->nativeentry = nativeentry;
+    cvm->nativelib = lib;
+
+    if(run_threaded(cvm, 1) < 0) {
+        cvm->stage = temp;
+        return(-1);
+    }
+
+    cvm->stage = temp;
+    return(0);
+}
+#else
+int crustyvm_translate(CrustyVM *cvm, const char *filename) {
+    LOG_PRINTF(cvm, "Native code isn't supported in this build.\n");
+    return(-1);
 }
 
+int crustyvm_load_native(CrustyVM *cvm, const char *filename) {
+    LOG_PRINTF(cvm, "Native code isn't supported in this build.\n");
+    return(-1);
+}
+#endif
+
 unsigned int crustyvm_get_tokenmem(CrustyVM *cvm) {
     return(cvm->tokenmemlen);
 }
@@ -6031,6 +15451,8 @@ int main(int argc, char **argv) {
     char **var = NULL;
     char **value = NULL;
     unsigned int vars = 0;
+    unsigned int cvmflags = CRUSTY_FLAG_OUTPUT_PASSES
+                            /* | CRUSTY_FLAG_TRACE */;
 
     FILE *in = NULL;
     CrustyVM *cvm = NULL;
@@ -6138,6 +15560,10 @@ int main(int argc, char **argv) {
                     temp[arglen - (equals - argv[i] - 2) - 1] = '\0';
                     value[vars] = temp;
                     vars++;
+                } else if(argv[i][1] == 'O' && arglen == 2) {
+                    cvmflags |= CRUSTY_FLAG_OPTIMIZE;
+                } else if(argv[i][1] == 'J' && arglen == 2) {
+                    cvmflags |= CRUSTY_FLAG_JIT;
                 } else {
                     filename = NULL;
                     break;
@@ -6153,7 +15579,7 @@ int main(int argc, char **argv) {
     }
 
     if(filename == NULL) {
-        fprintf(stderr, "USAGE: %s [(<filename>|-D<var>=<value>) ...]"
+        fprintf(stderr, "USAGE: %s [(<filename>|-D<var>=<value>|-O|-J) ...]"
                         " [-- <filename>]\n", argv[0]);
         goto error;
     }
@@ -6193,8 +15619,7 @@ int main(int argc, char **argv) {
 
     cvm = crustyvm_new(filename, fullpath,
                        program, len,
-                       CRUSTY_FLAG_OUTPUT_PASSES
-                       /* | CRUSTY_FLAG_TRACE */,
+                       cvmflags,
                        0,
                        cb, sizeof(cb) / sizeof(CrustyCallback),
                        (const char **)var, (const char **)value, vars,
@@ -34,6 +34,8 @@
 #define CRUSTY_FLAG_OUTPUT_PASSES (1<<0)
 #endif
 #define CRUSTY_FLAG_TRACE (1<<1)
+#define CRUSTY_FLAG_OPTIMIZE (1<<2)
+#define CRUSTY_FLAG_JIT (1<<3)
 
 typedef enum {
     CRUSTY_STATUS_READY = 0,
@@ -94,8 +96,29 @@ FILE *crustyvm_open_file(const char *filename,
  *                  happen:
  *                  CRUSTY_FLAG_OUTPUT_PASSES - Output each pass to file to help
  *                                              in debugging and development.
+ *                  CRUSTY_FLAG_OPTIMIZE - Clean up the generated code by
+ *                                         threading jumps and removing
+ *                                         unreachable code, jumps which do
+ *                                         nothing, dead moves and redundant
+ *                                         compares, skip checking array
+ *                                         indexes which can be proven to
+ *                                         always be in range, copy
+ *                                         procedures for each set of
+ *                                         argument types they're called with,
+ *                                         inline small procedures which don't
+ *                                         call anything and make calls
+ *                                         followed by a return reuse the
+ *                                         frame of the procedure they're made
+ *                                         from.
+ *                  CRUSTY_FLAG_JIT - Translate what can be to native code on
+ *                                    x86-64, leaving the rest to the
+ *                                    interpreter.  Ignored elsewhere or with
+ *                                    CRUSTY_FLAG_TRACE.
  * callstacksize    Specify the callstack size.  This isn't the memory size but
- *                  the depth of procedures which could be called.
+ *                  the depth of procedures which could be called.  0 for the
+ *                  default.  A program which can't recurse gets stacks sized
+ *                  exactly for its deepest calls instead, as long as that fits
+ *                  in this, and then never has to check for overflow.
  * cb               Array of callbacks described by struct CrustyCallback.
  *                      name        Variable name which the callback will be
  *                                  called by.
@@ -140,6 +163,43 @@ CrustyVM *crustyvm_new(const char *name,
                        unsigned int vars,
                        void (*log_cb)(void *priv, const char *fmt, ...),
                        void *log_priv);
+/*
+ * Save a compiled program as an image which can be loaded with
+ * crustyvm_load_image() without going through the compiler again.  The image
+ * is specific to the machine and build it's saved from.
+ *
+ * cvm      CrustyVM to save.
+ * filename Name of the image file to write.
+ * returns  Negative on failure.
+ */
+int crustyvm_save_image(CrustyVM *cvm, const char *filename);
+
+/*
+ * Load a program from an image saved by crustyvm_save_image().  Takes the same
+ * arguments as crustyvm_new() besides safepath, and the image is only used if
+ * it was saved from the same program text, name, defines, callbacks and
+ * CRUSTY_FLAG_OPTIMIZE setting, and none of the files included or read in by
+ * the program have changed.  The image file is mapped and used in place where
+ * possible.  Otherwise, NULL is returned and the program should be loaded with
+ * crustyvm_new() instead.
+ *
+ * filename Name of the image file to load.
+ * returns  The loaded CrustyVM or NULL if the image couldn't be used.
+ */
+CrustyVM *crustyvm_load_image(const char *filename,
+                              const char *name,
+                              const char *program,
+                              long len,
+                              unsigned int flags,
+                              unsigned int callstacksize,
+                              const CrustyCallback *cb,
+                              unsigned int cbcount,
+                              const char **var,
+                              const char **value,
+                              unsigned int vars,
+                              void (*log_cb)(void *priv, const char *fmt, ...),
+                              void *log_priv);
+
 /*
  * Free memory allocated by cvm.
  *
@@ -148,10 +208,25 @@ CrustyVM *crustyvm_new(const char *name,
 void crustyvm_free(CrustyVM *cvm);
 
 /*
- * Reset program state.  All memory is reinitialized.
+ * Create another instance of a program without compiling it again.  The clone
+ * shares everything but its stack and callstack with cvm, so it costs about
+ * as much as a reset.  Callbacks are shared too and will be called with the
+ * same private pointers.  The program data is freed along with the last VM
+ * using it, so cvm and the clone may be freed in any order.  The clone starts
+ * out reset no matter what state cvm is in.
+ *
+ * cvm      CrustyVM to clone.
+ * returns  The new CrustyVM or NULL on failure.
+ */
+CrustyVM *crustyvm_clone(CrustyVM *cvm);
+
+/*
+ * Reset program state.  All memory is reinitialized.  Only the globals the
+ * program is able to write to are restored and nothing is restored if nothing
+ * has run since the last reset.
  *
  * cvm      CrustyVM to reset.
- * returns  Negative on failure.
+ * returns  Negative on failure, otherwise the number of bytes restored.
  */
 int crustyvm_reset(CrustyVM *cvm);
 
@@ -165,7 +240,9 @@ int crustyvm_reset(CrustyVM *cvm);
 int crustyvm_begin(CrustyVM *cvm, const char *procname);
 
 /*
- * Process the next instruction after a program has begun.
+ * Process the next instruction after a program has begun.  This is slower than
+ * letting crustyvm_run() run the program, so it's mostly useful for tracing
+ * and debugging.
  *
  * cvm      CrustyVM to step.
  * returns  Negative on failure.
@@ -173,7 +250,9 @@ int crustyvm_begin(CrustyVM *cvm, const char *procname);
 CrustyStatus crustyvm_step(CrustyVM *cvm);
 
 /*
- * Run a procedure until it is done or there is an error.
+ * Run a procedure until it is done or there is an error.  If the VM was
+ * created with CRUSTY_FLAG_TRACE, this steps through the program with
+ * crustyvm_step(), otherwise a faster threaded interpreter loop is used.
  *
  * cvm      CrustyVM to run.
  * procname Procedure to run.
@@ -181,6 +260,28 @@ CrustyStatus crustyvm_step(CrustyVM *cvm);
  */
 int crustyvm_run(CrustyVM *cvm, const char *procname);
 
+/*
+ * Look up an entry point once, so it can be run over and over with
+ * crustyvm_run_entrypoint() without finding it by name every time.
+ *
+ * cvm      CrustyVM to look in.
+ * name     Name of entry point.
+ * returns  A handle for the entry point, or negative if there's no procedure
+ *          by that name which can be entered.
+ */
+int crustyvm_get_entrypoint(CrustyVM *cvm, const char *name);
+
+/*
+ * Run an entry point from crustyvm_get_entrypoint().  Works like
+ * crustyvm_run(), but the frame is set up directly without looking anything up
+ * or checking it again.
+ *
+ * cvm      CrustyVM to run.
+ * entry    Entry point handle.
+ * returns  Negative on failure.
+ */
+int crustyvm_run_entrypoint(CrustyVM *cvm, int entry);
+
 /*
  * Get status of CrustyVM.
  *
@@ -213,6 +314,30 @@ void crustyvm_debugtrace(CrustyVM *cvm, int full);
  */
 int crustyvm_has_entrypoint(CrustyVM *cvm, const char *name);
 
+/*
+ * Translate what can be of a program to C, to be built as a shared object and
+ * loaded with crustyvm_load_native().  Like CRUSTY_FLAG_JIT, runs of
+ * instructions on plain int and float variables are translated and anything
+ * else is left to the interpreter.
+ *
+ * cvm      CrustyVM to translate.
+ * filename Name of the C file to write.
+ * returns  Negative on failure.
+ */
+int crustyvm_translate(CrustyVM *cvm, const char *filename);
+
+/*
+ * Load a translated program built from crustyvm_translate().  The VM must have
+ * been created from the same program with the same defines and flags, otherwise
+ * it's refused.  Replaces any code from CRUSTY_FLAG_JIT.  Has to be done before
+ * the VM is cloned.
+ *
+ * cvm      CrustyVM to load the translated program in to.
+ * filename Name of the shared object to load.
+ * returns  Negative on failure.
+ */
+int crustyvm_load_native(CrustyVM *cvm, const char *filename);
+
 unsigned int crustyvm_get_tokenmem(CrustyVM *cvm);
 unsigned int crustyvm_get_stackmem(CrustyVM *cvm);
 
@@ -82,6 +82,7 @@ typedef struct {
 
     jack_client_t *jack;
     CrustyVM *cvm;
+    int event; /* entry point handle */
     midi_event *curEv;
 
     unsigned int outPort;
@@ -357,7 +358,7 @@ int process(jack_nframes_t nframes, void *arg) {
         tctx.outPort = 0;
         tctx.outTime = 0;
         tctx.outLen = 0;
-        if(crustyvm_run(tctx.cvm, "event") < 0) {
+        if(crustyvm_run_entrypoint(tctx.cvm, tctx.event) < 0) {
             printf("Event handler reached an exception while running: %s\n",
                    crustyvm_statusstr(crustyvm_get_status(tctx.cvm)));
             crustyvm_debugtrace(tctx.cvm, 1);
@@ -862,6 +863,12 @@ void free_portnames(unsigned int inports, unsigned int outports,
 int main(int argc, char **argv) {
     /* general stuff */
     const char *filename = NULL;
+    const char *translatename = NULL;
+    const char *nativename = NULL;
+    const char *imagename = NULL;
+    /* images are only reused when they were compiled with the same flags */
+    unsigned int cvmflags = CRUSTY_FLAG_DEFAULTS
+                            /* | CRUSTY_FLAG_TRACE */;
     char *fullpath;
     unsigned int i;
     unsigned int arglen;
@@ -1015,6 +1022,16 @@ int main(int argc, char **argv) {
                     temp[arglen - (equals - argv[i] - 2) - 1] = '\0';
                     value[vars] = temp;
                     vars++;
+                } else if(argv[i][1] == 'C' && arglen > 2) {
+                    translatename = &(argv[i][2]);
+                } else if(argv[i][1] == 'N' && arglen > 2) {
+                    nativename = &(argv[i][2]);
+                } else if(argv[i][1] == 'B' && arglen > 2) {
+                    imagename = &(argv[i][2]);
+                } else if(argv[i][1] == 'O' && arglen == 2) {
+                    cvmflags |= CRUSTY_FLAG_OPTIMIZE;
+                } else if(argv[i][1] == 'J' && arglen == 2) {
+                    cvmflags |= CRUSTY_FLAG_JIT;
                 } else {
                     filename = NULL;
                     break;
@@ -1030,7 +1047,7 @@ int main(int argc, char **argv) {
     }
 
     if(filename == NULL) {
-        fprintf(stderr, "USAGE: %s [(<filename>|-D<var>=<value>) ...] [-- <filename>]\n", argv[0]);
+        fprintf(stderr, "USAGE: %s [(<filename>|-D<var>=<value>|-C<C file>|-N<shared object>|-B<image>|-O|-J) ...] [-- <filename>]\n", argv[0]);
         CLEAN_ARGS
         exit(EXIT_FAILURE);
     }
@@ -1087,14 +1104,34 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    tctx.cvm = crustyvm_new(filename, fullpath,
-                            program, len,
-                            CRUSTY_FLAG_DEFAULTS
-                            /* | CRUSTY_FLAG_TRACE */,
-                            0,
-                            cb, sizeof(cb) / sizeof(CrustyCallback),
-                            (const char **)var, (const char **)value, vars,
-                            vprintf_cb, stderr);
+    tctx.cvm = NULL;
+    if(imagename != NULL) {
+        tctx.cvm = crustyvm_load_image(imagename, filename,
+                                       program, len,
+                                       cvmflags,
+                                       0,
+                                       cb, sizeof(cb) / sizeof(CrustyCallback),
+                                       (const char **)var,
+                                       (const char **)value,
+                                       vars,
+                                       vprintf_cb, stderr);
+    }
+    if(tctx.cvm == NULL) {
+        tctx.cvm = crustyvm_new(filename, fullpath,
+                                program, len,
+                                cvmflags,
+                                0,
+                                cb, sizeof(cb) / sizeof(CrustyCallback),
+                                (const char **)var, (const char **)value, vars,
+                                vprintf_cb, stderr);
+        /* not being able to save the image isn't fatal, it'll just be
+           compiled again next time */
+        if(tctx.cvm != NULL && imagename != NULL) {
+            if(crustyvm_save_image(tctx.cvm, imagename) < 0) {
+                fprintf(stderr, "Failed to save image.\n");
+            }
+        }
+    }
     free(program);
     CLEAN_ARGS
     if(tctx.cvm == NULL) {
@@ -1105,6 +1142,31 @@ int main(int argc, char **argv) {
     }
     fprintf(stderr, "Program loaded.\n");
 
+    /* just write out the translation for building in to a shared object */
+    if(translatename != NULL) {
+        free_portnames(tctx.inports, tctx.outports,
+                       inportnames,  outportnames);
+        if(crustyvm_translate(tctx.cvm, translatename) < 0) {
+            fprintf(stderr, "Failed to translate program.\n");
+            crustyvm_free(tctx.cvm);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Program translated to %s.\n", translatename);
+        crustyvm_free(tctx.cvm);
+        exit(EXIT_SUCCESS);
+    }
+
+    if(nativename != NULL) {
+        if(crustyvm_load_native(tctx.cvm, nativename) < 0) {
+            fprintf(stderr, "Failed to load translated program.\n");
+            crustyvm_free(tctx.cvm);
+            free_portnames(tctx.inports, tctx.outports,
+                           inportnames,  outportnames);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Translated program loaded.\n");
+    }
+
     if(!crustyvm_has_entrypoint(tctx.cvm, "init")) {
         fprintf(stderr, "Program has no valid entrypoint for 'init'.\n");
         crustyvm_free(tctx.cvm);
@@ -1113,7 +1175,8 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    if(!crustyvm_has_entrypoint(tctx.cvm, "event")) {
+    tctx.event = crustyvm_get_entrypoint(tctx.cvm, "event");
+    if(tctx.event < 0) {
         fprintf(stderr, "Program has no valid entrypoint for 'event'.\n");
         crustyvm_free(tctx.cvm);
         free_portnames(tctx.inports, tctx.outports,